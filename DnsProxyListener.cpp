@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #define LOG_TAG "resolv"
 
@@ -796,6 +797,22 @@ static bool sendLenAndData(SocketClient* c, const int len, const void* data) {
     return sendBE32(c, len) && (len == 0 || c->sendData(data, len) == 0);
 }
 
+// Sends the length of the DNS message |answer|, then |answer| with |queryId| as its DNS ID, without
+// modifying it, so that it can be a buffer shared with the cache.
+// Returns true on success.
+static bool sendAnswer(SocketClient* c, span<const uint8_t> answer, uint16_t queryId) {
+    HEADER header;
+    memcpy(&header, answer.data(), sizeof(header));
+    header.id = htons(queryId);
+    uint32_t be_len = htonl(answer.size());
+    iovec iov[] = {
+            {&be_len, sizeof(be_len)},
+            {&header, sizeof(header)},
+            {const_cast<uint8_t*>(answer.data()) + sizeof(header), answer.size() - sizeof(header)},
+    };
+    return c->sendDatav(iov, std::size(iov)) == 0;
+}
+
 // Returns true on success
 static bool sendhostent(SocketClient* c, hostent* hp) {
     bool success = true;
@@ -1125,6 +1142,8 @@ void DnsProxyListener::ResNSendHandler::run() {
 
     // Send DNS query
     std::vector<uint8_t> ansBuf(MAXPACKET, 0);
+    // Set instead of |ansBuf| when the answer comes from the cache, which shares its buffer.
+    ResolvCacheAnswer sharedAns;
     int rcode = ns_r_noerror;
     int ansLen = -1;
     NetworkDnsEventReported event;
@@ -1136,7 +1155,7 @@ void DnsProxyListener::ResNSendHandler::run() {
     } else if (startQueryLimiter(uid)) {
         if (evaluate_domain_name(mNetContext, rr_name.c_str())) {
             ansLen = resolv_res_nsend(&mNetContext, std::span(msg.data(), msgLen), ansBuf, &rcode,
-                                      static_cast<ResNsendFlags>(mFlags), &event);
+                                      static_cast<ResNsendFlags>(mFlags), &event, &sharedAns);
         } else {
             // TODO(b/307048182): It should return -errno.
             ansLen = -EAI_SYSTEM;
@@ -1173,14 +1192,16 @@ void DnsProxyListener::ResNSendHandler::run() {
         return;
     }
 
-    // Restore query id
-    if (!setQueryId(std::span(ansBuf.data(), ansLen), original_query_id)) {
+    const span<const uint8_t> answer = sharedAns != nullptr
+                                               ? span<const uint8_t>(*sharedAns)
+                                               : span<const uint8_t>(ansBuf.data(), ansLen);
+    if (answer.size() < sizeof(HEADER)) {
         LOG(WARNING) << "ResNSendHandler::run: resnsend: failed to restore query id";
         return;
     }
 
-    // Send answer
-    if (!sendLenAndData(mClient, ansLen, ansBuf.data())) {
+    // Send answer, with the query id restored
+    if (!sendAnswer(mClient, answer, original_query_id)) {
         PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send answer to uid " << uid
                       << " pid " << mClient->getPid();
         return;
@@ -1188,8 +1209,7 @@ void DnsProxyListener::ResNSendHandler::run() {
 
     if (rr_type == ns_t_a || rr_type == ns_t_aaaa) {
         std::vector<std::string> ip_addrs;
-        const int total_ip_addr_count =
-                extractResNsendAnswers(std::span(ansBuf.data(), ansLen), rr_type, &ip_addrs);
+        const int total_ip_addr_count = extractResNsendAnswers(answer, rr_type, &ip_addrs);
         reportDnsEvent(INetdEventListener::EVENT_RES_NSEND, mNetContext, latencyUs,
                        resNSendToAiError(ansLen, rcode), event, rr_name, /*skipStats=*/false,
                        ip_addrs, total_ip_addr_count);
@@ -37,6 +37,7 @@
 
 using aidl::android::net::ResolverOptionsParcel;
 using aidl::android::net::ResolverParamsParcel;
+using aidl::android::net::resolv::aidl::CacheStatsParcel;
 using android::base::Join;
 using android::netdutils::DumpWriter;
 using android::netdutils::IPPrefix;
@@ -309,5 +310,12 @@ binder_status_t DnsResolverService::dump(int fd, const char** args, uint32_t num
     return statusFromErrcode(resolv_set_options(netId, options));
 }
 
+::ndk::ScopedAStatus DnsResolverService::getCacheStats(int32_t netId, CacheStatsParcel* stats) {
+    // Locking happens in res_cache.cpp functions.
+    ENFORCE_NETWORK_STACK_PERMISSIONS();
+
+    return statusFromErrcode(resolv_cache_get_stats(netId, stats));
+}
+
 }  // namespace net
 }  // namespace android
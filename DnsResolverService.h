@@ -57,6 +57,8 @@ class DnsResolverService : public aidl::android::net::BnDnsResolver {
     ::ndk::ScopedAStatus flushNetworkCache(int32_t netId) override;
     ::ndk::ScopedAStatus setResolverOptions(
             int32_t netId, const aidl::android::net::ResolverOptionsParcel& options) override;
+    ::ndk::ScopedAStatus getCacheStats(
+            int32_t netId, aidl::android::net::resolv::aidl::CacheStatsParcel* stats) override;
 
     // DNS64-related commands
     ::ndk::ScopedAStatus startPrefix64Discovery(int32_t netId) override;
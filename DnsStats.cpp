@@ -109,6 +109,7 @@ void StatsRecords::push(const Record& record) {
 
     // Update the quality factors.
     mSkippedCount = 0;
+    updateRttEstimate(record);
 
     // Because failures due to no permission can't prove that the quality of DNS server is bad,
     // skip the penalty update. The average latency, however, has been updated. For short-latency
@@ -170,6 +171,57 @@ void StatsRecords::incrementSkippedCount() {
     mSkippedCount = std::min(mSkippedCount + 1, kMaxQuality);
 }
 
+void StatsRecords::updateRttEstimate(const Record& record) {
+    // The timeout is also bounded by the caller, so a long run of timeouts needs no more.
+    constexpr int kMaxBackoff = 6;
+    if (record.rcode == NS_R_TIMEOUT) {
+        mBackoff = std::min(mBackoff + 1, kMaxBackoff);
+        return;
+    }
+    // As in latencyPercentile(), only the answers of known latency are samples.
+    const bool answered = record.rcode == NS_R_NO_ERROR || record.rcode == NS_R_NXDOMAIN ||
+                          record.rcode == NS_R_NOTAUTH;
+    if (!answered || record.latencyUs.count() < 0) return;
+
+    const microseconds rtt = record.latencyUs;
+    if (!mSrtt.has_value()) {
+        mSrtt = rtt;
+        mRttVar = rtt / 2;
+    } else {
+        mRttVar = (3 * mRttVar + std::chrono::abs(*mSrtt - rtt)) / 4;
+        mSrtt = (7 * *mSrtt + rtt) / 8;
+    }
+    mBackoff = 0;
+}
+
+std::optional<microseconds> StatsRecords::retransmissionTimeout() const {
+    // The clock granularity G of RFC 6298, which keeps the timeout above the smoothed latency of
+    // a server whose latency hardly varies.
+    constexpr microseconds kGranularity = milliseconds(1);
+    if (!mSrtt.has_value()) return std::nullopt;
+    return (*mSrtt + std::max(kGranularity, 4 * mRttVar)) * (1 << mBackoff);
+}
+
+std::optional<microseconds> StatsRecords::latencyPercentile(int percentile,
+                                                            size_t minSamples) const {
+    std::vector<microseconds> latencies;
+    latencies.reserve(mRecords.size());
+    for (const auto& record : mRecords) {
+        // The same rcodes as in updatePenalty(). The latency of an answer which came from another
+        // server than the one queried is unknown, and recorded as negative.
+        const bool answered = record.rcode == NS_R_NO_ERROR || record.rcode == NS_R_NXDOMAIN ||
+                              record.rcode == NS_R_NOTAUTH;
+        if (answered && record.latencyUs.count() >= 0) latencies.push_back(record.latencyUs);
+    }
+    if (latencies.empty() || latencies.size() < minSamples) return std::nullopt;
+
+    // Nearest-rank percentile.
+    const size_t rank = (std::clamp(percentile, 1, 100) * latencies.size() + 99) / 100;
+    const auto nth = latencies.begin() + rank - 1;
+    std::nth_element(latencies.begin(), nth, latencies.end());
+    return *nth;
+}
+
 bool DnsStats::setAddrs(const std::vector<netdutils::IPSockAddr>& addrs, Protocol protocol) {
     if (!ensureNoInvalidIp(addrs)) return false;
 
@@ -252,6 +304,25 @@ std::optional<microseconds> DnsStats::getAverageLatencyUs(Protocol protocol) con
     return sum / count;
 }
 
+std::optional<microseconds> DnsStats::getLatencyPercentileUs(const IPSockAddr& server,
+                                                             Protocol protocol, int percentile,
+                                                             size_t minSamples) const {
+    const auto it = mStats.find(protocol);
+    if (it == mStats.end()) return std::nullopt;
+    const auto records = it->second.find(server);
+    if (records == it->second.end()) return std::nullopt;
+    return records->second.latencyPercentile(percentile, minSamples);
+}
+
+std::optional<microseconds> DnsStats::getRetransmissionTimeoutUs(const IPSockAddr& server,
+                                                                 Protocol protocol) const {
+    const auto it = mStats.find(protocol);
+    if (it == mStats.end()) return std::nullopt;
+    const auto records = it->second.find(server);
+    if (records == it->second.end()) return std::nullopt;
+    return records->second.retransmissionTimeout();
+}
+
 std::vector<StatsData> DnsStats::getStats(Protocol protocol) const {
     std::vector<StatsData> ret;
 
@@ -20,6 +20,7 @@
 #include <chrono>
 #include <deque>
 #include <map>
+#include <optional>
 #include <vector>
 
 #include <android-base/thread_annotations.h>
@@ -85,9 +86,20 @@ class StatsRecords {
 
     void incrementSkippedCount();
 
+    // Returns the |percentile|th percentile of the latencies of the answered queries, or nullopt
+    // if fewer than |minSamples| queries were answered.
+    std::optional<std::chrono::microseconds> latencyPercentile(int percentile,
+                                                               size_t minSamples) const;
+
+    // Returns the retransmission timeout, estimated from the smoothed latency and latency
+    // variance of the answered queries as TCP does (RFC 6298), or nullopt if none was answered.
+    // The timeout doubles with each query which timed out since the last answer.
+    std::optional<std::chrono::microseconds> retransmissionTimeout() const;
+
   private:
     void updateStatsData(const Record& record, const bool add);
     void updatePenalty(const Record& record);
+    void updateRttEstimate(const Record& record);
 
     std::deque<Record> mRecords;
     size_t mCapacity;
@@ -100,6 +112,12 @@ class StatsRecords {
     // A quality factor used to prevent starvation.
     int mSkippedCount = 0;
 
+    // The smoothed latency (SRTT) and its variance (RTTVAR) of RFC 6298, and the number of times
+    // the retransmission timeout has been backed off.
+    std::optional<std::chrono::microseconds> mSrtt;
+    std::chrono::microseconds mRttVar = {};
+    int mBackoff = 0;
+
     // The maximum of the quantified result. As the sorting is on the basis of server latency, limit
     // the maximal value of the quantity to 10000 in correspondence with the maximal cleartext
     // query timeout 10000 milliseconds. This helps normalize the value of the quality to a score.
@@ -124,6 +142,16 @@ class DnsStats {
     // Returns the average query latency in microseconds.
     std::optional<std::chrono::microseconds> getAverageLatencyUs(Protocol protocol) const;
 
+    // Returns the |percentile|th percentile of the latencies of the queries answered by |server|,
+    // or nullopt if it answered fewer than |minSamples| of its recent queries.
+    std::optional<std::chrono::microseconds> getLatencyPercentileUs(
+            const netdutils::IPSockAddr& server, Protocol protocol, int percentile,
+            size_t minSamples) const;
+
+    // Returns the retransmission timeout of |server|, or nullopt if it never answered.
+    std::optional<std::chrono::microseconds> getRetransmissionTimeoutUs(
+            const netdutils::IPSockAddr& server, Protocol protocol) const;
+
     void dump(netdutils::DumpWriter& dw);
 
     std::vector<StatsData> getStats(Protocol protocol) const;
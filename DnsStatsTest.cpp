@@ -521,6 +521,78 @@ TEST_F(DnsStatsTest, GetServers_SortingByLatency) {
                 testing::ElementsAreArray({server2, server4}));
 }
 
+TEST_F(DnsStatsTest, GetLatencyPercentile) {
+    const IPSockAddr server1 = IPSockAddr::toIPSockAddr("127.0.0.1", 53);
+    const IPSockAddr server2 = IPSockAddr::toIPSockAddr("127.0.0.2", 53);
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server1, PROTO_UDP, 90, 1), std::nullopt);
+    EXPECT_TRUE(mDnsStats.setAddrs({server1, server2}, PROTO_UDP));
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server1, PROTO_UDP, 90, 1), std::nullopt);
+
+    // 10ms, 20ms, ..., 100ms, in a shuffled order.
+    for (const int i : {7, 2, 10, 5, 1, 9, 4, 8, 3, 6}) {
+        EXPECT_TRUE(
+                mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_UDP, NS_R_NO_ERROR, i * 10ms)));
+    }
+    // Neither the failed queries nor the answers of unknown latency count.
+    EXPECT_TRUE(mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_UDP, NS_R_TIMEOUT, 1000ms)));
+    EXPECT_TRUE(mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_UDP, NS_R_SERVFAIL, 500ms)));
+    auto unknownLatency = makeDnsQueryEvent(PROTO_UDP, NS_R_NO_ERROR, 0ms);
+    unknownLatency.set_latency_micros(-1);
+    EXPECT_TRUE(mDnsStats.addStats(server1, unknownLatency));
+
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server1, PROTO_UDP, 90, 10), microseconds(90ms));
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server1, PROTO_UDP, 50, 10), microseconds(50ms));
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server1, PROTO_UDP, 95, 10), microseconds(100ms));
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server1, PROTO_UDP, 100, 10), microseconds(100ms));
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server1, PROTO_UDP, 1, 10), microseconds(10ms));
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server1, PROTO_UDP, 90, 11), std::nullopt);
+
+    // The stats of the other servers and protocols are separate.
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server2, PROTO_UDP, 90, 1), std::nullopt);
+    EXPECT_EQ(mDnsStats.getLatencyPercentileUs(server1, PROTO_TCP, 90, 1), std::nullopt);
+}
+
+TEST_F(DnsStatsTest, GetRetransmissionTimeout) {
+    const IPSockAddr server1 = IPSockAddr::toIPSockAddr("127.0.0.1", 53);
+    const IPSockAddr server2 = IPSockAddr::toIPSockAddr("127.0.0.2", 53);
+    EXPECT_TRUE(mDnsStats.setAddrs({server1, server2}, PROTO_UDP));
+    EXPECT_EQ(mDnsStats.getRetransmissionTimeoutUs(server1, PROTO_UDP), std::nullopt);
+
+    // The first answer sets SRTT = 20ms and RTTVAR = 10ms, so RTO = SRTT + 4 * RTTVAR.
+    EXPECT_TRUE(mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_UDP, NS_R_NO_ERROR, 20ms)));
+    EXPECT_EQ(mDnsStats.getRetransmissionTimeoutUs(server1, PROTO_UDP), microseconds(60ms));
+    // RTTVAR = 3/4 * 10ms + 1/4 * |20ms - 20ms|.
+    EXPECT_TRUE(mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_UDP, NS_R_NO_ERROR, 20ms)));
+    EXPECT_EQ(mDnsStats.getRetransmissionTimeoutUs(server1, PROTO_UDP), microseconds(50ms));
+
+    // With a steady latency, the variance vanishes, and only the 1ms granularity is left.
+    for (int i = 0; i < 100; i++) {
+        EXPECT_TRUE(
+                mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_UDP, NS_R_NO_ERROR, 20ms)));
+    }
+    EXPECT_EQ(mDnsStats.getRetransmissionTimeoutUs(server1, PROTO_UDP), microseconds(21ms));
+
+    // Neither the failed queries nor the answers of unknown latency are samples.
+    EXPECT_TRUE(mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_UDP, NS_R_SERVFAIL, 500ms)));
+    auto unknownLatency = makeDnsQueryEvent(PROTO_UDP, NS_R_NO_ERROR, 0ms);
+    unknownLatency.set_latency_micros(-1);
+    EXPECT_TRUE(mDnsStats.addStats(server1, unknownLatency));
+    EXPECT_EQ(mDnsStats.getRetransmissionTimeoutUs(server1, PROTO_UDP), microseconds(21ms));
+
+    // Each timeout doubles the timeout, until the next answer.
+    EXPECT_TRUE(mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_UDP, NS_R_TIMEOUT, 21ms)));
+    EXPECT_EQ(mDnsStats.getRetransmissionTimeoutUs(server1, PROTO_UDP), microseconds(42ms));
+    EXPECT_TRUE(mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_UDP, NS_R_TIMEOUT, 42ms)));
+    EXPECT_EQ(mDnsStats.getRetransmissionTimeoutUs(server1, PROTO_UDP), microseconds(84ms));
+    // SRTT = 7/8 * 20ms + 1/8 * 40ms, RTTVAR = 1/4 * |20ms - 40ms|.
+    EXPECT_TRUE(mDnsStats.addStats(server1, makeDnsQueryEvent(PROTO_UDP, NS_R_NO_ERROR, 40ms)));
+    EXPECT_EQ(mDnsStats.getRetransmissionTimeoutUs(server1, PROTO_UDP), microseconds(42500us));
+
+    // The stats of the other servers and protocols are separate.
+    EXPECT_EQ(mDnsStats.getRetransmissionTimeoutUs(server2, PROTO_UDP), std::nullopt);
+    EXPECT_EQ(mDnsStats.getRetransmissionTimeoutUs(server1, PROTO_TCP), std::nullopt);
+}
+
 TEST_F(DnsStatsTest, GetServers_DeprioritizingBadServers) {
     const IPSockAddr server1 = IPSockAddr::toIPSockAddr("127.0.0.1", 53);
     const IPSockAddr server2 = IPSockAddr::toIPSockAddr("127.0.0.2", 53);
@@ -48,6 +48,16 @@ class Experiments {
     mutable std::mutex mMutex;
     std::map<std::string_view, int> mFlagsMapInt GUARDED_BY(mMutex);
     static constexpr const char* const kExperimentFlagKeyList[] = {
+            "batched_parallel_lookup",
+            "cache_admission_filter",
+            "cache_max_bytes",
+            "cache_max_total_bytes",
+            "cache_prefetch_budget_pct",
+            "cache_prefetch_threshold_pct",
+            "cache_serve_stale_window_sec",
+            "cache_share_between_networks",
+            "cache_snapshot_interval_sec",
+            "cache_stale_answer_timeout_ms",
             "doh_early_data",
             "doh_idle_timeout_ms",
             "doh_probe_timeout_ms",
@@ -64,13 +74,23 @@ class Experiments {
             "dot_xport_unusable_threshold",
             "fail_fast_on_uid_network_blocking",
             "keep_listening_udp",
+            "lookup_executor",
             "max_cache_entries",
             "max_queries_global",
+            "mdns_engine",
             "mdns_resolution",
             "parallel_lookup_sleep_time",
             "retransmission_time_interval",
             "retry_count",
+            "server_capability_ttl_sec",
             "sort_nameservers",
+            "tcp_connection_pool",
+            "udp_adaptive_timeout",
+            "udp_hedge_budget_pct",
+            "udp_hedge_latency_percentile",
+            "udp_kernel_timestamps",
+            "udp_query_engine",
+            "udp_socket_pool",
     };
     // This value is used in updateInternal as the default value if any flags can't be found.
     static constexpr int kFlagIntDefault = INT_MIN;
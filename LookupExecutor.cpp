@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "LookupExecutor.h"
+
+#include <algorithm>
+
+#include <netdutils/ThreadUtil.h>
+
+namespace android::net {
+
+LookupExecutor::~LookupExecutor() {
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard guard(mMutex);
+        mStopping = true;
+        threads.swap(mThreads);
+    }
+    mWorkCv.notify_all();
+    for (auto& thread : threads) thread.join();
+}
+
+LookupExecutor& LookupExecutor::getInstance() {
+    // Never destroyed, to avoid races with the threads which are still resolving at exit.
+    static LookupExecutor* instance = new LookupExecutor();
+    return *instance;
+}
+
+void LookupExecutor::run(std::span<const std::function<void()>> tasks) {
+    if (tasks.empty()) return;
+    Group group = {.pending = tasks.size() - 1};
+    {
+        std::lock_guard guard(mMutex);
+        for (const auto& task : tasks.subspan(1)) {
+            mQueue.push_back({.fn = &task, .group = &group});
+        }
+        startThreadsLocked();
+    }
+    mWorkCv.notify_all();
+
+    tasks.front()();
+
+    std::unique_lock lock(mMutex);
+    mStats.tasksRunByCaller++;
+    while (group.pending > 0) {
+        const auto it = std::find_if(mQueue.begin(), mQueue.end(),
+                                     [&](const Task& task) { return task.group == &group; });
+        if (it == mQueue.end()) {
+            // The remaining tasks are running on workers.
+            mDoneCv.wait(lock);
+            continue;
+        }
+        const Task task = *it;
+        mQueue.erase(it);
+        lock.unlock();
+        (*task.fn)();
+        lock.lock();
+        mStats.tasksRunByCaller++;
+        finishLocked(task.group);
+    }
+}
+
+bool LookupExecutor::post(std::function<void()> task) {
+    {
+        std::lock_guard guard(mMutex);
+        if (mPostedTasks >= kMaxPostedTasks || mMaxThreads == 0) {
+            mStats.postedTasksRejected++;
+            return false;
+        }
+        mPostedTasks++;
+        auto posted = std::make_shared<const std::function<void()>>(std::move(task));
+        mQueue.push_back({.fn = posted.get(), .group = nullptr, .posted = std::move(posted)});
+        startThreadsLocked();
+    }
+    mWorkCv.notify_one();
+    return true;
+}
+
+void LookupExecutor::startThreadsLocked() {
+    const size_t needed = std::min(mQueue.size() - std::min(mQueue.size(), mIdleThreads),
+                                   mMaxThreads - mThreads.size());
+    for (size_t i = 0; i < needed; ++i) {
+        mThreads.emplace_back(&LookupExecutor::work, this);
+        mStats.threadsStarted++;
+    }
+}
+
+void LookupExecutor::work() {
+    netdutils::setThreadName("LookupWorker");
+    std::unique_lock lock(mMutex);
+    while (true) {
+        mIdleThreads++;
+        while (!mStopping && mQueue.empty()) mWorkCv.wait(lock);
+        mIdleThreads--;
+        if (mStopping) return;
+        const Task task = mQueue.front();
+        mQueue.pop_front();
+        lock.unlock();
+        (*task.fn)();
+        lock.lock();
+        mStats.tasksRunByWorkers++;
+        finishLocked(task.group);
+    }
+}
+
+void LookupExecutor::finishLocked(Group* group) {
+    if (group == nullptr) {
+        mPostedTasks--;
+    } else if (--group->pending == 0) {
+        mDoneCv.notify_all();
+    }
+}
+
+LookupExecutor::Stats LookupExecutor::getStats() {
+    std::lock_guard guard(mMutex);
+    return mStats;
+}
+
+}  // namespace android::net
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
+namespace android::net {
+
+// Runs the queries which a lookup sends in parallel, such as the A and AAAA queries of
+// getaddrinfo(), on a bounded set of worker threads shared by all lookups, rather than on threads
+// started for each lookup. The thread of the lookup runs some of its queries too, so a lookup
+// never waits for a worker: when they are all busy, it runs its queries itself, one after another.
+//
+// Workers are started as they are needed, up to a maximum, and then kept.
+//
+// Background work, such as refreshing cache entries, can also be posted to the workers. Only a
+// few such tasks are queued or running at a time, so that they never take all the workers.
+//
+// This class is thread-safe.
+class LookupExecutor {
+  public:
+    struct Stats {
+        uint64_t threadsStarted = 0;
+        uint64_t tasksRunByCaller = 0;  // Tasks run by the thread which called run().
+        uint64_t tasksRunByWorkers = 0;
+        uint64_t postedTasksRejected = 0;
+    };
+
+    static constexpr size_t kMaxThreads = 8;
+    static constexpr size_t kMaxPostedTasks = 2;
+
+    explicit LookupExecutor(size_t maxThreads = kMaxThreads) : mMaxThreads(maxThreads) {}
+    ~LookupExecutor();
+
+    static LookupExecutor& getInstance();
+
+    // Run |tasks|, and return once they have all run. The calling thread runs the first one,
+    // and then any other which no worker has picked up yet.
+    void run(std::span<const std::function<void()>> tasks) EXCLUDES(mMutex);
+
+    // Queue |task| to run on a worker, and return without waiting for it. Return false, without
+    // queueing it, if kMaxPostedTasks posted tasks are already queued or running, or if there are
+    // no workers.
+    bool post(std::function<void()> task) EXCLUDES(mMutex);
+
+    Stats getStats() EXCLUDES(mMutex);
+
+  private:
+    // The tasks of one call to run().
+    struct Group {
+        size_t pending = 0;
+    };
+
+    struct Task {
+        const std::function<void()>* fn;
+        // Null for the tasks of post(), whose function is owned by |posted|.
+        Group* group;
+        std::shared_ptr<const std::function<void()>> posted;
+    };
+
+    // Start a worker for each queued task which no idle worker can take.
+    void startThreadsLocked() REQUIRES(mMutex);
+    void work() EXCLUDES(mMutex);
+    void finishLocked(Group* group) REQUIRES(mMutex);
+
+    const size_t mMaxThreads;
+
+    std::mutex mMutex;
+    // Signaled when a task is queued, or when the workers ought to exit.
+    std::condition_variable mWorkCv;
+    // Signaled when the last task of a group is done.
+    std::condition_variable mDoneCv;
+    std::deque<Task> mQueue GUARDED_BY(mMutex);
+    std::vector<std::thread> mThreads GUARDED_BY(mMutex);
+    size_t mIdleThreads GUARDED_BY(mMutex) = 0;
+    size_t mPostedTasks GUARDED_BY(mMutex) = 0;
+    bool mStopping GUARDED_BY(mMutex) = false;
+    Stats mStats GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
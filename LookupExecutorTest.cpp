@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "LookupExecutor.h"
+
+#include <atomic>
+#include <future>
+#include <thread>
+
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+
+class LookupExecutorTest : public NetNativeTestBase {};
+
+TEST_F(LookupExecutorTest, RunsAllTasks) {
+    LookupExecutor executor;
+    std::atomic<int> ran = 0;
+    std::thread::id firstThread;
+    const std::vector<std::function<void()>> tasks = {
+            [&] {
+                firstThread = std::this_thread::get_id();
+                ran++;
+            },
+            [&] { ran++; },
+            [&] { ran++; },
+    };
+    executor.run(tasks);
+    EXPECT_EQ(3, ran);
+    EXPECT_EQ(std::this_thread::get_id(), firstThread);
+
+    const auto stats = executor.getStats();
+    EXPECT_EQ(3U, stats.tasksRunByCaller + stats.tasksRunByWorkers);
+    EXPECT_LE(stats.threadsStarted, 2U);
+}
+
+TEST_F(LookupExecutorTest, RunsTasksInParallel) {
+    LookupExecutor executor(1);
+    // Each task waits for the other to start, so they only both complete if they run at the same
+    // time.
+    std::promise<void> firstStarted;
+    std::promise<void> secondStarted;
+    std::atomic<bool> firstSawSecond = false;
+    std::atomic<bool> secondSawFirst = false;
+    const std::vector<std::function<void()>> tasks = {
+            [&] {
+                firstStarted.set_value();
+                firstSawSecond =
+                        secondStarted.get_future().wait_for(1s) == std::future_status::ready;
+            },
+            [&] {
+                secondStarted.set_value();
+                secondSawFirst =
+                        firstStarted.get_future().wait_for(1s) == std::future_status::ready;
+            },
+    };
+    executor.run(tasks);
+    EXPECT_TRUE(firstSawSecond);
+    EXPECT_TRUE(secondSawFirst);
+    EXPECT_EQ(1U, executor.getStats().tasksRunByWorkers);
+}
+
+// Without workers, the caller runs all its tasks itself.
+TEST_F(LookupExecutorTest, CallerRunsTasksWithoutWorkers) {
+    LookupExecutor executor(0);
+    std::vector<std::thread::id> threads;
+    const std::vector<std::function<void()>> tasks = {
+            [&] { threads.push_back(std::this_thread::get_id()); },
+            [&] { threads.push_back(std::this_thread::get_id()); },
+    };
+    executor.run(tasks);
+    EXPECT_EQ(std::vector(2, std::this_thread::get_id()), threads);
+
+    const auto stats = executor.getStats();
+    EXPECT_EQ(0U, stats.threadsStarted);
+    EXPECT_EQ(2U, stats.tasksRunByCaller);
+}
+
+TEST_F(LookupExecutorTest, ReusesThreads) {
+    LookupExecutor executor;
+    std::atomic<int> ran = 0;
+    const std::vector<std::function<void()>> tasks = {[&] { ran++; }, [&] { ran++; }};
+    executor.run(tasks);
+    // Let the worker wait for work.
+    std::this_thread::sleep_for(50ms);
+
+    const uint64_t threadsStarted = executor.getStats().threadsStarted;
+    for (int i = 0; i < 100; i++) executor.run(tasks);
+    EXPECT_EQ(202, ran);
+    EXPECT_EQ(threadsStarted, executor.getStats().threadsStarted);
+}
+
+TEST_F(LookupExecutorTest, BoundedThreads) {
+    constexpr size_t kMaxThreads = 2;
+    constexpr int kCallers = 16;
+    constexpr int kRuns = 200;
+    LookupExecutor executor(kMaxThreads);
+    std::atomic<int> ran = 0;
+    std::vector<std::thread> callers;
+    for (int i = 0; i < kCallers; i++) {
+        callers.emplace_back([&] {
+            const std::vector<std::function<void()>> tasks = {[&] { ran++; }, [&] { ran++; }};
+            for (int j = 0; j < kRuns; j++) executor.run(tasks);
+        });
+    }
+    for (auto& caller : callers) caller.join();
+
+    EXPECT_EQ(kCallers * kRuns * 2, ran);
+    const auto stats = executor.getStats();
+    EXPECT_LE(stats.threadsStarted, kMaxThreads);
+    EXPECT_EQ(static_cast<uint64_t>(ran), stats.tasksRunByCaller + stats.tasksRunByWorkers);
+}
+
+TEST_F(LookupExecutorTest, PostedTasks) {
+    LookupExecutor executor;
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    std::atomic<int> ran = 0;
+    for (size_t i = 0; i < LookupExecutor::kMaxPostedTasks; i++) {
+        EXPECT_TRUE(executor.post([&ran, released] {
+            released.wait();
+            ran++;
+        }));
+    }
+    // Only a few posted tasks run at a time, and they don't keep the other tasks from running.
+    EXPECT_FALSE(executor.post([&ran] { ran++; }));
+    const std::vector<std::function<void()>> tasks = {[&] { ran++; }, [&] { ran++; }};
+    executor.run(tasks);
+    EXPECT_EQ(2, ran);
+
+    EXPECT_EQ(1U, executor.getStats().postedTasksRejected);
+
+    // Once they are done, other tasks can be posted.
+    release.set_value();
+    for (int i = 0; i < 100 && ran < 4; i++) std::this_thread::sleep_for(10ms);
+    EXPECT_EQ(4, ran);
+    std::promise<void> done;
+    bool posted = false;
+    for (int i = 0; i < 100 && !posted; i++) {
+        posted = executor.post([&done] { done.set_value(); });
+        if (!posted) std::this_thread::sleep_for(10ms);
+    }
+    ASSERT_TRUE(posted);
+    EXPECT_EQ(std::future_status::ready, done.get_future().wait_for(1s));
+
+    LookupExecutor noWorkers(0);
+    EXPECT_FALSE(noWorkers.post([] {}));
+}
+
+}  // namespace android::net
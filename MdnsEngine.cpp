@@ -0,0 +1,570 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "MdnsEngine.h"
+
+#include <arpa/nameser.h>
+#include <ifaddrs.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <memory>
+#include <utility>
+
+#include <android-base/logging.h>
+
+#include "res_comp.h"
+#include "util.h"
+
+namespace android::net {
+
+using base::ErrnoError;
+using base::Error;
+using base::Result;
+using netdutils::IPSockAddr;
+using std::chrono::milliseconds;
+
+namespace {
+
+// The top bit of the class of a record (RFC 6762 section 10.2), and of a question (section 5.4).
+constexpr uint16_t kCacheFlushBit = 0x8000;
+constexpr uint16_t kUnicastResponseBit = 0x8000;
+// Records are replaced or said goodbye to this long after being told to (sections 10.1 and 10.2).
+constexpr auto kFlushDelay = std::chrono::seconds(1);
+// A record is fresh until 80% of its TTL has elapsed (section 5.2), and is only a known answer
+// while at least half of its TTL is left (section 7.1).
+constexpr double kFreshTtlLeft = 0.2;
+constexpr double kKnownAnswerTtlLeft = 0.5;
+constexpr int kMaxCnameHops = 8;
+// Known answers are only added as long as the query fits in this.
+constexpr size_t kMaxQuerySize = PACKETSZ;
+// The largest mDNS message (section 17).
+constexpr size_t kMaxMessageSize = 9000;
+
+std::string lowercase(const char* name) {
+    std::string s(name);
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+    return s;
+}
+
+uint16_t get16(const uint8_t* p) {
+    return static_cast<uint16_t>(p[0] << 8 | p[1]);
+}
+
+void append16(uint16_t v, std::vector<uint8_t>* out) {
+    out->push_back(v >> 8);
+    out->push_back(v & 0xff);
+}
+
+void append32(uint32_t v, std::vector<uint8_t>* out) {
+    append16(v >> 16, out);
+    append16(v & 0xffff, out);
+}
+
+struct Question {
+    std::string name;  // Lowercase.
+    uint16_t type;
+    uint16_t cls;    // Without the unicast-response bit.
+    size_t nameEnd;  // The offset of the end of the name in the query.
+    size_t end;      // The offset of the end of the question in the query.
+};
+
+std::optional<Question> parseQuestion(std::span<const uint8_t> query) {
+    if (query.size() < HFIXEDSZ) return std::nullopt;
+    if (ntohs(reinterpret_cast<const HEADER*>(query.data())->qdcount) != 1) return std::nullopt;
+    const uint8_t* eom = query.data() + query.size();
+    char name[NS_MAXDNAME];
+    const int n = dn_expand(query.data(), eom, query.data() + HFIXEDSZ, name, sizeof(name));
+    if (n < 0 || static_cast<size_t>(HFIXEDSZ + n + QFIXEDSZ) > query.size()) return std::nullopt;
+    const uint8_t* p = query.data() + HFIXEDSZ + n;
+    return Question{
+            .name = lowercase(name),
+            .type = get16(p),
+            .cls = static_cast<uint16_t>(get16(p + INT16SZ) & ~kUnicastResponseBit),
+            .nameEnd = static_cast<size_t>(HFIXEDSZ + n),
+            .end = static_cast<size_t>(HFIXEDSZ + n + QFIXEDSZ),
+    };
+}
+
+// Return the data of |rr|, a record of |msg|, with the names in it uncompressed.
+std::optional<std::vector<uint8_t>> recordData(std::span<const uint8_t> msg, const ns_rr& rr) {
+    const uint8_t* rdata = ns_rr_rdata(rr);
+    const size_t rdlen = ns_rr_rdlen(rr);
+    size_t nameOffset;
+    switch (ns_rr_type(rr)) {
+        case ns_t_cname:
+        case ns_t_ns:
+        case ns_t_ptr:
+            nameOffset = 0;
+            break;
+        case ns_t_srv:
+            nameOffset = 3 * INT16SZ;  // The priority, weight and port.
+            break;
+        default:
+            return std::vector<uint8_t>(rdata, rdata + rdlen);
+    }
+    if (rdlen <= nameOffset) return std::nullopt;
+    char name[NS_MAXDNAME];
+    if (dn_expand(msg.data(), msg.data() + msg.size(), rdata + nameOffset, name, sizeof(name)) <
+        0) {
+        return std::nullopt;
+    }
+    std::vector<uint8_t> data(rdata, rdata + nameOffset);
+    uint8_t buf[NS_MAXCDNAME];
+    const int n = dn_comp(name, buf, sizeof(buf), nullptr, nullptr);
+    if (n < 0) return std::nullopt;
+    data.insert(data.end(), buf, buf + n);
+    return data;
+}
+
+// Return the bytes of the address of |sa|, an IPv4 or IPv6 socket address.
+std::span<const uint8_t> addressBytes(const sockaddr* sa) {
+    if (sa->sa_family == AF_INET) {
+        const auto& a = reinterpret_cast<const sockaddr_in*>(sa)->sin_addr;
+        return {reinterpret_cast<const uint8_t*>(&a), sizeof(a)};
+    }
+    const auto& a6 = reinterpret_cast<const sockaddr_in6*>(sa)->sin6_addr;
+    return {a6.s6_addr, sizeof(a6.s6_addr)};
+}
+
+// Return true if |from| is IPv6 link-local, or in the subnet of one of the addresses of |ifa|.
+bool onLink(const sockaddr_storage& from, const ifaddrs* ifa) {
+    const auto* sa = reinterpret_cast<const sockaddr*>(&from);
+    if (sa->sa_family != AF_INET && sa->sa_family != AF_INET6) return false;
+    if (sa->sa_family == AF_INET6 &&
+        IN6_IS_ADDR_LINKLOCAL(&reinterpret_cast<const sockaddr_in6*>(sa)->sin6_addr)) {
+        return true;
+    }
+    const auto addr = addressBytes(sa);
+    for (; ifa != nullptr; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr == nullptr || ifa->ifa_netmask == nullptr ||
+            ifa->ifa_addr->sa_family != sa->sa_family) {
+            continue;
+        }
+        const auto local = addressBytes(ifa->ifa_addr);
+        const auto mask = addressBytes(ifa->ifa_netmask);
+        bool match = true;
+        for (size_t i = 0; i < addr.size() && match; i++) {
+            match = (addr[i] & mask[i]) == (local[i] & mask[i]);
+        }
+        if (match) return true;
+    }
+    return false;
+}
+
+}  // namespace
+
+void MdnsEngine::RecordCache::add(std::span<const uint8_t> msg, Clock::time_point now) {
+    if (msg.size() < HFIXEDSZ) return;
+    const HEADER* hp = reinterpret_cast<const HEADER*>(msg.data());
+    if (!hp->qr || hp->opcode != ns_o_query || hp->rcode != ns_r_noerror) return;
+    ns_msg handle;
+    if (ns_initparse(msg.data(), msg.size(), &handle) < 0) return;
+
+    struct Parsed {
+        RecordKey key;
+        Record record;
+        bool cacheFlush;
+    };
+    std::vector<Parsed> parsed;
+    for (const ns_sect section : {ns_s_an, ns_s_ar}) {
+        for (int i = 0; i < ns_msg_count(handle, section); i++) {
+            ns_rr rr;
+            if (ns_parserr(&handle, section, i, &rr) < 0) return;
+            if (ns_rr_type(rr) == ns_t_opt) continue;
+            auto rdata = recordData(msg, rr);
+            if (!rdata.has_value()) continue;
+            const uint16_t cls = ns_rr_class(rr);
+            const uint32_t ttl = std::min(ns_rr_ttl(rr), kMaxTtl);
+            parsed.push_back({.key = {lowercase(ns_rr_name(rr)), ns_rr_type(rr),
+                                      cls & ~kCacheFlushBit},
+                              .record = {.rdata = std::move(*rdata),
+                                         .ttl = ttl,
+                                         .received = now,
+                                         .expiry = now + std::chrono::seconds(ttl)},
+                              .cacheFlush = (cls & kCacheFlushBit) != 0});
+        }
+    }
+
+    std::lock_guard guard(mMutex);
+    // The target of a CNAME is expected as long as its owner is. The records are taken over a
+    // few passes, so that the records of a target are taken wherever they are in |msg|.
+    std::vector<bool> taken(parsed.size());
+    for (int pass = 0; pass <= kMaxCnameHops; pass++) {
+        bool progress = false;
+        for (size_t i = 0; i < parsed.size(); i++) {
+            auto& [key, record, cacheFlush] = parsed[i];
+            if (taken[i]) continue;
+            const auto& [name, type, cls] = key;
+            const auto expected = mExpected.find(name);
+            if (expected != mExpected.end() && expected->second > now) {
+                char target[NS_MAXDNAME];
+                if (type == ns_t_cname &&
+                    dn_expand(record.rdata.data(), record.rdata.data() + record.rdata.size(),
+                              record.rdata.data(), target, sizeof(target)) >= 0) {
+                    expectLocked(lowercase(target), now, expected->second);
+                }
+            } else if (record.ttl != 0 || !mRecords.contains(key)) {
+                continue;
+            }
+            addLocked(key, std::move(record), cacheFlush, now);
+            taken[i] = true;
+            progress = true;
+        }
+        if (!progress) break;
+    }
+}
+
+void MdnsEngine::RecordCache::expect(std::span<const uint8_t> query, Clock::time_point now,
+                                     Clock::time_point until) {
+    const auto question = parseQuestion(query);
+    if (!question.has_value()) return;
+    std::lock_guard guard(mMutex);
+    expectLocked(question->name, now, until);
+}
+
+void MdnsEngine::RecordCache::expectLocked(const std::string& name, Clock::time_point now,
+                                           Clock::time_point until) {
+    if (mExpected.size() >= kMaxRecords) {
+        std::erase_if(mExpected, [now](const auto& expected) { return expected.second <= now; });
+    }
+    const auto it = mExpected.find(name);
+    if (it != mExpected.end()) {
+        it->second = std::max(it->second, until);
+    } else if (mExpected.size() < kMaxRecords) {
+        mExpected.emplace(name, until);
+    }
+}
+
+void MdnsEngine::RecordCache::addLocked(const RecordKey& key, Record record, bool cacheFlush,
+                                        Clock::time_point now) {
+    if (mSize >= kMaxRecords) {
+        // Make room by dropping the records which expired.
+        mSize = 0;
+        for (auto it = mRecords.begin(); it != mRecords.end();) {
+            std::erase_if(it->second, [&](const Record& r) { return r.expiry <= now; });
+            mSize += it->second.size();
+            it = it->second.empty() ? mRecords.erase(it) : std::next(it);
+        }
+    }
+
+    const auto it = mRecords.find(key);
+    if (it != mRecords.end()) {
+        auto& records = it->second;
+        // The records which were received before the burst of answers of the new one are
+        // replaced by it.
+        if (cacheFlush) {
+            for (auto& r : records) {
+                if (r.received < now - kFlushDelay) {
+                    r.expiry = std::min(r.expiry, now + kFlushDelay);
+                }
+            }
+        }
+        const auto same = std::find_if(records.begin(), records.end(),
+                                       [&](const Record& r) { return r.rdata == record.rdata; });
+        if (same != records.end()) {
+            // A TTL of 0 says goodbye to the record.
+            if (record.ttl == 0) {
+                same->expiry = std::min(same->expiry, now + kFlushDelay);
+            } else {
+                *same = std::move(record);
+            }
+            return;
+        }
+    }
+    if (record.ttl == 0 || mSize >= kMaxRecords) return;
+    mRecords[key].push_back(std::move(record));
+    mSize++;
+}
+
+std::vector<const MdnsEngine::RecordCache::Record*> MdnsEngine::RecordCache::findLocked(
+        const RecordKey& key, Clock::time_point now, double minLeft) {
+    std::vector<const Record*> found;
+    const auto it = mRecords.find(key);
+    if (it == mRecords.end()) return found;
+    for (const auto& r : it->second) {
+        const std::chrono::duration<double> left = r.expiry - now;
+        if (r.expiry > now && left.count() >= minLeft * r.ttl) found.push_back(&r);
+    }
+    return found;
+}
+
+namespace {
+
+// Append a record of |name|, in wire format, to |out|. Its TTL is what is left of |expiry|.
+template <typename Record>
+void appendRecord(std::span<const uint8_t> name, uint16_t type, uint16_t cls, const Record& r,
+                  std::chrono::steady_clock::time_point now, std::vector<uint8_t>* out) {
+    out->insert(out->end(), name.begin(), name.end());
+    append16(type, out);
+    append16(cls, out);
+    append32(std::chrono::ceil<std::chrono::seconds>(r.expiry - now).count(), out);
+    append16(r.rdata.size(), out);
+    out->insert(out->end(), r.rdata.begin(), r.rdata.end());
+}
+
+}  // namespace
+
+std::optional<std::vector<uint8_t>> MdnsEngine::RecordCache::answer(std::span<const uint8_t> query,
+                                                                    Clock::time_point now,
+                                                                    bool allowStale) {
+    const auto question = parseQuestion(query);
+    if (!question.has_value()) return std::nullopt;
+    const double minLeft = allowStale ? 0 : kFreshTtlLeft;
+
+    std::vector<uint8_t> answer(query.begin(), query.begin() + question->end);
+    int ancount = 0;
+    // The owner of the records which are looked for, first in the query, then in a CNAME.
+    std::vector<uint8_t> owner(query.begin() + HFIXEDSZ, query.begin() + question->nameEnd);
+    std::string name = question->name;
+
+    std::lock_guard guard(mMutex);
+    for (int hops = 0;; hops++) {
+        const auto records = findLocked({name, question->type, question->cls}, now, minLeft);
+        if (!records.empty()) {
+            for (const Record* r : records) {
+                appendRecord(owner, question->type, question->cls, *r, now, &answer);
+            }
+            ancount += records.size();
+            break;
+        }
+        // Follow the CNAME of the name, if any, as a unicast server would.
+        if (question->type == ns_t_cname || hops == kMaxCnameHops) return std::nullopt;
+        const auto cnames = findLocked({name, ns_t_cname, question->cls}, now, minLeft);
+        if (cnames.empty()) return std::nullopt;
+        appendRecord(owner, ns_t_cname, question->cls, *cnames[0], now, &answer);
+        ancount++;
+        owner = cnames[0]->rdata;
+        char target[NS_MAXDNAME];
+        if (dn_expand(owner.data(), owner.data() + owner.size(), owner.data(), target,
+                      sizeof(target)) < 0) {
+            return std::nullopt;
+        }
+        name = lowercase(target);
+    }
+
+    HEADER* hp = reinterpret_cast<HEADER*>(answer.data());
+    hp->qr = 1;
+    hp->aa = 1;
+    hp->tc = 0;
+    hp->rcode = ns_r_noerror;
+    hp->ancount = htons(ancount);
+    hp->nscount = 0;
+    hp->arcount = 0;
+    return answer;
+}
+
+std::vector<uint8_t> MdnsEngine::RecordCache::withKnownAnswers(std::span<const uint8_t> query,
+                                                               Clock::time_point now) {
+    std::vector<uint8_t> result(query.begin(), query.end());
+    const auto question = parseQuestion(query);
+    if (!question.has_value()) return result;
+    const HEADER* hp = reinterpret_cast<const HEADER*>(query.data());
+    if (hp->ancount != 0 || hp->nscount != 0) return result;
+
+    // The known answers go between the question and the additional records, if any.
+    const auto owner = query.subspan(HFIXEDSZ, question->nameEnd - HFIXEDSZ);
+    std::vector<uint8_t> knownAnswers;
+    int ancount = 0;
+    {
+        std::lock_guard guard(mMutex);
+        for (const Record* r : findLocked({question->name, question->type, question->cls}, now,
+                                          kKnownAnswerTtlLeft)) {
+            std::vector<uint8_t> record;
+            appendRecord(owner, question->type, question->cls, *r, now, &record);
+            if (query.size() + knownAnswers.size() + record.size() > kMaxQuerySize) break;
+            knownAnswers.insert(knownAnswers.end(), record.begin(), record.end());
+            ancount++;
+        }
+    }
+    if (ancount == 0) return result;
+    result.insert(result.begin() + question->end, knownAnswers.begin(), knownAnswers.end());
+    reinterpret_cast<HEADER*>(result.data())->ancount = htons(ancount);
+    return result;
+}
+
+size_t MdnsEngine::RecordCache::size() {
+    std::lock_guard guard(mMutex);
+    return mSize;
+}
+
+Result<std::vector<uint8_t>> MdnsEngine::Listener::query(std::span<const uint8_t> query,
+                                                         const IPSockAddr& group,
+                                                         Clock::time_point deadline) {
+    mCache->expect(query, Clock::now(), deadline);
+    const auto packet = mCache->withKnownAnswers(query, Clock::now());
+    const sockaddr_storage ss = group;
+    if (sendto(mFd.get(), packet.data(), packet.size(), 0, reinterpret_cast<const sockaddr*>(&ss),
+               sockaddrSize(ss)) != static_cast<ssize_t>(packet.size())) {
+        return ErrnoError() << "sendto failed";
+    }
+
+    std::unique_lock lock(mMutex);
+    while (true) {
+        if (auto answer = mCache->answer(query, Clock::now(), /*allowStale=*/false)) {
+            return std::move(*answer);
+        }
+        if (mError != 0) return Error(mError) << "Socket broken";
+        if (Clock::now() >= deadline) break;
+        if (mReading) {
+            mCv.wait_until(lock, deadline);
+            continue;
+        }
+
+        mReading = true;
+        lock.unlock();
+        const auto result = read(deadline);
+        lock.lock();
+        mReading = false;
+        if (!result.ok()) {
+            mError = result.error().code();
+            LOG(DEBUG) << __func__ << ": " << result.error().message();
+        }
+        // Wake up the queries which may now be answered, and another one to take over reading.
+        mCv.notify_all();
+    }
+    lock.unlock();
+
+    if (auto answer = mCache->answer(query, Clock::now(), /*allowStale=*/true)) {
+        return std::move(*answer);
+    }
+    return Error(ETIMEDOUT) << "Timed out";
+}
+
+Result<void> MdnsEngine::Listener::read(Clock::time_point deadline) {
+    const auto remaining = std::chrono::ceil<milliseconds>(deadline - Clock::now());
+    pollfd pfd = {.fd = mFd.get(), .events = POLLIN};
+    const int n = poll(&pfd, 1, std::max<int64_t>(remaining.count(), 0));
+    if (n == -1 && errno != EINTR) return ErrnoError() << "poll failed";
+    if (n <= 0) return {};
+
+    // Cache whatever arrived, including the answers to the queries of other threads, as long as
+    // it was sent from the mDNS port by a host on the link.
+    ifaddrs* ifa = nullptr;
+    if (getifaddrs(&ifa) == -1) return ErrnoError() << "getifaddrs failed";
+    const std::unique_ptr<ifaddrs, decltype(&freeifaddrs)> ifaCleanup(ifa, freeifaddrs);
+    std::array<uint8_t, kMaxMessageSize> buf;
+    while (true) {
+        sockaddr_storage from;
+        socklen_t fromlen = sizeof(from);
+        const ssize_t len = recvfrom(mFd.get(), buf.data(), buf.size(), MSG_DONTWAIT,
+                                     reinterpret_cast<sockaddr*>(&from), &fromlen);
+        if (len == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return {};
+            return ErrnoError() << "recvfrom failed";
+        }
+        const IPSockAddr source = IPSockAddr::toIPSockAddr(from);
+        if (source.port() != mPort || !onLink(from, ifa)) {
+            LOG(DEBUG) << __func__ << ": ignoring datagram from " << source.toString();
+            continue;
+        }
+        mCache->add(std::span(buf.data(), len), Clock::now());
+    }
+}
+
+bool MdnsEngine::Listener::broken() {
+    std::lock_guard guard(mMutex);
+    return mError != 0;
+}
+
+MdnsEngine& MdnsEngine::getInstance() {
+    // Never destroyed, to avoid races with the threads which are still resolving at exit.
+    static MdnsEngine* instance = new MdnsEngine();
+    return *instance;
+}
+
+std::shared_ptr<MdnsEngine::RecordCache> MdnsEngine::cacheLocked(unsigned netid) {
+    auto& cache = mCaches[netid];
+    if (cache == nullptr) cache = std::make_shared<RecordCache>();
+    return cache;
+}
+
+std::optional<std::vector<uint8_t>> MdnsEngine::answer(unsigned netid,
+                                                       std::span<const uint8_t> query) {
+    std::shared_ptr<RecordCache> cache;
+    {
+        std::lock_guard guard(mMutex);
+        const auto it = mCaches.find(netid);
+        if (it == mCaches.end()) return std::nullopt;
+        cache = it->second;
+    }
+    auto answer = cache->answer(query, Clock::now(), /*allowStale=*/false);
+    if (answer.has_value()) {
+        std::lock_guard guard(mMutex);
+        mStats[netid].localAnswers++;
+    }
+    return answer;
+}
+
+Result<std::vector<uint8_t>> MdnsEngine::query(
+        const Key& key, std::span<const uint8_t> query, Clock::time_point deadline,
+        const std::function<Result<base::unique_fd>()>& openSocket) {
+    std::shared_ptr<Listener> listener;
+    {
+        std::lock_guard guard(mMutex);
+        const auto it = mListeners.find(key);
+        if (it != mListeners.end() && !it->second->broken()) listener = it->second;
+    }
+    if (listener == nullptr) {
+        auto fd = openSocket();
+        if (!fd.ok()) return Error(fd.error().code()) << fd.error().message();
+        std::shared_ptr<Listener> replaced;
+        std::lock_guard guard(mMutex);
+        listener = std::make_shared<Listener>(std::move(*fd), key.server.port(),
+                                              cacheLocked(key.netid));
+        // A broken listener, or one which another thread added meanwhile, is closed once its
+        // queries are done.
+        replaced = std::exchange(mListeners[key], listener);
+    }
+    {
+        std::lock_guard guard(mMutex);
+        mStats[key.netid].queriesSent++;
+    }
+    return listener->query(query, key.server, deadline);
+}
+
+void MdnsEngine::clear(unsigned netid) {
+    std::vector<std::shared_ptr<Listener>> closed;
+    std::lock_guard guard(mMutex);
+    for (auto it = mListeners.begin(); it != mListeners.end();) {
+        if (it->first.netid != netid) {
+            ++it;
+            continue;
+        }
+        closed.push_back(std::move(it->second));
+        it = mListeners.erase(it);
+    }
+    mCaches.erase(netid);
+    mStats.erase(netid);
+}
+
+MdnsEngine::Stats MdnsEngine::getStats(unsigned netid) {
+    std::lock_guard guard(mMutex);
+    Stats stats;
+    if (const auto it = mStats.find(netid); it != mStats.end()) stats = it->second;
+    if (const auto it = mCaches.find(netid); it != mCaches.end()) {
+        stats.records = it->second->size();
+    }
+    return stats;
+}
+
+}  // namespace android::net
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <android-base/result.h>
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+
+#include "UdpSocketPool.h"
+
+namespace android::net {
+
+// Resolves .local names over mDNS with sockets which are kept open, and a cache of the records
+// which were seen in the mDNS answers of each network, so that a name which was recently resolved
+// is answered without waiting for the link.
+//
+// The records are cached as RFC 6762 says: one by one, with their own TTL, and with the records
+// which a record with the cache-flush bit replaces expiring a second later (section 10.2). A
+// query which goes out carries the cached records which answer it as known answers, so that the
+// responders don't send them again (section 7.1).
+//
+// Since the sockets stay open, anyone who can reach them could fill the cache. So only the
+// records of the names which were queried are cached, for at most kMaxTtl, and only from the
+// datagrams which come from the mDNS port of a host on the link (sections 6 and 11).
+//
+// This class is thread-safe.
+class MdnsEngine {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    // Sockets are only shared by queries which would have set them up identically. The server is
+    // the mDNS group address which the queries are sent to.
+    using Key = UdpSocketPool::Key;
+
+    // The records seen in the mDNS answers of a network.
+    class RecordCache {
+      public:
+        // Cache the records of |msg| which answer the queries that expect() was told of, and
+        // the records of the targets of their CNAMEs, with their TTL capped at kMaxTtl. Records
+        // with a TTL of 0 are always taken, as they can only remove cached records. Anything
+        // but a successful mDNS response is ignored (RFC 6762 section 18).
+        void add(std::span<const uint8_t> msg, Clock::time_point now) EXCLUDES(mMutex);
+
+        // Accept the records of the name of |query| until |until|.
+        void expect(std::span<const uint8_t> query, Clock::time_point now,
+                    Clock::time_point until) EXCLUDES(mMutex);
+
+        // Return an answer to |query| made of the cached records, with the ID and question of
+        // |query|, or nothing if none of the records answering it are fresh. A record is fresh
+        // until 80% of its TTL has elapsed, when RFC 6762 section 5.2 has it queried again. With
+        // |allowStale|, the records which haven't expired are used as well.
+        std::optional<std::vector<uint8_t>> answer(std::span<const uint8_t> query,
+                                                   Clock::time_point now, bool allowStale)
+                EXCLUDES(mMutex);
+
+        // Return |query| with the cached records which answer it, and still have at least half
+        // of their TTL left, added as known answers.
+        std::vector<uint8_t> withKnownAnswers(std::span<const uint8_t> query,
+                                              Clock::time_point now) EXCLUDES(mMutex);
+
+        size_t size() EXCLUDES(mMutex);
+
+      private:
+        struct Record {
+            // Names in the data are uncompressed, so that it can be copied to any message.
+            std::vector<uint8_t> rdata;
+            uint32_t ttl;
+            Clock::time_point received;
+            Clock::time_point expiry;
+        };
+
+        // A lowercase name, a type and a class, without the cache-flush bit.
+        using RecordKey = std::tuple<std::string, uint16_t, uint16_t>;
+
+        void addLocked(const RecordKey& key, Record record, bool cacheFlush, Clock::time_point now)
+                REQUIRES(mMutex);
+
+        // Return the records of |key| which haven't expired, and which have more than |minLeft|
+        // of their TTL left.
+        std::vector<const Record*> findLocked(const RecordKey& key, Clock::time_point now,
+                                              double minLeft) REQUIRES(mMutex);
+
+        // Accept the records of |name| until |until|, unless too many names are expected.
+        void expectLocked(const std::string& name, Clock::time_point now, Clock::time_point until)
+                REQUIRES(mMutex);
+
+        std::mutex mMutex;
+        std::map<RecordKey, std::vector<Record>> mRecords GUARDED_BY(mMutex);
+        size_t mSize GUARDED_BY(mMutex) = 0;
+        // The lowercase names which records are accepted for, and until when.
+        std::map<std::string, Clock::time_point> mExpected GUARDED_BY(mMutex);
+    };
+
+    struct Stats {
+        uint64_t localAnswers = 0;  // Queries answered from the cache.
+        uint64_t queriesSent = 0;   // Queries sent on the link.
+        size_t records = 0;         // Records in the cache.
+    };
+
+    // The records cached per network.
+    static constexpr size_t kMaxRecords = 512;
+    // The longest TTL which a record is cached for, the one RFC 6762 section 10 recommends for
+    // most records.
+    static constexpr uint32_t kMaxTtl = 75 * 60;
+
+    static MdnsEngine& getInstance();
+
+    // Return an answer to |query| from the fresh records cached for |netid|, if there are any.
+    std::optional<std::vector<uint8_t>> answer(unsigned netid, std::span<const uint8_t> query)
+            EXCLUDES(mMutex);
+
+    // Send |query| to the group address of |key|, and wait until |deadline| for the answers to
+    // make it answerable from the cache. It is sent on the socket of |key|, which is opened with
+    // |openSocket| if there is none yet. At the deadline, the records which haven't expired are
+    // used, if any of them answers |query|. Otherwise it fails with ETIMEDOUT, or with the error
+    // of the socket.
+    base::Result<std::vector<uint8_t>> query(
+            const Key& key, std::span<const uint8_t> query, Clock::time_point deadline,
+            const std::function<base::Result<base::unique_fd>()>& openSocket) EXCLUDES(mMutex);
+
+    // Drop the sockets, records and stats of |netid|. Queries in flight on them still complete.
+    void clear(unsigned netid) EXCLUDES(mMutex);
+
+    Stats getStats(unsigned netid) EXCLUDES(mMutex);
+
+  private:
+    // A socket which the queries of a key are sent on, and which their answers, and whatever
+    // else the responders send to it, are read from into the cache.
+    class Listener {
+      public:
+        // Only the datagrams sent from |port|, the port of the group address, are read.
+        Listener(base::unique_fd fd, uint16_t port, std::shared_ptr<RecordCache> cache)
+            : mFd(std::move(fd)), mPort(port), mCache(std::move(cache)) {}
+        Listener(const Listener&) = delete;
+        Listener& operator=(const Listener&) = delete;
+
+        base::Result<std::vector<uint8_t>> query(std::span<const uint8_t> query,
+                                                 const netdutils::IPSockAddr& group,
+                                                 Clock::time_point deadline) EXCLUDES(mMutex);
+
+        bool broken() EXCLUDES(mMutex);
+
+      private:
+        // Wait until |deadline| for the socket to be readable, and cache what was read. Called
+        // without the lock, by the one thread which reads at a time.
+        base::Result<void> read(Clock::time_point deadline);
+
+        const base::unique_fd mFd;
+        const uint16_t mPort;
+        const std::shared_ptr<RecordCache> mCache;
+
+        std::mutex mMutex;
+        std::condition_variable mCv;
+        // Set while one of the waiting threads reads the socket on behalf of all of them.
+        bool mReading GUARDED_BY(mMutex) = false;
+        int mError GUARDED_BY(mMutex) = 0;
+    };
+
+    std::shared_ptr<RecordCache> cacheLocked(unsigned netid) REQUIRES(mMutex);
+
+    std::mutex mMutex;
+    std::map<Key, std::shared_ptr<Listener>> mListeners GUARDED_BY(mMutex);
+    std::map<unsigned, std::shared_ptr<RecordCache>> mCaches GUARDED_BY(mMutex);
+    std::map<unsigned, Stats> mStats GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
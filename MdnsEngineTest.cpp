@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MdnsEngine.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <sys/socket.h>
+
+#include <thread>
+
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+#include "res_comp.h"
+#include "resolv_private.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+using android::base::unique_fd;
+using android::netdutils::IPSockAddr;
+
+namespace {
+
+constexpr uint16_t kCacheFlush = 0x8000;
+constexpr uint8_t kAddr1[] = {192, 168, 1, 10};
+constexpr uint8_t kAddr2[] = {192, 168, 1, 11};
+
+struct Rr {
+    const char* name;
+    uint16_t type;
+    uint16_t cls;
+    uint32_t ttl;
+    std::vector<uint8_t> rdata;
+};
+
+std::vector<uint8_t> wireName(const char* name) {
+    uint8_t buf[NS_MAXCDNAME];
+    const int n = dn_comp(name, buf, sizeof(buf), nullptr, nullptr);
+    EXPECT_GT(n, 0);
+    return {buf, buf + n};
+}
+
+std::vector<uint8_t> makeQuery(const char* qname, uint16_t qtype) {
+    std::vector<uint8_t> buf(MAXPACKET);
+    const int len = res_nmkquery(ns_o_query, qname, ns_c_in, qtype, {}, buf, 0);
+    EXPECT_GT(len, 0);
+    buf.resize(len);
+    return buf;
+}
+
+// An mDNS response, with no question, and |rrs| as answers.
+std::vector<uint8_t> makeResponse(const std::vector<Rr>& rrs) {
+    std::vector<uint8_t> msg(HFIXEDSZ);
+    HEADER* hp = reinterpret_cast<HEADER*>(msg.data());
+    hp->qr = 1;
+    hp->aa = 1;
+    hp->ancount = htons(rrs.size());
+    for (const auto& rr : rrs) {
+        const auto name = wireName(rr.name);
+        msg.insert(msg.end(), name.begin(), name.end());
+        for (const uint16_t v : {rr.type, rr.cls, static_cast<uint16_t>(rr.ttl >> 16),
+                                 static_cast<uint16_t>(rr.ttl),
+                                 static_cast<uint16_t>(rr.rdata.size())}) {
+            msg.push_back(v >> 8);
+            msg.push_back(v & 0xff);
+        }
+        msg.insert(msg.end(), rr.rdata.begin(), rr.rdata.end());
+    }
+    return msg;
+}
+
+Rr aRecord(const char* name, const uint8_t (&addr)[4], uint32_t ttl, bool cacheFlush = true) {
+    return {name, ns_t_a, static_cast<uint16_t>(ns_c_in | (cacheFlush ? kCacheFlush : 0)), ttl,
+            {addr, addr + 4}};
+}
+
+// The answer records of |msg|, as the data of each, and its TTL.
+std::vector<std::pair<std::vector<uint8_t>, uint32_t>> answers(const std::vector<uint8_t>& msg) {
+    std::vector<std::pair<std::vector<uint8_t>, uint32_t>> result;
+    ns_msg handle;
+    EXPECT_EQ(0, ns_initparse(msg.data(), msg.size(), &handle));
+    for (int i = 0; i < ns_msg_count(handle, ns_s_an); i++) {
+        ns_rr rr;
+        EXPECT_EQ(0, ns_parserr(&handle, ns_s_an, i, &rr));
+        const uint8_t* rdata = ns_rr_rdata(rr);
+        result.emplace_back(std::vector<uint8_t>(rdata, rdata + ns_rr_rdlen(rr)), ns_rr_ttl(rr));
+    }
+    return result;
+}
+
+std::vector<uint8_t> addr(const uint8_t (&a)[4]) {
+    return {a, a + 4};
+}
+
+}  // namespace
+
+class MdnsEngineTest : public NetNativeTestBase {
+  protected:
+    MdnsEngineTest() {
+        for (const char* name : {"printer.local", "alias.local"}) {
+            mCache.expect(makeQuery(name, ns_t_a), mNow, mNow + 1h);
+        }
+    }
+
+    MdnsEngine::RecordCache mCache;
+    const MdnsEngine::Clock::time_point mNow = MdnsEngine::Clock::now();
+};
+
+TEST_F(MdnsEngineTest, AnswersFreshRecords) {
+    const auto query = makeQuery("printer.local", ns_t_a);
+    EXPECT_FALSE(mCache.answer(query, mNow, /*allowStale=*/false).has_value());
+
+    mCache.add(makeResponse({aRecord("Printer.local", kAddr1, 120)}), mNow);
+    EXPECT_EQ(1U, mCache.size());
+    auto answer = mCache.answer(query, mNow + 10s, /*allowStale=*/false);
+    ASSERT_TRUE(answer.has_value());
+    const HEADER* hp = reinterpret_cast<const HEADER*>(answer->data());
+    EXPECT_EQ(hp->id, reinterpret_cast<const HEADER*>(query.data())->id);
+    EXPECT_TRUE(hp->qr);
+    EXPECT_EQ(1, ntohs(hp->qdcount));
+    EXPECT_EQ(answers(*answer), (decltype(answers({})){{addr(kAddr1), 110}}));
+
+    // Past 80% of the TTL, the record is only used when nothing better comes.
+    EXPECT_FALSE(mCache.answer(query, mNow + 100s, /*allowStale=*/false).has_value());
+    answer = mCache.answer(query, mNow + 100s, /*allowStale=*/true);
+    ASSERT_TRUE(answer.has_value());
+    EXPECT_EQ(answers(*answer), (decltype(answers({})){{addr(kAddr1), 20}}));
+    EXPECT_FALSE(mCache.answer(query, mNow + 120s, /*allowStale=*/true).has_value());
+
+    // Other types aren't answered.
+    EXPECT_FALSE(mCache.answer(makeQuery("printer.local", ns_t_aaaa), mNow, false).has_value());
+}
+
+TEST_F(MdnsEngineTest, CacheFlush) {
+    const auto query = makeQuery("printer.local", ns_t_a);
+
+    // Records without the cache-flush bit add up, as do those of one burst of answers.
+    mCache.add(makeResponse({aRecord("printer.local", kAddr1, 120, /*cacheFlush=*/false)}), mNow);
+    mCache.add(makeResponse({aRecord("printer.local", kAddr2, 120)}), mNow + 500ms);
+    auto answer = mCache.answer(query, mNow + 1s, /*allowStale=*/false);
+    ASSERT_TRUE(answer.has_value());
+    EXPECT_EQ(2U, answers(*answer).size());
+
+    // Once the printer changed its address, the other one goes away.
+    mCache.add(makeResponse({aRecord("printer.local", kAddr2, 120)}), mNow + 5s);
+    answer = mCache.answer(query, mNow + 5s, /*allowStale=*/false);
+    ASSERT_TRUE(answer.has_value());
+    EXPECT_EQ(answers(*answer), (decltype(answers({})){{addr(kAddr2), 120}}));
+    answer = mCache.answer(query, mNow + 7s, /*allowStale=*/true);
+    ASSERT_TRUE(answer.has_value());
+    EXPECT_EQ(answers(*answer), (decltype(answers({})){{addr(kAddr2), 118}}));
+}
+
+TEST_F(MdnsEngineTest, Goodbye) {
+    const auto query = makeQuery("printer.local", ns_t_a);
+    mCache.add(makeResponse({aRecord("printer.local", kAddr1, 120)}), mNow);
+    mCache.add(makeResponse({aRecord("printer.local", kAddr1, 0)}), mNow + 10s);
+    EXPECT_FALSE(mCache.answer(query, mNow + 10s, /*allowStale=*/false).has_value());
+    EXPECT_FALSE(mCache.answer(query, mNow + 12s, /*allowStale=*/true).has_value());
+}
+
+TEST_F(MdnsEngineTest, FollowsCnames) {
+    // The target of the CNAME is cached although it comes first, and wasn't queried.
+    const auto cname = wireName("target.local");
+    mCache.add(makeResponse({aRecord("target.local", kAddr1, 120),
+                             {"alias.local", ns_t_cname, ns_c_in | kCacheFlush, 120, cname}}),
+               mNow);
+    const auto answer =
+            mCache.answer(makeQuery("alias.local", ns_t_a), mNow, /*allowStale=*/false);
+    ASSERT_TRUE(answer.has_value());
+    EXPECT_EQ(answers(*answer),
+              (decltype(answers({})){{cname, 120}, {addr(kAddr1), 120}}));
+}
+
+TEST_F(MdnsEngineTest, OnlyCachesExpectedNames) {
+    const auto query = makeQuery("scanner.local", ns_t_a);
+    mCache.add(makeResponse({aRecord("scanner.local", kAddr1, 120)}), mNow);
+    EXPECT_EQ(0U, mCache.size());
+
+    // Once expected, a name is cached until the query is done, and its TTL is capped.
+    mCache.expect(query, mNow, mNow + 2s);
+    mCache.add(makeResponse({aRecord("Scanner.local", kAddr1, 0xffffffff)}), mNow + 1s);
+    EXPECT_EQ(1U, mCache.size());
+    const auto answer = mCache.answer(query, mNow + 1s, /*allowStale=*/false);
+    ASSERT_TRUE(answer.has_value());
+    EXPECT_EQ(answers(*answer), (decltype(answers({})){{addr(kAddr1), MdnsEngine::kMaxTtl}}));
+    mCache.add(makeResponse({aRecord("scanner.local", kAddr2, 120, /*cacheFlush=*/false)}),
+               mNow + 3s);
+    EXPECT_EQ(1U, mCache.size());
+
+    // A goodbye is still heard.
+    mCache.add(makeResponse({aRecord("scanner.local", kAddr1, 0)}), mNow + 3s);
+    EXPECT_FALSE(mCache.answer(query, mNow + 5s, /*allowStale=*/true).has_value());
+}
+
+TEST_F(MdnsEngineTest, IgnoresQueries) {
+    auto msg = makeResponse({aRecord("printer.local", kAddr1, 120)});
+    reinterpret_cast<HEADER*>(msg.data())->qr = 0;
+    mCache.add(msg, mNow);
+    EXPECT_EQ(0U, mCache.size());
+}
+
+TEST_F(MdnsEngineTest, KnownAnswers) {
+    const auto query = makeQuery("printer.local", ns_t_a);
+    EXPECT_EQ(query, mCache.withKnownAnswers(query, mNow));
+
+    mCache.add(makeResponse({aRecord("printer.local", kAddr1, 120)}), mNow);
+    const auto withKnownAnswers = mCache.withKnownAnswers(query, mNow + 10s);
+    EXPECT_EQ(answers(withKnownAnswers), (decltype(answers({})){{addr(kAddr1), 110}}));
+    const HEADER* hp = reinterpret_cast<const HEADER*>(withKnownAnswers.data());
+    EXPECT_FALSE(hp->qr);
+    EXPECT_EQ(1, ntohs(hp->qdcount));
+
+    // Only the records with at least half of their TTL left are known answers.
+    EXPECT_EQ(query, mCache.withKnownAnswers(query, mNow + 61s));
+}
+
+// A responder which the test drives by hand, standing for the mDNS group address.
+class MdnsEngineQueryTest : public NetNativeTestBase {
+  protected:
+    static constexpr unsigned kNetId = 30;
+
+    MdnsEngineQueryTest() {
+        mResponderFd.reset(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+        sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(0)};
+        EXPECT_EQ(1, inet_pton(AF_INET, "127.0.0.3", &sin.sin_addr));
+        EXPECT_EQ(0, bind(mResponderFd.get(), reinterpret_cast<sockaddr*>(&sin), sizeof(sin)));
+        socklen_t len = sizeof(sin);
+        EXPECT_EQ(0, getsockname(mResponderFd.get(), reinterpret_cast<sockaddr*>(&sin), &len));
+        mKey = {.netid = kNetId,
+                .mark = 0,
+                .uid = 1000,
+                .server = IPSockAddr::toIPSockAddr("127.0.0.3", ntohs(sin.sin_port))};
+    }
+
+    ~MdnsEngineQueryTest() { mEngine.clear(kNetId); }
+
+    base::Result<std::vector<uint8_t>> query(const std::vector<uint8_t>& msg,
+                                             std::chrono::milliseconds timeout) {
+        return mEngine.query(mKey, msg, MdnsEngine::Clock::now() + timeout, [this]() {
+            mSocketsOpened++;
+            unique_fd fd(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+            return base::Result<unique_fd>(std::move(fd));
+        });
+    }
+
+    // Read a query, and send |response| back to its sender.
+    std::vector<uint8_t> respond(const std::vector<uint8_t>& response) {
+        std::vector<uint8_t> buf(MAXPACKET);
+        sockaddr_storage from;
+        socklen_t fromlen = sizeof(from);
+        const ssize_t len = recvfrom(mResponderFd.get(), buf.data(), buf.size(), 0,
+                                     reinterpret_cast<sockaddr*>(&from), &fromlen);
+        EXPECT_GT(len, 0);
+        buf.resize(std::max<ssize_t>(len, 0));
+        EXPECT_EQ(static_cast<ssize_t>(response.size()),
+                  sendto(mResponderFd.get(), response.data(), response.size(), 0,
+                         reinterpret_cast<sockaddr*>(&from), fromlen));
+        return buf;
+    }
+
+    MdnsEngine mEngine;
+    MdnsEngine::Key mKey;
+    unique_fd mResponderFd;
+    int mSocketsOpened = 0;
+};
+
+TEST_F(MdnsEngineQueryTest, AnswersRepeatedQueriesLocally) {
+    const auto msg = makeQuery("printer.local", ns_t_a);
+    EXPECT_FALSE(mEngine.answer(kNetId, msg).has_value());
+
+    // The responder also tells of another name, which nobody asked about, so it isn't cached.
+    std::thread responder([&]() {
+        respond(makeResponse({aRecord("printer.local", kAddr1, 120),
+                              aRecord("scanner.local", kAddr2, 120)}));
+    });
+    const auto result = query(msg, 1s);
+    responder.join();
+    ASSERT_TRUE(result.ok()) << result.error().message();
+    EXPECT_EQ(answers(*result), (decltype(answers({})){{addr(kAddr1), 120}}));
+
+    const auto answer = mEngine.answer(kNetId, msg);
+    ASSERT_TRUE(answer.has_value());
+    EXPECT_EQ(answers(*answer), answers(*result));
+    EXPECT_FALSE(mEngine.answer(kNetId, makeQuery("scanner.local", ns_t_a)).has_value());
+
+    const auto stats = mEngine.getStats(kNetId);
+    EXPECT_EQ(1U, stats.localAnswers);
+    EXPECT_EQ(1U, stats.queriesSent);
+    EXPECT_EQ(1U, stats.records);
+
+    // The socket is kept for the next query.
+    std::thread responder2([&]() {
+        respond(makeResponse({{"printer.local", ns_t_aaaa, ns_c_in, 120,
+                               std::vector<uint8_t>(16, 1)}}));
+    });
+    EXPECT_TRUE(query(makeQuery("printer.local", ns_t_aaaa), 1s).ok());
+    responder2.join();
+    EXPECT_EQ(1, mSocketsOpened);
+
+    mEngine.clear(kNetId);
+    EXPECT_FALSE(mEngine.answer(kNetId, msg).has_value());
+    EXPECT_EQ(0U, mEngine.getStats(kNetId).records);
+}
+
+TEST_F(MdnsEngineQueryTest, SendsKnownAnswers) {
+    std::thread responder([&]() {
+        respond(makeResponse({{"printer.local", ns_t_txt, ns_c_in, 120, {3, 'a', '=', 'b'}}}));
+    });
+    const auto msg = makeQuery("printer.local", ns_t_txt);
+    ASSERT_TRUE(query(msg, 1s).ok());
+    responder.join();
+
+    // The cached record goes out with the query, so that the responders leave it out of their
+    // answers.
+    std::vector<uint8_t> sent;
+    std::thread responder2([&]() { sent = respond(makeResponse({})); });
+    const auto result = mEngine.query(mKey, msg, MdnsEngine::Clock::now() + 200ms, nullptr);
+    responder2.join();
+    ASSERT_TRUE(result.ok()) << result.error().message();
+    EXPECT_EQ(1U, answers(*result).size());
+    EXPECT_EQ(1U, answers(sent).size());
+}
+
+TEST_F(MdnsEngineQueryTest, IgnoresOtherPorts) {
+    // An answer from another port than that of the group address is dropped.
+    unique_fd other(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+    std::thread responder([&]() {
+        std::vector<uint8_t> buf(MAXPACKET);
+        sockaddr_storage from;
+        socklen_t fromlen = sizeof(from);
+        EXPECT_GT(recvfrom(mResponderFd.get(), buf.data(), buf.size(), 0,
+                           reinterpret_cast<sockaddr*>(&from), &fromlen),
+                  0);
+        const auto response = makeResponse({aRecord("printer.local", kAddr1, 120)});
+        EXPECT_EQ(static_cast<ssize_t>(response.size()),
+                  sendto(other.get(), response.data(), response.size(), 0,
+                         reinterpret_cast<sockaddr*>(&from), fromlen));
+    });
+    const auto result = query(makeQuery("printer.local", ns_t_a), 200ms);
+    responder.join();
+    ASSERT_FALSE(result.ok());
+    EXPECT_EQ(ETIMEDOUT, result.error().code());
+    EXPECT_EQ(0U, mEngine.getStats(kNetId).records);
+}
+
+TEST_F(MdnsEngineQueryTest, Timeout) {
+    const auto start = MdnsEngine::Clock::now();
+    const auto result = query(makeQuery("printer.local", ns_t_a), 200ms);
+    ASSERT_FALSE(result.ok());
+    EXPECT_EQ(ETIMEDOUT, result.error().code());
+    EXPECT_GE(MdnsEngine::Clock::now() - start, 200ms);
+}
+
+}  // namespace android::net
@@ -23,6 +23,7 @@
 #include <vector>
 
 #include <aidl/android/net/IDnsResolver.h>
+#include <android-base/format.h>
 #include <android-base/logging.h>
 #include <android-base/strings.h>
 #include <statslog_resolv.h>
@@ -30,9 +31,12 @@
 #include "Dns64Configuration.h"
 #include "DnsResolver.h"
 #include "DnsTlsDispatcher.h"
+#include "MdnsEngine.h"
 #include "PrivateDnsConfiguration.h"
 #include "ResolverEventReporter.h"
 #include "ResolverStats.h"
+#include "TcpConnectionPool.h"
+#include "UdpSocketPool.h"
 #include "resolv_cache.h"
 #include "stats.h"
 #include "util.h"
@@ -177,6 +181,9 @@ void ResolverController::destroyNetworkCache(unsigned netId) {
                                      event.network_type(), event.private_dns_modes(), bytesField);
 
     resolv_delete_cache_for_net(netId);
+    UdpSocketPool::getInstance().clear(netId);
+    TcpConnectionPool::getInstance().clear(netId);
+    MdnsEngine::getInstance().clear(netId);
     mDns64Configuration->stopPrefixDiscovery(netId);
     privateDnsConfiguration.clear(netId);
 
@@ -192,6 +199,8 @@ int ResolverController::createNetworkCache(unsigned netId) {
 
 int ResolverController::flushNetworkCache(unsigned netId) {
     LOG(VERBOSE) << __func__ << ": netId = " << netId;
+    // The mDNS records are cached answers as well.
+    MdnsEngine::getInstance().clear(netId);
     return resolv_flush_cache_for_net(netId);
 }
 
@@ -374,6 +383,19 @@ void ResolverController::dump(DumpWriter& dw, unsigned netId) {
             dw.decIndent();
         }
         dw.println("Concurrent DNS query timeout: %d", wait_for_pending_req_timeout_count);
+        const auto tcpStats = TcpConnectionPool::getInstance().getStats(netId);
+        if (tcpStats.handshakes > 0) {
+            const uint64_t connections = tcpStats.handshakes + tcpStats.reuses;
+            dw.println(fmt::format("TCP connections: {} handshakes, {} reused ({:.1f}%), {} open",
+                                   tcpStats.handshakes, tcpStats.reuses,
+                                   100.0 * tcpStats.reuses / connections, tcpStats.open));
+        }
+        const auto mdnsStats = MdnsEngine::getInstance().getStats(netId);
+        if (mdnsStats.localAnswers + mdnsStats.queriesSent > 0) {
+            dw.println(fmt::format("mDNS: {} queries sent, {} answered locally, {} records cached",
+                                   mdnsStats.queriesSent, mdnsStats.localAnswers,
+                                   mdnsStats.records));
+        }
         resolv_netconfig_dump(dw, netId);
     }
     dw.decIndent();
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "ServerCapabilities.h"
+
+#include <android-base/format.h>
+
+namespace android::net {
+
+using netdutils::DumpWriter;
+using netdutils::IPSockAddr;
+using netdutils::ScopedIndent;
+
+std::optional<ServerCapabilities::Record> ServerCapabilities::get(const IPSockAddr& server,
+                                                                  Clock::time_point now) const {
+    const auto it = mEntries.find(server);
+    if (it == mEntries.end() || now >= it->second.expiry) return std::nullopt;
+    return it->second.record;
+}
+
+void ServerCapabilities::recordEdnsRejected(const IPSockAddr& server, Clock::time_point now,
+                                            Clock::duration ttl) {
+    entry(server, now, ttl).record.ednsRejected = true;
+}
+
+void ServerCapabilities::recordUdpAnswer(const IPSockAddr& server, bool truncated,
+                                         uint16_t udpPayloadSize, Clock::time_point now,
+                                         Clock::duration ttl) {
+    Entry& e = entry(server, now, ttl);
+    e.udpAnswers++;
+    if (truncated) e.truncatedAnswers++;
+    e.record.udpPayloadSize = udpPayloadSize;
+    e.record.oftenTruncated =
+            e.udpAnswers >= kMinUdpAnswers && e.truncatedAnswers * 2 >= e.udpAnswers;
+}
+
+void ServerCapabilities::recordTcpConnect(const IPSockAddr& server, bool connected,
+                                          Clock::time_point now, Clock::duration ttl) {
+    entry(server, now, ttl).record.tcpReachable = connected;
+}
+
+ServerCapabilities::Entry& ServerCapabilities::entry(const IPSockAddr& server,
+                                                     Clock::time_point now, Clock::duration ttl) {
+    std::erase_if(mEntries, [&](const auto& item) { return now >= item.second.expiry; });
+    const auto [it, inserted] = mEntries.try_emplace(server);
+    if (inserted) it->second.expiry = now + ttl;
+    return it->second;
+}
+
+void ServerCapabilities::dump(DumpWriter& dw, Clock::time_point now) const {
+    bool first = true;
+    for (const auto& [server, e] : mEntries) {
+        if (now >= e.expiry) continue;
+        if (first) dw.println("Server capabilities:");
+        first = false;
+        ScopedIndent indent(dw);
+        const Record& r = e.record;
+        dw.println(fmt::format(
+                "{} EDNS0 {}, UDP payload size {}, {}/{} UDP answers truncated, TCP {}, "
+                "expires in {}s",
+                server.toString(), r.ednsRejected ? "rejected" : "not rejected", r.udpPayloadSize,
+                e.truncatedAnswers, e.udpAnswers,
+                r.tcpReachable.has_value() ? (*r.tcpReachable ? "reachable" : "unreachable")
+                                           : "untried",
+                std::chrono::duration_cast<std::chrono::seconds>(e.expiry - now).count()));
+    }
+}
+
+}  // namespace android::net
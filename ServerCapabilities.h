@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <optional>
+
+#include <netdutils/DumpWriter.h>
+#include <netdutils/InternetAddresses.h>
+
+namespace android::net {
+
+// What has been learned of how the nameservers of a network handle EDNS0 and TCP, so that a query
+// can be sent in the right format and over the right transport on the first attempt, rather than
+// learning it again from a FORMERR or a truncated answer. What is learned of a server is forgotten
+// after a while, as servers and the paths to them change.
+//
+// This class is not thread-safe.
+class ServerCapabilities {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Record {
+        // The server answered FORMERR to a query with EDNS0.
+        bool ednsRejected = false;
+        // The UDP payload size which the server advertised in its last answer, or 0 if the answer
+        // had no OPT record.
+        uint16_t udpPayloadSize = 0;
+        // Enough of the UDP answers of the server were truncated that its queries had better be
+        // sent over TCP in the first place.
+        bool oftenTruncated = false;
+        // Whether the last TCP connection to the server was set up, if one was tried.
+        std::optional<bool> tcpReachable;
+    };
+
+    // The UDP answers needed to tell whether a server often truncates them.
+    static constexpr int kMinUdpAnswers = 4;
+
+    // Return what was learned of |server|, or nothing if it was forgotten.
+    std::optional<Record> get(const netdutils::IPSockAddr& server, Clock::time_point now) const;
+
+    // Each of these records what a query to |server| showed. What is learned of a server is
+    // forgotten |ttl| after the first of it was.
+    void recordEdnsRejected(const netdutils::IPSockAddr& server, Clock::time_point now,
+                            Clock::duration ttl);
+    void recordUdpAnswer(const netdutils::IPSockAddr& server, bool truncated,
+                         uint16_t udpPayloadSize, Clock::time_point now, Clock::duration ttl);
+    void recordTcpConnect(const netdutils::IPSockAddr& server, bool connected,
+                          Clock::time_point now, Clock::duration ttl);
+
+    void dump(netdutils::DumpWriter& dw, Clock::time_point now) const;
+
+  private:
+    struct Entry {
+        Record record;
+        int udpAnswers = 0;
+        int truncatedAnswers = 0;
+        Clock::time_point expiry;
+    };
+
+    // Return the entry of |server|, which is reset if it expired.
+    Entry& entry(const netdutils::IPSockAddr& server, Clock::time_point now, Clock::duration ttl);
+
+    std::map<netdutils::IPSockAddr, Entry> mEntries;
+};
+
+}  // namespace android::net
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ServerCapabilities.h"
+
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+using android::netdutils::IPSockAddr;
+
+namespace {
+
+const IPSockAddr kServer1 = IPSockAddr::toIPSockAddr("127.0.0.3", 53);
+const IPSockAddr kServer2 = IPSockAddr::toIPSockAddr("127.0.0.4", 53);
+constexpr auto kTtl = 600s;
+
+}  // namespace
+
+class ServerCapabilitiesTest : public NetNativeTestBase {
+  protected:
+    ServerCapabilities mCapabilities;
+    const ServerCapabilities::Clock::time_point mNow = ServerCapabilities::Clock::now();
+};
+
+TEST_F(ServerCapabilitiesTest, Unknown) {
+    EXPECT_FALSE(mCapabilities.get(kServer1, mNow).has_value());
+}
+
+TEST_F(ServerCapabilitiesTest, EdnsRejected) {
+    mCapabilities.recordEdnsRejected(kServer1, mNow, kTtl);
+    const auto record = mCapabilities.get(kServer1, mNow);
+    ASSERT_TRUE(record.has_value());
+    EXPECT_TRUE(record->ednsRejected);
+    EXPECT_FALSE(record->oftenTruncated);
+    EXPECT_FALSE(record->tcpReachable.has_value());
+
+    // Servers are separate.
+    EXPECT_FALSE(mCapabilities.get(kServer2, mNow).has_value());
+}
+
+TEST_F(ServerCapabilitiesTest, UdpAnswers) {
+    mCapabilities.recordUdpAnswer(kServer1, true, 1232, mNow, kTtl);
+    auto record = mCapabilities.get(kServer1, mNow);
+    ASSERT_TRUE(record.has_value());
+    EXPECT_EQ(1232, record->udpPayloadSize);
+    // Too few answers to tell.
+    EXPECT_FALSE(record->oftenTruncated);
+
+    for (int i = 1; i < ServerCapabilities::kMinUdpAnswers; i++) {
+        mCapabilities.recordUdpAnswer(kServer1, true, 1232, mNow, kTtl);
+    }
+    EXPECT_TRUE(mCapabilities.get(kServer1, mNow)->oftenTruncated);
+
+    // Truncation stays frequent until most answers aren't truncated.
+    for (int i = 0; i < ServerCapabilities::kMinUdpAnswers; i++) {
+        mCapabilities.recordUdpAnswer(kServer1, false, 0, mNow, kTtl);
+    }
+    record = mCapabilities.get(kServer1, mNow);
+    EXPECT_TRUE(record->oftenTruncated);
+    EXPECT_EQ(0, record->udpPayloadSize);
+    mCapabilities.recordUdpAnswer(kServer1, false, 0, mNow, kTtl);
+    EXPECT_FALSE(mCapabilities.get(kServer1, mNow)->oftenTruncated);
+}
+
+TEST_F(ServerCapabilitiesTest, TcpConnect) {
+    mCapabilities.recordTcpConnect(kServer1, false, mNow, kTtl);
+    EXPECT_EQ(false, mCapabilities.get(kServer1, mNow)->tcpReachable);
+    mCapabilities.recordTcpConnect(kServer1, true, mNow, kTtl);
+    EXPECT_EQ(true, mCapabilities.get(kServer1, mNow)->tcpReachable);
+}
+
+TEST_F(ServerCapabilitiesTest, Expiry) {
+    mCapabilities.recordEdnsRejected(kServer1, mNow, kTtl);
+    // Later records don't extend what was learned first.
+    mCapabilities.recordTcpConnect(kServer1, true, mNow + kTtl / 2, kTtl);
+    EXPECT_TRUE(mCapabilities.get(kServer1, mNow + kTtl - 1s).has_value());
+    EXPECT_FALSE(mCapabilities.get(kServer1, mNow + kTtl).has_value());
+
+    // Everything is learned again from scratch.
+    mCapabilities.recordTcpConnect(kServer1, true, mNow + kTtl, kTtl);
+    const auto record = mCapabilities.get(kServer1, mNow + kTtl);
+    ASSERT_TRUE(record.has_value());
+    EXPECT_FALSE(record->ednsRejected);
+    EXPECT_EQ(true, record->tcpReachable);
+}
+
+}  // namespace android::net
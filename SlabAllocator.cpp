@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SlabAllocator.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace android::net {
+
+void SlabAllocator::swap(SlabAllocator& other) {
+    std::swap(mClasses, other.mClasses);
+    mSlabs.swap(other.mSlabs);
+    mLarge.swap(other.mLarge);
+    std::swap(mStats, other.mStats);
+}
+
+void* SlabAllocator::allocate(size_t size) {
+    const int index = sizeClassOf(size);
+    void* p;
+    if (index < 0) {
+        p = malloc(size);
+        if (p == nullptr) return nullptr;
+        mLarge.insert(p);
+        mStats.used_bytes += size;
+        mStats.reserved_bytes += size;
+        mStats.large_allocations++;
+    } else {
+        SizeClass& sc = mClasses[index];
+        const size_t chunk = chunkSize(index);
+        if (sc.free_list != nullptr) {
+            p = sc.free_list;
+            sc.free_list = sc.free_list->next;
+        } else {
+            if (sc.bump == sc.bump_end) {
+                char* slab = static_cast<char*>(malloc(kSlabSize));
+                if (slab == nullptr) return nullptr;
+                mSlabs.push_back(slab);
+                mStats.reserved_bytes += kSlabSize;
+                mStats.slabs++;
+                sc.bump = slab;
+                sc.bump_end = slab + kSlabSize / chunk * chunk;
+            }
+            p = sc.bump;
+            sc.bump += chunk;
+        }
+        mStats.used_bytes += chunk;
+    }
+    mStats.requested_bytes += size;
+    return p;
+}
+
+void SlabAllocator::deallocate(void* p, size_t size) {
+    if (p == nullptr) return;
+    const int index = sizeClassOf(size);
+    if (index < 0) {
+        mLarge.erase(p);
+        free(p);
+        mStats.used_bytes -= size;
+        mStats.reserved_bytes -= size;
+        mStats.large_allocations--;
+    } else {
+        SizeClass& sc = mClasses[index];
+        FreeChunk* chunk = static_cast<FreeChunk*>(p);
+        chunk->next = sc.free_list;
+        sc.free_list = chunk;
+        mStats.used_bytes -= chunkSize(index);
+    }
+    mStats.requested_bytes -= size;
+}
+
+void SlabAllocator::reset() {
+    for (char* slab : mSlabs) free(slab);
+    for (void* p : mLarge) free(p);
+    mSlabs.clear();
+    mLarge.clear();
+    mClasses = {};
+    mStats = {};
+}
+
+int SlabAllocator::sizeClassOf(size_t size) {
+    const auto it = std::lower_bound(kChunkSizes.begin(), kChunkSizes.end(), size);
+    return it != kChunkSizes.end() ? it - kChunkSizes.begin() : -1;
+}
+
+}  // namespace android::net
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <unordered_set>
+#include <vector>
+
+namespace android::net {
+
+// Size-class allocator for the entries of a Cache, so that a busy cache recycles its own memory
+// instead of churning the general-purpose heap. Each size class carves fixed-size chunks out of
+// slabs and keeps the freed chunks in a free list; the allocations which don't fit in the largest
+// class go to malloc(). reset() returns all the memory at once.
+//
+// This class is not thread-safe. Like the Cache, it is protected by the mutex of that Cache.
+class SlabAllocator {
+  public:
+    struct Stats {
+        size_t requested_bytes = 0;  // Sum of the sizes of the live allocations
+        size_t used_bytes = 0;       // Same, rounded up to their chunk sizes
+        size_t reserved_bytes = 0;   // Slabs plus large allocations
+        size_t slabs = 0;
+        size_t large_allocations = 0;
+    };
+
+    // Two size classes per power of two, so that at most a third of a chunk is wasted.
+    static constexpr std::array<size_t, 11> kChunkSizes = {128,  192,  256,  384,  512, 768,
+                                                           1024, 1536, 2048, 3072, 4096};
+    static constexpr size_t kSlabSize = 16 * 1024;
+
+    SlabAllocator() = default;
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+    ~SlabAllocator() { reset(); }
+
+    void swap(SlabAllocator& other);
+
+    void* allocate(size_t size);
+
+    // |size| must be the size which |p| was allocated with.
+    void deallocate(void* p, size_t size);
+
+    // Free everything, including the chunks which are still allocated.
+    void reset();
+
+    const Stats& stats() const { return mStats; }
+
+  private:
+    struct FreeChunk {
+        FreeChunk* next;
+    };
+    struct SizeClass {
+        FreeChunk* free_list = nullptr;
+        // The part of the last slab which was never handed out.
+        char* bump = nullptr;
+        char* bump_end = nullptr;
+    };
+
+    static size_t chunkSize(int index) { return kChunkSizes[index]; }
+
+    // Return the index of the smallest size class which fits |size|, or -1 if none does.
+    static int sizeClassOf(size_t size);
+
+    std::array<SizeClass, kChunkSizes.size()> mClasses{};
+    std::vector<char*> mSlabs;
+    std::unordered_set<void*> mLarge;
+    Stats mStats;
+};
+
+}  // namespace android::net
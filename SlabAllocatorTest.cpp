@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SlabAllocator.h"
+
+#include <string.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+namespace android::net {
+
+class SlabAllocatorTest : public NetNativeTestBase {};
+
+TEST_F(SlabAllocatorTest, RoundsUpToSizeClass) {
+    SlabAllocator allocator;
+    for (const auto& [size, chunk] : {std::pair<size_t, size_t>{1, 128},
+                                      {128, 128},
+                                      {129, 192},
+                                      {300, 384},
+                                      {1025, 1536},
+                                      {4096, 4096}}) {
+        SCOPED_TRACE(size);
+        const size_t used = allocator.stats().used_bytes;
+        void* p = allocator.allocate(size);
+        ASSERT_NE(nullptr, p);
+        memset(p, 0xab, size);
+        EXPECT_EQ(used + chunk, allocator.stats().used_bytes);
+    }
+    EXPECT_EQ(0U, allocator.stats().large_allocations);
+}
+
+TEST_F(SlabAllocatorTest, ReusesFreedChunks) {
+    SlabAllocator allocator;
+    void* p = allocator.allocate(200);
+    ASSERT_NE(nullptr, p);
+    allocator.deallocate(p, 200);
+
+    // Any size of the same class gets the freed chunk back, without another slab.
+    EXPECT_EQ(p, allocator.allocate(250));
+    EXPECT_EQ(1U, allocator.stats().slabs);
+
+    // Other classes don't.
+    void* q = allocator.allocate(100);
+    EXPECT_NE(p, q);
+    EXPECT_EQ(2U, allocator.stats().slabs);
+}
+
+TEST_F(SlabAllocatorTest, FillsSlabsBeforeAddingOne) {
+    constexpr size_t kChunk = 4096;
+    constexpr size_t kPerSlab = SlabAllocator::kSlabSize / kChunk;
+    SlabAllocator allocator;
+    for (size_t i = 0; i < kPerSlab; i++) {
+        ASSERT_NE(nullptr, allocator.allocate(kChunk));
+    }
+    EXPECT_EQ(1U, allocator.stats().slabs);
+    ASSERT_NE(nullptr, allocator.allocate(kChunk));
+    EXPECT_EQ(2U, allocator.stats().slabs);
+    EXPECT_EQ(2 * SlabAllocator::kSlabSize, allocator.stats().reserved_bytes);
+}
+
+TEST_F(SlabAllocatorTest, LargeAllocationsBypassSlabs) {
+    constexpr size_t kLarge = SlabAllocator::kChunkSizes.back() + 1;
+    SlabAllocator allocator;
+    void* p = allocator.allocate(kLarge);
+    ASSERT_NE(nullptr, p);
+    memset(p, 0xab, kLarge);
+
+    auto stats = allocator.stats();
+    EXPECT_EQ(0U, stats.slabs);
+    EXPECT_EQ(1U, stats.large_allocations);
+    EXPECT_EQ(kLarge, stats.used_bytes);
+    EXPECT_EQ(kLarge, stats.reserved_bytes);
+
+    allocator.deallocate(p, kLarge);
+    stats = allocator.stats();
+    EXPECT_EQ(0U, stats.large_allocations);
+    EXPECT_EQ(0U, stats.used_bytes);
+    EXPECT_EQ(0U, stats.reserved_bytes);
+}
+
+TEST_F(SlabAllocatorTest, Reset) {
+    SlabAllocator allocator;
+    for (const size_t size : {100, 1000, 10000}) {
+        ASSERT_NE(nullptr, allocator.allocate(size));
+    }
+    allocator.reset();
+
+    const auto stats = allocator.stats();
+    EXPECT_EQ(0U, stats.requested_bytes);
+    EXPECT_EQ(0U, stats.used_bytes);
+    EXPECT_EQ(0U, stats.reserved_bytes);
+    EXPECT_EQ(0U, stats.slabs);
+    EXPECT_EQ(0U, stats.large_allocations);
+
+    // The allocator is usable again, with fresh slabs.
+    EXPECT_NE(nullptr, allocator.allocate(100));
+    EXPECT_EQ(1U, allocator.stats().slabs);
+}
+
+TEST_F(SlabAllocatorTest, RequestedBytes) {
+    SlabAllocator allocator;
+    std::vector<std::pair<void*, size_t>> allocations;
+    size_t requested = 0;
+    for (const size_t size : {1, 129, 700, 4096, 5000}) {
+        allocations.emplace_back(allocator.allocate(size), size);
+        ASSERT_NE(nullptr, allocations.back().first);
+        requested += size;
+        EXPECT_EQ(requested, allocator.stats().requested_bytes);
+    }
+    EXPECT_LT(requested, allocator.stats().used_bytes);
+
+    for (const auto& [p, size] : allocations) {
+        allocator.deallocate(p, size);
+        requested -= size;
+        EXPECT_EQ(requested, allocator.stats().requested_bytes);
+    }
+    EXPECT_EQ(0U, allocator.stats().used_bytes);
+    // The slabs are kept for the next allocations.
+    EXPECT_EQ(4U, allocator.stats().slabs);
+}
+
+}  // namespace android::net
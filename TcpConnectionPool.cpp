@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "TcpConnectionPool.h"
+
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <array>
+#include <iterator>
+
+#include <android-base/logging.h>
+
+#include "resolv_private.h"
+
+namespace android::net {
+
+using base::ErrnoError;
+using base::Error;
+using base::Result;
+using std::chrono::milliseconds;
+
+namespace {
+
+uint16_t messageId(std::span<const uint8_t> msg) {
+    return static_cast<uint16_t>(msg[0] << 8 | msg[1]);
+}
+
+}  // namespace
+
+TcpConnectionPool::Connection::Connection(base::unique_fd fd)
+    : mFd(std::move(fd)), mLastUsed(Clock::now()) {}
+
+Result<std::vector<uint8_t>> TcpConnectionPool::Connection::query(std::span<const uint8_t> query,
+                                                                  milliseconds timeout) {
+    const auto deadline = Clock::now() + timeout;
+    if (query.size() < HFIXEDSZ || query.size() > UINT16_MAX) {
+        return Error(EINVAL) << "Invalid query size " << query.size();
+    }
+    const uint16_t id = messageId(query);
+
+    std::unique_lock lock(mMutex);
+    if (mError != 0) return Error(mError) << "Connection broken";
+    if (mPending.contains(id)) return Error(EBUSY) << "ID " << id << " already in flight";
+
+    // A query is written whole under the lock, so that it can't interleave with another one on
+    // the stream. The write doesn't block: a connection which can't take a query is congested.
+    uint16_t len = htons(static_cast<uint16_t>(query.size()));
+    iovec iov[] = {
+            {.iov_base = &len, .iov_len = INT16SZ},
+            {.iov_base = const_cast<uint8_t*>(query.data()), .iov_len = query.size()},
+    };
+    const msghdr msg = {.msg_iov = iov, .msg_iovlen = std::size(iov)};
+    const ssize_t written = sendmsg(mFd.get(), &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (written != static_cast<ssize_t>(INT16SZ + query.size())) {
+        if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return ErrnoError() << "Connection congested";
+        }
+        // Part of the query may have been written, so the stream can't be used any more.
+        mError = (written == -1) ? errno : EIO;
+        mCv.notify_all();
+        return Error(mError) << "Failed to send query";
+    }
+
+    const auto it = mPending.emplace(id, Pending{.query = {query.begin(), query.end()}}).first;
+    mLastUsed = Clock::now();
+    Result<std::vector<uint8_t>> result = Error(ETIMEDOUT) << "Timed out";
+    while (true) {
+        if (it->second.answer.has_value()) {
+            result = std::move(*it->second.answer);
+            break;
+        }
+        if (mError != 0) {
+            result = Error(mError) << "Connection broken";
+            break;
+        }
+        if (Clock::now() >= deadline) break;
+        if (mReading) {
+            mCv.wait_until(lock, deadline);
+            continue;
+        }
+
+        mReading = true;
+        lock.unlock();
+        auto messages = read(deadline);
+        lock.lock();
+        mReading = false;
+        if (messages.ok()) {
+            for (auto& message : *messages) dispatchLocked(std::move(message));
+        } else {
+            mError = messages.error().code();
+            LOG(DEBUG) << __func__ << ": " << messages.error().message();
+        }
+        // Wake up the queries which were answered, and another one to take over reading.
+        mCv.notify_all();
+    }
+    mPending.erase(it);
+    mLastUsed = Clock::now();
+    return result;
+}
+
+Result<TcpConnectionPool::Connection::Messages> TcpConnectionPool::Connection::read(
+        Clock::time_point deadline) {
+    const auto remaining = std::chrono::ceil<milliseconds>(deadline - Clock::now());
+    pollfd pfd = {.fd = mFd.get(), .events = POLLIN};
+    const int n = poll(&pfd, 1, std::max<int64_t>(remaining.count(), 0));
+    if (n == -1 && errno != EINTR) return ErrnoError() << "poll failed";
+    if (n <= 0) return Messages{};
+
+    std::array<uint8_t, 8192> buf;
+    const ssize_t len = recv(mFd.get(), buf.data(), buf.size(), MSG_DONTWAIT);
+    if (len == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return Messages{};
+        return ErrnoError() << "recv failed";
+    }
+    if (len == 0) return Error(ECONNRESET) << "Connection closed by the server";
+    mReadBuffer.insert(mReadBuffer.end(), buf.begin(), buf.begin() + len);
+
+    // Each message is preceded by its length.
+    Messages messages;
+    size_t offset = 0;
+    while (mReadBuffer.size() - offset >= INT16SZ) {
+        const size_t size = mReadBuffer[offset] << 8 | mReadBuffer[offset + 1];
+        if (size < HFIXEDSZ) return Error(EMSGSIZE) << "Undersized answer: " << size;
+        if (mReadBuffer.size() - offset - INT16SZ < size) break;
+        const auto begin = mReadBuffer.begin() + offset + INT16SZ;
+        messages.emplace_back(begin, begin + size);
+        offset += INT16SZ + size;
+    }
+    mReadBuffer.erase(mReadBuffer.begin(), mReadBuffer.begin() + offset);
+    return messages;
+}
+
+void TcpConnectionPool::Connection::dispatchLocked(std::vector<uint8_t> answer) {
+    const auto it = mPending.find(messageId(answer));
+    // As in send_dg(), only a definite mismatch is rejected: the answers which carry no question,
+    // such as FORMERR, still match.
+    if (it == mPending.end() || it->second.answer.has_value() ||
+        !res_queriesmatch(it->second.query.data(),
+                          it->second.query.data() + it->second.query.size(), answer.data(),
+                          answer.data() + answer.size())) {
+        // Likely the late answer of a query which timed out.
+        LOG(DEBUG) << __func__ << ": dropped unexpected answer";
+        return;
+    }
+    it->second.answer = std::move(answer);
+}
+
+size_t TcpConnectionPool::Connection::inFlight() {
+    std::lock_guard guard(mMutex);
+    return mPending.size();
+}
+
+bool TcpConnectionPool::Connection::usable(Clock::time_point now, Clock::duration idleTimeout) {
+    std::lock_guard guard(mMutex);
+    return mError == 0 && (!mPending.empty() || now - mLastUsed < idleTimeout);
+}
+
+TcpConnectionPool& TcpConnectionPool::getInstance() {
+    // Never destroyed, to avoid races with the threads which are still resolving at exit.
+    static TcpConnectionPool* instance = new TcpConnectionPool();
+    return *instance;
+}
+
+std::shared_ptr<TcpConnectionPool::Connection> TcpConnectionPool::acquire(const Key& key) {
+    std::vector<std::shared_ptr<Connection>> unusable;
+    std::lock_guard guard(mMutex);
+    unusable = takeUnusableLocked(Clock::now());
+    const auto it = mConnections.find(key);
+    if (it == mConnections.end()) return nullptr;
+
+    std::shared_ptr<Connection> best;
+    size_t bestInFlight = mMaxPipelined;
+    for (const auto& connection : it->second) {
+        if (const size_t inFlight = connection->inFlight(); inFlight < bestInFlight) {
+            best = connection;
+            bestInFlight = inFlight;
+        }
+    }
+    if (best != nullptr) mStats[key.netid].reuses++;
+    return best;
+}
+
+std::shared_ptr<TcpConnectionPool::Connection> TcpConnectionPool::add(const Key& key,
+                                                                      base::unique_fd fd) {
+    auto connection = std::make_shared<Connection>(std::move(fd));
+    std::vector<std::shared_ptr<Connection>> unusable;
+    std::lock_guard guard(mMutex);
+    unusable = takeUnusableLocked(Clock::now());
+    mStats[key.netid].handshakes++;
+    auto& connections = mConnections[key];
+    if (connections.size() < mMaxConnectionsPerKey) connections.push_back(connection);
+    return connection;
+}
+
+void TcpConnectionPool::clear(unsigned netid) {
+    std::vector<std::shared_ptr<Connection>> closed;
+    std::lock_guard guard(mMutex);
+    for (auto it = mConnections.begin(); it != mConnections.end();) {
+        if (it->first.netid != netid) {
+            ++it;
+            continue;
+        }
+        std::move(it->second.begin(), it->second.end(), std::back_inserter(closed));
+        it = mConnections.erase(it);
+    }
+    mStats.erase(netid);
+}
+
+TcpConnectionPool::Stats TcpConnectionPool::getStats(unsigned netid) {
+    std::lock_guard guard(mMutex);
+    Stats stats;
+    if (const auto it = mStats.find(netid); it != mStats.end()) stats = it->second;
+    for (const auto& [key, connections] : mConnections) {
+        if (key.netid == netid) stats.open += connections.size();
+    }
+    return stats;
+}
+
+std::vector<std::shared_ptr<TcpConnectionPool::Connection>> TcpConnectionPool::takeUnusableLocked(
+        Clock::time_point now) {
+    std::vector<std::shared_ptr<Connection>> unusable;
+    for (auto it = mConnections.begin(); it != mConnections.end();) {
+        auto& connections = it->second;
+        const auto end = std::stable_partition(
+                connections.begin(), connections.end(),
+                [&](const auto& c) { return c->usable(now, mIdleTimeout); });
+        std::move(end, connections.end(), std::back_inserter(unusable));
+        connections.erase(end, connections.end());
+        it = connections.empty() ? mConnections.erase(it) : std::next(it);
+    }
+    return unusable;
+}
+
+}  // namespace android::net
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <android-base/result.h>
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+
+#include "UdpSocketPool.h"
+
+namespace android::net {
+
+// Keeps DNS-over-TCP connections open across queries, so that a query to a server which was
+// recently queried over TCP skips the handshake (RFC 7766). A connection is shared by the queries
+// of all threads: they are pipelined on it, and their answers are matched by ID and question, in
+// whatever order the server sends them. Connections which stay idle for a while are closed.
+//
+// This class is thread-safe.
+class TcpConnectionPool {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    // Connections are only shared by queries which would have set them up identically.
+    using Key = UdpSocketPool::Key;
+
+    class Connection {
+      public:
+        explicit Connection(base::unique_fd fd);
+        Connection(const Connection&) = delete;
+        Connection& operator=(const Connection&) = delete;
+
+        // Send |query| and wait for its answer for up to |timeout|. It fails with EBUSY if a query
+        // with the same ID is in flight on the connection, with ETIMEDOUT, or with the error which
+        // broke the connection, ECONNRESET if the server closed it. A broken connection fails all
+        // its queries.
+        base::Result<std::vector<uint8_t>> query(std::span<const uint8_t> query,
+                                                 std::chrono::milliseconds timeout)
+                EXCLUDES(mMutex);
+
+        size_t inFlight() EXCLUDES(mMutex);
+
+        // Return true if the connection isn't broken, and has been in use within |idleTimeout|.
+        bool usable(Clock::time_point now, Clock::duration idleTimeout) EXCLUDES(mMutex);
+
+      private:
+        using Messages = std::vector<std::vector<uint8_t>>;
+
+        struct Pending {
+            std::vector<uint8_t> query;
+            std::optional<std::vector<uint8_t>> answer;
+        };
+
+        // Wait until |deadline| for the socket to be readable, and return the messages completed
+        // by what was read. Called without the lock, by the one thread which reads at a time.
+        base::Result<Messages> read(Clock::time_point deadline);
+
+        // Hand |answer| to the pending query which it answers, or drop it.
+        void dispatchLocked(std::vector<uint8_t> answer) REQUIRES(mMutex);
+
+        const base::unique_fd mFd;
+
+        std::mutex mMutex;
+        std::condition_variable mCv;
+        // Queries in flight, by ID.
+        std::map<uint16_t, Pending> mPending GUARDED_BY(mMutex);
+        // Set while one of the waiting threads reads the socket on behalf of all of them. The
+        // others wait for it to hand them their answer, or to give up reading.
+        bool mReading GUARDED_BY(mMutex) = false;
+        // The start of the next messages, only used by the reading thread.
+        std::vector<uint8_t> mReadBuffer;
+        int mError GUARDED_BY(mMutex) = 0;
+        Clock::time_point mLastUsed GUARDED_BY(mMutex);
+    };
+
+    struct Stats {
+        uint64_t handshakes = 0;  // Connections opened.
+        uint64_t reuses = 0;      // Connections handed out by acquire().
+        size_t open = 0;          // Connections kept in the pool.
+    };
+
+    static constexpr std::chrono::seconds kIdleTimeout{10};
+    static constexpr size_t kMaxConnectionsPerKey = 2;
+    static constexpr size_t kMaxPipelined = 16;
+
+    explicit TcpConnectionPool(Clock::duration idleTimeout = kIdleTimeout,
+                               size_t maxConnectionsPerKey = kMaxConnectionsPerKey,
+                               size_t maxPipelined = kMaxPipelined)
+        : mIdleTimeout(idleTimeout),
+          mMaxConnectionsPerKey(maxConnectionsPerKey),
+          mMaxPipelined(maxPipelined) {}
+
+    static TcpConnectionPool& getInstance();
+
+    // Return the least busy usable connection of |key|, or nullptr if there is none with room
+    // for another query.
+    std::shared_ptr<Connection> acquire(const Key& key) EXCLUDES(mMutex);
+
+    // Wrap |fd|, a TCP socket of |key| which was just connected, into a connection. It is kept
+    // for later queries, unless |key| already has enough connections.
+    std::shared_ptr<Connection> add(const Key& key, base::unique_fd fd) EXCLUDES(mMutex);
+
+    // Drop the connections and stats of |netid|. Queries in flight on them still complete.
+    void clear(unsigned netid) EXCLUDES(mMutex);
+
+    Stats getStats(unsigned netid) EXCLUDES(mMutex);
+
+  private:
+    // Remove the connections which are no longer usable, and return them so that they can be
+    // closed without the lock.
+    std::vector<std::shared_ptr<Connection>> takeUnusableLocked(Clock::time_point now)
+            REQUIRES(mMutex);
+
+    const Clock::duration mIdleTimeout;
+    const size_t mMaxConnectionsPerKey;
+    const size_t mMaxPipelined;
+
+    std::mutex mMutex;
+    std::map<Key, std::vector<std::shared_ptr<Connection>>> mConnections GUARDED_BY(mMutex);
+    // By netid.
+    std::map<unsigned, Stats> mStats GUARDED_BY(mMutex);
+};
+
+}  // namespace android::net
@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "TcpConnectionPool.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <thread>
+
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+#include "resolv_private.h"
+#include "tests/dns_responder/dns_responder.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+using android::base::unique_fd;
+using android::netdutils::IPSockAddr;
+
+namespace {
+
+const TcpConnectionPool::Key kKey = {
+        .netid = 30,
+        .mark = 0,
+        .uid = 1000,
+        .server = IPSockAddr::toIPSockAddr("127.0.0.3", 53),
+};
+
+std::vector<uint8_t> makeQuery(const char* qname, uint16_t id) {
+    std::vector<uint8_t> buf(MAXPACKET);
+    const int len = res_nmkquery(ns_o_query, qname, ns_c_in, ns_t_a, {}, buf, 0);
+    EXPECT_GT(len, 0);
+    buf.resize(len);
+    buf[0] = id >> 8;
+    buf[1] = id & 0xff;
+    return buf;
+}
+
+// The answer to |query|, with no records.
+std::vector<uint8_t> makeAnswer(std::vector<uint8_t> query) {
+    reinterpret_cast<HEADER*>(query.data())->qr = 1;
+    return query;
+}
+
+// A DNS-over-TCP server which the test drives by hand, unlike DNSResponder which answers one
+// query per connection.
+class TcpServer {
+  public:
+    TcpServer() {
+        mListenFd.reset(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(0)};
+        EXPECT_EQ(1, inet_pton(AF_INET, test::kDefaultListenAddr.c_str(), &sin.sin_addr));
+        EXPECT_EQ(0, bind(mListenFd.get(), reinterpret_cast<sockaddr*>(&sin), sizeof(sin)));
+        EXPECT_EQ(0, listen(mListenFd.get(), 4));
+        socklen_t len = sizeof(sin);
+        EXPECT_EQ(0, getsockname(mListenFd.get(), reinterpret_cast<sockaddr*>(&sin), &len));
+        mAddr = sin;
+    }
+
+    // A client socket connected to the server, and the server side of the connection.
+    std::pair<unique_fd, unique_fd> connect() {
+        unique_fd client(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        const sockaddr_in sin = mAddr;
+        EXPECT_EQ(0, ::connect(client.get(), reinterpret_cast<const sockaddr*>(&sin),
+                               sizeof(sin)));
+        unique_fd server(accept4(mListenFd.get(), nullptr, nullptr, SOCK_CLOEXEC));
+        EXPECT_NE(-1, server.get());
+        return {std::move(client), std::move(server)};
+    }
+
+    static std::vector<uint8_t> readQuery(int fd) {
+        uint8_t lengthField[INT16SZ];
+        if (!readFully(fd, lengthField, sizeof(lengthField))) return {};
+        std::vector<uint8_t> query(lengthField[0] << 8 | lengthField[1]);
+        if (!readFully(fd, query.data(), query.size())) return {};
+        return query;
+    }
+
+    static void writeAnswer(int fd, const std::vector<uint8_t>& answer) {
+        std::vector<uint8_t> packet = {static_cast<uint8_t>(answer.size() >> 8),
+                                       static_cast<uint8_t>(answer.size())};
+        packet.insert(packet.end(), answer.begin(), answer.end());
+        EXPECT_EQ(static_cast<ssize_t>(packet.size()), write(fd, packet.data(), packet.size()));
+    }
+
+  private:
+    static bool readFully(int fd, uint8_t* buf, size_t len) {
+        while (len > 0) {
+            const ssize_t n = read(fd, buf, len);
+            if (n <= 0) return false;
+            buf += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    unique_fd mListenFd;
+    sockaddr_in mAddr;
+};
+
+}  // namespace
+
+class TcpConnectionPoolTest : public NetNativeTestBase {
+  protected:
+    TcpServer mServer;
+};
+
+TEST_F(TcpConnectionPoolTest, PipelinedQueries) {
+    auto [client, server] = mServer.connect();
+    TcpConnectionPool::Connection connection(std::move(client));
+    const std::vector<uint8_t> query1 = makeQuery("hello.example.com.", 1);
+    const std::vector<uint8_t> query2 = makeQuery("hello.example.com.", 2);
+
+    auto answer1 = std::async(std::launch::async, [&]() { return connection.query(query1, 1s); });
+    auto answer2 = std::async(std::launch::async, [&]() { return connection.query(query2, 1s); });
+
+    // Both queries are sent on the same connection before either is answered, and the answers
+    // come back in any order.
+    std::vector<std::vector<uint8_t>> queries = {TcpServer::readQuery(server.get()),
+                                                 TcpServer::readQuery(server.get())};
+    EXPECT_EQ(2U, connection.inFlight());
+    std::sort(queries.begin(), queries.end());
+    ASSERT_EQ(query1, queries[0]);
+    ASSERT_EQ(query2, queries[1]);
+    TcpServer::writeAnswer(server.get(), makeAnswer(query2));
+    TcpServer::writeAnswer(server.get(), makeAnswer(query1));
+
+    const auto result1 = answer1.get();
+    const auto result2 = answer2.get();
+    ASSERT_TRUE(result1.ok()) << result1.error().message();
+    ASSERT_TRUE(result2.ok()) << result2.error().message();
+    EXPECT_EQ(makeAnswer(query1), *result1);
+    EXPECT_EQ(makeAnswer(query2), *result2);
+    EXPECT_EQ(0U, connection.inFlight());
+}
+
+// Many threads share one connection, each getting the answers of its own queries.
+TEST_F(TcpConnectionPoolTest, ConcurrentQueries) {
+    constexpr int kThreads = 8;
+    constexpr int kQueriesPerThread = 200;
+    auto [client, server] = mServer.connect();
+    TcpConnectionPool::Connection connection(std::move(client));
+    std::thread responder([fd = server.get()]() {
+        for (int i = 0; i < kThreads * kQueriesPerThread; i++) {
+            const std::vector<uint8_t> query = TcpServer::readQuery(fd);
+            if (query.empty()) return;
+            TcpServer::writeAnswer(fd, makeAnswer(query));
+        }
+    });
+
+    std::vector<std::thread> threads;
+    std::atomic<int> answered = 0;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < kQueriesPerThread; i++) {
+                const auto query = makeQuery("hello.example.com.", t * kQueriesPerThread + i);
+                const auto result = connection.query(query, 5s);
+                ASSERT_TRUE(result.ok()) << result.error().message();
+                EXPECT_EQ(makeAnswer(query), *result);
+                answered++;
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    responder.join();
+    EXPECT_EQ(kThreads * kQueriesPerThread, answered);
+}
+
+TEST_F(TcpConnectionPoolTest, IgnoresUnmatchedAnswers) {
+    auto [client, server] = mServer.connect();
+    TcpConnectionPool::Connection connection(std::move(client));
+    const std::vector<uint8_t> query = makeQuery("hello.example.com.", 1);
+    auto answer = std::async(std::launch::async, [&]() { return connection.query(query, 1s); });
+    ASSERT_EQ(query, TcpServer::readQuery(server.get()));
+
+    // Neither an answer with another ID nor one with another question is taken.
+    TcpServer::writeAnswer(server.get(), makeAnswer(makeQuery("hello.example.com.", 2)));
+    TcpServer::writeAnswer(server.get(), makeAnswer(makeQuery("other.example.com.", 1)));
+    EXPECT_EQ(std::future_status::timeout, answer.wait_for(100ms));
+
+    // An answer split across several reads is reassembled.
+    const std::vector<uint8_t> expected = makeAnswer(query);
+    const uint8_t lengthField[] = {static_cast<uint8_t>(expected.size() >> 8),
+                                   static_cast<uint8_t>(expected.size())};
+    ASSERT_EQ(1, write(server.get(), lengthField, 1));
+    std::this_thread::sleep_for(20ms);
+    ASSERT_EQ(1, write(server.get(), lengthField + 1, 1));
+    ASSERT_EQ(5, write(server.get(), expected.data(), 5));
+    std::this_thread::sleep_for(20ms);
+    ASSERT_EQ(static_cast<ssize_t>(expected.size() - 5),
+              write(server.get(), expected.data() + 5, expected.size() - 5));
+
+    const auto result = answer.get();
+    ASSERT_TRUE(result.ok()) << result.error().message();
+    EXPECT_EQ(expected, *result);
+}
+
+TEST_F(TcpConnectionPoolTest, Timeout) {
+    auto [client, server] = mServer.connect();
+    TcpConnectionPool::Connection connection(std::move(client));
+    const std::vector<uint8_t> query = makeQuery("hello.example.com.", 1);
+
+    const auto result = connection.query(query, 100ms);
+    ASSERT_FALSE(result.ok());
+    EXPECT_EQ(ETIMEDOUT, result.error().code());
+    EXPECT_EQ(0U, connection.inFlight());
+
+    // The late answer is dropped, and the connection still works.
+    ASSERT_EQ(query, TcpServer::readQuery(server.get()));
+    TcpServer::writeAnswer(server.get(), makeAnswer(query));
+    const std::vector<uint8_t> query2 = makeQuery("hello.example.com.", 2);
+    auto answer = std::async(std::launch::async, [&]() { return connection.query(query2, 1s); });
+    ASSERT_EQ(query2, TcpServer::readQuery(server.get()));
+    TcpServer::writeAnswer(server.get(), makeAnswer(query2));
+    const auto result2 = answer.get();
+    ASSERT_TRUE(result2.ok()) << result2.error().message();
+    EXPECT_EQ(makeAnswer(query2), *result2);
+    EXPECT_TRUE(connection.usable(TcpConnectionPool::Clock::now(), 1s));
+}
+
+TEST_F(TcpConnectionPoolTest, DuplicateId) {
+    auto [client, server] = mServer.connect();
+    TcpConnectionPool::Connection connection(std::move(client));
+    const std::vector<uint8_t> query = makeQuery("hello.example.com.", 1);
+    auto answer = std::async(std::launch::async, [&]() { return connection.query(query, 1s); });
+    ASSERT_EQ(query, TcpServer::readQuery(server.get()));
+
+    const auto result = connection.query(makeQuery("other.example.com.", 1), 1s);
+    ASSERT_FALSE(result.ok());
+    EXPECT_EQ(EBUSY, result.error().code());
+
+    TcpServer::writeAnswer(server.get(), makeAnswer(query));
+    EXPECT_TRUE(answer.get().ok());
+}
+
+TEST_F(TcpConnectionPoolTest, ClosedByServer) {
+    auto [client, server] = mServer.connect();
+    TcpConnectionPool::Connection connection(std::move(client));
+    const std::vector<uint8_t> query = makeQuery("hello.example.com.", 1);
+    auto answer = std::async(std::launch::async, [&]() { return connection.query(query, 1s); });
+    ASSERT_EQ(query, TcpServer::readQuery(server.get()));
+    server.reset();
+
+    const auto result = answer.get();
+    ASSERT_FALSE(result.ok());
+    EXPECT_EQ(ECONNRESET, result.error().code());
+    EXPECT_FALSE(connection.usable(TcpConnectionPool::Clock::now(), 1s));
+}
+
+TEST_F(TcpConnectionPoolTest, Pool) {
+    TcpConnectionPool pool(TcpConnectionPool::kIdleTimeout, 1 /*maxConnectionsPerKey*/,
+                           1 /*maxPipelined*/);
+    EXPECT_EQ(nullptr, pool.acquire(kKey));
+
+    auto [client, server] = mServer.connect();
+    const auto connection = pool.add(kKey, std::move(client));
+    EXPECT_EQ(connection, pool.acquire(kKey));
+    TcpConnectionPool::Key otherNetwork = kKey;
+    otherNetwork.netid++;
+    EXPECT_EQ(nullptr, pool.acquire(otherNetwork));
+
+    // A connection with as many queries in flight as allowed isn't handed out.
+    const std::vector<uint8_t> query = makeQuery("hello.example.com.", 1);
+    auto answer = std::async(std::launch::async, [&]() { return connection->query(query, 1s); });
+    ASSERT_EQ(query, TcpServer::readQuery(server.get()));
+    EXPECT_EQ(nullptr, pool.acquire(kKey));
+
+    // Neither is a connection beyond the limit of the key kept.
+    auto [client2, server2] = mServer.connect();
+    const auto extra = pool.add(kKey, std::move(client2));
+    EXPECT_NE(nullptr, extra);
+    TcpServer::writeAnswer(server.get(), makeAnswer(query));
+    EXPECT_TRUE(answer.get().ok());
+    EXPECT_EQ(connection, pool.acquire(kKey));
+
+    auto stats = pool.getStats(kKey.netid);
+    EXPECT_EQ(2U, stats.handshakes);
+    EXPECT_EQ(2U, stats.reuses);
+    EXPECT_EQ(1U, stats.open);
+
+    pool.clear(kKey.netid);
+    EXPECT_EQ(nullptr, pool.acquire(kKey));
+    stats = pool.getStats(kKey.netid);
+    EXPECT_EQ(0U, stats.handshakes);
+    EXPECT_EQ(0U, stats.open);
+}
+
+TEST_F(TcpConnectionPoolTest, IdleTimeout) {
+    constexpr auto kIdleTimeout = 200ms;
+    TcpConnectionPool pool(kIdleTimeout);
+    auto [client, server] = mServer.connect();
+    const auto connection = pool.add(kKey, std::move(client));
+    EXPECT_EQ(connection, pool.acquire(kKey));
+
+    std::this_thread::sleep_for(kIdleTimeout);
+    EXPECT_EQ(nullptr, pool.acquire(kKey));
+    EXPECT_EQ(0U, pool.getStats(kKey.netid).open);
+}
+
+}  // namespace android::net
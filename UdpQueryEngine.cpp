@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "UdpQueryEngine.h"
+
+#include <arpa/nameser.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <array>
+
+#include <android-base/logging.h>
+#include <netdutils/ThreadUtil.h>
+
+#include "resolv_private.h"
+
+namespace android::net {
+
+using base::ErrnoError;
+using base::borrowed_fd;
+using netdutils::IPSockAddr;
+using std::chrono::milliseconds;
+
+namespace {
+
+// Return true if |answer|, received from |from|, answers |query| sent to |server|.
+bool isAnswer(std::span<const uint8_t> query, const IPSockAddr& server,
+              std::span<const uint8_t> answer, const sockaddr_storage& from) {
+    const HEADER* hp = reinterpret_cast<const HEADER*>(query.data());
+    const HEADER* anhp = reinterpret_cast<const HEADER*>(answer.data());
+    if (hp->id != anhp->id) return false;
+    if (IPSockAddr::toIPSockAddr(from) != server) return false;
+    // As in send_dg(), only a definite mismatch is rejected: the answers which carry no question,
+    // such as FORMERR, still match.
+    return res_queriesmatch(query.data(), query.data() + query.size(), answer.data(),
+                            answer.data() + answer.size()) != 0;
+}
+
+}  // namespace
+
+UdpQueryEngine::UdpQueryEngine() {
+    mEpollFd.reset(epoll_create1(EPOLL_CLOEXEC));
+    mEventFd.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    if (mEpollFd == -1 || mEventFd == -1) {
+        PLOG(FATAL) << "Failed to set up the UDP query engine";
+    }
+    epoll_event event = {.events = EPOLLIN, .data = {.fd = mEventFd.get()}};
+    if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, mEventFd.get(), &event) == -1) {
+        PLOG(FATAL) << "Failed to watch the eventfd of the UDP query engine";
+    }
+    mThread = std::thread(&UdpQueryEngine::loop, this);
+}
+
+UdpQueryEngine::~UdpQueryEngine() {
+    {
+        std::lock_guard guard(mMutex);
+        mStopping = true;
+    }
+    eventfd_write(mEventFd.get(), 1);
+    mThread.join();
+
+    // Fail the queries which are still waiting.
+    std::vector<std::unique_ptr<Query>> queries;
+    {
+        std::lock_guard guard(mMutex);
+        while (!mQueries.empty()) {
+            queries.push_back(takeLocked(mQueries.begin()->first));
+        }
+    }
+    for (const auto& q : queries) {
+        q->callback(base::Error(ECANCELED) << "UDP query engine stopped");
+    }
+}
+
+UdpQueryEngine& UdpQueryEngine::getInstance() {
+    // Never destroyed, so that queries can't outlive it.
+    static UdpQueryEngine* instance = new UdpQueryEngine();
+    return *instance;
+}
+
+void UdpQueryEngine::send(borrowed_fd fd, const IPSockAddr& server, std::span<const uint8_t> query,
+                          size_t maxAnswerSize, milliseconds timeout, Callback callback) {
+    if (::send(fd.get(), query.data(), query.size(), 0) != static_cast<ssize_t>(query.size())) {
+        callback(ErrnoError() << "send failed");
+        return;
+    }
+
+    const int sock = fd.get();
+    auto q = std::make_unique<Query>(Query{
+            .fd = sock,
+            .server = server,
+            .query = std::vector<uint8_t>(query.begin(), query.end()),
+            .maxAnswerSize = maxAnswerSize,
+            .callback = std::move(callback),
+    });
+    {
+        std::lock_guard guard(mMutex);
+        epoll_event event = {.events = EPOLLIN, .data = {.fd = sock}};
+        if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, sock, &event) == 0) {
+            q->deadline = mDeadlines.emplace(Clock::now() + timeout, sock);
+            // The engine thread only needs waking up if it sleeps past the new deadline.
+            if (q->deadline == mDeadlines.begin()) {
+                eventfd_write(mEventFd.get(), 1);
+            }
+            mQueries.emplace(sock, std::move(q));
+            return;
+        }
+    }
+    q->callback(ErrnoError() << "epoll_ctl failed");
+}
+
+std::future<UdpQueryEngine::Answer> UdpQueryEngine::send(borrowed_fd fd, const IPSockAddr& server,
+                                                         std::span<const uint8_t> query,
+                                                         size_t maxAnswerSize,
+                                                         milliseconds timeout) {
+    auto promise = std::make_shared<std::promise<Answer>>();
+    std::future<Answer> future = promise->get_future();
+    send(fd, server, query, maxAnswerSize, timeout,
+         [promise](Answer answer) { promise->set_value(std::move(answer)); });
+    return future;
+}
+
+size_t UdpQueryEngine::inFlight() {
+    std::lock_guard guard(mMutex);
+    return mQueries.size();
+}
+
+std::optional<UdpQueryEngine::Answer> UdpQueryEngine::receive(const Query& q) {
+    std::vector<uint8_t> answer(q.maxAnswerSize);
+    for (;;) {
+        sockaddr_storage from;
+        socklen_t fromlen = sizeof(from);
+        const ssize_t n = recvfrom(q.fd, answer.data(), answer.size(), MSG_DONTWAIT,
+                                   reinterpret_cast<sockaddr*>(&from), &fromlen);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return std::nullopt;
+            // Typically ECONNREFUSED, when the server isn't listening.
+            return Answer(ErrnoError() << "recvfrom failed");
+        }
+        if (n < HFIXEDSZ) {
+            LOG(DEBUG) << __func__ << ": undersized: " << n;
+            continue;
+        }
+        if (!isAnswer(q.query, q.server, std::span(answer.data(), n), from)) {
+            LOG(DEBUG) << __func__ << ": not an answer to the query, ignoring it";
+            continue;
+        }
+        answer.resize(n);
+        return answer;
+    }
+}
+
+std::unique_ptr<UdpQueryEngine::Query> UdpQueryEngine::takeLocked(int fd) {
+    auto node = mQueries.extract(fd);
+    std::unique_ptr<Query> q = std::move(node.mapped());
+    mDeadlines.erase(q->deadline);
+    epoll_ctl(mEpollFd.get(), EPOLL_CTL_DEL, fd, nullptr);
+    return q;
+}
+
+void UdpQueryEngine::loop() {
+    netdutils::setThreadName("UdpQueryEngine");
+    std::array<epoll_event, 64> events;
+    for (;;) {
+        int timeoutMs = -1;
+        {
+            std::lock_guard guard(mMutex);
+            if (mStopping) return;
+            if (!mDeadlines.empty()) {
+                const auto wait = mDeadlines.begin()->first - Clock::now();
+                timeoutMs = std::max<int64_t>(0, std::chrono::ceil<milliseconds>(wait).count());
+            }
+        }
+
+        const int n = epoll_wait(mEpollFd.get(), events.data(), events.size(), timeoutMs);
+        if (n < 0 && errno != EINTR) {
+            PLOG(ERROR) << __func__ << ": epoll_wait failed";
+            continue;
+        }
+
+        std::vector<std::pair<std::unique_ptr<Query>, Answer>> completed;
+        for (int i = 0; i < n; i++) {
+            const int fd = events[i].data.fd;
+            if (fd == mEventFd.get()) {
+                eventfd_t ignored;
+                eventfd_read(mEventFd.get(), &ignored);
+                continue;
+            }
+            const Query* q;
+            {
+                std::lock_guard guard(mMutex);
+                const auto it = mQueries.find(fd);
+                if (it == mQueries.end()) continue;
+                q = it->second.get();
+            }
+            std::optional<Answer> answer = receive(*q);
+            if (!answer.has_value()) continue;
+            std::lock_guard guard(mMutex);
+            completed.emplace_back(takeLocked(fd), std::move(*answer));
+        }
+        {
+            std::lock_guard guard(mMutex);
+            const auto now = Clock::now();
+            while (!mDeadlines.empty() && mDeadlines.begin()->first <= now) {
+                completed.emplace_back(takeLocked(mDeadlines.begin()->second),
+                                       base::Error(ETIMEDOUT) << "timed out");
+            }
+        }
+
+        for (auto& [q, answer] : completed) {
+            q->callback(std::move(answer));
+        }
+    }
+}
+
+}  // namespace android::net
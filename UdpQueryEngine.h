@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/result.h>
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+#include <netdutils/InternetAddresses.h>
+
+namespace android::net {
+
+// Waits for the answers of UDP queries on behalf of their senders. One thread waits on the sockets
+// of all the queries with epoll, so that an in-flight query costs a socket rather than a blocked
+// thread, for the senders which pass a callback. res_nsend() still waits for the future of its
+// query, so its thread stays blocked until the answer or the deadline.
+//
+// A datagram answers a query if it comes from the server which the query was sent to, and has
+// the ID and question of the query. Other datagrams are dropped, and the query keeps waiting.
+// A query which isn't answered before its deadline fails with ETIMEDOUT.
+class UdpQueryEngine {
+  public:
+    using Answer = base::Result<std::vector<uint8_t>>;
+    using Callback = std::function<void(Answer)>;
+
+    UdpQueryEngine();
+    ~UdpQueryEngine();
+    UdpQueryEngine(const UdpQueryEngine&) = delete;
+    UdpQueryEngine& operator=(const UdpQueryEngine&) = delete;
+
+    static UdpQueryEngine& getInstance();
+
+    // Send |query| on |fd|, a UDP socket connected to |server|, and call |callback| with its
+    // answer, truncated to |maxAnswerSize| bytes, or with the error. The callback is called on
+    // the engine thread, or on the calling thread if the query can't be sent. It must not block.
+    // The engine stops using |fd| before calling the callback, and the caller must keep it open
+    // until then, and not use it for another query meanwhile.
+    void send(base::borrowed_fd fd, const netdutils::IPSockAddr& server,
+              std::span<const uint8_t> query, size_t maxAnswerSize,
+              std::chrono::milliseconds timeout, Callback callback) EXCLUDES(mMutex);
+
+    // Same, for senders which wait for the answer.
+    std::future<Answer> send(base::borrowed_fd fd, const netdutils::IPSockAddr& server,
+                             std::span<const uint8_t> query, size_t maxAnswerSize,
+                             std::chrono::milliseconds timeout) EXCLUDES(mMutex);
+
+    // Number of queries waiting for their answer.
+    size_t inFlight() EXCLUDES(mMutex);
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Query {
+        int fd;
+        netdutils::IPSockAddr server;
+        std::vector<uint8_t> query;
+        size_t maxAnswerSize;
+        Callback callback;
+        std::multimap<Clock::time_point, int>::iterator deadline;
+    };
+
+    void loop() EXCLUDES(mMutex);
+
+    // Read the datagrams queued on the socket of |q|. Return the answer or the error which
+    // completes |q|, or nullopt if it must keep waiting.
+    static std::optional<Answer> receive(const Query& q);
+
+    // Remove the query of |fd| from the engine.
+    std::unique_ptr<Query> takeLocked(int fd) REQUIRES(mMutex);
+
+    std::mutex mMutex;
+    // In-flight queries, by socket. Only the engine thread removes them, so that it can use
+    // them without holding |mMutex|.
+    std::unordered_map<int, std::unique_ptr<Query>> mQueries GUARDED_BY(mMutex);
+    // Sockets of the in-flight queries, by deadline.
+    std::multimap<Clock::time_point, int> mDeadlines GUARDED_BY(mMutex);
+    bool mStopping GUARDED_BY(mMutex) = false;
+
+    base::unique_fd mEpollFd;
+    // Written to wake up the engine thread when its next deadline changes, or to stop it.
+    base::unique_fd mEventFd;
+    std::thread mThread;
+};
+
+}  // namespace android::net
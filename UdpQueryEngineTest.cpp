@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UdpQueryEngine.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <condition_variable>
+
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+#include "resolv_private.h"
+#include "tests/dns_responder/dns_responder.h"
+#include "util.h"
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+using android::base::unique_fd;
+using android::netdutils::IPSockAddr;
+
+namespace {
+
+constexpr char kHelloExampleCom[] = "hello.example.com.";
+constexpr char kHelloExampleComAddrV4[] = "1.2.3.4";
+
+std::vector<uint8_t> makeQuery(const char* qname) {
+    std::vector<uint8_t> buf(MAXPACKET);
+    const int len = res_nmkquery(ns_o_query, qname, ns_c_in, ns_t_a, {}, buf, 0);
+    EXPECT_GT(len, 0);
+    buf.resize(len);
+    return buf;
+}
+
+unique_fd connectedSocket(const IPSockAddr& server) {
+    unique_fd fd(socket(server.family(), SOCK_DGRAM | SOCK_CLOEXEC, 0));
+    EXPECT_NE(-1, fd.get());
+    const sockaddr_storage ss = server;
+    EXPECT_EQ(0, connect(fd.get(), reinterpret_cast<const sockaddr*>(&ss), sockaddrSize(ss)));
+    return fd;
+}
+
+}  // namespace
+
+class UdpQueryEngineTest : public NetNativeTestBase {
+  protected:
+    const IPSockAddr kServer = IPSockAddr::toIPSockAddr(test::kDefaultListenAddr, 53);
+    UdpQueryEngine mEngine;
+};
+
+TEST_F(UdpQueryEngineTest, Answer) {
+    test::DNSResponder dns;
+    dns.addMapping(kHelloExampleCom, ns_type::ns_t_a, kHelloExampleComAddrV4);
+    ASSERT_TRUE(dns.startServer());
+
+    const std::vector<uint8_t> query = makeQuery(kHelloExampleCom);
+    const auto answer =
+            mEngine.send(connectedSocket(kServer), kServer, query, MAXPACKET, 1000ms).get();
+    ASSERT_TRUE(answer.ok()) << answer.error().message();
+    ASSERT_GE(answer->size(), static_cast<size_t>(HFIXEDSZ));
+    EXPECT_EQ(0, memcmp(query.data(), answer->data(), 2));  // ID
+    EXPECT_EQ(0U, mEngine.inFlight());
+}
+
+TEST_F(UdpQueryEngineTest, Timeout) {
+    test::DNSResponder dns(static_cast<ns_rcode>(-1) /*no response*/);
+    ASSERT_TRUE(dns.startServer());
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto answer = mEngine.send(connectedSocket(kServer), kServer,
+                                     makeQuery(kHelloExampleCom), MAXPACKET, 200ms)
+                                .get();
+    ASSERT_FALSE(answer.ok());
+    EXPECT_EQ(ETIMEDOUT, answer.error().code());
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 200ms);
+}
+
+TEST_F(UdpQueryEngineTest, ConnectionRefused) {
+    // Nothing listens on this port, so the ICMP port-unreachable fails the query right away.
+    const IPSockAddr server = IPSockAddr::toIPSockAddr(test::kDefaultListenAddr, 54);
+    const auto answer =
+            mEngine.send(connectedSocket(server), server, makeQuery(kHelloExampleCom), MAXPACKET,
+                         5000ms)
+                    .get();
+    ASSERT_FALSE(answer.ok());
+    EXPECT_EQ(ECONNREFUSED, answer.error().code());
+}
+
+TEST_F(UdpQueryEngineTest, IgnoresUnmatchedAnswers) {
+    // A server which first answers with the wrong ID, then with the wrong question.
+    unique_fd server(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+    sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(0)};
+    ASSERT_EQ(1, inet_pton(AF_INET, test::kDefaultListenAddr.c_str(), &sin.sin_addr));
+    ASSERT_EQ(0, bind(server.get(), reinterpret_cast<sockaddr*>(&sin), sizeof(sin)));
+    socklen_t len = sizeof(sin);
+    ASSERT_EQ(0, getsockname(server.get(), reinterpret_cast<sockaddr*>(&sin), &len));
+    const IPSockAddr serverAddr(sin);
+
+    const std::vector<uint8_t> query = makeQuery(kHelloExampleCom);
+    const unique_fd fd = connectedSocket(serverAddr);
+    std::future<UdpQueryEngine::Answer> future =
+            mEngine.send(fd, serverAddr, query, MAXPACKET, 1000ms);
+
+    std::vector<uint8_t> received(MAXPACKET);
+    sockaddr_storage from;
+    socklen_t fromlen = sizeof(from);
+    const ssize_t n = recvfrom(server.get(), received.data(), received.size(), 0,
+                               reinterpret_cast<sockaddr*>(&from), &fromlen);
+    ASSERT_EQ(static_cast<ssize_t>(query.size()), n);
+    const auto reply = [&](std::vector<uint8_t> packet) {
+        reinterpret_cast<HEADER*>(packet.data())->qr = 1;
+        ASSERT_EQ(static_cast<ssize_t>(packet.size()),
+                  sendto(server.get(), packet.data(), packet.size(), 0,
+                         reinterpret_cast<sockaddr*>(&from), fromlen));
+    };
+
+    std::vector<uint8_t> wrongId = query;
+    wrongId[1] ^= 1;
+    reply(wrongId);
+    std::vector<uint8_t> wrongQuestion = makeQuery("other.example.com.");
+    std::copy(query.begin(), query.begin() + 2, wrongQuestion.begin());
+    reply(wrongQuestion);
+    EXPECT_EQ(std::future_status::timeout, future.wait_for(100ms));
+
+    reply(query);
+    const auto answer = future.get();
+    ASSERT_TRUE(answer.ok()) << answer.error().message();
+    EXPECT_EQ(query.size(), answer->size());
+}
+
+// Sends many queries at once from a single thread, and measures how long they take to be
+// answered. The engine waits for all of them with one thread, so the number of queries in flight
+// is only bounded by the number of sockets. It is kept low enough here that the responder doesn't
+// drop queries. The query rate is recorded as a test property.
+TEST_F(UdpQueryEngineTest, Load) {
+    constexpr int kQueries = 10000;
+    constexpr int kMaxInFlight = 100;
+    test::DNSResponder dns;
+    dns.addMapping(kHelloExampleCom, ns_type::ns_t_a, kHelloExampleComAddrV4);
+    ASSERT_TRUE(dns.startServer());
+    const std::vector<uint8_t> query = makeQuery(kHelloExampleCom);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    int inFlight = 0;
+    int answered = 0;
+    int failed = 0;
+    size_t maxInFlight = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kQueries; i++) {
+        {
+            std::unique_lock lock(mutex);
+            cv.wait(lock, [&]() { return inFlight < kMaxInFlight; });
+            inFlight++;
+        }
+        // Closed once the callback is destroyed, after the engine is done with it.
+        auto fd = std::make_shared<unique_fd>(connectedSocket(kServer));
+        mEngine.send(*fd, kServer, query, MAXPACKET, 5000ms,
+                     [&, fd](UdpQueryEngine::Answer answer) {
+                         std::lock_guard guard(mutex);
+                         inFlight--;
+                         if (answer.ok()) {
+                             answered++;
+                         } else {
+                             failed++;
+                         }
+                         cv.notify_one();
+                     });
+        maxInFlight = std::max(maxInFlight, mEngine.inFlight());
+    }
+    {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&]() { return inFlight == 0; });
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    EXPECT_EQ(kQueries, answered);
+    EXPECT_EQ(0, failed);
+    RecordProperty("max_in_flight", maxInFlight);
+    RecordProperty("queries_per_sec", static_cast<int>(kQueries / elapsed.count()));
+}
+
+}  // namespace android::net
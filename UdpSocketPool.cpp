@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UdpSocketPool.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <iterator>
+
+namespace android::net {
+
+UdpSocketPool& UdpSocketPool::getInstance() {
+    // Never destroyed, to avoid races with the threads which are still resolving at exit.
+    static UdpSocketPool* instance = new UdpSocketPool();
+    return *instance;
+}
+
+UdpSocketPool::Socket UdpSocketPool::acquire(const Key& key) {
+    const auto now = Clock::now();
+    std::vector<Socket> expired;
+    std::lock_guard guard(mMutex);
+    if (const auto it = mIdle.find(key); it != mIdle.end()) {
+        auto& sockets = it->second;
+        while (!sockets.empty()) {
+            Socket socket = std::move(sockets.back());
+            sockets.pop_back();
+            mIdleCount--;
+            if (socket.expiry > now) {
+                if (sockets.empty()) mIdle.erase(it);
+                mHits++;
+                return socket;
+            }
+            expired.push_back(std::move(socket));
+        }
+        mIdle.erase(it);
+    }
+    mMisses++;
+
+    // Jitter the lifetimes by up to a quarter, so that the sockets opened together by a burst of
+    // queries are not all rotated together.
+    const auto lifetimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(mLifetime);
+    const auto jitter = std::chrono::milliseconds(arc4random_uniform(lifetimeMs.count() / 4 + 1));
+    return {.expiry = now + lifetimeMs - jitter};
+}
+
+void UdpSocketPool::release(const Key& key, Socket socket) {
+    const auto now = Clock::now();
+    if (socket.fd == -1 || socket.expiry <= now) return;
+
+    std::vector<Socket> expired;
+    std::lock_guard guard(mMutex);
+    if (mIdleCount >= mMaxIdle) expired = takeExpiredLocked(now);
+    auto& sockets = mIdle[key];
+    if (mIdleCount >= mMaxIdle || sockets.size() >= mMaxIdlePerKey) {
+        if (sockets.empty()) mIdle.erase(key);
+        return;
+    }
+    sockets.push_back(std::move(socket));
+    mIdleCount++;
+}
+
+void UdpSocketPool::clear(unsigned netid) {
+    std::vector<Socket> closed;
+    std::lock_guard guard(mMutex);
+    for (auto it = mIdle.begin(); it != mIdle.end();) {
+        if (it->first.netid != netid) {
+            ++it;
+            continue;
+        }
+        mIdleCount -= it->second.size();
+        std::move(it->second.begin(), it->second.end(), std::back_inserter(closed));
+        it = mIdle.erase(it);
+    }
+}
+
+UdpSocketPool::Stats UdpSocketPool::getStats() {
+    std::lock_guard guard(mMutex);
+    return {.hits = mHits, .misses = mMisses, .idle = mIdleCount};
+}
+
+std::vector<UdpSocketPool::Socket> UdpSocketPool::takeExpiredLocked(Clock::time_point now) {
+    std::vector<Socket> expired;
+    for (auto it = mIdle.begin(); it != mIdle.end();) {
+        auto& sockets = it->second;
+        const auto end = std::stable_partition(sockets.begin(), sockets.end(),
+                                               [now](const Socket& s) { return s.expiry > now; });
+        std::move(end, sockets.end(), std::back_inserter(expired));
+        mIdleCount -= sockets.end() - end;
+        sockets.erase(end, sockets.end());
+        it = sockets.empty() ? mIdle.erase(it) : std::next(it);
+    }
+    return expired;
+}
+
+}  // namespace android::net
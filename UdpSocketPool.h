@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+#include <netdutils/InternetAddresses.h>
+
+namespace android::net {
+
+// Keeps the connected UDP sockets of finished queries, so that a later query to the same server
+// can skip creating, tagging, marking, binding and connecting a socket of its own.
+//
+// A socket is only handed out to one query at a time, and answers are still matched by ID and
+// question, so a late answer to a previous query which is read from a reused socket is dropped.
+// To bound how long a source port stays predictable, each socket has a randomized lifetime, after
+// which it is closed rather than reused.
+//
+// This class is thread-safe.
+class UdpSocketPool {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    // Sockets are only shared by queries which would have set them up identically.
+    struct Key {
+        unsigned netid;
+        unsigned mark;
+        uid_t uid;  // The uid which the socket is tagged with.
+        netdutils::IPSockAddr server;
+
+        bool operator<(const Key& o) const {
+            return std::tie(netid, mark, uid, server) < std::tie(o.netid, o.mark, o.uid, o.server);
+        }
+    };
+
+    struct Socket {
+        base::unique_fd fd;
+        Clock::time_point expiry;
+    };
+
+    struct Stats {
+        uint64_t hits = 0;    // Sockets handed out by acquire().
+        uint64_t misses = 0;  // Calls to acquire() which found no idle socket.
+        size_t idle = 0;
+    };
+
+    static constexpr size_t kMaxIdlePerKey = 4;
+    static constexpr size_t kMaxIdle = 64;
+    static constexpr std::chrono::seconds kLifetime{60};
+
+    explicit UdpSocketPool(Clock::duration lifetime = kLifetime,
+                           size_t maxIdlePerKey = kMaxIdlePerKey, size_t maxIdle = kMaxIdle)
+        : mLifetime(lifetime), mMaxIdlePerKey(maxIdlePerKey), mMaxIdle(maxIdle) {}
+
+    static UdpSocketPool& getInstance();
+
+    // Take an idle socket of |key| out of the pool. If there is none, return a socket with an
+    // invalid fd, and the expiry which the caller's new socket should be given.
+    Socket acquire(const Key& key) EXCLUDES(mMutex);
+
+    // Give back a socket of |key| once its query is answered. It is closed instead if it has
+    // expired, or if the pool is full.
+    void release(const Key& key, Socket socket) EXCLUDES(mMutex);
+
+    // Close the idle sockets of |netid|.
+    void clear(unsigned netid) EXCLUDES(mMutex);
+
+    Stats getStats() EXCLUDES(mMutex);
+
+  private:
+    // Remove the expired idle sockets, and return them so they can be closed without the lock.
+    std::vector<Socket> takeExpiredLocked(Clock::time_point now) REQUIRES(mMutex);
+
+    const Clock::duration mLifetime;
+    const size_t mMaxIdlePerKey;
+    const size_t mMaxIdle;
+
+    std::mutex mMutex;
+    // Idle sockets, most recently released last.
+    std::map<Key, std::vector<Socket>> mIdle GUARDED_BY(mMutex);
+    size_t mIdleCount GUARDED_BY(mMutex) = 0;
+    uint64_t mHits GUARDED_BY(mMutex) = 0;
+    uint64_t mMisses GUARDED_BY(mMutex) = 0;
+};
+
+}  // namespace android::net
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UdpSocketPool.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <thread>
+
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+namespace android::net {
+
+using namespace std::chrono_literals;
+using android::base::unique_fd;
+using android::netdutils::IPSockAddr;
+
+namespace {
+
+const UdpSocketPool::Key kKey = {
+        .netid = 30,
+        .mark = 0,
+        .uid = 1000,
+        .server = IPSockAddr::toIPSockAddr("127.0.0.3", 53),
+};
+
+bool isOpen(int fd) {
+    return fcntl(fd, F_GETFD) != -1;
+}
+
+}  // namespace
+
+class UdpSocketPoolTest : public NetNativeTestBase {
+  protected:
+    // Acquire a socket of |key| which isn't in the pool, and open it as the caller would.
+    UdpSocketPool::Socket newSocket(UdpSocketPool& pool, const UdpSocketPool::Key& key = kKey) {
+        UdpSocketPool::Socket socket = pool.acquire(key);
+        EXPECT_EQ(-1, socket.fd.get());
+        socket.fd.reset(::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+        EXPECT_NE(-1, socket.fd.get());
+        return socket;
+    }
+};
+
+TEST_F(UdpSocketPoolTest, ReusesReleasedSocket) {
+    UdpSocketPool pool;
+    UdpSocketPool::Socket socket = newSocket(pool);
+    const int fd = socket.fd.get();
+    pool.release(kKey, std::move(socket));
+    EXPECT_EQ(1U, pool.getStats().idle);
+
+    UdpSocketPool::Socket reused = pool.acquire(kKey);
+    EXPECT_EQ(fd, reused.fd.get());
+    EXPECT_EQ(0U, pool.getStats().idle);
+
+    // Only one query uses a socket at a time.
+    EXPECT_EQ(-1, pool.acquire(kKey).fd.get());
+
+    const auto stats = pool.getStats();
+    EXPECT_EQ(1U, stats.hits);
+    EXPECT_EQ(2U, stats.misses);
+}
+
+TEST_F(UdpSocketPoolTest, KeysAreSeparate) {
+    UdpSocketPool pool;
+    pool.release(kKey, newSocket(pool));
+
+    UdpSocketPool::Key otherNetwork = kKey;
+    otherNetwork.netid++;
+    UdpSocketPool::Key otherMark = kKey;
+    otherMark.mark = 0x10064;
+    UdpSocketPool::Key otherUid = kKey;
+    otherUid.uid++;
+    UdpSocketPool::Key otherServer = kKey;
+    otherServer.server = IPSockAddr::toIPSockAddr("127.0.0.4", 53);
+    for (const auto& key : {otherNetwork, otherMark, otherUid, otherServer}) {
+        EXPECT_EQ(-1, pool.acquire(key).fd.get());
+    }
+    EXPECT_NE(-1, pool.acquire(kKey).fd.get());
+}
+
+TEST_F(UdpSocketPoolTest, Lifetime) {
+    constexpr auto kLifetime = 200ms;
+    UdpSocketPool pool(kLifetime);
+
+    const auto now = UdpSocketPool::Clock::now();
+    UdpSocketPool::Socket socket = newSocket(pool);
+    EXPECT_GE(socket.expiry, now + kLifetime * 3 / 4);
+    EXPECT_LE(socket.expiry, UdpSocketPool::Clock::now() + kLifetime);
+
+    const int fd = socket.fd.get();
+    pool.release(kKey, std::move(socket));
+    std::this_thread::sleep_for(kLifetime);
+
+    // The expired socket is closed rather than reused.
+    EXPECT_EQ(-1, pool.acquire(kKey).fd.get());
+    EXPECT_FALSE(isOpen(fd));
+
+    // Same if it expires while in use.
+    socket = newSocket(pool);
+    const int fd2 = socket.fd.get();
+    std::this_thread::sleep_for(kLifetime);
+    pool.release(kKey, std::move(socket));
+    EXPECT_FALSE(isOpen(fd2));
+    EXPECT_EQ(0U, pool.getStats().idle);
+}
+
+TEST_F(UdpSocketPoolTest, Limits) {
+    UdpSocketPool pool(UdpSocketPool::kLifetime, 2 /*maxIdlePerKey*/, 3 /*maxIdle*/);
+
+    std::vector<UdpSocketPool::Socket> sockets;
+    for (int i = 0; i < 3; i++) sockets.push_back(newSocket(pool));
+    const int extra = sockets.back().fd.get();
+    for (auto& socket : sockets) pool.release(kKey, std::move(socket));
+    EXPECT_EQ(2U, pool.getStats().idle);
+    EXPECT_FALSE(isOpen(extra));
+
+    UdpSocketPool::Key otherServer = kKey;
+    otherServer.server = IPSockAddr::toIPSockAddr("127.0.0.4", 53);
+    UdpSocketPool::Socket socket = newSocket(pool, otherServer);
+    pool.release(otherServer, std::move(socket));
+    EXPECT_EQ(3U, pool.getStats().idle);
+
+    // The pool is full.
+    UdpSocketPool::Key otherUid = kKey;
+    otherUid.uid++;
+    socket = newSocket(pool, otherUid);
+    const int fd = socket.fd.get();
+    pool.release(otherUid, std::move(socket));
+    EXPECT_EQ(3U, pool.getStats().idle);
+    EXPECT_FALSE(isOpen(fd));
+}
+
+TEST_F(UdpSocketPoolTest, Clear) {
+    UdpSocketPool pool;
+    UdpSocketPool::Key otherNetwork = kKey;
+    otherNetwork.netid++;
+    UdpSocketPool::Socket socket = newSocket(pool);
+    const int fd = socket.fd.get();
+    pool.release(kKey, std::move(socket));
+    pool.release(otherNetwork, newSocket(pool, otherNetwork));
+
+    pool.clear(kKey.netid);
+    EXPECT_FALSE(isOpen(fd));
+    EXPECT_EQ(-1, pool.acquire(kKey).fd.get());
+    EXPECT_NE(-1, pool.acquire(otherNetwork).fd.get());
+}
+
+}  // namespace android::net
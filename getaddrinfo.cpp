@@ -53,12 +53,14 @@
 #include <unistd.h>
 
 #include <chrono>
+#include <functional>
 #include <future>
 
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
 
 #include "Experiments.h"
+#include "LookupExecutor.h"
 #include "netd_resolv/resolv.h"
 #include "res_comp.h"
 #include "res_debug.h"
@@ -68,6 +70,7 @@
 #define ANY 0
 
 using android::net::Experiments;
+using android::net::LookupExecutor;
 using android::net::NetworkDnsEventReported;
 
 const char in_addrany[] = {0, 0, 0, 0};
@@ -1601,6 +1604,50 @@ struct QueryResult {
     NetworkDnsEventReported event;
 };
 
+// Formulate the query of |t| into |buf|. Returns its length, or a non-positive value on error.
+int makeQuery(const char* name, const res_target* t, ResState* res, std::span<uint8_t> buf) {
+    LOG(DEBUG) << __func__ << ": (" << t->qclass << ", " << t->qtype << ")";
+
+    int n = res_nmkquery(QUERY, name, t->qclass, t->qtype, {}, buf, res->netcontext_flags);
+    if (n > 0 &&
+        (res->netcontext_flags & (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS))) {
+        n = res_nopt(res, n, buf, t->answer.size());
+    }
+    if (n <= 0) LOG(ERROR) << __func__ << ": res_nmkquery failed";
+    return n;
+}
+
+// Check the answer of the query of |t|, for which res_nsend() returned |n| and |rcode|, and retry
+// the query without EDNS0 if it choked on it.
+QueryResult checkAnswer(const char* name, res_target* t, ResState* res_temp, int n, int rcode) {
+    HEADER* hp = (HEADER*)(void*)t->answer.data();
+    const int anslen = t->answer.size();
+    if (n < 0 || hp->rcode != NOERROR || ntohs(hp->ancount) == 0) {
+        if (rcode != RCODE_TIMEOUT) rcode = hp->rcode;
+        // if the query choked with EDNS0, retry without EDNS0
+        if ((res_temp->netcontext_flags &
+             (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS)) &&
+            (res_temp->flags & RES_F_EDNS0ERR)) {
+            LOG(INFO) << __func__ << ": retry without EDNS0";
+            uint8_t buf[MAXPACKET];
+            n = res_nmkquery(QUERY, name, t->qclass, t->qtype, {}, buf,
+                             res_temp->netcontext_flags);
+            n = res_nsend(res_temp, std::span(buf, n), std::span(t->answer.data(), anslen), &rcode,
+                          0);
+        }
+    }
+
+    LOG(INFO) << __func__ << ": rcode=" << rcode << ", ancount=" << ntohs(hp->ancount)
+              << ", return value=" << n;
+
+    t->n = n;
+    return {
+            .ancount = ntohs(hp->ancount),
+            .rcode = rcode,
+            .qerrno = errno,
+    };
+}
+
 // Formulate a normal query, send, and await answer.
 // Caller must parse answer and determine whether it answers the question.
 QueryResult doQuery(const char* name, res_target* t, ResState* res,
@@ -1609,23 +1656,11 @@ QueryResult doQuery(const char* name, res_target* t, ResState* res,
 
     hp->rcode = NOERROR;  // default
 
-    const int cl = t->qclass;
-    const int type = t->qtype;
-    const int anslen = t->answer.size();
-
-    LOG(DEBUG) << __func__ << ": (" << cl << ", " << type << ")";
-
     uint8_t buf[MAXPACKET];
-    int n = res_nmkquery(QUERY, name, cl, type, {}, buf, res->netcontext_flags);
-
-    if (n > 0 &&
-        (res->netcontext_flags & (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS))) {
-        n = res_nopt(res, n, buf, anslen);
-    }
+    int n = makeQuery(name, t, res, buf);
 
     NetworkDnsEventReported event;
     if (n <= 0) {
-        LOG(ERROR) << __func__ << ": res_nmkquery failed";
         return {
                 .ancount = 0,
                 .rcode = -1,
@@ -1638,58 +1673,101 @@ QueryResult doQuery(const char* name, res_target* t, ResState* res,
     ResState res_temp = res->clone(&event);
 
     int rcode = NOERROR;
-    n = res_nsend(&res_temp, std::span(buf, n), std::span(t->answer.data(), anslen), &rcode, 0,
-                  sleepTimeMs);
-    if (n < 0 || hp->rcode != NOERROR || ntohs(hp->ancount) == 0) {
-        if (rcode != RCODE_TIMEOUT) rcode = hp->rcode;
-        // if the query choked with EDNS0, retry without EDNS0
-        if ((res_temp.netcontext_flags &
-             (NET_CONTEXT_FLAG_USE_DNS_OVER_TLS | NET_CONTEXT_FLAG_USE_EDNS)) &&
-            (res_temp.flags & RES_F_EDNS0ERR)) {
-            LOG(INFO) << __func__ << ": retry without EDNS0";
-            n = res_nmkquery(QUERY, name, cl, type, {}, buf, res_temp.netcontext_flags);
-            n = res_nsend(&res_temp, std::span(buf, n), std::span(t->answer.data(), anslen), &rcode,
-                          0);
+    n = res_nsend(&res_temp, std::span(buf, n), t->answer, &rcode, 0, sleepTimeMs);
+    QueryResult result = checkAnswer(name, t, &res_temp, n, rcode);
+    result.event = std::move(event);
+    return result;
+}
+
+// Same as running doQuery() for each res_target in parallel, except that the queries are sent
+// together by res_nsend_batch(), from the calling thread. Returns nothing if they can't be sent
+// that way, such as when private DNS is in use.
+std::vector<QueryResult> doBatchedQueries(const char* name, res_target* target, ResState* res) {
+    std::vector<res_target*> targets;
+    for (res_target* t = target; t; t = t->next) targets.push_back(t);
+    std::vector<std::vector<uint8_t>> bufs(targets.size(), std::vector<uint8_t>(MAXPACKET));
+    std::vector<BatchQuery> queries;
+    for (size_t i = 0; i < targets.size(); ++i) {
+        HEADER* hp = (HEADER*)(void*)targets[i]->answer.data();
+        hp->rcode = NOERROR;  // default
+        const int n = makeQuery(name, targets[i], res, bufs[i]);
+        if (n <= 0) {
+            return {{
+                    .ancount = 0,
+                    .rcode = -1,
+                    .herrno = NO_RECOVERY,
+                    .qerrno = errno,
+            }};
         }
+        queries.push_back({.msg = std::span(bufs[i].data(), n), .ans = targets[i]->answer});
     }
 
-    LOG(INFO) << __func__ << ": rcode=" << rcode << ", ancount=" << ntohs(hp->ancount)
-              << ", return value=" << n;
-
-    t->n = n;
-    return {
-            .ancount = ntohs(hp->ancount),
-            .rcode = rcode,
-            .qerrno = errno,
-            .event = event,
-    };
+    NetworkDnsEventReported event;
+    ResState res_temp = res->clone(&event);
+    if (!res_nsend_batch(&res_temp, queries)) return {};
+
+    std::vector<QueryResult> results;
+    for (size_t i = 0; i < targets.size(); ++i) {
+        // As res_nsend() leaves it.
+        if (queries[i].result < 0) errno = -queries[i].result;
+        results.push_back(
+                checkAnswer(name, targets[i], &res_temp, queries[i].result, queries[i].rcode));
+    }
+    // The events of all the queries were recorded together.
+    results.front().event = std::move(event);
+    return results;
 }
 
 }  // namespace
 
 // This function runs doQuery() for each res_target in parallel.
 // The `target`, which is set in dns_getaddrinfo(), contains at most two res_target.
+// With the batched_parallel_lookup flag, the queries are sent together from the calling thread
+// instead, when they can be. Otherwise, with the lookup_executor flag, they run on the shared
+// LookupExecutor rather than on threads started for them.
 static int res_queryN_parallel(const char* name, res_target* target, ResState* res, int* herrno) {
-    std::vector<std::future<QueryResult>> results;
-    results.reserve(2);
-    std::chrono::milliseconds sleepTimeMs{};
-    for (res_target* t = target; t; t = t->next) {
-        results.emplace_back(std::async(std::launch::async, doQuery, name, t, res, sleepTimeMs));
-        // Avoiding gateways drop packets if queries are sent too close together
-        // Only needed if we have multiple queries in a row.
-        if (t->next) {
-            int sleepFlag = Experiments::getInstance()->getFlag("parallel_lookup_sleep_time",
-                                                                SLEEP_TIME_MS);
-            if (sleepFlag > 1000) sleepFlag = 1000;
-            sleepTimeMs = std::chrono::milliseconds(sleepFlag);
+    std::vector<QueryResult> results;
+    if (Experiments::getInstance()->getFlag("batched_parallel_lookup", 0)) {
+        results = doBatchedQueries(name, target, res);
+    }
+    if (results.empty()) {
+        std::vector<std::pair<res_target*, std::chrono::milliseconds>> queries;
+        std::chrono::milliseconds sleepTimeMs{};
+        for (res_target* t = target; t; t = t->next) {
+            queries.emplace_back(t, sleepTimeMs);
+            // Avoiding gateways drop packets if queries are sent too close together
+            // Only needed if we have multiple queries in a row.
+            if (t->next) {
+                int sleepFlag = Experiments::getInstance()->getFlag("parallel_lookup_sleep_time",
+                                                                    SLEEP_TIME_MS);
+                if (sleepFlag > 1000) sleepFlag = 1000;
+                sleepTimeMs = std::chrono::milliseconds(sleepFlag);
+            }
+        }
+
+        if (Experiments::getInstance()->getFlag("lookup_executor", 0)) {
+            results.resize(queries.size());
+            std::vector<std::function<void()>> tasks;
+            for (size_t i = 0; i < queries.size(); ++i) {
+                tasks.emplace_back([&, i] {
+                    results[i] = doQuery(name, queries[i].first, res, queries[i].second);
+                });
+            }
+            LookupExecutor::getInstance().run(tasks);
+        } else {
+            std::vector<std::future<QueryResult>> futures;
+            futures.reserve(2);
+            for (const auto& [t, sleep] : queries) {
+                futures.emplace_back(std::async(std::launch::async, doQuery, name, t, res, sleep));
+            }
+            for (auto& f : futures) results.push_back(f.get());
         }
     }
 
     int ancount = 0;
     int rcode = 0;
 
-    for (auto& f : results) {
-        const QueryResult& r = f.get();
+    for (const QueryResult& r : results) {
         if (r.herrno == NO_RECOVERY) {
             *herrno = r.herrno;
             return -1;
@@ -36,30 +36,47 @@
 #include <string.h>
 #include <time.h>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <deque>
+#include <map>
 #include <mutex>
+#include <optional>
 #include <set>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <linux/if.h>
 #include <net/if.h>
 #include <netdb.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <aidl/android/net/IDnsResolver.h>
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
 #include <android-base/strings.h>
 #include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
 #include <android/multinetwork.h>  // ResNsendFlags
+#include <netdutils/ThreadUtil.h>
 
 #include <server_configurable_flags/get_flags.h>
 
 #include "DnsStats.h"
 #include "Experiments.h"
+#include "SlabAllocator.h"
 #include "res_comp.h"
 #include "res_debug.h"
 #include "resolv_private.h"
@@ -68,12 +85,15 @@
 using aidl::android::net::IDnsResolver;
 using aidl::android::net::ResolverOptionsParcel;
 using aidl::android::net::ResolverParamsParcel;
+using aidl::android::net::resolv::aidl::CacheStatsParcel;
 using android::net::DnsQueryEvent;
 using android::net::DnsStats;
 using android::net::Experiments;
 using android::net::PROTO_TCP;
 using android::net::PROTO_UDP;
 using android::net::Protocol;
+using android::net::ServerCapabilities;
+using android::net::SlabAllocator;
 using android::netdutils::DumpWriter;
 using android::netdutils::IPSockAddr;
 using std::span;
@@ -100,7 +120,8 @@ using std::span;
  *    (and should be solved by the later full DNS cache process).
  *
  *  - the implementation is just a (query-data) => (answer-data) hash table
- *    with a trivial least-recently-used expiration policy.
+ *    with a CLOCK (second chance) approximation of least-recently-used
+ *    expiration policy.
  *
  * Doing this keeps the code simple and avoids to deal with a lot of things
  * that a full DNS cache is expected to do.
@@ -271,45 +292,12 @@ static uint8_t res_tolower(uint8_t c) {
     return (c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
 }
 
-static int res_memcasecmp(const unsigned char *s1, const unsigned char *s2, size_t len) {
-    for (size_t i = 0; i < len; i++) {
-        int ch1 = *s1++;
-        int ch2 = *s2++;
-        int d = res_tolower(ch1) - res_tolower(ch2);
-        if (d != 0) {
-            return d;
-        }
-    }
-    return 0;
-}
-
 static void _dnsPacket_init(DnsPacket* packet, const uint8_t* buff, int bufflen) {
     packet->base = buff;
     packet->end = buff + bufflen;
     packet->cursor = buff;
 }
 
-static void _dnsPacket_rewind(DnsPacket* packet) {
-    packet->cursor = packet->base;
-}
-
-static void _dnsPacket_skip(DnsPacket* packet, int count) {
-    const uint8_t* p = packet->cursor + count;
-
-    if (p > packet->end) p = packet->end;
-
-    packet->cursor = p;
-}
-
-static int _dnsPacket_readInt16(DnsPacket* packet) {
-    const uint8_t* p = packet->cursor;
-
-    if (p + 2 > packet->end) return -1;
-
-    packet->cursor = p + 2;
-    return (p[0] << 8) | p[1];
-}
-
 /** QUERY CHECKING **/
 
 /* check bytes in a dns packet. returns 1 on success, 0 on failure.
@@ -443,272 +431,180 @@ static int _dnsPacket_checkQuery(DnsPacket* packet) {
     return 1;
 }
 
-/** QUERY HASHING SUPPORT
+/** CANONICAL QUERY KEYS
+ **
+ ** The cache is keyed on a canonical form of the query, which is built once
+ ** per query so that comparing two keys is just a length check and a memcmp().
+ ** It is made of:
+ **
+ **   RD      :  8 : the RD bit of the header, the other bits are zero
+ **   FLAGS   :  8 : the second byte of the header (AD and CD bits)
+ **   QDCOUNT : 16
+ **   ARCOUNT : 16
+ **   the QDCOUNT QRs, with their QNAMEs lowercased
+ **   the ARCOUNT RRs, with their NAMEs lowercased
+ **
+ ** That is, the query without its ID and its TC bit, and with case-insensitive
+ ** names. See _dnsPacket_checkQuery() for why these are the fields which matter.
  **
- ** THE FOLLOWING CODE ASSUMES THAT THE INPUT PACKET HAS ALREADY
- ** BEEN SUCCESFULLY CHECKED.
+ ** THE FOLLOWING CODE ASSUMES THAT THE QRs OF THE INPUT PACKET HAVE ALREADY
+ ** BEEN SUCCESSFULLY CHECKED.
  **/
 
-/* use 32-bit FNV hash function */
-#define FNV_MULT 16777619U
-#define FNV_BASIS 2166136261U
-
-static unsigned _dnsPacket_hashBytes(DnsPacket* packet, int numBytes, unsigned hash) {
+/* Maximum size of a canonical key, queries with larger keys are not cached */
+constexpr size_t CACHE_KEY_MAX = NS_PACKETSZ;
+
+using CacheKeyBuffer = std::array<uint8_t, CACHE_KEY_MAX>;
+
+/* lowercase the ASCII letters among 'len' bytes, 8 bytes at a time. This is
+ * also safe on wire-format names, as label lengths are below 'A' */
+static void _key_lowercase(uint8_t* p, size_t len) {
+    constexpr uint64_t kOnes = 0x0101010101010101;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        /* with the top bit of each byte cleared, adding these constants sets
+         * it again in the bytes which are >= 'A', resp. > 'Z', without
+         * carrying into the next byte. Bytes >= 0x80 are left alone. */
+        const uint64_t heptets = w & (0x7f * kOnes);
+        const uint64_t ge_a = heptets + (0x80 - 'A') * kOnes;
+        const uint64_t gt_z = heptets + (0x80 - 'Z' - 1) * kOnes;
+        const uint64_t upper = (ge_a ^ gt_z) & ~w & (0x80 * kOnes);
+        w |= upper >> 2; /* 0x80 >> 2 == 0x20, the case bit */
+        memcpy(p + i, &w, 8);
+    }
+    for (; i < len; i++) p[i] = res_tolower(p[i]);
+}
+
+/* append 'numBytes' bytes from the cursor of 'packet' to the key being built
+ * at '*key', return 0 on read or write overflow */
+static int _dnsPacket_appendBytes(DnsPacket* packet, int numBytes, uint8_t** key,
+                                  const uint8_t* key_end) {
     const uint8_t* p = packet->cursor;
-    const uint8_t* end = packet->end;
 
-    while (numBytes > 0 && p < end) {
-        hash = hash * FNV_MULT ^ *p++;
-        numBytes--;
-    }
-    packet->cursor = p;
-    return hash;
+    if (numBytes < 0 || p + numBytes > packet->end || *key + numBytes > key_end) return 0;
+
+    memcpy(*key, p, numBytes);
+    *key += numBytes;
+    packet->cursor = p + numBytes;
+    return 1;
 }
 
-static unsigned _dnsPacket_hashQName(DnsPacket* packet, unsigned hash) {
+/* append the lowercased name at the cursor of 'packet' to the key being
+ * built at '*key'. Compressed names are not supported. Return 0 if the name
+ * is malformed or doesn't fit */
+static int _dnsPacket_appendName(DnsPacket* packet, uint8_t** key, const uint8_t* key_end) {
     const uint8_t* p = packet->cursor;
     const uint8_t* end = packet->end;
 
     for (;;) {
-        if (p >= end) { /* should not happen */
-            LOG(INFO) << __func__ << ": INTERNAL_ERROR: read-overflow";
-            break;
-        }
-
+        if (p >= end) return 0;
         int c = *p++;
-
         if (c == 0) break;
-
-        if (c >= 64) {
-            LOG(INFO) << __func__ << ": INTERNAL_ERROR: malformed domain";
-            break;
-        }
-        if (p + c >= end) {
-            LOG(INFO) << __func__ << ": INTERNAL_ERROR: simple label read-overflow";
-            break;
-        }
-
-        while (c > 0) {
-            uint8_t ch = *p++;
-            ch = res_tolower(ch);
-            hash = hash * FNV_MULT ^ ch;
-            c--;
-        }
-    }
-    packet->cursor = p;
-    return hash;
-}
-
-static unsigned _dnsPacket_hashQR(DnsPacket* packet, unsigned hash) {
-    hash = _dnsPacket_hashQName(packet, hash);
-    hash = _dnsPacket_hashBytes(packet, 4, hash); /* TYPE and CLASS */
-    return hash;
-}
-
-static unsigned _dnsPacket_hashRR(DnsPacket* packet, unsigned hash) {
-    int rdlength;
-    hash = _dnsPacket_hashQR(packet, hash);
-    hash = _dnsPacket_hashBytes(packet, 4, hash); /* TTL */
-    rdlength = _dnsPacket_readInt16(packet);
-    hash = _dnsPacket_hashBytes(packet, rdlength, hash); /* RDATA */
-    return hash;
-}
-
-static unsigned _dnsPacket_hashQuery(DnsPacket* packet) {
-    unsigned hash = FNV_BASIS;
-    int count, arcount;
-    _dnsPacket_rewind(packet);
-
-    /* ignore the ID */
-    _dnsPacket_skip(packet, 2);
-
-    /* we ignore the TC bit for reasons explained in
-     * _dnsPacket_checkQuery().
-     *
-     * however we hash the RD bit to differentiate
-     * between answers for recursive and non-recursive
-     * queries.
-     */
-    hash = hash * FNV_MULT ^ (packet->base[2] & 1);
-
-    /* mark the first header byte as processed */
-    _dnsPacket_skip(packet, 1);
-
-    /* process the second header byte */
-    hash = _dnsPacket_hashBytes(packet, 1, hash);
-
-    /* read QDCOUNT */
-    count = _dnsPacket_readInt16(packet);
-
-    /* assume: ANcount and NScount are 0 */
-    _dnsPacket_skip(packet, 4);
-
-    /* read ARCOUNT */
-    arcount = _dnsPacket_readInt16(packet);
-
-    /* hash QDCOUNT QRs */
-    for (; count > 0; count--) hash = _dnsPacket_hashQR(packet, hash);
-
-    /* hash ARCOUNT RRs */
-    for (; arcount > 0; arcount--) hash = _dnsPacket_hashRR(packet, hash);
-
-    return hash;
-}
-
-/** QUERY COMPARISON
- **
- ** THE FOLLOWING CODE ASSUMES THAT THE INPUT PACKETS HAVE ALREADY
- ** BEEN SUCCESSFULLY CHECKED.
- **/
-
-static int _dnsPacket_isEqualDomainName(DnsPacket* pack1, DnsPacket* pack2) {
-    const uint8_t* p1 = pack1->cursor;
-    const uint8_t* end1 = pack1->end;
-    const uint8_t* p2 = pack2->cursor;
-    const uint8_t* end2 = pack2->end;
-
-    for (;;) {
-        if (p1 >= end1 || p2 >= end2) {
-            LOG(INFO) << __func__ << ": INTERNAL_ERROR: read-overflow";
-            break;
-        }
-        int c1 = *p1++;
-        int c2 = *p2++;
-        if (c1 != c2) break;
-
-        if (c1 == 0) {
-            pack1->cursor = p1;
-            pack2->cursor = p2;
-            return 1;
-        }
-        if (c1 >= 64) {
-            LOG(INFO) << __func__ << ": INTERNAL_ERROR: malformed domain";
-            break;
-        }
-        if ((p1 + c1 > end1) || (p2 + c1 > end2)) {
-            LOG(INFO) << __func__ << ": INTERNAL_ERROR: simple label read-overflow";
-            break;
-        }
-        if (res_memcasecmp(p1, p2, c1) != 0) break;
-        p1 += c1;
-        p2 += c1;
-        /* we rely on the bound checks at the start of the loop */
+        if (c >= 64) return 0;
+        p += c;
     }
-    /* not the same, or one is malformed */
-    LOG(INFO) << __func__ << ": different DN";
-    return 0;
-}
-
-static int _dnsPacket_isEqualBytes(DnsPacket* pack1, DnsPacket* pack2, int numBytes) {
-    const uint8_t* p1 = pack1->cursor;
-    const uint8_t* p2 = pack2->cursor;
-
-    if (p1 + numBytes > pack1->end || p2 + numBytes > pack2->end) return 0;
-
-    if (memcmp(p1, p2, numBytes) != 0) return 0;
-
-    pack1->cursor += numBytes;
-    pack2->cursor += numBytes;
-    return 1;
-}
-
-static int _dnsPacket_isEqualQR(DnsPacket* pack1, DnsPacket* pack2) {
-    /* compare domain name encoding + TYPE + CLASS */
-    if (!_dnsPacket_isEqualDomainName(pack1, pack2) ||
-        !_dnsPacket_isEqualBytes(pack1, pack2, 2 + 2))
-        return 0;
-
-    return 1;
-}
-
-static int _dnsPacket_isEqualRR(DnsPacket* pack1, DnsPacket* pack2) {
-    int rdlength1, rdlength2;
-    /* compare query + TTL */
-    if (!_dnsPacket_isEqualQR(pack1, pack2) || !_dnsPacket_isEqualBytes(pack1, pack2, 4)) return 0;
-
-    /* compare RDATA */
-    rdlength1 = _dnsPacket_readInt16(pack1);
-    rdlength2 = _dnsPacket_readInt16(pack2);
-    if (rdlength1 != rdlength2 || !_dnsPacket_isEqualBytes(pack1, pack2, rdlength1)) return 0;
 
+    uint8_t* start = *key;
+    if (!_dnsPacket_appendBytes(packet, p - packet->cursor, key, key_end)) return 0;
+    _key_lowercase(start, *key - start);
     return 1;
 }
 
-static int _dnsPacket_isEqualQuery(DnsPacket* pack1, DnsPacket* pack2) {
-    int count1, count2, arcount1, arcount2;
-
-    /* compare the headers, ignore most fields */
-    _dnsPacket_rewind(pack1);
-    _dnsPacket_rewind(pack2);
-
-    /* compare RD, ignore TC, see comment in _dnsPacket_checkQuery */
-    if ((pack1->base[2] & 1) != (pack2->base[2] & 1)) {
-        LOG(INFO) << __func__ << ": different RD";
-        return 0;
-    }
-
-    if (pack1->base[3] != pack2->base[3]) {
-        LOG(INFO) << __func__ << ": different CD or AD";
-        return 0;
-    }
-
-    /* mark ID and header bytes as compared */
-    _dnsPacket_skip(pack1, 4);
-    _dnsPacket_skip(pack2, 4);
-
-    /* compare QDCOUNT */
-    count1 = _dnsPacket_readInt16(pack1);
-    count2 = _dnsPacket_readInt16(pack2);
-    if (count1 != count2 || count1 < 0) {
-        LOG(INFO) << __func__ << ": different QDCOUNT";
-        return 0;
-    }
-
-    /* assume: ANcount and NScount are 0 */
-    _dnsPacket_skip(pack1, 4);
-    _dnsPacket_skip(pack2, 4);
-
-    /* compare ARCOUNT */
-    arcount1 = _dnsPacket_readInt16(pack1);
-    arcount2 = _dnsPacket_readInt16(pack2);
-    if (arcount1 != arcount2 || arcount1 < 0) {
-        LOG(INFO) << __func__ << ": different ARCOUNT";
-        return 0;
-    }
+/* build the canonical key of a checked query packet into 'buf'. Return its
+ * length, or 0 if the additional records are malformed or the key doesn't
+ * fit in CACHE_KEY_MAX bytes */
+static size_t _dnsPacket_makeKey(DnsPacket* packet, CacheKeyBuffer& buf) {
+    const uint8_t* p = packet->base;
+    uint8_t* key = buf.data();
+    const uint8_t* key_end = buf.data() + buf.size();
+    const int qdcount = (p[4] << 8) | p[5];
+    const int arcount = (p[10] << 8) | p[11];
+
+    *key++ = p[2] & 1;
+    *key++ = p[3];
+    *key++ = p[4];
+    *key++ = p[5];
+    *key++ = p[10];
+    *key++ = p[11];
 
-    /* compare the QDCOUNT QRs */
-    for (; count1 > 0; count1--) {
-        if (!_dnsPacket_isEqualQR(pack1, pack2)) {
-            LOG(INFO) << __func__ << ": different QR";
+    packet->cursor = p + DNS_HEADER_SIZE;
+    for (int n = 0; n < qdcount; n++) {
+        /* QNAME, TYPE and CLASS */
+        if (!_dnsPacket_appendName(packet, &key, key_end) ||
+            !_dnsPacket_appendBytes(packet, 4, &key, key_end)) {
             return 0;
         }
     }
-
-    /* compare the ARCOUNT RRs */
-    for (; arcount1 > 0; arcount1--) {
-        if (!_dnsPacket_isEqualRR(pack1, pack2)) {
-            LOG(INFO) << __func__ << ": different additional RR";
+    for (int n = 0; n < arcount; n++) {
+        /* NAME, TYPE, CLASS, TTL, RDLENGTH and RDATA. RDLENGTH is the last
+         * two bytes appended before RDATA */
+        if (!_dnsPacket_appendName(packet, &key, key_end) ||
+            !_dnsPacket_appendBytes(packet, 8, &key, key_end) ||
+            !_dnsPacket_appendBytes(packet, (key[-2] << 8) | key[-1], &key, key_end)) {
             return 0;
         }
     }
-    return 1;
+    return key - buf.data();
+}
+
+/* 64-bit hash of a canonical key. This is XXH64 reduced to a single lane,
+ * which is plenty for keys of a few dozen bytes */
+static uint64_t _key_hash(const uint8_t* key, size_t len) {
+    constexpr uint64_t P1 = 0x9e3779b185ebca87;
+    constexpr uint64_t P2 = 0xc2b2ae3d27d4eb4f;
+    constexpr uint64_t P3 = 0x165667b19e3779f9;
+    constexpr uint64_t P4 = 0x85ebca77c2b2ae63;
+    uint64_t hash = P3 + len;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, key + i, 8);
+        hash ^= std::rotl(w * P2, 31) * P1;
+        hash = std::rotl(hash, 27) * P1 + P4;
+    }
+    if (i < len) {
+        uint64_t w = 0;
+        memcpy(&w, key + i, len - i);
+        hash ^= std::rotl(w * P2, 31) * P1;
+        hash = std::rotl(hash, 27) * P1 + P4;
+    }
+
+    hash ^= hash >> 33;
+    hash *= P2;
+    hash ^= hash >> 29;
+    hash *= P3;
+    hash ^= hash >> 32;
+    return hash;
 }
 
-/* cache entry. for simplicity, 'hash' and 'hlink' are inlined in this
- * structure though they are conceptually part of the hash table.
+/* cache entry. the hash table only stores pointers to entries, so that
+ * a lookup only touches the entry it is looking for.
  *
- * similarly, mru_next and mru_prev are part of the global MRU list
+ * 'clock_index' and 'referenced' are conceptually part of the CLOCK ring
+ * used to select eviction victims, see Cache.
  */
 struct Entry {
-    unsigned int hash;   /* hash value */
-    struct Entry* hlink; /* next in collision chain */
-    struct Entry* mru_prev;
-    struct Entry* mru_next;
+    unsigned int hash; /* hash value of the canonical key */
+    int clock_index;   /* position in the CLOCK ring */
+    int heap_index;    /* position in the expiry heap */
+    bool referenced;   /* set on every cache hit, cleared by the CLOCK hand */
+    time_t stale_recheck; /* don't try to refresh a stale entry before this time */
+    uint32_t ttl;         /* TTL of the answer when it was added */
+    uint32_t hits;        /* number of cache hits */
+    bool prefetching;     /* a refresh-ahead prefetch has been issued for this entry */
+    bool in_window;       /* in the admission window rather than the main CLOCK region */
 
     const uint8_t* query;
     int querylen;
     const uint8_t* answer;
     int answerlen;
+    const uint8_t* key; /* canonical key of the query */
+    int keylen;
+    ResolvCacheAnswer* shared_answer; /* copy of the answer handed out by reference, if any */
     time_t expires; /* time_t when the entry isn't valid any more */
     int id;         /* for debugging purpose */
 };
@@ -806,61 +702,85 @@ static uint32_t answer_getTTL(span<const uint8_t> answer) {
     return result;
 }
 
-static void entry_free(Entry* e) {
-    /* everything is allocated in a single memory block */
-    if (e) {
-        free(e);
+/*
+ * Replace the TTL of all the records of an answer with update(TTL), except
+ * the OPT pseudo-record which uses that field for something else.
+ */
+template <typename F>
+static void answer_updateTTL(span<uint8_t> answer, F update) {
+    ns_msg handle;
+    ns_rr rr;
+
+    if (ns_initparse(answer.data(), answer.size(), &handle) < 0) {
+        PLOG(INFO) << __func__ << ": ns_initparse failed";
+        return;
+    }
+    for (ns_sect section : {ns_s_an, ns_s_ns, ns_s_ar}) {
+        for (int n = 0; n < ns_msg_count(handle, section); n++) {
+            if (ns_parserr(&handle, section, n, &rr) || ns_rr_type(rr) == ns_t_opt) {
+                continue;
+            }
+            // The TTL is followed by the 16-bit RDLENGTH, right before the RDATA.
+            uint8_t* p = answer.data() + (ns_rr_rdata(rr) - answer.data()) - NS_INT16SZ -
+                         NS_INT32SZ;
+            ns_put32(update(ns_rr_ttl(rr)), p);
+        }
     }
 }
 
-static void entry_mru_remove(Entry* e) {
-    e->mru_prev->mru_next = e->mru_next;
-    e->mru_next->mru_prev = e->mru_prev;
+static void answer_setTTL(span<uint8_t> answer, uint32_t ttl) {
+    answer_updateTTL(answer, [ttl](uint32_t) { return ttl; });
 }
 
-static void entry_mru_add(Entry* e, Entry* list) {
-    Entry* first = list->mru_next;
-
-    e->mru_next = first;
-    e->mru_prev = list;
-
-    list->mru_next = e;
-    first->mru_prev = e;
+static size_t entry_size(const Entry* e) {
+    return sizeof(*e) + e->querylen + e->answerlen + e->keylen;
 }
 
-/* compute the hash of a given entry, this is a hash of most
- * data in the query (key) */
-static unsigned entry_hash(const Entry* e) {
-    DnsPacket pack[1];
-
-    _dnsPacket_init(pack, e->query, e->querylen);
-    return _dnsPacket_hashQuery(pack);
+static void entry_free(SlabAllocator* allocator, Entry* e) {
+    /* everything is allocated in a single memory block */
+    if (e) {
+        delete e->shared_answer;
+        allocator->deallocate(e, entry_size(e));
+    }
 }
 
 /* initialize an Entry as a search key, this also checks the input query packet
+ * and builds its canonical key into 'keybuf', which must outlive the Entry.
  * returns 1 on success, or 0 in case of unsupported/malformed data */
-static int entry_init_key(Entry* e, span<const uint8_t> query) {
+static int entry_init_key(Entry* e, span<const uint8_t> query, CacheKeyBuffer& keybuf) {
     DnsPacket pack[1];
 
     memset(e, 0, sizeof(*e));
 
     e->query = query.data();
     e->querylen = query.size();
-    e->hash = entry_hash(e);
 
     _dnsPacket_init(pack, e->query, e->querylen);
+    if (!_dnsPacket_checkQuery(pack)) return 0;
 
-    return _dnsPacket_checkQuery(pack);
+    const size_t keylen = _dnsPacket_makeKey(pack, keybuf);
+    if (keylen == 0) {
+        LOG(INFO) << __func__ << ": malformed additional records or query too long";
+        return 0;
+    }
+    e->key = keybuf.data();
+    e->keylen = keylen;
+
+    const uint64_t hash = _key_hash(e->key, e->keylen);
+    e->hash = hash ^ (hash >> 32);
+    return 1;
 }
 
 /* allocate a new entry as a cache node */
-static Entry* entry_alloc(const Entry* init, span<const uint8_t> answer) {
+static Entry* entry_alloc(SlabAllocator* allocator, const Entry* init,
+                          span<const uint8_t> answer) {
     Entry* e;
     int size;
 
-    size = sizeof(*e) + init->querylen + answer.size();
-    e = (Entry*) calloc(size, 1);
+    size = sizeof(*e) + init->querylen + answer.size() + init->keylen;
+    e = (Entry*) allocator->allocate(size);
     if (e == NULL) return e;
+    memset(e, 0, sizeof(*e));
 
     e->hash = init->hash;
     e->query = (const uint8_t*) (e + 1);
@@ -873,32 +793,132 @@ static Entry* entry_alloc(const Entry* init, span<const uint8_t> answer) {
 
     memcpy((char*)e->answer, answer.data(), e->answerlen);
 
+    e->key = e->answer + e->answerlen;
+    e->keylen = init->keylen;
+
+    memcpy((char*)e->key, init->key, e->keylen);
+
     return e;
 }
 
-static int entry_equals(const Entry* e1, const Entry* e2) {
-    DnsPacket pack1[1], pack2[1];
+/* return the bytes of the shared buffer of a given entry, if it has one */
+static size_t entry_shared_size(const Entry* e) {
+    return e->shared_answer != nullptr ? e->answerlen : 0;
+}
 
-    if (e1->querylen != e2->querylen) {
-        return 0;
+/* call 'fn' with the raw rdata of every A and AAAA record in the
+ * answer section of a given entry */
+template <typename F>
+static void entry_for_each_address(const Entry* e, F fn) {
+    ns_msg handle;
+    ns_rr rr;
+
+    if (ns_initparse(e->answer, e->answerlen, &handle) < 0) {
+        return;
     }
-    _dnsPacket_init(pack1, e1->query, e1->querylen);
-    _dnsPacket_init(pack2, e2->query, e2->querylen);
+    for (int n = 0; n < ns_msg_count(handle, ns_s_an); n++) {
+        if (ns_parserr(&handle, ns_s_an, n, &rr)) {
+            continue;
+        }
+        if ((ns_rr_type(rr) == ns_t_a && ns_rr_rdlen(rr) == sizeof(in_addr)) ||
+            (ns_rr_type(rr) == ns_t_aaaa && ns_rr_rdlen(rr) == sizeof(in6_addr))) {
+            fn(std::string(reinterpret_cast<const char*>(ns_rr_rdata(rr)), ns_rr_rdlen(rr)));
+        }
+    }
+}
 
-    return _dnsPacket_isEqualQuery(pack1, pack2);
+/* copy the first non-empty question name of a given entry to 'domain_name'
+ * returns true on success */
+static bool entry_get_qname(const Entry* e, char domain_name[], size_t domain_name_size) {
+    ns_msg handle;
+    ns_rr rr_query;
+
+    if (ns_initparse(e->answer, e->answerlen, &handle) < 0) {
+        return false;
+    }
+    for (int i = 0; i < ns_msg_count(handle, ns_s_qd); i++) {
+        if (ns_parserr(&handle, ns_s_qd, i, &rr_query)) {
+            continue;
+        }
+        strlcpy(domain_name, ns_rr_name(rr_query), domain_name_size);
+        if (domain_name[0] != '\0') {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int entry_equals(const Entry* e1, const Entry* e2) {
+    return e1 == e2 || (e1->keylen == e2->keylen && memcmp(e1->key, e2->key, e1->keylen) == 0);
 }
 
-/* We use a simple hash table with external collision lists
- * for simplicity, the hash-table fields 'hash' and 'hlink' are
- * inlined in the Entry structure.
+/* We use an open-addressing hash table with linear probing. Each slot keeps
+ * a copy of the hash and of the key length of its entry, so that probing
+ * a slot that holds another entry almost never needs to dereference it.
  */
+struct Slot {
+    Entry* entry;  /* nullptr if the slot is empty */
+    unsigned int hash;
+    int keylen;
+};
 
 /* Maximum time for a thread to wait for an pending request */
 constexpr int PENDING_REQUEST_TIMEOUT = 20;
 
-// lock protecting everything in NetConfig.
-static std::mutex cache_mutex;
-static std::condition_variable cv;
+/* Serve-stale (RFC 8767) parameters. The TTL of the records of a stale
+ * answer, and how long to answer from a stale entry without retrying the
+ * upstream servers after they failed to refresh it. Both values are the ones
+ * recommended by section 5 of the RFC. */
+constexpr uint32_t STALE_ANSWER_TTL = 30;
+constexpr int STALE_FAILURE_RECHECK_TIMEOUT = 30;
+constexpr int STALE_ANSWER_TIMEOUT_MS_DEFAULT = 1800;
+
+/* Refresh-ahead prefetching. An entry which got at least PREFETCH_MIN_HITS
+ * hits is prefetched when a hit lands in the last 'cache_prefetch_threshold_pct'
+ * percent of its TTL. */
+constexpr uint32_t PREFETCH_MIN_HITS = 2;
+constexpr int PREFETCH_BUDGET_PCT_DEFAULT = 10;
+
+// Budget shared by the prefetches of all networks. Each cache lookup earns |pct| credits and
+// each prefetch costs 100 of them, so prefetch traffic stays under |pct| percent of the lookups.
+// The credits are capped so that a long quiet period doesn't allow a burst of prefetches.
+class PrefetchBudget {
+  public:
+    void earn(int pct) {
+        int credits = mCredits.load(std::memory_order_relaxed);
+        while (credits < kMaxCredits &&
+               !mCredits.compare_exchange_weak(credits, std::min(credits + pct, kMaxCredits),
+                                               std::memory_order_relaxed)) {
+        }
+    }
+    bool trySpend() {
+        int credits = mCredits.load(std::memory_order_relaxed);
+        while (credits >= kCost) {
+            if (mCredits.compare_exchange_weak(credits, credits - kCost,
+                                               std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+  private:
+    static constexpr int kCost = 100;
+    static constexpr int kMaxCredits = 10 * kCost;
+    std::atomic_int mCredits = 0;
+};
+
+static PrefetchBudget sPrefetchBudget;
+
+// Lock protecting sNetConfigMap only. Each NetConfig has its own lock protecting its state,
+// so that cache traffic on one network never contends with another network. Lock order is
+// always netconfig_map_mutex first, then NetConfig::mutex; in practice the former is released
+// before the latter is acquired.
+static std::shared_mutex netconfig_map_mutex;
+
+// Lock protecting the registry of shareable caches and their sharer counts. It may be taken
+// while holding a NetConfig::mutex, but not a Cache::mutex.
+static std::mutex shared_caches_mutex;
 
 namespace {
 
@@ -945,65 +965,349 @@ std::unordered_map<int, uint32_t> resolv_get_dns_event_subsampling_map(bool isMd
 
 }  // namespace
 
-// Note that Cache is not thread-safe per se, access to its members must be protected
-// by an external mutex.
+// A query which missed the cache and is being resolved by a leader thread. The other threads
+// asking the same question wait for the leader instead of sending it again, and the leader hands
+// its answer over to them directly, even if the answer can't be cached.
+struct InFlightQuery {
+    explicit InFlightQuery(const Entry* key) : keybuf(key->key, key->key + key->keylen) {
+        this->key.hash = key->hash;
+        this->key.key = keybuf.data();
+        this->key.keylen = keybuf.size();
+    }
+
+    // Copy of the canonical key, to tell apart the queries which have the same hash.
+    const std::vector<uint8_t> keybuf;
+    Entry key{};
+    bool done = false;
+    // The answer of the leader, or null if the query failed.
+    ResolvCacheAnswer answer;
+    // Notified when |done| is set. Waiters must hold the Cache mutex.
+    std::condition_variable cv;
+};
+
+// Estimates how often each query was looked up recently, for the admission filter of the cache.
+// This is a count-min sketch: each query increments one 4-bit counter in each of kDepth rows, and
+// its frequency is the smallest of these counters, which collisions can only inflate. The
+// counters saturate at kMaxCount, and all of them are halved once kSampleFactor lookups per cache
+// entry were recorded, so that queries which were popular a long time ago fade out.
+class FrequencySketch {
+  public:
+    // Size the sketch for a cache of |entries| entries, and forget everything.
+    void resize(size_t entries) {
+        mMask = std::bit_ceil(std::max(entries * kWidthFactor, kMinWidth)) - 1;
+        mCounters.assign(kDepth * (mMask + 1) / 2, 0);
+        mSampleSize = kSampleFactor * entries;
+        mAdditions = 0;
+    }
+
+    void increment(unsigned hash) {
+        bool added = false;
+        for (int row = 0; row < kDepth; row++) {
+            const size_t i = index(row, hash);
+            if (get(i) < kMaxCount) {
+                mCounters[i / 2] += 1 << shift(i);
+                added = true;
+            }
+        }
+        if (added && ++mAdditions >= mSampleSize) age();
+    }
+
+    int frequency(unsigned hash) const {
+        int frequency = kMaxCount;
+        for (int row = 0; row < kDepth; row++) {
+            frequency = std::min(frequency, get(index(row, hash)));
+        }
+        return frequency;
+    }
+
+  private:
+    static constexpr int kDepth = 4;
+    static constexpr int kMaxCount = 15;
+    // Collisions make one-time queries look popular unless there are a few counters per entry.
+    static constexpr size_t kWidthFactor = 4;
+    static constexpr size_t kMinWidth = 16;
+    static constexpr size_t kSampleFactor = 10;
+
+    size_t index(int row, unsigned hash) const {
+        // Rehash with a different seed per row (splitmix64 finalizer), so that queries which
+        // collide in one row are unlikely to collide in the others.
+        static constexpr std::array<uint64_t, kDepth> kSeeds = {
+                0x9e3779b97f4a7c15, 0x3c6ef372fe94f82a, 0xdaa66d2c7ddf743f, 0x78dde6e5fd29f054};
+        uint64_t h = hash + kSeeds[row];
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+        h ^= h >> 31;
+        return row * (mMask + 1) + (h & mMask);
+    }
+
+    // Two counters per byte.
+    static int shift(size_t i) { return (i & 1) * 4; }
+    int get(size_t i) const { return (mCounters[i / 2] >> shift(i)) & 0xf; }
+
+    void age() {
+        for (uint8_t& counters : mCounters) counters = (counters >> 1) & 0x77;
+        mAdditions /= 2;
+    }
+
+    size_t mMask = 0;
+    std::vector<uint8_t> mCounters;
+    size_t mSampleSize = 0;
+    size_t mAdditions = 0;
+};
+
+// Bytes of entries held by the caches of all networks.
+static std::atomic<size_t> sCacheBytes = 0;
+
+/* Size of the admission window, in percent of the maximum number of entries. */
+constexpr int ADMISSION_WINDOW_PCT = 1;
+
+// The contents of a flushed Cache. Freeing the entries of a large cache takes a while, so flush()
+// only swaps them out under the lock, and they are freed by cache_free_in_background().
+struct CacheGarbage {
+    ~CacheGarbage() {
+        // The entries are freed all at once with their slabs, but not their shared answers.
+        for (const Slot& slot : slots) {
+            if (slot.entry != nullptr) delete slot.entry->shared_answer;
+        }
+    }
+
+    std::vector<Slot> slots;
+    std::vector<Entry*> clock;
+    std::vector<Entry*> expiry_heap;
+    std::unordered_multimap<std::string, Entry*> addr_index;
+    std::deque<Entry*> window;
+    SlabAllocator allocator;
+};
+
+// The hash table and the CLOCK ring of a Cache, which cache_add() builds before taking the lock of
+// the cache, and hands over to Cache::setTable().
+struct CacheTable {
+    std::vector<Slot> slots;
+    std::vector<Entry*> clock;
+    std::vector<int> free_frames;
+    std::vector<Entry*> expiry_heap;
+};
+
+// The contents of the flushed caches waiting to be freed, in the order they were flushed.
+static std::mutex cache_free_mutex;
+static std::condition_variable cache_free_cv;
+static std::deque<std::unique_ptr<CacheGarbage>> sCacheFreeQueue GUARDED_BY(cache_free_mutex);
+
+// Hand |garbage| over to the one thread which frees the contents of all the flushed caches, which
+// is started by the first flush.
+static void cache_free_in_background(std::unique_ptr<CacheGarbage> garbage) {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        std::thread([] {
+            android::netdutils::setThreadName("CacheFree");
+            while (true) {
+                std::unique_ptr<CacheGarbage> next;
+                {
+                    std::unique_lock lock(cache_free_mutex);
+                    cache_free_cv.wait(lock, [] { return !sCacheFreeQueue.empty(); });
+                    next = std::move(sCacheFreeQueue.front());
+                    sCacheFreeQueue.pop_front();
+                }
+                next.reset();
+            }
+        }).detach();
+    });
+    {
+        std::lock_guard guard(cache_free_mutex);
+        sCacheFreeQueue.push_back(std::move(garbage));
+    }
+    cache_free_cv.notify_one();
+}
+
+// Access to the members of a Cache must be protected by its mutex. Networks which use the same
+// upstream servers may share one Cache, see resolv_set_nameservers().
 //
 // TODO: move all cache manipulation code here and make data members private.
 struct Cache {
-    Cache() : max_cache_entries(get_max_cache_entries_from_flag()) {
-        entries.resize(max_cache_entries);
-        mru_list.mru_prev = mru_list.mru_next = &mru_list;
+    Cache()
+        : stale_window_sec(std::max(0, android::net::Experiments::getInstance()->getFlag(
+                                               "cache_serve_stale_window_sec", 0))),
+          stale_answer_timeout_ms(android::net::Experiments::getInstance()->getFlag(
+                  "cache_stale_answer_timeout_ms", STALE_ANSWER_TIMEOUT_MS_DEFAULT)),
+          prefetch_threshold_pct(std::clamp(android::net::Experiments::getInstance()->getFlag(
+                                                    "cache_prefetch_threshold_pct", 0),
+                                            0, 100)),
+          prefetch_budget_pct(std::clamp(android::net::Experiments::getInstance()->getFlag(
+                                                 "cache_prefetch_budget_pct",
+                                                 PREFETCH_BUDGET_PCT_DEFAULT),
+                                         0, 100)),
+          max_bytes(std::max(0, android::net::Experiments::getInstance()->getFlag(
+                                        "cache_max_bytes", 0))),
+          max_total_bytes(std::max(0, android::net::Experiments::getInstance()->getFlag(
+                                              "cache_max_total_bytes", 0))),
+          admission_filter(android::net::Experiments::getInstance()->getFlag(
+                                   "cache_admission_filter", 0) != 0),
+          max_cache_entries(get_max_cache_entries_from_flag()) {
+        if (admission_filter) {
+            sketch.resize(max_cache_entries);
+        }
+    }
+    ~Cache() {
+        takeContents();
+        flushPendingRequests();
     }
-    ~Cache() { flush(); }
 
-    void flush() {
-        for (int nn = 0; nn < max_cache_entries; nn++) {
-            Entry** pnode = (Entry**)&entries[nn];
+    // Number of networks using this cache.
+    int sharers GUARDED_BY(shared_caches_mutex) = 1;
 
-            while (*pnode) {
-                Entry* node = *pnode;
-                *pnode = node->hlink;
-                entry_free(node);
-            }
-        }
+    // Protects everything below.
+    std::mutex mutex;
 
+    void flush() {
+        // Only swap out the contents under the lock, so that flushing a large cache doesn't stall
+        // its lookups. The entries are freed on a background thread.
+        const int flushed = num_entries;
+        std::unique_ptr<CacheGarbage> garbage = takeContents();
         flushPendingRequests();
-
-        mru_list.mru_next = mru_list.mru_prev = &mru_list;
-        num_entries = 0;
-        last_id = 0;
+        if (flushed > 0) {
+            cache_free_in_background(std::move(garbage));
+        }
 
         LOG(INFO) << "DNS cache flushed";
     }
 
     void flushPendingRequests() {
-        pending_req_info* ri = pending_requests.next;
-        while (ri) {
-            pending_req_info* tmp = ri;
-            ri = ri->next;
-            free(tmp);
+        // Fail all the in-flight queries, so that their waiters send their own.
+        for (auto& [hash, iq] : in_flight) {
+            iq->done = true;
+            iq->cv.notify_all();
         }
-
-        pending_requests.next = nullptr;
-        cv.notify_all();
+        in_flight.clear();
     }
 
     int get_max_cache_entries() { return max_cache_entries; }
 
-    int num_entries = 0;
+    // Build the hash table and the CLOCK ring, which an empty cache goes without, so that neither
+    // creating nor flushing a cache allocates them. Doesn't need the lock, as it only reads
+    // max_cache_entries.
+    CacheTable newTable() const {
+        CacheTable table;
+        // Keep the load factor under 3/4 so that probe sequences stay short. The table size
+        // is a power of two so that the slot index is just a mask of the hash.
+        table.slots.resize(std::bit_ceil(static_cast<size_t>(max_cache_entries) * 4 / 3 + 1));
+        table.clock.resize(max_cache_entries);
+        // Hand out frames in ring order, so that eviction starts with the oldest entries.
+        for (int i = max_cache_entries - 1; i >= 0; i--) {
+            table.free_frames.push_back(i);
+        }
+        table.expiry_heap.reserve(max_cache_entries);
+        return table;
+    }
 
-    // TODO: convert to std::list
-    Entry mru_list;
-    int last_id = 0;
-    std::vector<Entry> entries;
+    // Take |table| as the table of the cache, unless it already has one. An entry can only be
+    // added once the cache has a table.
+    void setTable(CacheTable&& table) {
+        if (has_table) return;
+        slots = std::move(table.slots);
+        clock = std::move(table.clock);
+        free_frames = std::move(table.free_frames);
+        expiry_heap = std::move(table.expiry_heap);
+        has_table = true;
+    }
+
+    // Bytes of the entries in the cache, headers and shared answers included.
+    size_t bytes() const { return allocator.stats().requested_bytes + shared_answer_bytes; }
+
+    // Return true if an entry of |size| bytes could only be added after evicting another one.
+    bool isFull(size_t size) const {
+        return num_entries >= max_cache_entries || (max_bytes > 0 && bytes() + size > max_bytes) ||
+               (max_total_bytes > 0 && sCacheBytes + size > max_total_bytes);
+    }
 
-    // TODO: convert to std::vector
-    struct pending_req_info {
-        unsigned int hash;
-        struct pending_req_info* next;
-    } pending_requests{};
+    size_t window_capacity() const {
+        return std::max(1, max_cache_entries * ADMISSION_WINDOW_PCT / 100);
+    }
+
+    // Return true if an entry of |size| bytes fits in the byte budgets at all.
+    bool fits(size_t size) const {
+        return (max_bytes == 0 || size <= max_bytes) &&
+               (max_total_bytes == 0 || size <= max_total_bytes);
+    }
+
+    int num_entries = 0;
+    int last_id = 0;
+    // Whether the cache has a table, see setTable(). Also read without the lock, by cache_add().
+    std::atomic<bool> has_table = false;
+    // Empty until setTable() is called.
+    std::vector<Slot> slots;
+    SlabAllocator allocator;
+    // Bytes of the answers which resolv_cache_lookup_shared() hands out, which live outside
+    // |allocator|.
+    size_t shared_answer_bytes = 0;
+
+    // The CLOCK ring. Each entry occupies one frame of the ring. A cache hit only sets the
+    // referenced bit of the entry; when an entry must be evicted, the hand sweeps the ring and
+    // takes the first entry which has not been referenced since the hand last passed it.
+    std::vector<Entry*> clock;
+    size_t clock_hand = 0;
+    // Indices of the unused frames of |clock|.
+    std::vector<int> free_frames;
+
+    // Binary min-heap of the entries ordered by expiration time, so that expired entries are
+    // found without scanning the whole cache.
+    std::vector<Entry*> expiry_heap;
+
+    // Reverse index from the raw A/AAAA rdata found in the answer section of an entry to that
+    // entry. Keys are 4 bytes long for IPv4 addresses and 16 bytes long for IPv6 addresses.
+    std::unordered_multimap<std::string, Entry*> addr_index;
+
+    // Queries being resolved, by hash. See InFlightQuery.
+    std::unordered_multimap<unsigned int, std::shared_ptr<InFlightQuery>> in_flight;
+
+    // Serve-stale (RFC 8767). Expired entries are kept for |stale_window_sec| more seconds, so
+    // that they can still be answered when the upstream servers can't refresh them. 0 disables
+    // serve-stale.
+    const int stale_window_sec;
+    // How long a lookup waits for the in-flight refresh of a stale entry before answering it.
+    const int stale_answer_timeout_ms;
+
+    // Refresh-ahead prefetching. A popular entry is prefetched when it is hit in the last
+    // |prefetch_threshold_pct| percent of its TTL, as long as the prefetches stay within
+    // |prefetch_budget_pct| percent of the lookups. 0 disables prefetching.
+    const int prefetch_threshold_pct;
+    const int prefetch_budget_pct;
+
+    // Byte budgets of this cache, and of the caches of all networks together. Each network only
+    // evicts its own entries, so an entry which doesn't fit in the global budget once its cache
+    // is empty is not cached. 0 disables the budget.
+    const size_t max_bytes;
+    const size_t max_total_bytes;
+
+    // W-TinyLFU admission. New entries enter a small FIFO window first. When the cache is full,
+    // the oldest entry of the window only replaces the CLOCK victim of the main region if the
+    // sketch says that it was looked up more often; otherwise it is evicted itself. This keeps
+    // scans of one-time queries from flushing the popular entries.
+    const bool admission_filter;
+    std::deque<Entry*> window;
+    FrequencySketch sketch;
 
   private:
+    // Empty the cache, and return its former contents. Nothing is allocated here but the garbage
+    // itself: the next entry added builds a fresh table.
+    std::unique_ptr<CacheGarbage> takeContents() {
+        auto garbage = std::make_unique<CacheGarbage>();
+        garbage->slots = std::exchange(slots, {});
+        garbage->clock = std::exchange(clock, {});
+        garbage->expiry_heap = std::exchange(expiry_heap, {});
+        garbage->addr_index = std::exchange(addr_index, {});
+        garbage->window = std::exchange(window, {});
+        has_table = false;
+        sCacheBytes -= bytes();
+        garbage->allocator.swap(allocator);
+        shared_answer_bytes = 0;
+
+        clock_hand = 0;
+        free_frames.clear();
+        num_entries = 0;
+        last_id = 0;
+        return garbage;
+    }
+
     int get_max_cache_entries_from_flag() {
         int entries = android::net::Experiments::getInstance()->getFlag("max_cache_entries",
                                                                         MAX_ENTRIES_DEFAULT);
@@ -1019,9 +1323,68 @@ struct Cache {
     const int max_cache_entries;
 };
 
+// Counts latency samples in power-of-two buckets: bucket 0 counts the samples below 1us, bucket i
+// the ones in [2^(i-1), 2^i) us, and the last bucket everything slower.
+class LatencyHistogram {
+  public:
+    static constexpr int kBuckets = 16;
+
+    void record(std::chrono::nanoseconds latency) {
+        const auto us = static_cast<uint64_t>(std::max<int64_t>(latency.count() / 1000, 0));
+        const int bucket = std::min<int>(std::bit_width(us), kBuckets - 1);
+        mBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count(int bucket) const { return mBuckets[bucket].load(std::memory_order_relaxed); }
+
+  private:
+    std::array<std::atomic<uint64_t>, kBuckets> mBuckets{};
+};
+
+// Telemetry of the cache of a network. The counters are relaxed atomics, so that they are updated
+// and read without any lock, at the price of being slightly out of sync with each other while
+// lookups are running. They are kept per network even when the Cache itself is shared.
+struct CacheCounters {
+    std::atomic<uint64_t> lookups = 0;
+    std::atomic<uint64_t> hits = 0;
+    std::atomic<uint64_t> misses = 0;
+    // Expired entries dropped by the lookup which found them.
+    std::atomic<uint64_t> stale_discards = 0;
+    // Entries evicted, by cause.
+    std::atomic<uint64_t> evicted_for_room = 0;
+    std::atomic<uint64_t> evicted_expired = 0;
+    std::atomic<uint64_t> evicted_flushed = 0;
+    std::atomic<uint64_t> admissions_rejected = 0;
+    // Lookups which waited for an in-flight query, and those which gave up waiting.
+    std::atomic<uint64_t> coalesced_waits = 0;
+    std::atomic<uint64_t> coalesced_wait_timeouts = 0;
+    std::atomic<uint64_t> stale_answers_served = 0;
+    std::atomic<uint64_t> stale_entries_refreshed = 0;
+    std::atomic<uint64_t> prefetches_issued = 0;
+    std::atomic<uint64_t> prefetches_completed = 0;
+    LatencyHistogram lookup_latency;
+};
+
+// Hedged UDP queries of a network.
+struct HedgeState {
+    // Hedges which may be sent before the budget is exhausted. Each query adds a fraction of one.
+    double budget = 0;
+    uint64_t sent = 0;
+    uint64_t won = 0;
+    // Hedges which were due, but not sent because of the budget.
+    uint64_t denied = 0;
+
+    // The budget which can be saved up, to allow for short bursts of slow answers.
+    static constexpr double kMaxBudget = 10;
+};
+
+static void counter_add(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+
 struct NetConfig {
     explicit NetConfig(unsigned netId) : netid(netId) {
-        cache = std::make_unique<Cache>();
+        cache = std::make_shared<Cache>();
         dns_event_subsampling_map = resolv_get_dns_event_subsampling_map(false);
         mdns_event_subsampling_map = resolv_get_dns_event_subsampling_map(true);
     }
@@ -1044,14 +1407,27 @@ struct NetConfig {
         return 0;
     }
     const unsigned netid;
-    std::unique_ptr<Cache> cache;
+    // Protects everything in this NetConfig. The cache has its own mutex, which may be taken
+    // while holding this one, but not the other way around.
+    std::mutex mutex;
+    std::shared_ptr<Cache> cache;
+    // The configuration which |cache| is shared under, or empty if it isn't shareable.
+    std::string cache_share_key;
+    // The configuration and boot which the snapshot of the cache is saved for. A snapshot is only
+    // loaded back into a network with the same fingerprint. Empty until the first configuration.
+    std::string snapshot_fingerprint;
+    // Set once the snapshot left by a previous resolver was loaded or discarded. Until then, the
+    // cache isn't saved, so that the snapshot isn't overwritten before it was read.
+    bool snapshot_checked = false;
     std::vector<std::string> nameservers;
     std::vector<IPSockAddr> nameserverSockAddrs;
     int revision_id = 0;  // # times the nameservers have been replaced
     res_params params{};
     res_stats nsstats[MAXNS]{};
     std::vector<std::string> search_domains;
-    int wait_for_pending_req_timeout_count = 0;
+    CacheCounters counters;
+    HedgeState hedge;
+    ServerCapabilities serverCapabilities;
     // Map format: ReturnCode:rate_denom
     std::unordered_map<int, uint32_t> dns_event_subsampling_map;
     std::unordered_map<int, uint32_t> mdns_event_subsampling_map;
@@ -1070,122 +1446,306 @@ struct NetConfig {
     std::vector<std::string> interfaceNames;
 };
 
-/* gets cache associated with a network, or NULL if none exists */
-static Cache* find_named_cache_locked(unsigned netid) REQUIRES(cache_mutex);
-
-// Return true - if there is a pending request in |cache| matching |key|.
-// Return false - if no pending request is found matching the key. Optionally
-//                link a new one if parameter append_if_not_found is true.
-static bool cache_has_pending_request_locked(Cache* cache, const Entry* key,
-                                             bool append_if_not_found) {
-    if (!cache || !key) return false;
-
-    Cache::pending_req_info* ri = cache->pending_requests.next;
-    Cache::pending_req_info* prev = &cache->pending_requests;
-    while (ri) {
-        if (ri->hash == key->hash) {
-            return true;
+// Get a NetConfig associated with a network, or nullptr if not found. The returned reference
+// keeps the NetConfig alive even if the network is deleted concurrently.
+static std::shared_ptr<NetConfig> find_netconfig(unsigned netid) EXCLUDES(netconfig_map_mutex);
+
+// Get the cache of a network, which it may share with other networks.
+static std::shared_ptr<Cache> netconfig_cache(NetConfig* netconfig) EXCLUDES(netconfig->mutex) {
+    std::lock_guard guard(netconfig->mutex);
+    return netconfig->cache;
+}
+
+// Caches which networks may share, by the upstream configuration they were created for. The
+// registry doesn't keep the caches alive; the networks using them do.
+static std::map<std::string, std::weak_ptr<Cache>> sSharedCaches GUARDED_BY(shared_caches_mutex);
+
+// Remove the network from the group sharing its cache. Return true if other networks still use
+// the cache, in which case the caller must drop its reference and decrement |sharers|.
+static bool cache_leave_locked(NetConfig* netconfig)
+        REQUIRES(netconfig->mutex, shared_caches_mutex) {
+    Cache* cache = netconfig->cache.get();
+    if (!netconfig->cache_share_key.empty() && cache->sharers == 1) {
+        sSharedCaches.erase(netconfig->cache_share_key);
+    }
+    netconfig->cache_share_key.clear();
+    return cache->sharers > 1;
+}
+
+// Make the network use the cache shared under |key|, creating it if no other network uses that
+// configuration. An empty |key| gives the network a cache of its own. The entries of a cache
+// which the network stops sharing are kept for the remaining networks.
+static void cache_share_locked(NetConfig* netconfig, const std::string& key)
+        REQUIRES(netconfig->mutex) {
+    if (key == netconfig->cache_share_key) return;
+
+    std::shared_ptr<Cache> old = netconfig->cache;
+    std::shared_ptr<Cache> cache;
+    {
+        std::lock_guard guard(shared_caches_mutex);
+        const bool shared = cache_leave_locked(netconfig);
+        if (auto it = sSharedCaches.find(key); it != sSharedCaches.end()) {
+            cache = it->second.lock();
+        }
+        if (cache != nullptr) {
+            old->sharers--;
+            cache->sharers++;
+        } else if (shared) {
+            old->sharers--;
+            cache = std::make_shared<Cache>();
+        } else {
+            cache = old;
         }
-        prev = ri;
-        ri = ri->next;
+        if (!key.empty()) sSharedCaches[key] = cache;
     }
+    netconfig->cache_share_key = key;
 
-    if (append_if_not_found) {
-        ri = (Cache::pending_req_info*)calloc(1, sizeof(Cache::pending_req_info));
-        if (ri) {
-            ri->hash = key->hash;
-            prev->next = ri;
+    if (cache != old) {
+        // Queries of this network may be leading requests on the old cache, which it won't
+        // complete anymore.
+        std::lock_guard guard(old->mutex);
+        old->flushPendingRequests();
+        netconfig->cache = std::move(cache);
+    }
+}
+
+// Return the in-flight query matching |key|, or nullptr if there is none.
+static std::shared_ptr<InFlightQuery> cache_find_in_flight_locked(Cache* cache, const Entry* key) {
+    auto [it, end] = cache->in_flight.equal_range(key->hash);
+    for (; it != end; ++it) {
+        if (entry_equals(&it->second->key, key)) {
+            return it->second;
         }
     }
-    return false;
+    return nullptr;
 }
 
-// Notify all threads that the cache entry |key| has become available
-static void cache_notify_waiting_tid_locked(struct Cache* cache, const Entry* key) {
-    if (!cache || !key) return;
+// Return the in-flight query matching |key| if there is one, for the caller to wait for it.
+// Otherwise, register a new one for the caller to lead, and return nullptr.
+static std::shared_ptr<InFlightQuery> cache_join_in_flight_locked(Cache* cache, const Entry* key) {
+    if (auto iq = cache_find_in_flight_locked(cache, key); iq != nullptr) {
+        return iq;
+    }
 
-    Cache::pending_req_info* ri = cache->pending_requests.next;
-    Cache::pending_req_info* prev = &cache->pending_requests;
-    while (ri) {
-        if (ri->hash == key->hash) {
-            // remove item from list and destroy
-            prev->next = ri->next;
-            free(ri);
-            cv.notify_all();
+    cache->in_flight.emplace(key->hash, std::make_shared<InFlightQuery>(key));
+    return nullptr;
+}
+
+// Complete the in-flight query matching |key|, if any, and wake up its waiters only. An empty
+// |answer| means that the query failed.
+static void cache_complete_in_flight_locked(Cache* cache, const Entry* key,
+                                            span<const uint8_t> answer) {
+    auto [it, end] = cache->in_flight.equal_range(key->hash);
+    for (; it != end; ++it) {
+        if (entry_equals(&it->second->key, key)) {
+            InFlightQuery* iq = it->second.get();
+            if (!answer.empty()) {
+                iq->answer = std::make_shared<const std::vector<uint8_t>>(answer.begin(),
+                                                                          answer.end());
+            }
+            iq->done = true;
+            iq->cv.notify_all();
+            cache->in_flight.erase(it);
             return;
         }
-        prev = ri;
-        ri = ri->next;
     }
 }
 
+// Where a lookup puts the answer it found: either copied to |buffer|, with its length in
+// |*answerlen|, or, if |shared| is set, handed out by reference.
+struct AnswerSink {
+    span<uint8_t> buffer;
+    int* answerlen = nullptr;
+    ResolvCacheAnswer* shared = nullptr;
+};
+
+// Copy |answer| to |sink|. If |stale| is true, the TTL of its records is lowered to
+// STALE_ANSWER_TTL, so the copy can't be shared with the cache.
+static ResolvCacheStatus answer_sink_copy(const AnswerSink& sink, span<const uint8_t> answer,
+                                          bool stale) {
+    if (sink.shared != nullptr) {
+        auto copy = std::make_shared<std::vector<uint8_t>>(answer.begin(), answer.end());
+        if (stale) answer_setTTL(*copy, STALE_ANSWER_TTL);
+        *sink.shared = std::move(copy);
+        return RESOLV_CACHE_FOUND;
+    }
+
+    *sink.answerlen = answer.size();
+    if (answer.size() > sink.buffer.size()) {
+        /* NOTE: we return UNSUPPORTED if the answer buffer is too short */
+        LOG(INFO) << __func__ << ": ANSWER TOO LONG";
+        return RESOLV_CACHE_UNSUPPORTED;
+    }
+    std::copy(answer.begin(), answer.end(), sink.buffer.begin());
+    if (stale) answer_setTTL(sink.buffer.first(answer.size()), STALE_ANSWER_TTL);
+    return RESOLV_CACHE_FOUND;
+}
+
+// Hand over the answer of the leader of an in-flight query.
+static ResolvCacheStatus in_flight_take_answer(const InFlightQuery* iq, const AnswerSink& sink) {
+    LOG(INFO) << __func__ << ": GOT ANSWER FROM IN-FLIGHT QUERY";
+    if (sink.shared != nullptr) {
+        *sink.shared = iq->answer;
+        return RESOLV_CACHE_FOUND;
+    }
+    return answer_sink_copy(sink, *iq->answer, /*stale=*/false);
+}
+
 void _resolv_cache_query_failed(unsigned netid, span<const uint8_t> query, uint32_t flags) {
     // We should not notify with these flags.
     if (flags & (ANDROID_RESOLV_NO_CACHE_STORE | ANDROID_RESOLV_NO_CACHE_LOOKUP)) {
         return;
     }
     Entry key[1];
+    CacheKeyBuffer keybuf;
 
-    if (!entry_init_key(key, query)) return;
+    if (!entry_init_key(key, query, keybuf)) return;
 
-    std::lock_guard guard(cache_mutex);
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return;
 
-    Cache* cache = find_named_cache_locked(netid);
-
-    if (cache) {
-        cache_notify_waiting_tid_locked(cache, key);
-    }
+    const auto cache = netconfig_cache(netconfig.get());
+    std::lock_guard guard(cache->mutex);
+    cache_complete_in_flight_locked(cache.get(), key, {});
 }
 
-static void cache_dump_mru_locked(Cache* cache) {
-    std::string buf = fmt::format("MRU LIST ({:2d}): ", cache->num_entries);
-    for (Entry* e = cache->mru_list.mru_next; e != &cache->mru_list; e = e->mru_next) {
-        fmt::format_to(std::back_inserter(buf), " {}", e->id);
+static void cache_dump_clock_locked(Cache* cache) {
+    // Listing every entry is O(n), don't do it on the add path unless it is logged.
+    if (!WOULD_LOG(DEBUG)) return;
+
+    std::string buf = fmt::format("CLOCK ({:2d}): ", cache->num_entries);
+    for (const Entry* e : cache->clock) {
+        if (e == nullptr) continue;
+        fmt::format_to(std::back_inserter(buf), " {}{}", e->id, e->referenced ? "*" : "");
     }
 
     LOG(DEBUG) << __func__ << ": " << buf;
 }
 
 /* This function tries to find a key within the hash table
- * In case of success, it will return a *pointer* to the hashed key.
- * In case of failure, it will return a *pointer* to NULL
+ * In case of success, it will return a pointer to the slot holding the key.
+ * In case of failure, it will return a pointer to the empty slot where
+ * the key would be inserted.
  *
- * So, the caller must check '*result' to check for success/failure.
+ * So, the caller must check 'result->entry' to check for success/failure.
+ * If the cache has no table yet, nullptr is returned instead, see _cache_find().
  *
  * The main idea is that the result can later be used directly in
- * calls to resolv_cache_add or _resolv_cache_remove as the 'lookup'
+ * calls to _cache_add_p or _cache_remove_p as the 'lookup'
  * parameter. This makes the code simpler and avoids re-searching
  * for the key position in the htable.
  *
  * The result of a lookup_p is only valid until you alter the hash
- * table.
+ * table; removals move other entries around.
+ */
+static Slot* _cache_lookup_p(Cache* cache, const Entry* key) {
+    // An empty cache may have no table yet, see Cache::setTable().
+    if (cache->slots.empty()) return nullptr;
+    const size_t mask = cache->slots.size() - 1;
+
+    // The table is never full, so this always ends on an empty slot at the latest.
+    for (size_t index = key->hash & mask;; index = (index + 1) & mask) {
+        Slot* slot = &cache->slots[index];
+
+        if (slot->entry == nullptr) return slot;
+
+        if (slot->hash == key->hash && slot->keylen == key->keylen &&
+            entry_equals(slot->entry, key)) {
+            return slot;
+        }
+    }
+}
+
+/* Return the entry of |key|, or nullptr if it isn't in the cache */
+static Entry* _cache_find(Cache* cache, const Entry* key) {
+    const Slot* lookup = _cache_lookup_p(cache, key);
+    return lookup != nullptr ? lookup->entry : nullptr;
+}
+
+/* The expiry heap keeps the entry expiring first at its root. Each entry
+ * knows its position in the heap, so that it can be removed in O(log n)
+ * when it is evicted or replaced before it expires.
  */
-static Entry** _cache_lookup_p(Cache* cache, Entry* key) {
-    int index = key->hash % cache->get_max_cache_entries();
-    Entry** pnode = (Entry**) &cache->entries[index];
+static void _expiry_heap_place(Cache* cache, size_t index, Entry* e) {
+    cache->expiry_heap[index] = e;
+    e->heap_index = index;
+}
 
-    while (*pnode != NULL) {
-        Entry* node = *pnode;
+static void _expiry_heap_sift_up(Cache* cache, size_t index) {
+    Entry* e = cache->expiry_heap[index];
+    while (index > 0) {
+        const size_t parent = (index - 1) / 2;
+        if (cache->expiry_heap[parent]->expires <= e->expires) break;
+        _expiry_heap_place(cache, index, cache->expiry_heap[parent]);
+        index = parent;
+    }
+    _expiry_heap_place(cache, index, e);
+}
 
-        if (node == NULL) break;
+static void _expiry_heap_sift_down(Cache* cache, size_t index) {
+    const size_t size = cache->expiry_heap.size();
+    Entry* e = cache->expiry_heap[index];
+    for (;;) {
+        size_t child = 2 * index + 1;
+        if (child >= size) break;
+        if (child + 1 < size &&
+            cache->expiry_heap[child + 1]->expires < cache->expiry_heap[child]->expires) {
+            child++;
+        }
+        if (e->expires <= cache->expiry_heap[child]->expires) break;
+        _expiry_heap_place(cache, index, cache->expiry_heap[child]);
+        index = child;
+    }
+    _expiry_heap_place(cache, index, e);
+}
 
-        if (node->hash == key->hash && entry_equals(node, key)) break;
+static void _expiry_heap_push(Cache* cache, Entry* e) {
+    cache->expiry_heap.push_back(e);
+    _expiry_heap_sift_up(cache, cache->expiry_heap.size() - 1);
+}
 
-        pnode = &node->hlink;
+static void _expiry_heap_remove(Cache* cache, Entry* e) {
+    const size_t index = e->heap_index;
+    Entry* last = cache->expiry_heap.back();
+    cache->expiry_heap.pop_back();
+    if (last != e) {
+        // Move the last entry into the hole, then restore the heap order in whichever
+        // direction it is broken.
+        _expiry_heap_place(cache, index, last);
+        _expiry_heap_sift_up(cache, index);
+        _expiry_heap_sift_down(cache, last->heap_index);
     }
-    return pnode;
 }
 
 /* Add a new entry to the hash table. 'lookup' must be the
  * result of an immediate previous failed _lookup_p() call
- * (i.e. with *lookup == NULL), and 'e' is the pointer to the
+ * (i.e. with lookup->entry == NULL), and 'e' is the pointer to the
  * newly created entry
  */
-static void _cache_add_p(Cache* cache, Entry** lookup, Entry* e) {
-    *lookup = e;
+static void _cache_add_p(Cache* cache, Slot* lookup, Entry* e) {
+    *lookup = {.entry = e, .hash = e->hash, .keylen = e->keylen};
     e->id = ++cache->last_id;
-    entry_mru_add(e, &cache->mru_list);
+
+    // The caller makes room first, so there is always a free frame here.
+    e->clock_index = cache->free_frames.back();
+    cache->free_frames.pop_back();
+    cache->clock[e->clock_index] = e;
+    _expiry_heap_push(cache, e);
+    entry_for_each_address(e, [cache, e](std::string addr) {
+        cache->addr_index.emplace(std::move(addr), e);
+    });
     cache->num_entries += 1;
+    sCacheBytes += entry_size(e);
+
+    if (cache->admission_filter) {
+        // Entries leave the window in FIFO order, unevicted as long as the cache has room.
+        e->in_window = true;
+        cache->window.push_back(e);
+        while (cache->window.size() > cache->window_capacity()) {
+            cache->window.front()->in_window = false;
+            cache->window.pop_front();
+        }
+    }
 
     LOG(DEBUG) << __func__ << ": entry " << e->id << " added (count=" << cache->num_entries << ")";
 }
@@ -1194,60 +1754,268 @@ static void _cache_add_p(Cache* cache, Entry** lookup, Entry* e) {
  * 'lookup' must be the result of an immediate previous
  * and succesful _lookup_p() call.
  */
-static void _cache_remove_p(Cache* cache, Entry** lookup) {
-    Entry* e = *lookup;
+static void _cache_remove_p(Cache* cache, Slot* lookup) {
+    Entry* e = lookup->entry;
+    const size_t mask = cache->slots.size() - 1;
 
     LOG(DEBUG) << __func__ << ": entry " << e->id << " removed (count=" << cache->num_entries - 1
                << ")";
 
-    entry_mru_remove(e);
-    *lookup = e->hlink;
-    entry_free(e);
+    // Backward shift deletion: move the following entries of the probe sequence into the hole,
+    // unless that would put them before their home slot. This keeps every entry reachable
+    // without tombstones.
+    size_t hole = lookup - cache->slots.data();
+    for (size_t index = (hole + 1) & mask; cache->slots[index].entry != nullptr;
+         index = (index + 1) & mask) {
+        const size_t home = cache->slots[index].hash & mask;
+        if (((index - home) & mask) >= ((index - hole) & mask)) {
+            cache->slots[hole] = cache->slots[index];
+            hole = index;
+        }
+    }
+    cache->slots[hole] = {};
+
+    cache->clock[e->clock_index] = nullptr;
+    cache->free_frames.push_back(e->clock_index);
+    _expiry_heap_remove(cache, e);
+    entry_for_each_address(e, [cache, e](const std::string& addr) {
+        auto [it, end] = cache->addr_index.equal_range(addr);
+        while (it != end) {
+            it = (it->second == e) ? cache->addr_index.erase(it) : std::next(it);
+        }
+    });
+    if (e->in_window) {
+        cache->window.erase(std::find(cache->window.begin(), cache->window.end(), e));
+    }
+    sCacheBytes -= entry_size(e) + entry_shared_size(e);
+    cache->shared_answer_bytes -= entry_shared_size(e);
+    entry_free(&cache->allocator, e);
     cache->num_entries -= 1;
 }
 
-/* Remove the oldest entry from the hash table.
+// Return the answer of |e| as a shared buffer. It is only created on the first call, so entries
+// which are never looked up with resolv_cache_lookup_shared() don't pay for it. The buffer counts
+// towards the byte budgets of the cache, which the next addition makes room for.
+static ResolvCacheAnswer entry_shared_answer(Cache* cache, Entry* e) REQUIRES(cache->mutex) {
+    if (e->shared_answer == nullptr) {
+        e->shared_answer = new ResolvCacheAnswer(
+                std::make_shared<const std::vector<uint8_t>>(e->answer, e->answer + e->answerlen));
+        cache->shared_answer_bytes += entry_shared_size(e);
+        sCacheBytes += entry_shared_size(e);
+    }
+    return *e->shared_answer;
+}
+
+/* Return the entry of the main region chosen by the CLOCK algorithm, or
+ * nullptr if that region is empty. Entries which were hit since the hand
+ * last passed them get a second chance, so this approximates the least
+ * recently used entry.
  */
-static void _cache_remove_oldest(Cache* cache) {
-    Entry* oldest = cache->mru_list.mru_prev;
-    Entry** lookup = _cache_lookup_p(cache, oldest);
+static Entry* _cache_clock_victim(Cache* cache) {
+    if (static_cast<size_t>(cache->num_entries) == cache->window.size()) return nullptr;
 
-    if (*lookup == NULL) { /* should not happen */
-        LOG(INFO) << __func__ << ": OLDEST NOT IN HTABLE ?";
-        return;
+    // Terminates within two rounds: the first one clears all referenced bits.
+    for (;;) {
+        Entry* e = cache->clock[cache->clock_hand];
+        cache->clock_hand = (cache->clock_hand + 1) % cache->clock.size();
+
+        if (e == nullptr || e->in_window) continue;
+        if (e->referenced) {
+            e->referenced = false;
+            continue;
+        }
+        return e;
     }
-    LOG(DEBUG) << __func__ << ": Cache full - removing oldest";
-    res_pquery(std::span(oldest->query, oldest->querylen));
+}
+
+/* Evict an entry of the hash table, return false if it isn't there */
+static bool _cache_evict(Cache* cache, Entry* e) {
+    Slot* lookup = _cache_lookup_p(cache, e);
+    if (lookup == nullptr || lookup->entry == NULL) { /* should not happen */
+        LOG(INFO) << __func__ << ": VICTIM NOT IN HTABLE ?";
+        return false;
+    }
+    LOG(DEBUG) << __func__ << ": Cache full - removing victim";
+    res_pquery(std::span(e->query, e->querylen));
     _cache_remove_p(cache, lookup);
+    return true;
 }
 
-/* Remove all expired entries from the hash table.
+/* Remove all expired entries from the hash table, and return how many
+ * were removed.
  */
-static void _cache_remove_expired(Cache* cache) {
-    Entry* e;
+static int _cache_remove_expired(Cache* cache) {
     time_t now = _time_now();
+    int removed = 0;
 
-    for (e = cache->mru_list.mru_next; e != &cache->mru_list;) {
-        // Entry is old, remove
+    // Only the expired entries are visited, from the root of the expiry heap.
+    while (!cache->expiry_heap.empty() && now >= cache->expiry_heap[0]->expires) {
+        Slot* lookup = _cache_lookup_p(cache, cache->expiry_heap[0]);
+        if (lookup == nullptr || lookup->entry == NULL) { /* should not happen */
+            LOG(INFO) << __func__ << ": ENTRY NOT IN HTABLE ?";
+            break;
+        }
+        _cache_remove_p(cache, lookup);
+        removed++;
+    }
+    return removed;
+}
+
+static bool entry_is_stale(const Cache* cache, const Entry* e, time_t now) {
+    return now >= e->expires && now < e->expires + cache->stale_window_sec;
+}
+
+/* copy a stale entry to 'sink', with the TTL of its records
+ * lowered to STALE_ANSWER_TTL */
+static ResolvCacheStatus cache_serve_stale_locked(NetConfig* netconfig, const Entry* e,
+                                                  const AnswerSink& sink) {
+    const ResolvCacheStatus status =
+            answer_sink_copy(sink, std::span(e->answer, e->answerlen), /*stale=*/true);
+    if (status != RESOLV_CACHE_FOUND) return status;
+    counter_add(netconfig->counters.stale_answers_served);
+
+    LOG(INFO) << __func__ << ": FOUND STALE ENTRY IN CACHE entry=" << e;
+    return RESOLV_CACHE_FOUND;
+}
+
+/* return true if a hit on a given entry should trigger a refresh-ahead prefetch */
+static bool cache_should_prefetch_locked(Cache* cache, Entry* e, time_t now) {
+    if (cache->prefetch_threshold_pct == 0 || e->prefetching || e->hits < PREFETCH_MIN_HITS) {
+        return false;
+    }
+    if ((e->expires - now) * 100 > static_cast<time_t>(e->ttl) * cache->prefetch_threshold_pct) {
+        return false;
+    }
+    if (!sPrefetchBudget.trySpend()) {
+        LOG(DEBUG) << __func__ << ": prefetch budget exhausted";
+        return false;
+    }
+    e->prefetching = true;
+    return true;
+}
+
+// Wait up to the stale answer timeout for |iq|, the refresh of a stale entry. Return the status of
+// handing its answer to |sink| if it brought one. Otherwise, return nothing, and the caller looks
+// the entry up again.
+static std::optional<ResolvCacheStatus> cache_wait_refresh_locked(
+        NetConfig* netconfig, Cache* cache, std::unique_lock<std::mutex>& lock,
+        const std::shared_ptr<InFlightQuery>& iq, const AnswerSink& sink) REQUIRES(cache->mutex) {
+    counter_add(netconfig->counters.coalesced_waits);
+    iq->cv.wait_for(lock, std::chrono::milliseconds(cache->stale_answer_timeout_ms),
+                    [&iq]() { return iq->done; });
+    if (iq->answer != nullptr) {
+        return in_flight_take_answer(iq.get(), sink);
+    }
+    return std::nullopt;
+}
+
+// The part of resolv_cache_lookup() which runs with the lock of |cache| held. The lock is released
+// while waiting for an in-flight query.
+static ResolvCacheStatus cache_lookup_locked(NetConfig* netconfig, Cache* cache,
+                                             std::unique_lock<std::mutex>& lock, const Entry* key,
+                                             const AnswerSink& sink, bool* prefetch, bool* stale)
+        REQUIRES(cache->mutex) {
+    Slot* lookup;
+    Entry* e;
+    time_t now;
+
+    /* see the description of _lookup_p to understand this.
+     * the slot is only NULL if the cache has no table yet.
+     */
+    lookup = _cache_lookup_p(cache, key);
+    e = lookup != nullptr ? lookup->entry : NULL;
+
+    if (e == NULL) {
+        LOG(DEBUG) << __func__ << ": NOT IN CACHE";
+
+        const auto iq = cache_join_in_flight_locked(cache, key);
+        if (iq == nullptr) {
+            return RESOLV_CACHE_NOTFOUND;
+        }
+
+        LOG(INFO) << __func__ << ": Waiting for previous request";
+        counter_add(netconfig->counters.coalesced_waits);
+        // wait until (1) timeout OR
+        //            (2) the leader completes the in-flight query.
+        // If the network is deleted meanwhile, its cache is flushed, which also completes it.
+        const bool ret = iq->cv.wait_for(lock, std::chrono::seconds(PENDING_REQUEST_TIMEOUT),
+                                         [&iq]() { return iq->done; });
+        if (ret == false) {
+            counter_add(netconfig->counters.coalesced_wait_timeouts);
+        }
+        if (iq->answer != nullptr) {
+            return in_flight_take_answer(iq.get(), sink);
+        }
+        lookup = _cache_lookup_p(cache, key);
+        e = lookup != nullptr ? lookup->entry : NULL;
+        if (e == NULL) {
+            return RESOLV_CACHE_NOTFOUND;
+        }
+    }
+
+    now = _time_now();
+
+    if (entry_is_stale(cache, e, now)) {
+        // Answer right away if the upstream servers recently failed to refresh this entry.
+        // Otherwise, either this request refreshes it, or it waits for the request which is
+        // already doing so, up to the stale answer timeout.
+        if (now < e->stale_recheck) {
+            return cache_serve_stale_locked(netconfig, e, sink);
+        }
+        const auto iq = cache_join_in_flight_locked(cache, key);
+        if (iq == nullptr) {
+            LOG(DEBUG) << __func__ << ": NOT IN CACHE (STALE ENTRY " << e << " REFRESHING)";
+            if (stale != nullptr) *stale = true;
+            return RESOLV_CACHE_NOTFOUND;
+        }
+        if (const auto status = cache_wait_refresh_locked(netconfig, cache, lock, iq, sink)) {
+            return *status;
+        }
+        lookup = _cache_lookup_p(cache, key);
+        e = lookup != nullptr ? lookup->entry : NULL;
+        if (e == NULL) {
+            return RESOLV_CACHE_NOTFOUND;
+        }
+        now = _time_now();
         if (now >= e->expires) {
-            Entry** lookup = _cache_lookup_p(cache, e);
-            if (*lookup == NULL) { /* should not happen */
-                LOG(INFO) << __func__ << ": ENTRY NOT IN HTABLE ?";
-                return;
-            }
-            e = e->mru_next;
-            _cache_remove_p(cache, lookup);
-        } else {
-            e = e->mru_next;
+            return cache_serve_stale_locked(netconfig, e, sink);
         }
     }
+
+    /* remove stale entries here */
+    if (now >= e->expires) {
+        LOG(DEBUG) << __func__ << ": NOT IN CACHE (STALE ENTRY " << e << "DISCARDED)";
+        res_pquery(std::span(e->query, e->querylen));
+        _cache_remove_p(cache, lookup);
+        counter_add(netconfig->counters.stale_discards);
+        return RESOLV_CACHE_NOTFOUND;
+    }
+
+    if (sink.shared != nullptr) {
+        *sink.shared = entry_shared_answer(cache, e);
+    } else {
+        const ResolvCacheStatus status =
+                answer_sink_copy(sink, std::span(e->answer, e->answerlen), /*stale=*/false);
+        if (status != RESOLV_CACHE_FOUND) return status;
+    }
+
+    /* give this entry a second chance the next time the CLOCK hand passes */
+    e->referenced = true;
+    e->hits++;
+
+    if (prefetch != nullptr && cache_should_prefetch_locked(cache, e, now)) {
+        LOG(DEBUG) << __func__ << ": prefetching entry " << e->id;
+        counter_add(netconfig->counters.prefetches_issued);
+        *prefetch = true;
+    }
+
+    LOG(INFO) << __func__ << ": FOUND IN CACHE entry=" << e;
+    return RESOLV_CACHE_FOUND;
 }
 
-// Get a NetConfig associated with a network, or nullptr if not found.
-static NetConfig* find_netconfig_locked(unsigned netid) REQUIRES(cache_mutex);
-
-ResolvCacheStatus resolv_cache_lookup(unsigned netid, span<const uint8_t> query,
-                                      span<uint8_t> answer, int* answerlen, uint32_t flags) {
+static ResolvCacheStatus cache_lookup(unsigned netid, span<const uint8_t> query,
+                                      const AnswerSink& sink, uint32_t flags, bool* prefetch,
+                                      bool* stale) {
     // Skip cache lookup, return RESOLV_CACHE_NOTFOUND directly so that it is
     // possible to cache the answer of this query.
     // If ANDROID_RESOLV_NO_CACHE_STORE is set, return RESOLV_CACHE_SKIP to skip possible cache
@@ -1257,155 +2025,284 @@ ResolvCacheStatus resolv_cache_lookup(unsigned netid, span<const uint8_t> query,
     if (flags & (ANDROID_RESOLV_NO_CACHE_LOOKUP | ANDROID_RESOLV_NO_CACHE_STORE)) {
         return flags & ANDROID_RESOLV_NO_CACHE_STORE ? RESOLV_CACHE_SKIP : RESOLV_CACHE_NOTFOUND;
     }
+    const auto start = std::chrono::steady_clock::now();
     Entry key;
-    Entry** lookup;
-    Entry* e;
-    time_t now;
+    CacheKeyBuffer keybuf;
 
     LOG(DEBUG) << __func__ << ": lookup";
 
     /* we don't cache malformed queries */
-    if (!entry_init_key(&key, query)) {
+    if (!entry_init_key(&key, query, keybuf)) {
         LOG(INFO) << __func__ << ": unsupported query";
         return RESOLV_CACHE_UNSUPPORTED;
     }
     /* lookup cache */
-    std::unique_lock lock(cache_mutex);
-    android::base::ScopedLockAssertion assume_lock(cache_mutex);
-    Cache* cache = find_named_cache_locked(netid);
-    if (cache == nullptr) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) {
         return RESOLV_CACHE_UNSUPPORTED;
     }
+    const auto shared_cache = netconfig_cache(netconfig.get());
+    Cache* cache = shared_cache.get();
+    std::unique_lock lock(cache->mutex);
+    android::base::ScopedLockAssertion assume_lock(cache->mutex);
 
-    /* see the description of _lookup_p to understand this.
-     * the function always return a non-NULL pointer.
-     */
-    lookup = _cache_lookup_p(cache, &key);
-    e = *lookup;
+    if (cache->prefetch_threshold_pct > 0) {
+        sPrefetchBudget.earn(cache->prefetch_budget_pct);
+    }
+    if (cache->admission_filter) {
+        cache->sketch.increment(key.hash);
+    }
 
-    if (e == NULL) {
-        LOG(DEBUG) << __func__ << ": NOT IN CACHE";
+    const ResolvCacheStatus status =
+            cache_lookup_locked(netconfig.get(), cache, lock, &key, sink, prefetch, stale);
+    lock.unlock();
 
-        if (!cache_has_pending_request_locked(cache, &key, true)) {
-            return RESOLV_CACHE_NOTFOUND;
-        }
+    CacheCounters& counters = netconfig->counters;
+    counter_add(counters.lookups);
+    if (status == RESOLV_CACHE_FOUND) {
+        counter_add(counters.hits);
+    } else if (status == RESOLV_CACHE_NOTFOUND) {
+        counter_add(counters.misses);
+    }
+    counters.lookup_latency.record(std::chrono::steady_clock::now() - start);
+    return status;
+}
 
-        LOG(INFO) << __func__ << ": Waiting for previous request";
-        // wait until (1) timeout OR
-        //            (2) cv is notified AND no pending request matching the |key|
-        // (cv notifier should delete pending request before sending notification.)
-        const bool ret = cv.wait_for(lock, std::chrono::seconds(PENDING_REQUEST_TIMEOUT),
-                                [netid, &cache, &key]() REQUIRES(cache_mutex) {
-                                    // Must update cache as it could have been deleted
-                                    cache = find_named_cache_locked(netid);
-                                    return !cache_has_pending_request_locked(cache, &key, false);
-                                });
-        if (!cache) {
-            return RESOLV_CACHE_NOTFOUND;
-        }
-        if (ret == false) {
-            NetConfig* info = find_netconfig_locked(netid);
-            if (info != NULL) {
-                info->wait_for_pending_req_timeout_count++;
-            }
-        }
-        lookup = _cache_lookup_p(cache, &key);
-        e = *lookup;
-        if (e == NULL) {
-            return RESOLV_CACHE_NOTFOUND;
-        }
+ResolvCacheStatus resolv_cache_lookup(unsigned netid, span<const uint8_t> query,
+                                      span<uint8_t> answer, int* answerlen, uint32_t flags,
+                                      bool* prefetch) {
+    return cache_lookup(netid, query, {.buffer = answer, .answerlen = answerlen}, flags, prefetch,
+                        /*stale=*/nullptr);
+}
+
+ResolvCacheStatus resolv_cache_lookup_shared(unsigned netid, span<const uint8_t> query,
+                                             ResolvCacheAnswer* answer, uint32_t flags,
+                                             bool* prefetch, bool* stale) {
+    return cache_lookup(netid, query, {.shared = answer}, flags, prefetch, stale);
+}
+
+ResolvCacheStatus resolv_cache_wait_refresh(unsigned netid, span<const uint8_t> query,
+                                            span<uint8_t> answer, int* answerlen) {
+    Entry key;
+    CacheKeyBuffer keybuf;
+    if (!entry_init_key(&key, query, keybuf)) {
+        return RESOLV_CACHE_UNSUPPORTED;
     }
 
-    now = _time_now();
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) {
+        return RESOLV_CACHE_UNSUPPORTED;
+    }
+    const auto shared_cache = netconfig_cache(netconfig.get());
+    Cache* cache = shared_cache.get();
+    std::unique_lock lock(cache->mutex);
+    android::base::ScopedLockAssertion assume_lock(cache->mutex);
 
-    /* remove stale entries here */
-    if (now >= e->expires) {
-        LOG(DEBUG) << __func__ << ": NOT IN CACHE (STALE ENTRY " << *lookup << "DISCARDED)";
-        res_pquery(std::span(e->query, e->querylen));
-        _cache_remove_p(cache, lookup);
+    const AnswerSink sink = {.buffer = answer, .answerlen = answerlen};
+    bool timedOut = false;
+    if (const auto iq = cache_find_in_flight_locked(cache, &key); iq != nullptr) {
+        if (const auto status = cache_wait_refresh_locked(netconfig.get(), cache, lock, iq, sink)) {
+            return *status;
+        }
+        timedOut = !iq->done;
+    }
+
+    Entry* e = _cache_find(cache, &key);
+    if (e == NULL) {
         return RESOLV_CACHE_NOTFOUND;
     }
+    const time_t now = _time_now();
+    if (now < e->expires) {
+        return answer_sink_copy(sink, std::span(e->answer, e->answerlen), /*stale=*/false);
+    }
+    // If the refresh is taking longer than the timeout, the lookups which come meanwhile are
+    // answered right away, rather than each waiting for it again.
+    if (timedOut) e->stale_recheck = now + STALE_FAILURE_RECHECK_TIMEOUT;
+    return cache_serve_stale_locked(netconfig.get(), e, sink);
+}
 
-    *answerlen = e->answerlen;
-    if (e->answerlen > static_cast<ptrdiff_t>(answer.size())) {
-        /* NOTE: we return UNSUPPORTED if the answer buffer is too short */
-        LOG(INFO) << __func__ << ": ANSWER TOO LONG";
+ResolvCacheStatus resolv_cache_lookup_stale(unsigned netid, span<const uint8_t> query,
+                                            span<uint8_t> answer, int* answerlen, uint32_t flags) {
+    if (flags & (ANDROID_RESOLV_NO_CACHE_LOOKUP | ANDROID_RESOLV_NO_CACHE_STORE)) {
+        return RESOLV_CACHE_SKIP;
+    }
+    Entry key;
+    CacheKeyBuffer keybuf;
+
+    if (!entry_init_key(&key, query, keybuf)) {
         return RESOLV_CACHE_UNSUPPORTED;
     }
 
-    memcpy(answer.data(), e->answer, e->answerlen);
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) {
+        return RESOLV_CACHE_UNSUPPORTED;
+    }
+    const auto shared_cache = netconfig_cache(netconfig.get());
+    Cache* cache = shared_cache.get();
+    std::lock_guard guard(cache->mutex);
 
-    /* bump up this entry to the top of the MRU list */
-    if (e != cache->mru_list.mru_next) {
-        entry_mru_remove(e);
-        entry_mru_add(e, &cache->mru_list);
+    Entry* e = _cache_find(cache, &key);
+    const time_t now = _time_now();
+    if (e == NULL || !entry_is_stale(cache, e, now)) {
+        return RESOLV_CACHE_NOTFOUND;
     }
 
-    LOG(INFO) << __func__ << ": FOUND IN CACHE entry=" << e;
-    return RESOLV_CACHE_FOUND;
+    // Don't make the following lookups wait for the upstream servers again for a while.
+    e->stale_recheck = now + STALE_FAILURE_RECHECK_TIMEOUT;
+    return cache_serve_stale_locked(netconfig.get(), e,
+                                    {.buffer = answer, .answerlen = answerlen});
 }
 
-int resolv_cache_add(unsigned netid, span<const uint8_t> query, span<const uint8_t> answer) {
+void resolv_cache_prefetch_failed(unsigned netid, span<const uint8_t> query) {
+    Entry key;
+    CacheKeyBuffer keybuf;
+    if (!entry_init_key(&key, query, keybuf)) return;
+
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return;
+    const auto cache = netconfig_cache(netconfig.get());
+    std::lock_guard guard(cache->mutex);
+    if (Entry* e = _cache_find(cache.get(), &key); e != nullptr) {
+        e->prefetching = false;
+    }
+}
+
+// Evict one entry of a full cache. Without the admission filter, that's the CLOCK victim. With
+// it, the oldest entry of the admission window competes with the CLOCK victim of the main region
+// once the window is full, and the one which was looked up less often is evicted.
+static bool cache_evict_one_locked(NetConfig* netconfig, Cache* cache) REQUIRES(cache->mutex) {
+    Entry* victim = _cache_clock_victim(cache);
+
+    if (!cache->window.empty() &&
+        (victim == nullptr || cache->window.size() >= cache->window_capacity())) {
+        Entry* candidate = cache->window.front();
+        if (victim == nullptr) {
+            victim = candidate;
+        } else if (cache->sketch.frequency(candidate->hash) >
+                   cache->sketch.frequency(victim->hash)) {
+            cache->window.pop_front();
+            candidate->in_window = false;
+        } else {
+            victim = candidate;
+            counter_add(netconfig->counters.admissions_rejected);
+        }
+    }
+
+    if (victim == nullptr || !_cache_evict(cache, victim)) return false;
+    counter_add(netconfig->counters.evicted_for_room);
+    return true;
+}
+
+// Make room for a new entry of |size| bytes within the entry and byte budgets. Return false if
+// the entry can't be cached.
+static bool cache_make_room_locked(NetConfig* netconfig, Cache* cache, size_t size)
+        REQUIRES(cache->mutex) {
+    if (!cache->fits(size)) return false;
+
+    if (cache->isFull(size)) {
+        counter_add(netconfig->counters.evicted_expired, _cache_remove_expired(cache));
+    }
+    // Only the entries of this cache can be evicted, so don't evict any if the global budget is
+    // held by the other caches.
+    if (cache->max_total_bytes > 0 &&
+        sCacheBytes - cache->bytes() + size > cache->max_total_bytes) {
+        return false;
+    }
+    while (cache->isFull(size)) {
+        if (!cache_evict_one_locked(netconfig, cache)) return false;
+    }
+    return true;
+}
+
+/* add an answer to the cache. if 'refresh' is true, an existing entry
+ * for the same query is replaced, otherwise -EEXIST is returned */
+static int cache_add(unsigned netid, span<const uint8_t> query, span<const uint8_t> answer,
+                     bool refresh) {
     Entry key[1];
+    CacheKeyBuffer keybuf;
     Entry* e;
-    Entry** lookup;
+    Slot* lookup;
     uint32_t ttl;
-    Cache* cache = NULL;
 
     /* don't assume that the query has already been cached
      */
-    if (!entry_init_key(key, query)) {
+    if (!entry_init_key(key, query, keybuf)) {
         LOG(INFO) << __func__ << ": passed invalid query?";
         return -EINVAL;
     }
 
-    std::lock_guard guard(cache_mutex);
-
-    cache = find_named_cache_locked(netid);
-    if (cache == nullptr) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) {
         return -ENONET;
     }
+    const auto shared_cache = netconfig_cache(netconfig.get());
+    Cache* cache = shared_cache.get();
+    // The table of an empty cache is built before taking the lock, so that its lookups don't
+    // wait for the allocation. If another thread installs one first, this one is freed after the
+    // lock is released.
+    std::optional<CacheTable> table;
+    if (!cache->has_table) table = cache->newTable();
+    std::lock_guard guard(cache->mutex);
+    if (table.has_value()) cache->setTable(std::move(*table));
+    if (!cache->has_table) {
+        // The cache was flushed meanwhile. Leave the answer out rather than allocate a table
+        // with the lock held.
+        cache_complete_in_flight_locked(cache, key, answer);
+        return 0;
+    }
 
+    // With a table, the slot is never NULL.
     lookup = _cache_lookup_p(cache, key);
-    e = *lookup;
+    e = lookup->entry;
+
+    // A stale entry being refreshed, an expired one that nobody looked up since, or a
+    // prefetched one.
+    if (e != NULL && (refresh || _time_now() >= e->expires)) {
+        if (entry_is_stale(cache, e, _time_now())) {
+            counter_add(netconfig->counters.stale_entries_refreshed);
+        } else if (refresh) {
+            counter_add(netconfig->counters.prefetches_completed);
+        }
+        _cache_remove_p(cache, lookup);
+        lookup = _cache_lookup_p(cache, key);
+        e = lookup->entry;
+    }
 
     // Should only happen on ANDROID_RESOLV_NO_CACHE_LOOKUP
     if (e != NULL) {
         LOG(INFO) << __func__ << ": ALREADY IN CACHE (" << e << ") ? IGNORING ADD";
-        cache_notify_waiting_tid_locked(cache, key);
+        cache_complete_in_flight_locked(cache, key, answer);
         return -EEXIST;
     }
 
-    if (cache->num_entries >= cache->get_max_cache_entries()) {
-        _cache_remove_expired(cache);
-        if (cache->num_entries >= cache->get_max_cache_entries()) {
-            _cache_remove_oldest(cache);
-        }
-        // TODO: It looks useless, remove below code after having test to prove it.
-        lookup = _cache_lookup_p(cache, key);
-        e = *lookup;
-        if (e != NULL) {
-            LOG(INFO) << __func__ << ": ALREADY IN CACHE (" << e << ") ? IGNORING ADD";
-            cache_notify_waiting_tid_locked(cache, key);
-            return -EEXIST;
-        }
-    }
-
     ttl = answer_getTTL(answer);
-    if (ttl > 0) {
-        e = entry_alloc(key, answer);
+    if (ttl > 0 && cache_make_room_locked(netconfig.get(), cache,
+                                          sizeof(Entry) + key->querylen + answer.size() +
+                                                  key->keylen)) {
+        // Removals shift entries around in the table, so the slot must be looked up again.
+        lookup = _cache_lookup_p(cache, key);
+        e = entry_alloc(&cache->allocator, key, answer);
         if (e != NULL) {
             e->expires = ttl + _time_now();
+            e->ttl = ttl;
             _cache_add_p(cache, lookup, e);
         }
     }
 
-    cache_dump_mru_locked(cache);
-    cache_notify_waiting_tid_locked(cache, key);
+    cache_dump_clock_locked(cache);
+    cache_complete_in_flight_locked(cache, key, answer);
 
     return 0;
 }
 
+int resolv_cache_add(unsigned netid, span<const uint8_t> query, span<const uint8_t> answer) {
+    return cache_add(netid, query, answer, false);
+}
+
+int resolv_cache_refresh(unsigned netid, span<const uint8_t> query, span<const uint8_t> answer) {
+    return cache_add(netid, query, answer, true);
+}
+
 bool resolv_gethostbyaddr_from_cache(unsigned netid, char domain_name[], size_t domain_name_size,
                                      const char* ip_address, int af) {
     if (domain_name_size > NS_MAXDNAME) {
@@ -1419,126 +2316,406 @@ bool resolv_gethostbyaddr_from_cache(unsigned netid, char domain_name[], size_t
         return false;
     }
 
-    Cache* cache = nullptr;
-    Entry* node = nullptr;
-
-    ns_rr rr;
-    ns_msg handle;
-    ns_rr rr_query;
-
-    struct sockaddr_in sa;
-    struct sockaddr_in6 sa6;
-    char* addr_buf = nullptr;
-
-    std::lock_guard guard(cache_mutex);
-
-    cache = find_named_cache_locked(netid);
-    if (cache == nullptr) {
+    in6_addr addr;
+    if (inet_pton(af, ip_address, &addr) != 1) {
+        LOG(WARNING) << __func__ << ": inet_pton() fail";
         return false;
     }
+    const std::string key(reinterpret_cast<const char*>(&addr),
+                          af == AF_INET ? sizeof(in_addr) : sizeof(in6_addr));
 
-    for (node = cache->mru_list.mru_next; node != nullptr && node != &cache->mru_list;
-         node = node->mru_next) {
-        if (node->answer == nullptr) {
-            continue;
-        }
-
-        memset(&handle, 0, sizeof(handle));
-
-        if (ns_initparse(node->answer, node->answerlen, &handle) < 0) {
-            continue;
-        }
-
-        for (int n = 0; n < ns_msg_count(handle, ns_s_an); n++) {
-            memset(&rr, 0, sizeof(rr));
-
-            if (ns_parserr(&handle, ns_s_an, n, &rr)) {
-                continue;
-            }
-
-            if (ns_rr_type(rr) == ns_t_a && af == AF_INET) {
-                addr_buf = (char*)&(sa.sin_addr);
-            } else if (ns_rr_type(rr) == ns_t_aaaa && af == AF_INET6) {
-                addr_buf = (char*)&(sa6.sin6_addr);
-            } else {
-                continue;
-            }
-
-            if (inet_pton(af, ip_address, addr_buf) != 1) {
-                LOG(WARNING) << __func__ << ": inet_pton() fail";
-                return false;
-            }
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) {
+        return false;
+    }
+    const auto shared_cache = netconfig_cache(netconfig.get());
+    Cache* cache = shared_cache.get();
+    std::lock_guard guard(cache->mutex);
 
-            if (memcmp(ns_rr_rdata(rr), addr_buf, ns_rr_rdlen(rr)) == 0) {
-                int query_count = ns_msg_count(handle, ns_s_qd);
-                for (int i = 0; i < query_count; i++) {
-                    memset(&rr_query, 0, sizeof(rr_query));
-                    if (ns_parserr(&handle, ns_s_qd, i, &rr_query)) {
-                        continue;
-                    }
-                    strlcpy(domain_name, ns_rr_name(rr_query), domain_name_size);
-                    if (domain_name[0] != '\0') {
-                        return true;
-                    }
-                }
-            }
+    auto [it, end] = cache->addr_index.equal_range(key);
+    for (; it != end; ++it) {
+        if (entry_get_qname(it->second, domain_name, domain_name_size)) {
+            return true;
         }
     }
 
     return false;
 }
 
-static std::unordered_map<unsigned, std::unique_ptr<NetConfig>> sNetConfigMap
-        GUARDED_BY(cache_mutex);
+static std::unordered_map<unsigned, std::shared_ptr<NetConfig>> sNetConfigMap
+        GUARDED_BY(netconfig_map_mutex);
 
 // Clears nameservers set for |netconfig| and clears the stats
-static void free_nameservers_locked(NetConfig* netconfig);
+static void free_nameservers_locked(NetConfig* netconfig) REQUIRES(netconfig->mutex);
 // Order-insensitive comparison for the two set of servers.
 static bool resolv_is_nameservers_equal(const std::vector<std::string>& oldServers,
                                         const std::vector<std::string>& newServers);
 // clears the stats samples contained withing the given netconfig.
-static void res_cache_clear_stats_locked(NetConfig* netconfig);
+static void res_cache_clear_stats_locked(NetConfig* netconfig) REQUIRES(netconfig->mutex);
 
 // public API for netd to query if name server is set on specific netid
 bool resolv_has_nameservers(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
-    return (info != nullptr) && (info->nameserverCount() > 0);
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return false;
+    std::lock_guard guard(info->mutex);
+    return info->nameserverCount() > 0;
+}
+
+// Cache snapshots let a restarted resolver start with a warm cache. The cache of each network is
+// saved to its own file, which is a SnapshotHeader, the fingerprint of the network, and then
+// |num_records| records. A record is a SnapshotRecord followed by the query and the answer. The
+// fingerprint and each record are padded to a multiple of 8 bytes so that the file can be read in
+// place once mmap()ed. The files are written in host byte order and are only meant to be read
+// back by the same device.
+//
+// NetIds are given to other networks after a restart, so a snapshot is only loaded once the
+// network it is found for is configured, and only if its fingerprint, made of the upstream
+// configuration and the interfaces of the network, matches. Otherwise it is discarded. The
+// expiry times are those of the cache, in wall-clock time, so a snapshot outlives a reboot, but
+// none of its entries outlive their TTL.
+constexpr char CACHE_SNAPSHOT_MAGIC[8] = {'D', 'N', 'S', 'C', 'A', 'C', 'H', 'E'};
+constexpr uint32_t CACHE_SNAPSHOT_VERSION = 2;
+constexpr char CACHE_SNAPSHOT_DIR_DEFAULT[] = "/data/misc/apexdata/com.android.resolv";
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_records;
+    int64_t saved_at;
+    uint32_t fingerprint_len;
+    uint32_t reserved;
+};
+
+struct SnapshotRecord {
+    int64_t expires;
+    uint32_t ttl;
+    uint32_t querylen;
+    uint32_t answerlen;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SnapshotHeader) % 8 == 0 && sizeof(SnapshotRecord) % 8 == 0);
+
+// Serializes the snapshot files, and protects the snapshot directory.
+static std::mutex snapshot_mutex;
+static std::string sSnapshotDir GUARDED_BY(snapshot_mutex) = CACHE_SNAPSHOT_DIR_DEFAULT;
+
+static int snapshot_interval_sec() {
+    return Experiments::getInstance()->getFlag("cache_snapshot_interval_sec", 0);
 }
 
-int resolv_create_cache_for_net(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    if (sNetConfigMap.find(netid) != sNetConfigMap.end()) {
-        LOG(ERROR) << __func__ << ": Cache is already created, netId: " << netid;
-        return -EEXIST;
+static std::string snapshot_path_locked(unsigned netid) REQUIRES(snapshot_mutex) {
+    return fmt::format("{}/cache_{}.snap", sSnapshotDir, netid);
+}
+
+static size_t snapshot_align(size_t size) {
+    return (size + 7) & ~size_t{7};
+}
+
+// Return the fingerprint which the snapshot of a network configured with |configKey|, see
+// cache_config_key(), on |interfaceNames| is saved with. The interfaces tell apart the networks
+// whose servers have the same private addresses.
+static std::string snapshot_fingerprint(const std::string& configKey,
+                                        const std::vector<std::string>& interfaceNames) {
+    const std::set<std::string> interfaces(interfaceNames.begin(), interfaceNames.end());
+    return fmt::format("{};interfaces={}", configKey, fmt::join(interfaces, ","));
+}
+
+// Serialize the entries of |cache| which haven't expired yet.
+static std::string cache_snapshot_locked(const Cache* cache, const std::string& fingerprint,
+                                         time_t now) {
+    std::string buf(sizeof(SnapshotHeader), '\0');
+    buf.append(fingerprint);
+    buf.resize(snapshot_align(buf.size()), '\0');
+    uint32_t count = 0;
+
+    for (const Entry* e : cache->clock) {
+        if (e == nullptr || now >= e->expires) continue;
+
+        const SnapshotRecord record = {
+                .expires = e->expires,
+                .ttl = e->ttl,
+                .querylen = static_cast<uint32_t>(e->querylen),
+                .answerlen = static_cast<uint32_t>(e->answerlen),
+        };
+        buf.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        buf.append(reinterpret_cast<const char*>(e->query), e->querylen);
+        buf.append(reinterpret_cast<const char*>(e->answer), e->answerlen);
+        buf.resize(snapshot_align(buf.size()), '\0');
+        count++;
+    }
+
+    SnapshotHeader header = {
+            .version = CACHE_SNAPSHOT_VERSION,
+            .num_records = count,
+            .saved_at = now,
+            .fingerprint_len = static_cast<uint32_t>(fingerprint.size()),
+    };
+    memcpy(header.magic, CACHE_SNAPSHOT_MAGIC, sizeof(header.magic));
+    memcpy(buf.data(), &header, sizeof(header));
+    return buf;
+}
+
+// Replace the snapshot of |netid| with |data|. The file is written aside and renamed so that a
+// crash never leaves a truncated snapshot behind. Only the resolver can read it, as it tells
+// which names were looked up.
+static int snapshot_write_locked(unsigned netid, const std::string& data) REQUIRES(snapshot_mutex) {
+    const std::string path = snapshot_path_locked(netid);
+    const std::string tmp = path + ".tmp";
+
+    android::base::unique_fd fd(
+            open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600));
+    if (fd == -1 || fchmod(fd, 0600) == -1 || !android::base::WriteStringToFd(data, fd)) {
+        const int err = errno;
+        PLOG(WARNING) << __func__ << ": failed to write " << tmp;
+        unlink(tmp.c_str());
+        return -err;
+    }
+    if (rename(tmp.c_str(), path.c_str()) == -1) {
+        const int err = errno;
+        PLOG(WARNING) << __func__ << ": failed to rename " << tmp;
+        unlink(tmp.c_str());
+        return -err;
+    }
+    return 0;
+}
+
+int resolv_cache_save_snapshots() {
+    std::vector<std::pair<unsigned, std::shared_ptr<NetConfig>>> netconfigs;
+    {
+        std::shared_lock guard(netconfig_map_mutex);
+        netconfigs.assign(sNetConfigMap.begin(), sNetConfigMap.end());
+    }
+
+    std::lock_guard guard(snapshot_mutex);
+    int rv = 0;
+    for (const auto& [netid, netconfig] : netconfigs) {
+        // The network may have been deleted since. As resolv_delete_cache_for_net() removes the
+        // snapshot with snapshot_mutex held, checking this here is enough not to resurrect it.
+        if (find_netconfig(netid) != netconfig) continue;
+
+        std::string data;
+        {
+            std::lock_guard netGuard(netconfig->mutex);
+            // The snapshot of the previous resolver hasn't been checked yet.
+            if (!netconfig->snapshot_checked) continue;
+            std::lock_guard cacheGuard(netconfig->cache->mutex);
+            data = cache_snapshot_locked(netconfig->cache.get(), netconfig->snapshot_fingerprint,
+                                         _time_now());
+        }
+        if (const int err = snapshot_write_locked(netid, data); err < 0) {
+            rv = err;
+        }
+    }
+    return rv;
+}
+
+void resolv_cache_set_snapshot_dir(const std::string& dir) {
+    std::lock_guard guard(snapshot_mutex);
+    sSnapshotDir = dir.empty() ? CACHE_SNAPSHOT_DIR_DEFAULT : dir;
+}
+
+static void snapshot_remove_locked(unsigned netid) REQUIRES(snapshot_mutex) {
+    const std::string path = snapshot_path_locked(netid);
+    if (unlink(path.c_str()) == -1 && errno != ENOENT) {
+        PLOG(WARNING) << __func__ << ": failed to remove " << path;
+    }
+}
+
+static void snapshot_remove(unsigned netid) {
+    std::lock_guard guard(snapshot_mutex);
+    snapshot_remove_locked(netid);
+}
+
+// Add the entries of the snapshot of |netid| which haven't expired yet to its cache, if it was
+// saved with |fingerprint|. Otherwise, it was saved by another network, and is removed. The TTLs
+// of the answers are reduced by the time elapsed since they were received, so that the entries
+// expire when they would have without the restart.
+static void snapshot_load_locked(unsigned netid, const std::string& fingerprint)
+        REQUIRES(snapshot_mutex) {
+    const std::string path = snapshot_path_locked(netid);
+    android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+        if (errno != ENOENT) PLOG(WARNING) << __func__ << ": failed to open " << path;
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(SnapshotHeader))) {
+        LOG(WARNING) << __func__ << ": invalid snapshot " << path;
+        return;
+    }
+    const size_t size = st.st_size;
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        PLOG(WARNING) << __func__ << ": failed to map " << path;
+        return;
     }
+    const span<const uint8_t> data(static_cast<const uint8_t*>(addr), size);
+
+    SnapshotHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, CACHE_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CACHE_SNAPSHOT_VERSION) {
+        LOG(WARNING) << __func__ << ": unsupported snapshot " << path;
+        munmap(addr, size);
+        return;
+    }
+    const size_t fingerprintLen = header.fingerprint_len;
+    if (size - sizeof(header) < fingerprintLen ||
+        std::string_view(reinterpret_cast<const char*>(data.data()) + sizeof(header),
+                         fingerprintLen) != fingerprint) {
+        LOG(INFO) << __func__ << ": discarding the snapshot of another network " << path;
+        munmap(addr, size);
+        snapshot_remove_locked(netid);
+        return;
+    }
+
+    const time_t now = _time_now();
+    std::vector<uint8_t> answer;
+    size_t offset = std::min(size, snapshot_align(sizeof(header) + fingerprintLen));
+    int loaded = 0;
+    for (uint32_t i = 0; i < header.num_records; i++) {
+        SnapshotRecord record;
+        if (size - offset < sizeof(record)) break;
+        memcpy(&record, data.data() + offset, sizeof(record));
+        offset += sizeof(record);
+        const size_t len = size_t{record.querylen} + record.answerlen;
+        if (size - offset < len) break;
+
+        const auto query = data.subspan(offset, record.querylen);
+        answer.assign(data.begin() + offset + record.querylen, data.begin() + offset + len);
+        offset = std::min(size, offset + snapshot_align(len));
+
+        if (record.expires <= now || record.expires - record.ttl > now) continue;
+        const uint32_t elapsed = now - (record.expires - record.ttl);
+        answer_updateTTL(answer,
+                         [elapsed](uint32_t ttl) { return ttl > elapsed ? ttl - elapsed : 0; });
+        if (resolv_cache_add(netid, query, answer) == 0) loaded++;
+    }
+    munmap(addr, size);
+
+    LOG(INFO) << __func__ << ": loaded " << loaded << " entries of " << header.num_records
+              << " from " << path;
+}
+
+// Load the snapshot of the network of |netconfig|, unless that was already done, and let its cache
+// be saved from now on. Holding snapshot_mutex meanwhile keeps the snapshot from being written
+// before it is read.
+static void snapshot_load(NetConfig* netconfig) EXCLUDES(netconfig->mutex) {
+    std::lock_guard guard(snapshot_mutex);
+    std::string fingerprint;
+    {
+        std::lock_guard netGuard(netconfig->mutex);
+        if (netconfig->snapshot_checked) return;
+        fingerprint = netconfig->snapshot_fingerprint;
+    }
+    snapshot_load_locked(netconfig->netid, fingerprint);
+    std::lock_guard netGuard(netconfig->mutex);
+    netconfig->snapshot_checked = true;
+}
+
+// Start the thread saving the snapshots of all the caches every cache_snapshot_interval_sec.
+static void snapshot_start_writer() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        std::thread([] {
+            android::netdutils::setThreadName("CacheSnapshot");
+            while (true) {
+                const int interval = snapshot_interval_sec();
+                std::this_thread::sleep_for(std::chrono::seconds(interval > 0 ? interval : 60));
+                if (interval > 0) resolv_cache_save_snapshots();
+            }
+        }).detach();
+    });
+}
 
-    sNetConfigMap[netid] = std::make_unique<NetConfig>(netid);
+int resolv_create_cache_for_net(unsigned netid) {
+    {
+        std::lock_guard guard(netconfig_map_mutex);
+        if (sNetConfigMap.find(netid) != sNetConfigMap.end()) {
+            LOG(ERROR) << __func__ << ": Cache is already created, netId: " << netid;
+            return -EEXIST;
+        }
+        sNetConfigMap[netid] = std::make_shared<NetConfig>(netid);
+    }
 
+    // The snapshot of the network, if any, is loaded once it is configured.
+    if (snapshot_interval_sec() > 0) snapshot_start_writer();
     return 0;
 }
 
 void resolv_delete_cache_for_net(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    sNetConfigMap.erase(netid);
+    std::shared_ptr<NetConfig> netconfig;
+    {
+        std::lock_guard guard(netconfig_map_mutex);
+        auto it = sNetConfigMap.find(netid);
+        if (it == sNetConfigMap.end()) return;
+        netconfig = std::move(it->second);
+        sNetConfigMap.erase(it);
+    }
+
+    // Threads which looked up the NetConfig before it was removed from the map may still be
+    // waiting for pending requests. Flushing the cache wakes them up. If other networks share the
+    // cache, only fail the pending requests, which this network may have been leading.
+    {
+        std::lock_guard guard(netconfig->mutex);
+        bool shared;
+        {
+            std::lock_guard sharedGuard(shared_caches_mutex);
+            shared = cache_leave_locked(netconfig.get());
+            if (shared) netconfig->cache->sharers--;
+        }
+        std::lock_guard cacheGuard(netconfig->cache->mutex);
+        if (shared) {
+            netconfig->cache->flushPendingRequests();
+        } else {
+            netconfig->cache->flush();
+        }
+    }
+
+    // The netId may later be given to another network, which must not inherit this cache.
+    snapshot_remove(netid);
 }
 
-int resolv_flush_cache_for_net(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
+// Return the networks which use |cache|.
+static std::vector<std::shared_ptr<NetConfig>> cache_sharers(const Cache* cache) {
+    std::vector<std::shared_ptr<NetConfig>> netconfigs;
+    {
+        std::shared_lock guard(netconfig_map_mutex);
+        for (const auto& [_, netconfig] : sNetConfigMap) netconfigs.push_back(netconfig);
+    }
+    std::erase_if(netconfigs, [cache](const auto& netconfig) {
+        return netconfig_cache(netconfig.get()).get() != cache;
+    });
+    return netconfigs;
+}
 
-    NetConfig* netconfig = find_netconfig_locked(netid);
+int resolv_flush_cache_for_net(unsigned netid) {
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) {
         return -ENONET;
     }
-    netconfig->cache->flush();
+    // This flushes the cache of all the networks which share it, so the flush is counted for each
+    // of them. They are found before locking this network, as their locks can't be nested.
+    const std::vector<std::shared_ptr<NetConfig>> sharers =
+            cache_sharers(netconfig_cache(netconfig.get()).get());
+
+    std::lock_guard guard(netconfig->mutex);
+    {
+        std::lock_guard cacheGuard(netconfig->cache->mutex);
+        for (const auto& sharer : sharers) {
+            counter_add(sharer->counters.evicted_flushed, netconfig->cache->num_entries);
+        }
+        netconfig->cache->flush();
+    }
 
     // Also clear the NS statistics.
-    res_cache_clear_stats_locked(netconfig);
+    res_cache_clear_stats_locked(netconfig.get());
     return 0;
 }
 
 std::vector<unsigned> resolv_list_caches() {
-    std::lock_guard guard(cache_mutex);
+    std::lock_guard guard(netconfig_map_mutex);
     std::vector<unsigned> result;
     result.reserve(sNetConfigMap.size());
     for (const auto& [netId, _] : sNetConfigMap) {
@@ -1547,23 +2724,22 @@ std::vector<unsigned> resolv_list_caches() {
     return result;
 }
 
-static Cache* find_named_cache_locked(unsigned netid) {
-    NetConfig* info = find_netconfig_locked(netid);
-    if (info != nullptr) return info->cache.get();
-    return nullptr;
-}
-
-static NetConfig* find_netconfig_locked(unsigned netid) {
+static std::shared_ptr<NetConfig> find_netconfig(unsigned netid) {
+    // This is on the path of every cache lookup, so only take the lock in shared mode. Not using
+    // std::shared_lock because it isn't annotated for thread safety analysis.
+    netconfig_map_mutex.lock_shared();
+    std::shared_ptr<NetConfig> netconfig;
     if (auto it = sNetConfigMap.find(netid); it != sNetConfigMap.end()) {
-        return it->second.get();
+        netconfig = it->second;
     }
-    return nullptr;
+    netconfig_map_mutex.unlock_shared();
+    return netconfig;
 }
 
 android::net::NetworkType resolv_get_network_types_for_net(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return android::net::NT_UNKNOWN;
+    std::lock_guard guard(netconfig->mutex);
     return convert_network_type(netconfig->transportTypes);
 }
 
@@ -1577,9 +2753,9 @@ bool is_mdns_supported_transport_types(const std::vector<int32_t>& transportType
 }
 
 bool is_mdns_supported_network(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return false;
+    std::lock_guard guard(netconfig->mutex);
     return is_mdns_supported_transport_types(netconfig->transportTypes);
 }
 
@@ -1629,11 +2805,11 @@ bool isValidServer(const std::string& server) {
 }  // namespace
 
 std::vector<std::string> getCustomizedTableByName(const size_t netid, const char* hostname) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
 
     std::vector<std::string> result;
     if (netconfig != nullptr) {
+        std::lock_guard guard(netconfig->mutex);
         const auto& hosts = netconfig->customizedTable.equal_range(hostname);
         for (auto i = hosts.first; i != hosts.second; ++i) {
             result.push_back(i->second);
@@ -1643,11 +2819,72 @@ std::vector<std::string> getCustomizedTableByName(const size_t netid, const char
 }
 
 std::vector<std::string> resolv_get_interface_names(int netid) {
-    std::lock_guard guard(cache_mutex);
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return {};
+    std::lock_guard guard(netconfig->mutex);
+    return netconfig->interfaceNames;
+}
 
-    NetConfig* netconfig = find_netconfig_locked(netid);
-    if (netconfig != nullptr) return netconfig->interfaceNames;
-    return {};
+// Return true if |server| is a global unicast address. Private, loopback, link-local and shared
+// (RFC 6598) addresses may reach a different server, with its own view of the names, on each
+// network.
+static bool is_global_server(const std::string& server) {
+    const addrinfo hints = {.ai_flags = AI_NUMERICHOST, .ai_family = AF_UNSPEC};
+    addrinfo* result = nullptr;
+    if (getaddrinfo(server.c_str(), nullptr, &hints, &result) != 0) return false;
+    const std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> cleanup(result, freeaddrinfo);
+
+    uint32_t v4;
+    if (result->ai_family == AF_INET6) {
+        const in6_addr& a6 = reinterpret_cast<const sockaddr_in6*>(result->ai_addr)->sin6_addr;
+        if (!IN6_IS_ADDR_V4MAPPED(&a6)) {
+            return !IN6_IS_ADDR_UNSPECIFIED(&a6) && !IN6_IS_ADDR_LOOPBACK(&a6) &&
+                   !IN6_IS_ADDR_LINKLOCAL(&a6) && !IN6_IS_ADDR_SITELOCAL(&a6) &&
+                   !IN6_IS_ADDR_MULTICAST(&a6) && (a6.s6_addr[0] & 0xfe) != 0xfc;
+        }
+        memcpy(&v4, &a6.s6_addr[12], sizeof(v4));
+    } else {
+        v4 = reinterpret_cast<const sockaddr_in*>(result->ai_addr)->sin_addr.s_addr;
+    }
+    const uint32_t a = ntohl(v4);
+    const auto in = [a](uint32_t prefix, int len) {
+        return (a >> (32 - len)) == (prefix >> (32 - len));
+    };
+    return !in(0x00000000, 8) && !in(0x0a000000, 8) && !in(0x7f000000, 8) &&
+           !in(0x64400000, 10) && !in(0xa9fe0000, 16) && !in(0xac100000, 12) &&
+           !in(0xc0a80000, 16) && !in(0xe0000000, 4);
+}
+
+// Return a key which is equal for the same cleartext and private DNS configuration.
+static std::string cache_config_key(const ResolverParamsParcel& params) {
+    const std::set<std::string> servers(params.servers.begin(), params.servers.end());
+    const std::set<std::string> tlsServers(params.tlsServers.begin(), params.tlsServers.end());
+    std::string key = fmt::format("servers={};tls={};tlsName={};domains={}",
+                                  fmt::join(servers, ","), fmt::join(tlsServers, ","),
+                                  params.tlsName, fmt::join(filter_domains(params.domains), ","));
+    if (params.dohParams.has_value()) {
+        const auto& doh = params.dohParams.value();
+        const std::set<std::string> ips(doh.ips.begin(), doh.ips.end());
+        key += fmt::format(";doh={},{},{},{}", doh.name, fmt::join(ips, ","), doh.dohpath,
+                           doh.port);
+    }
+    return key;
+}
+
+// Return a key which is equal for the networks whose answers can be shared: they send the same
+// queries through the same cleartext and private DNS servers. The order of the servers doesn't
+// matter, since any of them may answer a query. The key is empty if the configuration has a
+// server which isn't global, see is_global_server(), as the same address may then be a different
+// server on each network.
+static std::string cache_share_key(const ResolverParamsParcel& params) {
+    const auto isGlobal = [](const std::vector<std::string>& servers) {
+        return std::all_of(servers.begin(), servers.end(), is_global_server);
+    };
+    if (!isGlobal(params.servers) || !isGlobal(params.tlsServers) ||
+        (params.dohParams.has_value() && !isGlobal(params.dohParams->ips))) {
+        return "";
+    }
+    return cache_config_key(params);
 }
 
 int resolv_set_nameservers(const ResolverParamsParcel& params) {
@@ -1666,10 +2903,9 @@ int resolv_set_nameservers(const ResolverParamsParcel& params) {
         ipSockAddrs.push_back(IPSockAddr::toIPSockAddr(server, 53));
     }
 
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
-
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return -ENONET;
+    std::unique_lock guard(netconfig->mutex);
 
     uint8_t old_max_samples = netconfig->params.max_samples;
 
@@ -1696,7 +2932,7 @@ int resolv_set_nameservers(const ResolverParamsParcel& params) {
 
     if (!resolv_is_nameservers_equal(netconfig->nameservers, params.servers)) {
         // free current before adding new
-        free_nameservers_locked(netconfig);
+        free_nameservers_locked(netconfig.get());
         netconfig->nameservers = std::move(nameservers);
         for (int i = 0; i < numservers; i++) {
             LOG(INFO) << __func__ << ": netid = " << netid
@@ -1710,7 +2946,7 @@ int resolv_set_nameservers(const ResolverParamsParcel& params) {
             // All other parameters do not affect shared state: Changing these parameters does
             // not invalidate the samples, as they only affect aggregation and the conditions
             // under which servers are considered usable.
-            res_cache_clear_stats_locked(netconfig);
+            res_cache_clear_stats_locked(netconfig.get());
         }
     }
 
@@ -1728,18 +2964,36 @@ int resolv_set_nameservers(const ResolverParamsParcel& params) {
     netconfig->metered = params.meteredNetwork;
     netconfig->interfaceNames = std::move(params.interfaceNames);
 
+    // Networks with the same upstream configuration may share a cache. A network whose
+    // configuration changes leaves its group, keeping the entries for the other networks.
+    const bool share =
+            Experiments::getInstance()->getFlag("cache_share_between_networks", 0) != 0;
+    cache_share_locked(netconfig.get(), share ? cache_share_key(params) : "");
+
+    int rv = 0;
     if (params.resolverOptions.has_value()) {
-        return netconfig->setOptions(params.resolverOptions.value());
+        rv = netconfig->setOptions(params.resolverOptions.value());
     }
 
-    return 0;
+    // The snapshot which a previous resolver left for this netId is only used if it was saved
+    // for the same configuration, now that it is known.
+    netconfig->snapshot_fingerprint =
+            snapshot_fingerprint(cache_config_key(params), netconfig->interfaceNames);
+    if (!netconfig->snapshot_checked) {
+        if (snapshot_interval_sec() > 0) {
+            guard.unlock();
+            snapshot_load(netconfig.get());
+        } else {
+            netconfig->snapshot_checked = true;
+        }
+    }
+    return rv;
 }
 
 int resolv_set_options(unsigned netid, const ResolverOptionsParcel& options) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
-
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return -ENONET;
+    std::lock_guard guard(netconfig->mutex);
     return netconfig->setOptions(options);
 }
 
@@ -1768,9 +3022,9 @@ void resolv_populate_res_for_net(ResState* statp) {
     }
     LOG(DEBUG) << __func__ << ": netid=" << statp->netid;
 
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(statp->netid);
+    const auto info = find_netconfig(statp->netid);
     if (info == nullptr) return;
+    std::lock_guard guard(info->mutex);
 
     const bool sortNameservers = Experiments::getInstance()->getFlag("sort_nameservers", 0);
     statp->sort_nameservers = sortNameservers;
@@ -1816,9 +3070,9 @@ int android_net_res_stats_get_info_for_net(unsigned netid, int* nscount,
                                            char domains[MAXDNSRCH][MAXDNSRCHPATH],
                                            res_params* params, struct res_stats stats[MAXNS],
                                            int* wait_for_pending_req_timeout_count) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
+    const auto info = find_netconfig(netid);
     if (!info) return -1;
+    std::lock_guard guard(info->mutex);
 
     const int num = info->nameserverCount();
     if (num > MAXNS) {
@@ -1839,15 +3093,15 @@ int android_net_res_stats_get_info_for_net(unsigned netid, int* nscount,
     *nscount = num;
     *dcount = static_cast<int>(info->search_domains.size());
     *params = info->params;
-    *wait_for_pending_req_timeout_count = info->wait_for_pending_req_timeout_count;
+    *wait_for_pending_req_timeout_count = info->counters.coalesced_wait_timeouts;
 
     return info->revision_id;
 }
 
 std::vector<std::string> resolv_cache_dump_subsampling_map(unsigned netid, bool is_mdns) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return {};
+    std::lock_guard guard(netconfig->mutex);
     std::vector<std::string> result;
     const auto& subsampling_map = (!is_mdns) ? netconfig->dns_event_subsampling_map
                                              : netconfig->mdns_event_subsampling_map;
@@ -1867,9 +3121,9 @@ std::vector<std::string> resolv_cache_dump_subsampling_map(unsigned netid, bool
 //
 // Returns the subsampling rate if the event should be sampled, or 0 if it should be discarded.
 uint32_t resolv_cache_get_subsampling_denom(unsigned netid, int return_code, bool is_mdns) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return 0;  // Don't log anything at all.
+    std::lock_guard guard(netconfig->mutex);
     const auto& subsampling_map = (!is_mdns) ? netconfig->dns_event_subsampling_map
                                              : netconfig->mdns_event_subsampling_map;
     auto search_returnCode = subsampling_map.find(return_code);
@@ -1885,12 +3139,12 @@ uint32_t resolv_cache_get_subsampling_denom(unsigned netid, int return_code, boo
 
 int resolv_cache_get_resolver_stats(unsigned netid, res_params* params, res_stats stats[MAXNS],
                                     const std::vector<IPSockAddr>& serverSockAddrs) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
+    const auto info = find_netconfig(netid);
     if (!info) {
         LOG(WARNING) << __func__ << ": NetConfig for netid " << netid << " not found";
         return -1;
     }
+    std::lock_guard guard(info->mutex);
 
     for (size_t i = 0; i < serverSockAddrs.size(); i++) {
         for (size_t j = 0; j < info->nameserverSockAddrs.size(); j++) {
@@ -1920,10 +3174,11 @@ void resolv_cache_add_resolver_stats_sample(unsigned netid, int revision_id,
                                             const res_sample& sample, int max_samples) {
     if (max_samples <= 0) return;
 
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return;
 
-    if (info && info->revision_id == revision_id) {
+    std::lock_guard guard(info->mutex);
+    if (info->revision_id == revision_id) {
         const int serverNum = std::min(MAXNS, static_cast<int>(info->nameserverSockAddrs.size()));
         for (int ns = 0; ns < serverNum; ns++) {
             if (serverSockAddr == info->nameserverSockAddrs[ns]) {
@@ -1935,29 +3190,30 @@ void resolv_cache_add_resolver_stats_sample(unsigned netid, int revision_id,
 }
 
 bool has_named_cache(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    return find_named_cache_locked(netid) != nullptr;
+    return find_netconfig(netid) != nullptr;
 }
 
 int resolv_cache_get_expiration(unsigned netid, span<const uint8_t> query, time_t* expiration) {
     Entry key;
+    CacheKeyBuffer keybuf;
     *expiration = -1;
 
     // A malformed query is not allowed.
-    if (!entry_init_key(&key, query)) {
+    if (!entry_init_key(&key, query, keybuf)) {
         LOG(WARNING) << __func__ << ": unsupported query";
         return -EINVAL;
     }
 
     // lookup cache.
-    Cache* cache;
-    std::lock_guard guard(cache_mutex);
-    if (cache = find_named_cache_locked(netid); cache == nullptr) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) {
         LOG(WARNING) << __func__ << ": cache not created in the network " << netid;
         return -ENONET;
     }
-    Entry** lookup = _cache_lookup_p(cache, &key);
-    Entry* e = *lookup;
+    const auto shared_cache = netconfig_cache(netconfig.get());
+    Cache* cache = shared_cache.get();
+    std::lock_guard guard(cache->mutex);
+    Entry* e = _cache_find(cache, &key);
     if (e == NULL) {
         LOG(WARNING) << __func__ << ": not in cache";
         return -ENODATA;
@@ -1974,14 +3230,13 @@ int resolv_cache_get_expiration(unsigned netid, span<const uint8_t> query, time_
 
 int resolv_stats_set_addrs(unsigned netid, Protocol proto, const std::vector<std::string>& addrs,
                            int port) {
-    std::lock_guard guard(cache_mutex);
-    const auto info = find_netconfig_locked(netid);
-
+    const auto info = find_netconfig(netid);
     if (info == nullptr) {
         LOG(WARNING) << __func__ << ": Network " << netid << " not found for "
                      << Protocol_Name(proto);
         return -ENONET;
     }
+    std::lock_guard guard(info->mutex);
 
     std::vector<IPSockAddr> sockAddrs;
     sockAddrs.reserve(addrs.size());
@@ -2002,13 +3257,122 @@ bool resolv_stats_add(unsigned netid, const android::netdutils::IPSockAddr& serv
                       const DnsQueryEvent* record) {
     if (record == nullptr) return false;
 
-    std::lock_guard guard(cache_mutex);
-    if (const auto info = find_netconfig_locked(netid); info != nullptr) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::lock_guard guard(info->mutex);
         return info->dnsStats.addStats(server, *record);
     }
     return false;
 }
 
+std::optional<std::chrono::microseconds> resolv_stats_get_udp_timeout(unsigned netid,
+                                                                      const IPSockAddr& server) {
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return std::nullopt;
+    std::lock_guard guard(info->mutex);
+    return info->dnsStats.getRetransmissionTimeoutUs(server, PROTO_UDP);
+}
+
+// How long what is learned of a server is kept, or 0 if it isn't.
+static std::chrono::seconds server_capability_ttl() {
+    return std::chrono::seconds(
+            std::max(Experiments::getInstance()->getFlag("server_capability_ttl_sec", 0), 0));
+}
+
+std::optional<ServerCapabilities::Record> resolv_get_server_capabilities(unsigned netid,
+                                                                        const IPSockAddr& server) {
+    if (server_capability_ttl() == std::chrono::seconds(0)) return std::nullopt;
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return std::nullopt;
+    std::lock_guard guard(info->mutex);
+    return info->serverCapabilities.get(server, ServerCapabilities::Clock::now());
+}
+
+void resolv_record_edns_rejected(unsigned netid, const IPSockAddr& server) {
+    const auto ttl = server_capability_ttl();
+    if (ttl == std::chrono::seconds(0)) return;
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return;
+    std::lock_guard guard(info->mutex);
+    info->serverCapabilities.recordEdnsRejected(server, ServerCapabilities::Clock::now(), ttl);
+}
+
+// Return the UDP payload size advertised by the OPT record of |answer|, or 0 if it has none.
+static uint16_t edns_udp_payload_size(span<const uint8_t> answer) {
+    ns_msg handle;
+    if (ns_initparse(answer.data(), answer.size(), &handle) < 0) return 0;
+    for (int n = 0; n < ns_msg_count(handle, ns_s_ar); n++) {
+        ns_rr rr;
+        if (ns_parserr(&handle, ns_s_ar, n, &rr) < 0) return 0;
+        if (ns_rr_type(rr) == ns_t_opt) return ns_rr_class(rr);
+    }
+    return 0;
+}
+
+void resolv_record_udp_answer(unsigned netid, const IPSockAddr& server,
+                              span<const uint8_t> answer) {
+    const auto ttl = server_capability_ttl();
+    if (ttl == std::chrono::seconds(0)) return;
+    const bool truncated = reinterpret_cast<const HEADER*>(answer.data())->tc;
+    const uint16_t udpPayloadSize = edns_udp_payload_size(answer);
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return;
+    std::lock_guard guard(info->mutex);
+    info->serverCapabilities.recordUdpAnswer(server, truncated, udpPayloadSize,
+                                             ServerCapabilities::Clock::now(), ttl);
+}
+
+void resolv_record_tcp_connect(unsigned netid, const IPSockAddr& server, bool connected) {
+    const auto ttl = server_capability_ttl();
+    if (ttl == std::chrono::seconds(0)) return;
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return;
+    std::lock_guard guard(info->mutex);
+    info->serverCapabilities.recordTcpConnect(server, connected, ServerCapabilities::Clock::now(),
+                                              ttl);
+}
+
+std::optional<std::chrono::microseconds> resolv_hedge_delay(unsigned netid,
+                                                            const IPSockAddr& server,
+                                                            int percentile, int budgetPct) {
+    // Below this many answers, the percentile is too noisy to be worth hedging on.
+    constexpr size_t kMinSamples = 8;
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return std::nullopt;
+    std::lock_guard guard(info->mutex);
+    HedgeState& hedge = info->hedge;
+    hedge.budget = std::min(hedge.budget + budgetPct / 100.0, HedgeState::kMaxBudget);
+    return info->dnsStats.getLatencyPercentileUs(server, PROTO_UDP, percentile, kMinSamples);
+}
+
+bool resolv_hedge_spend(unsigned netid) {
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return false;
+    std::lock_guard guard(info->mutex);
+    HedgeState& hedge = info->hedge;
+    if (hedge.budget < 1) {
+        hedge.denied++;
+        return false;
+    }
+    hedge.budget -= 1;
+    hedge.sent++;
+    return true;
+}
+
+void resolv_hedge_refund(unsigned netid) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::lock_guard guard(info->mutex);
+        info->hedge.budget += 1;
+        info->hedge.sent--;
+    }
+}
+
+void resolv_hedge_won(unsigned netid) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::lock_guard guard(info->mutex);
+        info->hedge.won++;
+    }
+}
+
 static const char* tc_mode_to_str(const int mode) {
     switch (mode) {
         case aidl::android::net::IDnsResolver::TC_MODE_DEFAULT:
@@ -2107,37 +3471,124 @@ static const char* transport_type_to_str(const std::vector<int32_t>& transportTy
 }
 
 void resolv_netconfig_dump(DumpWriter& dw, unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    if (const auto info = find_netconfig_locked(netid); info != nullptr) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::lock_guard guard(info->mutex);
         info->dnsStats.dump(dw);
+        info->serverCapabilities.dump(dw, ServerCapabilities::Clock::now());
         // TODO: dump info->hosts
         dw.println("TC mode: %s", tc_mode_to_str(info->tc_mode));
         dw.println("TransportType: %s", transport_type_to_str(info->transportTypes));
         dw.println("Metered: %s", info->metered ? "true" : "false");
+        const HedgeState& hedge = info->hedge;
+        if (hedge.sent > 0 || hedge.denied > 0) {
+            dw.println(fmt::format("Hedged UDP queries: {} sent, {} won ({:.1f}%), {} denied by "
+                                   "budget",
+                                   hedge.sent, hedge.won,
+                                   hedge.sent > 0 ? 100.0 * hedge.won / hedge.sent : 0.0,
+                                   hedge.denied));
+        }
+        const CacheCounters& counters = info->counters;
+        Cache* cache = info->cache.get();
+        {
+            std::lock_guard sharedGuard(shared_caches_mutex);
+            if (cache->sharers > 1) {
+                dw.println("Cache shared with %d other networks", cache->sharers - 1);
+            }
+        }
+        std::lock_guard cacheGuard(cache->mutex);
+        dw.println(fmt::format("Serve-stale window: {}s, stale answers served: {}, stale entries "
+                               "refreshed: {}",
+                               cache->stale_window_sec, counters.stale_answers_served.load(),
+                               counters.stale_entries_refreshed.load()));
+        dw.println(fmt::format("Prefetch threshold: {}%, prefetches issued: {}, prefetches "
+                               "completed: {}",
+                               cache->prefetch_threshold_pct, counters.prefetches_issued.load(),
+                               counters.prefetches_completed.load()));
+        const SlabAllocator::Stats& mem = cache->allocator.stats();
+        dw.println("Cache memory: %zu bytes requested, %zu bytes used, %zu bytes reserved "
+                   "(%zu slabs, %zu large allocations), %zu bytes of shared answers",
+                   mem.requested_bytes, mem.used_bytes, mem.reserved_bytes, mem.slabs,
+                   mem.large_allocations, cache->shared_answer_bytes);
+        const uint64_t lookups = counters.lookups;
+        const uint64_t hits = counters.hits;
+        dw.println(fmt::format("Cache lookups: {}, hits: {}, misses: {}, hit ratio: {:.1f}%, stale "
+                               "discards: {}, coalesced waits: {} ({} timed out)",
+                               lookups, hits, counters.misses.load(),
+                               lookups > 0 ? 100.0 * hits / lookups : 0.0,
+                               counters.stale_discards.load(), counters.coalesced_waits.load(),
+                               counters.coalesced_wait_timeouts.load()));
+        dw.println("Cache budget: %d/%d entries, %zu/%zu bytes, %zu bytes in all caches (limit "
+                   "%zu), admission filter: %s",
+                   cache->num_entries, cache->get_max_cache_entries(), cache->bytes(),
+                   cache->max_bytes, sCacheBytes.load(), cache->max_total_bytes,
+                   cache->admission_filter ? "on" : "off");
+        dw.println(fmt::format("Cache evictions: {} for room, {} expired, {} flushed, admissions "
+                               "rejected: {}",
+                               counters.evicted_for_room.load(), counters.evicted_expired.load(),
+                               counters.evicted_flushed.load(),
+                               counters.admissions_rejected.load()));
+        std::vector<std::string> latency;
+        for (int i = 0; i < LatencyHistogram::kBuckets; i++) {
+            if (const uint64_t count = counters.lookup_latency.count(i); count > 0) {
+                const bool last = i == LatencyHistogram::kBuckets - 1;
+                latency.push_back(fmt::format("{}{}us: {}", last ? ">=" : "<",
+                                              last ? 1 << (i - 1) : 1 << i, count));
+            }
+        }
+        dw.println("Cache lookup latency: %s", android::base::Join(latency, ", ").c_str());
+    }
+}
+
+int resolv_cache_get_stats(unsigned netid, CacheStatsParcel* stats) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) {
+        return -ENONET;
     }
+    const CacheCounters& counters = netconfig->counters;
+    stats->lookups = counters.lookups;
+    stats->hits = counters.hits;
+    stats->misses = counters.misses;
+    stats->staleDiscards = counters.stale_discards;
+    stats->evictedForRoom = counters.evicted_for_room;
+    stats->evictedExpired = counters.evicted_expired;
+    stats->evictedFlushed = counters.evicted_flushed;
+    stats->admissionsRejected = counters.admissions_rejected;
+    stats->coalescedWaits = counters.coalesced_waits;
+    stats->lookupLatencyHistogram.clear();
+    for (int i = 0; i < LatencyHistogram::kBuckets; i++) {
+        stats->lookupLatencyHistogram.push_back(counters.lookup_latency.count(i));
+    }
+
+    stats->coalescedWaitTimeouts = counters.coalesced_wait_timeouts;
+
+    // The gauges are only consistent with the cache under its lock.
+    const auto cache = netconfig_cache(netconfig.get());
+    std::lock_guard guard(cache->mutex);
+    stats->entries = cache->num_entries;
+    stats->bytes = cache->bytes();
+    return 0;
 }
 
 int resolv_get_max_cache_entries(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
+    const auto info = find_netconfig(netid);
     if (!info) {
         LOG(WARNING) << __func__ << ": NetConfig for netid " << netid << " not found";
         return -1;
     }
-    return info->cache->get_max_cache_entries();
+    return netconfig_cache(info.get())->get_max_cache_entries();
 }
 
 bool resolv_is_enforceDnsUid_enabled_network(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    if (const auto info = find_netconfig_locked(netid); info != nullptr) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::lock_guard guard(info->mutex);
         return info->enforceDnsUid;
     }
     return false;
 }
 
 bool resolv_is_metered_network(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    if (const auto info = find_netconfig_locked(netid); info != nullptr) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::lock_guard guard(info->mutex);
         return info->metered;
     }
     return false;
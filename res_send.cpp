@@ -76,6 +76,7 @@
 
 #define LOG_TAG "resolv"
 
+#include <algorithm>
 #include <chrono>
 
 #include <sys/param.h>
@@ -96,6 +97,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <span>
+#include <thread>
 
 #include <android-base/logging.h>
 #include <android-base/result.h>
@@ -106,7 +108,12 @@
 #include "DnsTlsDispatcher.h"
 #include "DnsTlsTransport.h"
 #include "Experiments.h"
+#include "LookupExecutor.h"
+#include "MdnsEngine.h"
 #include "PrivateDnsConfiguration.h"
+#include "TcpConnectionPool.h"
+#include "UdpQueryEngine.h"
+#include "UdpSocketPool.h"
 #include "netd_resolv/resolv.h"
 #include "private/android_filesystem_config.h"
 
@@ -121,6 +128,7 @@
 using namespace std::chrono_literals;
 // TODO: use the namespace something like android::netd_resolv for libnetd_resolv
 using android::base::ErrnoError;
+using android::base::Error;
 using android::base::Result;
 using android::base::unique_fd;
 using android::net::CacheStatus;
@@ -134,6 +142,8 @@ using android::net::IV_IPV4;
 using android::net::IV_IPV6;
 using android::net::IV_UNKNOWN;
 using android::net::LinuxErrno;
+using android::net::LookupExecutor;
+using android::net::MdnsEngine;
 using android::net::NetworkDnsEventReported;
 using android::net::NS_T_AAAA;
 using android::net::NS_T_INVALID;
@@ -146,6 +156,9 @@ using android::net::PROTO_DOH;
 using android::net::PROTO_MDNS;
 using android::net::PROTO_TCP;
 using android::net::PROTO_UDP;
+using android::net::TcpConnectionPool;
+using android::net::UdpQueryEngine;
+using android::net::UdpSocketPool;
 using android::netdutils::IPSockAddr;
 using android::netdutils::Slice;
 using android::netdutils::Stopwatch;
@@ -155,12 +168,39 @@ const std::vector<IPSockAddr> mdns_addrs = {IPSockAddr::toIPSockAddr("ff02::fb",
                                             IPSockAddr::toIPSockAddr("224.0.0.251", 5353)};
 
 static int setupUdpSocket(ResState* statp, const sockaddr* sockap, unique_fd* fd_out, int* terrno);
+static UdpSocketPool::Key socketKey(const ResState* statp, size_t ns);
+static int openUdpSocket(ResState* statp, size_t ns, int* terrno);
+static void releaseUdpSocket(ResState* statp, size_t ns);
+static int res_nsend_uncached(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans,
+                              int* rcode, uint32_t flags, ResolvCacheStatus cache_status,
+                              std::chrono::milliseconds sleepTimeMs);
+static int res_nsend_shared(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans,
+                            int* rcode, uint32_t flags, std::chrono::milliseconds sleepTimeMs,
+                            ResolvCacheAnswer* shared);
+// The hedge of a UDP query: if the server queried hasn't answered after |delay|, the query is also
+// sent to the server |ns|, and the first answer of either is taken.
+struct UdpHedge {
+    size_t ns;
+    timespec delay;
+};
+
 static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg, span<uint8_t> ans,
-                   int* terrno, size_t* ns, int* v_circuit, int* gotsomewhere, int* rcode);
+                   int* terrno, size_t* ns, int* v_circuit, int* gotsomewhere, int* rcode,
+                   const UdpHedge* hedge, int32_t* wireRttUs);
+static std::optional<UdpHedge> plan_hedge(ResState* statp, const bool usable_servers[], size_t ns);
+static int send_dg_engine(ResState* statp, res_params* params, span<const uint8_t> msg,
+                          span<uint8_t> ans, int* terrno, size_t ns, int* v_circuit,
+                          int* gotsomewhere, int* rcode);
 static int send_vc(ResState* statp, res_params* params, span<const uint8_t> msg, span<uint8_t> ans,
                    int* terrno, size_t ns, int* rcode);
+static int send_vc_pooled(ResState* statp, res_params* params, span<const uint8_t> msg,
+                          span<uint8_t> ans, int* terrno, size_t ns, int* rcode);
+static int setupTcpSocket(ResState* statp, res_params* params, size_t ns, unique_fd* fd_out,
+                          int* terrno, int* rcode);
 static int send_mdns(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int* terrno,
-                     int* rcode);
+                     int* rcode, bool* answeredLocally);
+static int send_mdns_engine(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans,
+                            int* terrno, int* rcode, bool* answeredLocally);
 static void dump_error(const char*, const struct sockaddr*);
 
 static int sock_eq(struct sockaddr*, struct sockaddr*);
@@ -436,36 +476,228 @@ static bool isNetworkRestricted(int terrno) {
     return (terrno == EPERM);
 }
 
-int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int* rcode,
-              uint32_t flags, std::chrono::milliseconds sleepTimeMs) {
-    LOG(DEBUG) << __func__;
+// Run |send| on a worker of the LookupExecutor, with a copy of |statp| set up for its network. The
+// query it sends isn't reported, it only refreshes the cache on behalf of a previous one. Return
+// false, without running it, if there are already enough of those in the background.
+static bool res_send_in_background(ResState* statp, std::function<void(ResState*)> send) {
+    return LookupExecutor::getInstance().post(
+            [res = std::make_shared<ResState>(statp->clone()), send = std::move(send)]() {
+                NetworkDnsEventReported event;
+                res->event = &event;
+                resolv_populate_res_for_net(res.get());
+                send(res.get());
+            });
+}
 
-    // Should not happen
-    if (ans.size() < HFIXEDSZ) {
-        // TODO: Remove errno once callers stop using it
-        errno = EINVAL;
-        return -EINVAL;
+// Re-sends |msg| in the background and replaces its cache entry with the answer, so that a popular
+// entry is refreshed before it expires. When there are already enough queries in the background,
+// the prefetch is dropped.
+static void res_prefetch(ResState* statp, span<const uint8_t> msg) {
+    const bool posted = res_send_in_background(
+            statp, [query = std::vector(msg.begin(), msg.end())](ResState* res) {
+                std::vector<uint8_t> ans(MAXPACKET);
+                int rcode = RCODE_INTERNAL_ERROR;
+                // Don't let res_nsend() look up the entry being refreshed, or add the answer
+                // itself.
+                const int anslen =
+                        res_nsend(res, query, ans, &rcode, ANDROID_RESOLV_NO_CACHE_STORE);
+                if (anslen > 0) {
+                    resolv_cache_refresh(res->netid, query, std::span(ans.data(), anslen));
+                } else {
+                    resolv_cache_prefetch_failed(res->netid, query);
+                }
+            });
+    if (!posted) {
+        LOG(DEBUG) << __func__ << ": too many queries in the background";
+        resolv_cache_prefetch_failed(statp->netid, msg);
     }
-    res_pquery(msg);
+}
+
+// Refresh the stale cache entry of |msg|, which the cache lookup left to this query, in the
+// background, and wait up to the stale answer timeout for its answer. If the refresh takes longer
+// or fails, the stale answer is copied to |ans| instead, so that the lookup doesn't wait for the
+// retries and timeouts of the upstream servers. See RFC 8767.
+static ResolvCacheStatus res_refresh_stale(ResState* statp, span<const uint8_t> msg,
+                                           span<uint8_t> ans, int* anslen, uint32_t flags) {
+    const bool posted = res_send_in_background(
+            statp, [query = std::vector(msg.begin(), msg.end()), flags](ResState* res) {
+                std::vector<uint8_t> ans(MAXPACKET);
+                int rcode = RCODE_INTERNAL_ERROR;
+                res_nsend_uncached(res, query, ans, &rcode, flags, RESOLV_CACHE_NOTFOUND, 0ms);
+            });
+    if (!posted) {
+        // Serve the stale answer right away, and leave the refresh to a later lookup.
+        LOG(DEBUG) << __func__ << ": too many queries in the background";
+        _resolv_cache_query_failed(statp->netid, msg, flags);
+    }
+    return resolv_cache_wait_refresh(statp->netid, msg, ans, anslen);
+}
 
+// Called when the upstream servers failed to answer |msg|. Returns the length of a stale answer
+// copied from the cache to |ans|, or 0 if there is none. See RFC 8767.
+static int res_serve_stale(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans,
+                           int* rcode, uint32_t flags) {
     int anslen = 0;
+    if (resolv_cache_lookup_stale(statp->netid, msg, ans, &anslen, flags) != RESOLV_CACHE_FOUND) {
+        return 0;
+    }
+    LOG(DEBUG) << __func__ << ": serving stale answer";
+    *rcode = reinterpret_cast<HEADER*>(ans.data())->rcode;
+    return anslen;
+}
+
+// Look |msg| up in the cache of the network. On a hit, the answer is handed out in |*shared| if it
+// isn't null and the cache shares it, and copied to |ans| otherwise, and the hit is recorded. The
+// length of the answer is returned in |*anslen|.
+static ResolvCacheStatus res_lookup_cache(ResState* statp, span<const uint8_t> msg,
+                                          span<uint8_t> ans, int* anslen, int* rcode,
+                                          uint32_t flags, ResolvCacheAnswer* shared) {
+    bool prefetch = false;
+    bool stale = false;
+    ResolvCacheAnswer cached_answer;
     Stopwatch cacheStopwatch;
-    ResolvCacheStatus cache_status = resolv_cache_lookup(statp->netid, msg, ans, &anslen, flags);
+    // Only grab a reference to the cached answer under the cache lock, and copy it afterwards if
+    // the caller can't take the reference.
+    ResolvCacheStatus cache_status = resolv_cache_lookup_shared(statp->netid, msg, &cached_answer,
+                                                                flags, &prefetch, &stale);
+    if (cache_status == RESOLV_CACHE_FOUND) {
+        if (cached_answer->size() > ans.size()) {
+            LOG(INFO) << __func__ << ": cached answer too long";
+            cache_status = RESOLV_CACHE_UNSUPPORTED;
+        } else {
+            *anslen = cached_answer->size();
+            *rcode = reinterpret_cast<const HEADER*>(cached_answer->data())->rcode;
+            if (shared != nullptr) {
+                *shared = std::move(cached_answer);
+            } else {
+                std::copy(cached_answer->begin(), cached_answer->end(), ans.begin());
+            }
+        }
+    } else if (cache_status == RESOLV_CACHE_NOTFOUND && stale) {
+        cache_status = res_refresh_stale(statp, msg, ans, anslen, flags);
+        if (cache_status == RESOLV_CACHE_FOUND) {
+            *rcode = reinterpret_cast<const HEADER*>(ans.data())->rcode;
+        }
+    }
     const int32_t cacheLatencyUs = saturate_cast<int32_t>(cacheStopwatch.timeTakenUs());
     if (cache_status == RESOLV_CACHE_FOUND) {
-        HEADER* hp = (HEADER*)(void*)ans.data();
-        *rcode = hp->rcode;
+        if (prefetch) {
+            res_prefetch(statp, msg);
+        }
         DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
         dnsQueryEvent->set_latency_micros(cacheLatencyUs);
         dnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(cache_status));
         dnsQueryEvent->set_type(getQueryType(msg));
-        return anslen;
-    } else if (cache_status != RESOLV_CACHE_UNSUPPORTED) {
-        // had a cache miss for a known network, so populate the thread private
-        // data so the normal resolve path can do its thing
-        resolv_populate_res_for_net(statp);
     }
+    return cache_status;
+}
 
+// What a query sent to the nameserver |ns| came to.
+struct QueryOutcome {
+    size_t ns;
+    // The server which answered, which may be a server queried earlier than |ns|.
+    size_t actualNs;
+    int retryTimes;
+    ::android::net::Protocol protocol;
+    time_t queryTime;
+    int delayMs;
+    int32_t latencyUs;
+    // The round-trip time of the answer on the wire, from the kernel timestamps of the UDP
+    // socket, or -1 if it isn't known. See udp_kernel_timestamps.
+    int32_t wireRttUs = -1;
+    int rcode;
+    int terrno;
+};
+
+// Record |outcome| of the query |msg| in statp->event, and in the stats of the server if
+// |recordStats| is set.
+static void record_query(ResState* statp, span<const uint8_t> msg, ResolvCacheStatus cache_status,
+                         const res_params& params, int revision_id, const QueryOutcome& outcome,
+                         bool recordStats) {
+    const IPSockAddr& receivedServerAddr = statp->nsaddrs[outcome.actualNs];
+    DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
+    dnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(cache_status));
+    // When |retryTimes| > 1, we cannot actually know the correct latency value if we
+    // received the answer from the previous server. So temporarily set the latency as -1 if
+    // that condition happened, unless the wire RTT of the answer is known.
+    if (outcome.wireRttUs >= 0) {
+        dnsQueryEvent->set_latency_micros(outcome.wireRttUs);
+    } else {
+        dnsQueryEvent->set_latency_micros((outcome.actualNs == outcome.ns) ? outcome.latencyUs
+                                                                           : -1);
+    }
+    dnsQueryEvent->set_dns_server_index(outcome.actualNs);
+    dnsQueryEvent->set_ip_version(ipFamilyToIPVersion(receivedServerAddr.family()));
+    dnsQueryEvent->set_retry_times(outcome.retryTimes);
+    dnsQueryEvent->set_rcode(static_cast<NsRcode>(outcome.rcode));
+    dnsQueryEvent->set_protocol(outcome.protocol);
+    dnsQueryEvent->set_type(getQueryType(msg));
+    dnsQueryEvent->set_linux_errno(static_cast<LinuxErrno>(outcome.terrno));
+
+    // Only record stats the first time we try a query. This ensures that
+    // queries that deterministically fail (e.g., a name that always returns
+    // SERVFAIL or times out) do not unduly affect the stats.
+    if (recordStats) {
+        // (b/151166599): This is a workaround to prevent that DnsResolver calculates the
+        // reliability of DNS servers from being broken when network restricted mode is
+        // enabled.
+        // TODO: Introduce the new server selection instead of skipping stats recording.
+        if (!isNetworkRestricted(outcome.terrno)) {
+            res_sample sample;
+            const int delayMs =
+                    (outcome.wireRttUs >= 0) ? outcome.wireRttUs / 1000 : outcome.delayMs;
+            res_stats_set_sample(&sample, outcome.queryTime, outcome.rcode, delayMs);
+            resolv_cache_add_resolver_stats_sample(statp->netid, revision_id, receivedServerAddr,
+                                                   sample, params.max_samples);
+            resolv_stats_add(statp->netid, receivedServerAddr, dnsQueryEvent);
+        }
+    }
+}
+
+// Return |msg| without the OPT record which res_nopt() appended to it, or nothing if it has none.
+static std::optional<std::vector<uint8_t>> strip_edns(span<const uint8_t> msg) {
+    const HEADER* hp = reinterpret_cast<const HEADER*>(msg.data());
+    if (ntohs(hp->qdcount) != 1 || hp->ancount != 0 || hp->nscount != 0 ||
+        ntohs(hp->arcount) != 1) {
+        return std::nullopt;
+    }
+    const int n = dn_skipname(msg.data() + HFIXEDSZ, msg.data() + msg.size());
+    if (n < 0) return std::nullopt;
+    // The OPT record starts with the root name, then its type.
+    const size_t end = HFIXEDSZ + n + QFIXEDSZ;
+    if (msg.size() < end + 1 + INT16SZ || msg[end] != 0 ||
+        (msg[end + 1] << 8 | msg[end + 2]) != ns_t_opt) {
+        return std::nullopt;
+    }
+    std::vector<uint8_t> stripped(msg.begin(), msg.begin() + end);
+    reinterpret_cast<HEADER*>(stripped.data())->arcount = 0;
+    return stripped;
+}
+
+// Return true if a query of |size| bytes ought to be sent over TCP from the start. That is the case
+// if it is too long for UDP, unless the first usable server advertised a large enough EDNS0 payload
+// size. It is also the case if that server truncates most of its UDP answers and is known to be
+// reachable over TCP, rather than having each query learn it from a truncated answer.
+static bool start_with_tcp(ResState* statp, const bool usable_servers[], size_t size) {
+    // Larger queries are likely to be fragmented. See https://www.dnsflagday.net/2020/.
+    constexpr size_t kMaxUdpQuerySize = 1232;
+
+    size_t ns = 0;
+    while (ns < statp->nsaddrs.size() && !usable_servers[ns]) ns++;
+    const auto caps = (ns < statp->nsaddrs.size())
+                              ? resolv_get_server_capabilities(statp->netid, statp->nsaddrs[ns])
+                              : std::nullopt;
+    if (size > PACKETSZ) {
+        return !caps.has_value() ||
+               size > std::min<size_t>(caps->udpPayloadSize, kMaxUdpQuerySize);
+    }
+    return caps.has_value() && caps->oftenTruncated && caps->tcpReachable == true;
+}
+
+// The rest of res_nsend(), once |msg| wasn't answered from the cache.
+static int res_nsend_uncached(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans,
+                              int* rcode, uint32_t flags, ResolvCacheStatus cache_status,
+                              std::chrono::milliseconds sleepTimeMs) {
     // MDNS
     if (isMdnsResolution(statp->flags)) {
         // Use an impossible error code as default value.
@@ -473,25 +705,34 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
         int resplen = 0;
         *rcode = RCODE_INTERNAL_ERROR;
         Stopwatch queryStopwatch;
-        resplen = send_mdns(statp, msg, ans, &terrno, rcode);
+        bool answeredLocally = false;
+        resplen = send_mdns(statp, msg, ans, &terrno, rcode, &answeredLocally);
         const IPSockAddr& receivedMdnsAddr =
                 (getQueryType(msg) == NS_T_AAAA) ? mdns_addrs[0] : mdns_addrs[1];
         DnsQueryEvent* mDnsQueryEvent = addDnsQueryEvent(statp->event);
-        mDnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(cache_status));
+        mDnsQueryEvent->set_cache_hit(
+                static_cast<CacheStatus>(answeredLocally ? RESOLV_CACHE_FOUND : cache_status));
         mDnsQueryEvent->set_latency_micros(saturate_cast<int32_t>(queryStopwatch.timeTakenUs()));
         mDnsQueryEvent->set_ip_version(ipFamilyToIPVersion(receivedMdnsAddr.family()));
         mDnsQueryEvent->set_rcode(static_cast<NsRcode>(*rcode));
         mDnsQueryEvent->set_protocol(PROTO_MDNS);
         mDnsQueryEvent->set_type(getQueryType(msg));
         mDnsQueryEvent->set_linux_errno(static_cast<LinuxErrno>(terrno));
-        resolv_stats_add(statp->netid, receivedMdnsAddr, mDnsQueryEvent);
+        if (!answeredLocally) resolv_stats_add(statp->netid, receivedMdnsAddr, mDnsQueryEvent);
 
         if (resplen > 0) {
             LOG(DEBUG) << __func__ << ": got answer from mDNS:";
             res_pquery(ans.first(resplen));
 
             if (cache_status == RESOLV_CACHE_NOTFOUND) {
-                resolv_cache_add(statp->netid, msg, std::span(ans.data(), resplen));
+                if (Experiments::getInstance()->getFlag("mdns_engine", 0)) {
+                    // The engine caches the records of the answer itself, each with its own TTL,
+                    // so the answer is kept out of the cache. This only releases the queries
+                    // waiting for it, which the engine then answers.
+                    _resolv_cache_query_failed(statp->netid, msg, flags);
+                } else {
+                    resolv_cache_add(statp->netid, msg, std::span(ans.data(), resplen));
+                }
             }
             return resplen;
         }
@@ -526,6 +767,9 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
         if (!fallback) {
             _resolv_cache_query_failed(statp->netid, msg, flags);
             LOG(DEBUG) << __func__ << ": private DNS failed";
+            if (int stalelen = res_serve_stale(statp, msg, ans, rcode, flags); stalelen > 0) {
+                return stalelen;
+            }
             return -ETIMEDOUT;
         }
     }
@@ -569,7 +813,7 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
 
     // Send request, RETRY times, or until successful.
     int retryTimes = (flags & ANDROID_RESOLV_NO_RETRY) ? 1 : params.retry_count;
-    int useTcp = msg.size() > PACKETSZ;
+    int useTcp = start_with_tcp(statp, usable_servers, msg.size());
     int gotsomewhere = 0;
 
     // Use an impossible error code as default value
@@ -583,9 +827,19 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
             LOG(DEBUG) << __func__ << ": Querying server (# " << ns + 1
                        << ") address = " << statp->nsaddrs[ns].toString();
 
+            // A server which is known to reject EDNS0 is sent the query without it, rather than
+            // being asked again only to answer FORMERR.
+            std::optional<std::vector<uint8_t>> withoutEdns;
+            if (const auto caps = resolv_get_server_capabilities(statp->netid, statp->nsaddrs[ns]);
+                caps.has_value() && caps->ednsRejected) {
+                withoutEdns = strip_edns(msg);
+            }
+            const span<const uint8_t> query = withoutEdns ? span<const uint8_t>(*withoutEdns) : msg;
+
             ::android::net::Protocol query_proto = useTcp ? PROTO_TCP : PROTO_UDP;
             const time_t query_time = time(nullptr);
             int delay = 0;
+            int32_t wireRttUs = -1;
             bool fallbackTCP = false;
             const bool shouldRecordStats = (attempt == 0);
             int resplen;
@@ -597,7 +851,7 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
             if (useTcp) {
                 // TCP; at most one attempt per server.
                 attempt = retryTimes;
-                resplen = send_vc(statp, &params, msg, ans, &terrno, ns, rcode);
+                resplen = send_vc(statp, &params, query, ans, &terrno, ns, rcode);
                 delay = elapsedTimeInMs(statp->tcp_nssock_ts);
 
                 if (msg.size() <= PACKETSZ && resplen <= 0 &&
@@ -609,48 +863,30 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
                 LOG(INFO) << __func__ << ": used send_vc " << resplen << " terrno: " << terrno;
             } else {
                 // UDP
-                resplen = send_dg(statp, &params, msg, ans, &terrno, &actualNs, &useTcp,
-                                  &gotsomewhere, rcode);
+                const std::optional<UdpHedge> hedge =
+                        (attempt == 0) ? plan_hedge(statp, usable_servers, ns) : std::nullopt;
+                resplen = send_dg(statp, &params, query, ans, &terrno, &actualNs, &useTcp,
+                                  &gotsomewhere, rcode, hedge ? &*hedge : nullptr, &wireRttUs);
                 delay = elapsedTimeInMs(statp->udpsocks_ts[actualNs]);
                 fallbackTCP = useTcp ? true : false;
                 retry_count_for_event = attempt;
                 LOG(INFO) << __func__ << ": used send_dg " << resplen << " terrno: " << terrno;
             }
 
-            const IPSockAddr& receivedServerAddr = statp->nsaddrs[actualNs];
-            DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
-            dnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(cache_status));
-            // When |retryTimes| > 1, we cannot actually know the correct latency value if we
-            // received the answer from the previous server. So temporarily set the latency as -1 if
-            // that condition happened.
-            // TODO: make the latency value accurate.
-            dnsQueryEvent->set_latency_micros(
-                    (actualNs == ns) ? saturate_cast<int32_t>(queryStopwatch.timeTakenUs()) : -1);
-            dnsQueryEvent->set_dns_server_index(actualNs);
-            dnsQueryEvent->set_ip_version(ipFamilyToIPVersion(receivedServerAddr.family()));
-            dnsQueryEvent->set_retry_times(retry_count_for_event);
-            dnsQueryEvent->set_rcode(static_cast<NsRcode>(*rcode));
-            dnsQueryEvent->set_protocol(query_proto);
-            dnsQueryEvent->set_type(getQueryType(msg));
-            dnsQueryEvent->set_linux_errno(static_cast<LinuxErrno>(terrno));
-
-            // Only record stats the first time we try a query. This ensures that
-            // queries that deterministically fail (e.g., a name that always returns
-            // SERVFAIL or times out) do not unduly affect the stats.
-            if (shouldRecordStats) {
-                // (b/151166599): This is a workaround to prevent that DnsResolver calculates the
-                // reliability of DNS servers from being broken when network restricted mode is
-                // enabled.
-                // TODO: Introduce the new server selection instead of skipping stats recording.
-                if (!isNetworkRestricted(terrno)) {
-                    res_sample sample;
-                    res_stats_set_sample(&sample, query_time, *rcode, delay);
-                    resolv_cache_add_resolver_stats_sample(statp->netid, revision_id,
-                                                           receivedServerAddr, sample,
-                                                           params.max_samples);
-                    resolv_stats_add(statp->netid, receivedServerAddr, dnsQueryEvent);
-                }
-            }
+            record_query(statp, msg, cache_status, params, revision_id,
+                         {
+                                 .ns = ns,
+                                 .actualNs = actualNs,
+                                 .retryTimes = retry_count_for_event,
+                                 .protocol = query_proto,
+                                 .queryTime = query_time,
+                                 .delayMs = delay,
+                                 .latencyUs = saturate_cast<int32_t>(queryStopwatch.timeTakenUs()),
+                                 .wireRttUs = wireRttUs,
+                                 .rcode = *rcode,
+                                 .terrno = terrno,
+                         },
+                         shouldRecordStats);
 
             if (resplen == 0) continue;
             if (fallbackTCP) {
@@ -660,6 +896,9 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
             if (resplen < 0) {
                 _resolv_cache_query_failed(statp->netid, msg, flags);
                 statp->closeSockets();
+                if (int stalelen = res_serve_stale(statp, msg, ans, rcode, flags); stalelen > 0) {
+                    return stalelen;
+                }
                 return -terrno;
             }
 
@@ -669,6 +908,7 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
             if (cache_status == RESOLV_CACHE_NOTFOUND) {
                 resolv_cache_add(statp->netid, msg, std::span(ans.data(), resplen));
             }
+            if (query_proto == PROTO_UDP) releaseUdpSocket(statp, actualNs);
             statp->closeSockets();
             return (resplen);
         }  // for each ns
@@ -681,9 +921,45 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
                                   : ECONNREFUSED /* no nameservers found */;
 
     _resolv_cache_query_failed(statp->netid, msg, flags);
+    if (int stalelen = res_serve_stale(statp, msg, ans, rcode, flags); stalelen > 0) {
+        return stalelen;
+    }
     return -terrno;
 }
 
+int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int* rcode,
+              uint32_t flags, std::chrono::milliseconds sleepTimeMs) {
+    return res_nsend_shared(statp, msg, ans, rcode, flags, sleepTimeMs, nullptr);
+}
+
+// Like res_nsend(), but a cached answer may be handed out in |*shared| instead of being copied to
+// |ans|. See resolv_res_nsend().
+static int res_nsend_shared(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans,
+                            int* rcode, uint32_t flags, std::chrono::milliseconds sleepTimeMs,
+                            ResolvCacheAnswer* shared) {
+    LOG(DEBUG) << __func__;
+
+    // Should not happen
+    if (ans.size() < HFIXEDSZ) {
+        // TODO: Remove errno once callers stop using it
+        errno = EINVAL;
+        return -EINVAL;
+    }
+    res_pquery(msg);
+
+    int anslen = 0;
+    const ResolvCacheStatus cache_status =
+            res_lookup_cache(statp, msg, ans, &anslen, rcode, flags, shared);
+    if (cache_status == RESOLV_CACHE_FOUND) {
+        return anslen;
+    } else if (cache_status != RESOLV_CACHE_UNSUPPORTED) {
+        // had a cache miss for a known network, so populate the thread private
+        // data so the normal resolve path can do its thing
+        resolv_populate_res_for_net(statp);
+    }
+    return res_nsend_uncached(statp, msg, ans, rcode, flags, cache_status, sleepTimeMs);
+}
+
 static struct timespec get_timeout(ResState* statp, const res_params* params, const int addrIndex) {
     int msec;
     msec = params->base_timeout_msec << addrIndex;
@@ -705,12 +981,34 @@ static struct timespec get_timeout(ResState* statp, const res_params* params, co
     return result;
 }
 
+// The timeout of a UDP query to the server |ns|. With the udp_adaptive_timeout flag, it is the
+// retransmission timeout estimated from the recent latencies of the server, like TCP's, so that a
+// server which usually answers in milliseconds isn't waited on for seconds when it drops a query.
+// It never exceeds the timeout of get_timeout(), which is also used until the server answers.
+static timespec get_dg_timeout(ResState* statp, const res_params* params, size_t ns) {
+    // Below this, the timeout would mostly expire on answers delayed by a transient hiccup.
+    constexpr std::chrono::microseconds kMinAdaptiveTimeout = 100ms;
+
+    const timespec timeout = get_timeout(statp, params, ns);
+    if (!Experiments::getInstance()->getFlag("udp_adaptive_timeout", 0)) return timeout;
+    const auto rto = resolv_stats_get_udp_timeout(statp->netid, statp->nsaddrs[ns]);
+    if (!rto.has_value()) return timeout;
+
+    const std::chrono::microseconds maxTimeout =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::seconds(timeout.tv_sec) +
+                    std::chrono::nanoseconds(timeout.tv_nsec));
+    const auto adaptive = std::clamp(*rto, std::min(kMinAdaptiveTimeout, maxTimeout), maxTimeout);
+    LOG(DEBUG) << __func__ << ": using adaptive timeout of " << adaptive.count() << " usec";
+    const auto sec = std::chrono::duration_cast<std::chrono::seconds>(adaptive);
+    return {.tv_sec = sec.count(), .tv_nsec = std::chrono::nanoseconds(adaptive - sec).count()};
+}
+
 static int send_vc(ResState* statp, res_params* params, span<const uint8_t> msg, span<uint8_t> ans,
                    int* terrno, size_t ns, int* rcode) {
     const HEADER* hp = (const HEADER*)(const void*)msg.data();
     HEADER* anhp = (HEADER*)(void*)ans.data();
     struct sockaddr* nsap;
-    int nsaplen;
     int truncating, connreset, n;
     uint8_t* cp;
 
@@ -722,10 +1020,12 @@ static int send_vc(ResState* statp, res_params* params, span<const uint8_t> msg,
         *terrno = EINVAL;
         return -1;
     }
+    if (Experiments::getInstance()->getFlag("tcp_connection_pool", 0)) {
+        return send_vc_pooled(statp, params, msg, ans, terrno, ns, rcode);
+    }
 
     sockaddr_storage ss = statp->nsaddrs[ns];
     nsap = reinterpret_cast<sockaddr*>(&ss);
-    nsaplen = sockaddrSize(nsap);
 
     connreset = 0;
 same_ns:
@@ -748,52 +1048,11 @@ same_ns:
     if (statp->tcp_nssock < 0 || (statp->flags & RES_F_VC) == 0) {
         if (statp->tcp_nssock >= 0) statp->closeSockets();
 
-        statp->tcp_nssock.reset(socket(nsap->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0));
-        if (statp->tcp_nssock < 0) {
-            *terrno = errno;
-            PLOG(DEBUG) << __func__ << ": socket(vc): ";
-            switch (errno) {
-                case EPROTONOSUPPORT:
-                case EPFNOSUPPORT:
-                case EAFNOSUPPORT:
-                    return 0;
-                default:
-                    return -1;
-            }
-        }
         statp->tcp_nssock_ts = evNowTime();
-        const uid_t uid = statp->enforce_dns_uid ? AID_DNS : statp->uid;
-        resolv_tag_socket(statp->tcp_nssock, uid, statp->pid);
-        if (statp->mark != MARK_UNSET) {
-            if (setsockopt(statp->tcp_nssock, SOL_SOCKET, SO_MARK, &statp->mark,
-                           sizeof(statp->mark)) < 0) {
-                *terrno = errno;
-                PLOG(DEBUG) << __func__ << ": setsockopt: ";
-                return -1;
-            }
-        }
-        errno = 0;
-        if (random_bind(statp->tcp_nssock, nsap->sa_family) < 0) {
-            *terrno = errno;
-            dump_error("bind/vc", nsap);
-            statp->closeSockets();
-            return (0);
-        }
-        if (connect_with_timeout(statp->tcp_nssock, nsap, (socklen_t)nsaplen,
-                                 get_timeout(statp, params, ns)) < 0) {
-            *terrno = errno;
-            dump_error("connect/vc", nsap);
+        if (int result = setupTcpSocket(statp, params, ns, &statp->tcp_nssock, terrno, rcode);
+            result <= 0) {
             statp->closeSockets();
-            /*
-             * The way connect_with_timeout() is implemented prevents us from reliably
-             * determining whether this was really a timeout or e.g. ECONNREFUSED. Since
-             * currently both cases are handled in the same way, there is no need to
-             * change this (yet). If we ever need to reliably distinguish between these
-             * cases, both connect_with_timeout() and retrying_poll() need to be
-             * modified, though.
-             */
-            *rcode = RCODE_TIMEOUT;
-            return (0);
+            return result;
         }
         statp->flags |= RES_F_VC;
     }
@@ -913,6 +1172,111 @@ read_len:
     return (resplen);
 }
 
+// Set up a TCP socket connected to the server |ns| in |fd_out|.
+// Returns 1 on success, 0 if the next server ought to be tried, or -1 on a fatal error.
+static int setupTcpSocket(ResState* statp, res_params* params, size_t ns, unique_fd* fd_out,
+                          int* terrno, int* rcode) {
+    const sockaddr_storage ss = statp->nsaddrs[ns];
+    const sockaddr* nsap = reinterpret_cast<const sockaddr*>(&ss);
+    fd_out->reset(socket(nsap->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (*fd_out < 0) {
+        *terrno = errno;
+        PLOG(DEBUG) << __func__ << ": socket(vc): ";
+        switch (errno) {
+            case EPROTONOSUPPORT:
+            case EPFNOSUPPORT:
+            case EAFNOSUPPORT:
+                return 0;
+            default:
+                return -1;
+        }
+    }
+    const uid_t uid = statp->enforce_dns_uid ? AID_DNS : statp->uid;
+    resolv_tag_socket(*fd_out, uid, statp->pid);
+    if (statp->mark != MARK_UNSET) {
+        if (setsockopt(*fd_out, SOL_SOCKET, SO_MARK, &statp->mark, sizeof(statp->mark)) < 0) {
+            *terrno = errno;
+            PLOG(DEBUG) << __func__ << ": setsockopt: ";
+            return -1;
+        }
+    }
+    errno = 0;
+    if (random_bind(*fd_out, nsap->sa_family) < 0) {
+        *terrno = errno;
+        dump_error("bind/vc", nsap);
+        return 0;
+    }
+    if (connect_with_timeout(*fd_out, nsap, sockaddrSize(nsap), get_timeout(statp, params, ns)) <
+        0) {
+        *terrno = errno;
+        dump_error("connect/vc", nsap);
+        resolv_record_tcp_connect(statp->netid, statp->nsaddrs[ns], false);
+        /*
+         * The way connect_with_timeout() is implemented prevents us from reliably
+         * determining whether this was really a timeout or e.g. ECONNREFUSED. Since
+         * currently both cases are handled in the same way, there is no need to
+         * change this (yet). If we ever need to reliably distinguish between these
+         * cases, both connect_with_timeout() and retrying_poll() need to be
+         * modified, though.
+         */
+        *rcode = RCODE_TIMEOUT;
+        return 0;
+    }
+    resolv_record_tcp_connect(statp->netid, statp->nsaddrs[ns], true);
+    return 1;
+}
+
+// send_vc() over the connections of TcpConnectionPool, when the tcp_connection_pool flag is set.
+// The query is pipelined with those of other threads on an open connection to the server if there
+// is one, and a new connection is only set up otherwise. Returns the same as send_vc().
+static int send_vc_pooled(ResState* statp, res_params* params, span<const uint8_t> msg,
+                          span<uint8_t> ans, int* terrno, size_t ns, int* rcode) {
+    TcpConnectionPool& pool = TcpConnectionPool::getInstance();
+    const TcpConnectionPool::Key key = socketKey(statp, ns);
+    const timespec timeout = get_timeout(statp, params, ns);
+    const auto timeoutMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::seconds(timeout.tv_sec) + std::chrono::nanoseconds(timeout.tv_nsec));
+
+    statp->tcp_nssock_ts = evNowTime();
+    std::shared_ptr<TcpConnectionPool::Connection> connection = pool.acquire(key);
+    for (;;) {
+        const bool reused = (connection != nullptr);
+        if (!reused) {
+            unique_fd fd;
+            if (int result = setupTcpSocket(statp, params, ns, &fd, terrno, rcode); result <= 0) {
+                return result;
+            }
+            connection = pool.add(key, std::move(fd));
+        }
+        const auto answer = connection->query(msg, timeoutMs);
+        if (answer.ok()) {
+            size_t resplen = answer->size();
+            HEADER* anhp = reinterpret_cast<HEADER*>(ans.data());
+            std::copy_n(answer->begin(), std::min(resplen, ans.size()), ans.begin());
+            if (resplen > ans.size()) {
+                LOG(WARNING) << __func__ << ": resplen " << resplen << " exceeds buf size "
+                             << ans.size();
+                anhp->tc = 1;
+                resplen = ans.size();
+            }
+            *rcode = anhp->rcode;
+            *terrno = 0;
+            return resplen;
+        }
+
+        LOG(DEBUG) << __func__ << ": " << answer.error().message();
+        // The server may have closed an idle connection meanwhile, or the query may have the ID
+        // of another one in flight on it. Either way, the query is retried on a new connection.
+        if (reused && answer.error().code() != ETIMEDOUT) {
+            connection = nullptr;
+            continue;
+        }
+        *terrno = answer.error().code();
+        if (*terrno == ETIMEDOUT) *rcode = RCODE_TIMEOUT;
+        return 0;
+    }
+}
+
 /* return -1 on error (errno set), 0 on success */
 static int connect_with_timeout(int sock, const sockaddr* nsap, socklen_t salen,
                                 const timespec timeout) {
@@ -1082,8 +1446,210 @@ static int setupUdpSocket(ResState* statp, const sockaddr* sockap, unique_fd* fd
     return 1;
 }
 
+static UdpSocketPool::Key socketKey(const ResState* statp, size_t ns) {
+    return {
+            .netid = statp->netid,
+            .mark = statp->mark,
+            .uid = statp->enforce_dns_uid ? AID_DNS : statp->uid,
+            .server = statp->nsaddrs[ns],
+    };
+}
+
+// With the udp_kernel_timestamps flag, the RTT of a UDP answer is measured from the time its query
+// was sent to the time the kernel received the answer, which SO_TIMESTAMPNS tells. This leaves out
+// how long the resolver thread took to be scheduled and to read the answer, which on a busy device
+// can be more than the RTT itself.
+static void enable_rx_timestamps(int fd) {
+    if (!Experiments::getInstance()->getFlag("udp_kernel_timestamps", 0)) return;
+    const int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+        PLOG(DEBUG) << __func__ << ": setsockopt(SO_TIMESTAMPNS): ";
+    }
+}
+
+// Note that a query was just sent to the server |ns| over UDP. The timestamps of the kernel are
+// of CLOCK_REALTIME.
+static void note_udp_sent(ResState* statp, size_t ns) {
+    clock_gettime(CLOCK_REALTIME, &statp->udpsocks_sent_ts[ns]);
+}
+
+// The kernel receive timestamp of the datagram which |hdr| was read into, if there is one.
+static std::optional<timespec> rx_timestamp(const msghdr& hdr) {
+    for (const cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(const_cast<msghdr*>(&hdr), const_cast<cmsghdr*>(cmsg))) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return ts;
+        }
+    }
+    return std::nullopt;
+}
+
+// The room for the control message of rx_timestamp().
+using RxTimestampControl = std::array<uint8_t, CMSG_SPACE(sizeof(timespec))>;
+
+// Return the RTT of an answer of the server |ns| which the kernel received at |received|, or -1
+// if it isn't known.
+static int32_t wire_rtt_us(const ResState* statp, size_t ns,
+                           const std::optional<timespec>& received) {
+    const timespec& sent = statp->udpsocks_sent_ts[ns];
+    if (!received.has_value() || (sent.tv_sec == 0 && sent.tv_nsec == 0)) return -1;
+    const int64_t us = (received->tv_sec - sent.tv_sec) * 1000000LL +
+                       (received->tv_nsec - sent.tv_nsec) / 1000;
+    // The realtime clock may have been set in between.
+    return (us < 0) ? -1 : saturate_cast<int32_t>(us);
+}
+
+// Set up statp->udpsocks[ns], connected to the server |ns|. When the udp_socket_pool flag is set,
+// an idle socket of a previous query is reused if there is one.
+// Returns the same as setupUdpSocket(), and leaves statp->udpsocks[ns] unset on failure.
+static int openUdpSocket(ResState* statp, size_t ns, int* terrno) {
+    const bool pooled = Experiments::getInstance()->getFlag("udp_socket_pool", 0);
+    UdpSocketPool::Socket socket;
+    if (pooled) socket = UdpSocketPool::getInstance().acquire(socketKey(statp, ns));
+    statp->udpsocks_ts[ns] = evNowTime();
+    if (socket.fd != -1) {
+        // The socket may come from before the flag was set.
+        enable_rx_timestamps(socket.fd);
+        statp->udpsocks[ns] = std::move(socket.fd);
+        statp->udpsocks_expiry[ns] = socket.expiry;
+        LOG(DEBUG) << __func__ << ": reused DG socket";
+        return 1;
+    }
+
+    const sockaddr_storage ss = statp->nsaddrs[ns];
+    const sockaddr* nsap = reinterpret_cast<const sockaddr*>(&ss);
+    unique_fd fd;
+    if (int result = setupUdpSocket(statp, nsap, &fd, terrno); result <= 0) return result;
+
+    // Use a "connected" datagram socket to receive an ECONNREFUSED error
+    // on the next socket operation when the server responds with an
+    // ICMP port-unreachable error. This way we can detect the absence of
+    // a nameserver without timing out.
+    if (connect(fd, nsap, sockaddrSize(nsap)) < 0) {
+        *terrno = errno;
+        dump_error("connect(dg)", nsap);
+        return 0;
+    }
+    enable_rx_timestamps(fd);
+    statp->udpsocks[ns] = std::move(fd);
+    // Without the pool, the socket is closed at the end of the query anyway.
+    statp->udpsocks_expiry[ns] = socket.expiry;
+    LOG(DEBUG) << __func__ << ": new DG socket";
+    return 1;
+}
+
+// Give statp->udpsocks[ns] back to the pool once it brought the answer of the query. The sockets
+// which failed or timed out are closed instead, so that a late ICMP error can't fail a later query.
+static void releaseUdpSocket(ResState* statp, size_t ns) {
+    if (statp->udpsocks[ns] == -1) return;
+    if (!Experiments::getInstance()->getFlag("udp_socket_pool", 0)) return;
+    UdpSocketPool::getInstance().release(
+            socketKey(statp, ns),
+            {.fd = std::move(statp->udpsocks[ns]), .expiry = statp->udpsocks_expiry[ns]});
+}
+
+// Check the rcode and flags of |ans|, a UDP answer to the query from the server |ns|. Return 0 if
+// the next server ought to be tried, 1 if the query ought to be retried over TCP, or the size of
+// |ans| if it is the final answer.
+static int check_dg_answer(ResState* statp, span<const uint8_t> ans, size_t ns, int* terrno,
+                           int* v_circuit, int* rcode) {
+    const HEADER* anhp = reinterpret_cast<const HEADER*>(ans.data());
+    if (anhp->rcode == FORMERR && (statp->netcontext_flags & NET_CONTEXT_FLAG_USE_EDNS)) {
+        //  Do not retry if the server do not understand EDNS0.
+        //  The case has to be captured here, as FORMERR packet do not
+        //  carry query section, hence res_queriesmatch() returns 0.
+        LOG(DEBUG) << __func__ << ": server rejected query with EDNS0:";
+        res_pquery(ans);
+        // record the error
+        statp->flags |= RES_F_EDNS0ERR;
+        resolv_record_edns_rejected(statp->netid, statp->nsaddrs[ns]);
+        *terrno = EREMOTEIO;
+        return 0;
+    }
+    resolv_record_udp_answer(statp->netid, statp->nsaddrs[ns], ans);
+
+    if (anhp->rcode == SERVFAIL || anhp->rcode == NOTIMP || anhp->rcode == REFUSED) {
+        LOG(DEBUG) << __func__ << ": server rejected query:";
+        res_pquery(ans);
+        *rcode = anhp->rcode;
+        return 0;
+    }
+    if (anhp->tc) {
+        // To get the rest of answer,
+        // use TCP with same server.
+        LOG(DEBUG) << __func__ << ": truncated answer";
+        *terrno = E2BIG;
+        *v_circuit = 1;
+        return 1;
+    }
+    // All is well, or the error is fatal. Signal that the
+    // next nameserver ought not be tried.
+
+    *rcode = anhp->rcode;
+    *terrno = 0;
+    return ans.size();
+}
+
+// Plan the hedge of the first attempt of a query to the server |ns|, when the
+// udp_hedge_latency_percentile flag is set. The hedge goes to the next usable server, once |ns| has
+// taken longer than that percentile of its recent latencies. Hedges are bounded by a per-network
+// budget of udp_hedge_budget_pct percent of the queries. The udp_query_engine path doesn't hedge.
+static std::optional<UdpHedge> plan_hedge(ResState* statp, const bool usable_servers[], size_t ns) {
+    // Hedging sooner than this mostly duplicates queries which are about to be answered anyway.
+    constexpr auto kMinHedgeDelay = 10ms;
+    constexpr int kDefaultHedgeBudgetPct = 10;
+
+    const int percentile = Experiments::getInstance()->getFlag("udp_hedge_latency_percentile", 0);
+    if (percentile <= 0) return std::nullopt;
+    size_t next = ns + 1;
+    while (next < statp->nsaddrs.size() && !usable_servers[next]) next++;
+    if (next >= statp->nsaddrs.size()) return std::nullopt;
+
+    const int budgetPct =
+            Experiments::getInstance()->getFlag("udp_hedge_budget_pct", kDefaultHedgeBudgetPct);
+    const auto latency =
+            resolv_hedge_delay(statp->netid, statp->nsaddrs[ns], percentile, budgetPct);
+    if (!latency.has_value()) return std::nullopt;
+    const auto delay = std::max<std::chrono::microseconds>(*latency, kMinHedgeDelay);
+    const auto sec = std::chrono::duration_cast<std::chrono::seconds>(delay);
+    return UdpHedge{
+            .ns = next,
+            .delay = {.tv_sec = sec.count(),
+                      .tv_nsec = std::chrono::nanoseconds(delay - sec).count()},
+    };
+}
+
+// Send |msg| to the server |ns|, as the hedge of a query whose server is slow to answer. Return
+// true if it was sent. The failure of a hedge doesn't fail the query, so its error is only logged.
+static bool send_hedge(ResState* statp, span<const uint8_t> msg, size_t ns) {
+    // Most hedges are turned down by the budget, so check it before setting up a socket.
+    if (!resolv_hedge_spend(statp->netid)) return false;
+    // A hedge which isn't sent gives its credit back, so that socket errors don't drain the
+    // budget.
+    int terrno = 0;
+    if (statp->udpsocks[ns] == -1 && openUdpSocket(statp, ns, &terrno) <= 0) {
+        LOG(DEBUG) << __func__ << ": can't open socket: " << strerror(terrno);
+        resolv_hedge_refund(statp->netid);
+        return false;
+    }
+    if (send(statp->udpsocks[ns], msg.data(), msg.size(), 0) !=
+        static_cast<ptrdiff_t>(msg.size())) {
+        PLOG(DEBUG) << __func__ << ": send: ";
+        statp->udpsocks[ns].reset();
+        resolv_hedge_refund(statp->netid);
+        return false;
+    }
+    note_udp_sent(statp, ns);
+    LOG(DEBUG) << __func__ << ": hedged to server #" << ns + 1;
+    return true;
+}
+
 static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg, span<uint8_t> ans,
-                   int* terrno, size_t* ns, int* v_circuit, int* gotsomewhere, int* rcode) {
+                   int* terrno, size_t* ns, int* v_circuit, int* gotsomewhere, int* rcode,
+                   const UdpHedge* hedge, int32_t* wireRttUs) {
+    *wireRttUs = -1;
     // It should never happen, but just in case.
     if (*ns >= statp->nsaddrs.size()) {
         LOG(ERROR) << __func__ << ": Out-of-bound indexing: " << ns;
@@ -1091,25 +1657,14 @@ static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg,
         return -1;
     }
 
-    const sockaddr_storage ss = statp->nsaddrs[*ns];
-    const sockaddr* nsap = reinterpret_cast<const sockaddr*>(&ss);
+    if (Experiments::getInstance()->getFlag("udp_query_engine", 0)) {
+        return send_dg_engine(statp, params, msg, ans, terrno, *ns, v_circuit, gotsomewhere,
+                              rcode);
+    }
 
     if (statp->udpsocks[*ns] == -1) {
-        int result = setupUdpSocket(statp, nsap, &statp->udpsocks[*ns], terrno);
+        int result = openUdpSocket(statp, *ns, terrno);
         if (result <= 0) return result;
-        statp->udpsocks_ts[*ns] = evNowTime();
-
-        // Use a "connected" datagram socket to receive an ECONNREFUSED error
-        // on the next socket operation when the server responds with an
-        // ICMP port-unreachable error. This way we can detect the absence of
-        // a nameserver without timing out.
-        if (connect(statp->udpsocks[*ns], nsap, sockaddrSize(nsap)) < 0) {
-            *terrno = errno;
-            dump_error("connect(dg)", nsap);
-            statp->closeSockets();
-            return 0;
-        }
-        LOG(DEBUG) << __func__ << ": new DG socket";
     }
     if (send(statp->udpsocks[*ns], msg.data(), msg.size(), 0) !=
         static_cast<ptrdiff_t>(msg.size())) {
@@ -1118,14 +1673,27 @@ static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg,
         statp->closeSockets();
         return 0;
     }
+    note_udp_sent(statp, *ns);
 
-    timespec timeout = get_timeout(statp, params, *ns);
+    timespec timeout = get_dg_timeout(statp, params, *ns);
     timespec start_time = evNowTime();
     timespec finish = evAddTime(start_time, timeout);
+    // A hedged query waits on the sockets of all the servers queried so far, like
+    // keep_listening_udp does.
+    std::optional<timespec> hedgeAt;
+    if (hedge != nullptr) hedgeAt = evAddTime(start_time, hedge->delay);
+    bool hedged = false;
     for (;;) {
         // Wait for reply.
-        auto result = udpRetryingPollWrapper(statp, *ns, &finish);
-
+        const bool hedgeDue = hedgeAt.has_value() && evCmpTime(*hedgeAt, finish) < 0;
+        auto result = hedged ? udpRetryingPoll(statp, &finish)
+                             : udpRetryingPollWrapper(statp, *ns, hedgeDue ? &*hedgeAt : &finish);
+
+        if (!result.has_value() && hedgeDue && result.error().code() == ETIMEDOUT) {
+            hedgeAt.reset();
+            hedged = send_hedge(statp, msg, hedge->ns);
+            continue;
+        }
         if (!result.has_value()) {
             const bool isTimeout = (result.error().code() == ETIMEDOUT);
             *rcode = (isTimeout) ? RCODE_TIMEOUT : *rcode;
@@ -1141,9 +1709,24 @@ static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg,
         for (int fd : result.value()) {
             needRetry = false;
             sockaddr_storage from;
-            socklen_t fromlen = sizeof(from);
-            int resplen =
-                    recvfrom(fd, ans.data(), ans.size(), 0, (sockaddr*)(void*)&from, &fromlen);
+            iovec iov = {.iov_base = ans.data(), .iov_len = ans.size()};
+            RxTimestampControl control;
+            msghdr hdr = {
+                    .msg_name = &from,
+                    .msg_namelen = sizeof(from),
+                    .msg_iov = &iov,
+                    .msg_iovlen = 1,
+                    .msg_control = control.data(),
+                    .msg_controllen = control.size(),
+            };
+            int resplen = recvmsg(fd, &hdr, 0);
+            if (resplen <= 0 && hedged && fd == statp->udpsocks[hedge->ns]) {
+                // A failed hedge doesn't end the wait for the server queried.
+                PLOG(DEBUG) << __func__ << ": hedge recvfrom: ";
+                statp->udpsocks[hedge->ns].reset();
+                needRetry = true;
+                continue;
+            }
             if (resplen <= 0) {
                 *terrno = errno;
                 PLOG(DEBUG) << __func__ << ": recvfrom: ";
@@ -1167,49 +1750,394 @@ static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg,
                 continue;
             }
 
-            HEADER* anhp = (HEADER*)(void*)ans.data();
-            if (anhp->rcode == FORMERR && (statp->netcontext_flags & NET_CONTEXT_FLAG_USE_EDNS)) {
-                //  Do not retry if the server do not understand EDNS0.
-                //  The case has to be captured here, as FORMERR packet do not
-                //  carry query section, hence res_queriesmatch() returns 0.
-                LOG(DEBUG) << __func__ << ": server rejected query with EDNS0:";
-                res_pquery(ans.first(resplen));
-                // record the error
-                statp->flags |= RES_F_EDNS0ERR;
-                *terrno = EREMOTEIO;
+            const bool fromHedge = hedged && receivedFromNs == static_cast<int>(hedge->ns);
+            const int rv = check_dg_answer(statp, ans.first(resplen), receivedFromNs, terrno,
+                                           v_circuit, rcode);
+            if (rv == resplen) {
+                if (fromHedge) resolv_hedge_won(statp->netid);
+                *ns = receivedFromNs;
+            }
+            // The RTT is that of the server which the outcome of the query is recorded for.
+            if (receivedFromNs == static_cast<int>(*ns)) {
+                *wireRttUs = wire_rtt_us(statp, receivedFromNs, rx_timestamp(hdr));
+            }
+            if (rv == 0) {
+                // Nor does an error answered to it.
+                needRetry = fromHedge;
                 continue;
             }
+            return rv;
+        }
+        if (!needRetry) return 0;
+    }
+}
 
-            if (anhp->rcode == SERVFAIL || anhp->rcode == NOTIMP || anhp->rcode == REFUSED) {
-                LOG(DEBUG) << __func__ << ": server rejected query:";
-                res_pquery(ans.first(resplen));
-                *rcode = anhp->rcode;
-                continue;
+// Same as send_dg(), except that the UdpQueryEngine waits for the answer instead of polling the
+// sockets of |statp|. The calling thread still blocks until then. Only the socket of |ns| is
+// waited on, so a late answer of a previous server is not listened for.
+static int send_dg_engine(ResState* statp, res_params* params, span<const uint8_t> msg,
+                          span<uint8_t> ans, int* terrno, size_t ns, int* v_circuit,
+                          int* gotsomewhere, int* rcode) {
+    if (statp->udpsocks[ns] == -1) {
+        if (int result = openUdpSocket(statp, ns, terrno); result <= 0) return result;
+    }
+
+    const timespec timeout = get_dg_timeout(statp, params, ns);
+    const auto answer =
+            UdpQueryEngine::getInstance()
+                    .send(statp->udpsocks[ns], statp->nsaddrs[ns], msg, ans.size(),
+                          std::chrono::duration_cast<std::chrono::milliseconds>(
+                                  std::chrono::seconds(timeout.tv_sec) +
+                                  std::chrono::nanoseconds(timeout.tv_nsec)))
+                    .get();
+    if (!answer.ok()) {
+        const bool isTimeout = (answer.error().code() == ETIMEDOUT);
+        *rcode = (isTimeout) ? RCODE_TIMEOUT : *rcode;
+        *terrno = answer.error().code();
+        *gotsomewhere = (isTimeout) ? 1 : *gotsomewhere;
+        if (!isTimeout) statp->udpsocks[ns].reset();
+        LOG(DEBUG) << __func__ << ": " << answer.error().message();
+        return 0;
+    }
+    *gotsomewhere = 1;
+    std::copy(answer->begin(), answer->end(), ans.begin());
+    return check_dg_answer(statp, ans.first(answer->size()), ns, terrno, v_circuit, rcode);
+}
+
+// The state of a query of res_nsend_batch() which wasn't answered from the cache.
+struct BatchSlot {
+    BatchQuery* query;
+    ResolvCacheStatus cacheStatus;
+    // Set once the query is answered, or is left to res_nsend() to retry over TCP.
+    bool done = false;
+    // The outcome of the query to the last server queried, as in res_nsend().
+    size_t actualNs = 0;
+    int resplen = 0;
+    bool truncated = false;
+    int rcode = RCODE_INTERNAL_ERROR;
+    int terrno = ETIME;
+    int32_t latencyUs = 0;
+    int32_t wireRttUs = -1;
+};
+
+// Return false if the queries to any of the servers of |statp| would be adjusted by res_nsend()
+// because of the capabilities learnt about the server: a server known to reject EDNS0 is sent
+// the queries without it, and one which truncates most of its UDP answers is queried over TCP
+// from the start.
+static bool batch_fits_server_capabilities(ResState* statp) {
+    for (const IPSockAddr& server : statp->nsaddrs) {
+        const auto caps = resolv_get_server_capabilities(statp->netid, server);
+        if (!caps.has_value()) continue;
+        if (caps->ednsRejected || (caps->oftenTruncated && caps->tcpReachable == true)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Return true if |queries| can be sent by res_nsend_batch(): they need to go to the nameservers of
+// the network over UDP, as they are, which rules out mDNS, private DNS, the queries too long for
+// UDP, and the servers which res_nsend() treats differently.
+static bool batchable(ResState* statp, span<const BatchQuery> queries) {
+    if (queries.empty() || isMdnsResolution(statp->flags)) return false;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const BatchQuery& query = queries[i];
+        if (query.msg.size() < HFIXEDSZ || query.msg.size() > PACKETSZ ||
+            query.ans.size() < HFIXEDSZ) {
+            return false;
+        }
+        // The answers are told apart by ID.
+        const auto id = reinterpret_cast<const HEADER*>(query.msg.data())->id;
+        for (size_t j = 0; j < i; ++j) {
+            if (reinterpret_cast<const HEADER*>(queries[j].msg.data())->id == id) return false;
+        }
+    }
+    if (!(statp->netcontext_flags & NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS)) {
+        // The cases in which res_private_dns_send() falls back without sending anything.
+        const PrivateDnsStatus privateDnsStatus =
+                PrivateDnsConfiguration::getInstance().getStatus(statp->netid);
+        statp->event->set_private_dns_modes(convertEnumType(privateDnsStatus.mode));
+        const bool cleartext = privateDnsStatus.mode == PrivateDnsMode::OFF ||
+                               (privateDnsStatus.mode == PrivateDnsMode::OPPORTUNISTIC &&
+                                !privateDnsStatus.hasValidatedDohServers() &&
+                                privateDnsStatus.validatedServers().empty());
+        if (!cleartext) return false;
+    }
+
+    resolv_populate_res_for_net(statp);
+    return batch_fits_server_capabilities(statp);
+}
+
+// Send the queries of |slots| which aren't done to the server |ns| with one sendmmsg(), and read
+// their answers with recvmmsg() until each of them is answered, or the attempt times out. The
+// outcome of each query is left in its slot, the same as send_dg() returns it, and |unanswered|
+// counts the queries which each server was sent but didn't answer.
+// Returns -1 if the socket couldn't be set up because of a fatal error, and 0 otherwise.
+static int send_dg_batch(ResState* statp, res_params* params, std::vector<BatchSlot>& slots,
+                         size_t ns, int* gotsomewhere, std::array<int, MAXNS>& unanswered) {
+    std::vector<BatchSlot*> waiting;
+    size_t anslen = MAXPACKET;
+    for (BatchSlot& slot : slots) {
+        if (slot.done) continue;
+        slot.actualNs = ns;
+        slot.resplen = 0;
+        slot.rcode = RCODE_INTERNAL_ERROR;
+        slot.terrno = ETIME;
+        slot.latencyUs = 0;
+        slot.wireRttUs = -1;
+        waiting.push_back(&slot);
+        anslen = std::min(anslen, slot.query->ans.size());
+    }
+    Stopwatch queryStopwatch;
+    const auto finishAll = [&](int terrno, int rcode) {
+        const int32_t latencyUs = saturate_cast<int32_t>(queryStopwatch.timeTakenUs());
+        for (BatchSlot* slot : waiting) {
+            slot->terrno = terrno;
+            slot->rcode = rcode;
+            slot->latencyUs = latencyUs;
+        }
+    };
+
+    if (statp->udpsocks[ns] == -1) {
+        int terrno = ETIME;
+        if (int result = openUdpSocket(statp, ns, &terrno); result <= 0) {
+            finishAll(terrno, RCODE_INTERNAL_ERROR);
+            return result;
+        }
+    }
+
+    std::vector<iovec> iovs(waiting.size());
+    std::vector<mmsghdr> msgs(waiting.size());
+    for (size_t i = 0; i < waiting.size(); ++i) {
+        const span<const uint8_t> msg = waiting[i]->query->msg;
+        iovs[i] = {.iov_base = const_cast<uint8_t*>(msg.data()), .iov_len = msg.size()};
+        msgs[i].msg_hdr = {.msg_iov = &iovs[i], .msg_iovlen = 1};
+    }
+    const int sent = sendmmsg(statp->udpsocks[ns], msgs.data(), msgs.size(), 0);
+    if (sent != static_cast<int>(msgs.size())) {
+        // A short count means that the next query failed to be sent.
+        const int terrno = (sent == -1) ? errno : EIO;
+        PLOG(DEBUG) << __func__ << ": sendmmsg: ";
+        finishAll(terrno, RCODE_INTERNAL_ERROR);
+        statp->closeSockets();
+        return 0;
+    }
+    note_udp_sent(statp, ns);
+    unanswered[ns] += sent;
+
+    const timespec finish = evAddTime(evNowTime(), get_dg_timeout(statp, params, ns));
+    // An answer may be to any of the queries, so it is read aside first.
+    std::vector<std::vector<uint8_t>> bufs(waiting.size(), std::vector<uint8_t>(anslen));
+    std::vector<sockaddr_storage> froms(waiting.size());
+    std::vector<RxTimestampControl> controls(waiting.size());
+    while (!waiting.empty()) {
+        auto result = udpRetryingPollWrapper(statp, ns, &finish);
+        if (!result.has_value()) {
+            const bool isTimeout = (result.error().code() == ETIMEDOUT);
+            // Leave the UDP sockets open on timeout, as send_dg() does.
+            if (isTimeout) {
+                *gotsomewhere = 1;
+                finishAll(ETIMEDOUT, RCODE_TIMEOUT);
+            } else {
+                finishAll(result.error().code(), RCODE_INTERNAL_ERROR);
+                statp->closeSockets();
+            }
+            LOG(DEBUG) << __func__ << ": " << (isTimeout ? "timeout" : "poll");
+            return 0;
+        }
+        for (int fd : result.value()) {
+            for (size_t i = 0; i < waiting.size(); ++i) {
+                iovs[i] = {.iov_base = bufs[i].data(), .iov_len = anslen};
+                msgs[i].msg_hdr = {
+                        .msg_name = &froms[i],
+                        .msg_namelen = sizeof(froms[i]),
+                        .msg_iov = &iovs[i],
+                        .msg_iovlen = 1,
+                        .msg_control = controls[i].data(),
+                        .msg_controllen = controls[i].size(),
+                };
             }
-            if (anhp->tc) {
-                // To get the rest of answer,
-                // use TCP with same server.
-                LOG(DEBUG) << __func__ << ": truncated answer";
-                *terrno = E2BIG;
-                *v_circuit = 1;
-                return 1;
+            const int received = recvmmsg(fd, msgs.data(), waiting.size(), MSG_DONTWAIT, nullptr);
+            if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            if (received <= 0) {
+                // As in send_dg(), an error such as ECONNREFUSED ends the attempt.
+                PLOG(DEBUG) << __func__ << ": recvmmsg: ";
+                finishAll(errno, RCODE_INTERNAL_ERROR);
+                return 0;
             }
-            // All is well, or the error is fatal. Signal that the
-            // next nameserver ought not be tried.
+            *gotsomewhere = 1;
 
-            *rcode = anhp->rcode;
-            *ns = receivedFromNs;
-            *terrno = 0;
-            return resplen;
+            std::vector<BatchSlot*> answered;
+            for (int i = 0; i < received; ++i) {
+                const span<uint8_t> ans(bufs[i].data(), msgs[i].msg_len);
+                if (ans.size() < HFIXEDSZ || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+                    LOG(DEBUG) << __func__ << ": invalid answer size: " << ans.size();
+                    continue;
+                }
+                const auto id = reinterpret_cast<const HEADER*>(ans.data())->id;
+                const auto it = std::find_if(waiting.begin(), waiting.end(), [&](BatchSlot* s) {
+                    return reinterpret_cast<const HEADER*>(s->query->msg.data())->id == id;
+                });
+                if (it == waiting.end()) {
+                    // An answer to an earlier attempt, or to a query already answered.
+                    LOG(DEBUG) << __func__ << ": old answer:";
+                    continue;
+                }
+                BatchSlot* slot = *it;
+                int receivedFromNs = ns;
+                if (ignoreInvalidAnswer(statp, froms[i], slot->query->msg, ans, &receivedFromNs)) {
+                    res_pquery(ans);
+                    continue;
+                }
+
+                slot->actualNs = receivedFromNs;
+                slot->latencyUs = saturate_cast<int32_t>(queryStopwatch.timeTakenUs());
+                slot->wireRttUs = wire_rtt_us(statp, receivedFromNs, rx_timestamp(msgs[i].msg_hdr));
+                unanswered[receivedFromNs]--;
+                int v_circuit = 0;
+                const int rv = check_dg_answer(statp, ans, receivedFromNs, &slot->terrno,
+                                               &v_circuit, &slot->rcode);
+                if (v_circuit) {
+                    slot->truncated = true;
+                } else if (rv > 0) {
+                    std::copy(ans.begin(), ans.end(), slot->query->ans.begin());
+                    slot->resplen = rv;
+                }
+                // Otherwise the error answer sends the query to the next server.
+                answered.push_back(slot);
+            }
+            std::erase_if(waiting, [&](BatchSlot* s) {
+                return std::find(answered.begin(), answered.end(), s) != answered.end();
+            });
+            if (waiting.empty()) break;
+        }
+    }
+    return 0;
+}
+
+bool res_nsend_batch(ResState* statp, span<BatchQuery> queries) {
+    LOG(DEBUG) << __func__;
+    if (!batchable(statp, queries)) return false;
+
+    std::vector<BatchSlot> slots;
+    for (BatchQuery& query : queries) {
+        res_pquery(query.msg);
+        const ResolvCacheStatus cache_status = res_lookup_cache(
+                statp, query.msg, query.ans, &query.result, &query.rcode, 0, nullptr);
+        if (cache_status == RESOLV_CACHE_FOUND) continue;
+        slots.push_back({.query = &query, .cacheStatus = cache_status});
+    }
+    if (slots.empty()) return true;
+
+    res_stats stats[MAXNS]{};
+    res_params params;
+    const int revision_id =
+            (statp->nameserverCount() > 0)
+                    ? resolv_cache_get_resolver_stats(statp->netid, &params, stats, statp->nsaddrs)
+                    : -1;
+    if (revision_id < 0) {
+        // Let res_nsend() fail the queries the way it does.
+        for (BatchSlot& slot : slots) {
+            BatchQuery& query = *slot.query;
+            query.result = res_nsend_uncached(statp, query.msg, query.ans, &query.rcode, 0,
+                                              slot.cacheStatus, 0ms);
+        }
+        return true;
+    }
+
+    bool usable_servers[MAXNS];
+    android_net_res_stats_get_usable_servers(&params, stats, statp->nameserverCount(),
+                                             usable_servers);
+    if (statp->sort_nameservers) {
+        for (int i = 0; i < statp->nameserverCount(); i++) {
+            usable_servers[i] = true;
         }
-        if (!needRetry) return 0;
     }
+
+    const auto pending = [&] {
+        return std::any_of(slots.begin(), slots.end(), [](const auto& slot) { return !slot.done; });
+    };
+    int gotsomewhere = 0;
+    bool fatal = false;
+    std::array<int, MAXNS> unanswered{};
+    for (int attempt = 0; attempt < params.retry_count && !fatal && pending(); ++attempt) {
+        for (size_t ns = 0; ns < statp->nsaddrs.size() && !fatal && pending(); ++ns) {
+            if (!usable_servers[ns]) continue;
+            LOG(DEBUG) << __func__ << ": Querying server (# " << ns + 1
+                       << ") address = " << statp->nsaddrs[ns].toString();
+
+            const time_t query_time = time(nullptr);
+            fatal = send_dg_batch(statp, &params, slots, ns, &gotsomewhere, unanswered) < 0;
+            for (BatchSlot& slot : slots) {
+                if (slot.done) continue;
+                record_query(statp, slot.query->msg, slot.cacheStatus, params, revision_id,
+                             {
+                                     .ns = ns,
+                                     .actualNs = slot.actualNs,
+                                     .retryTimes = attempt,
+                                     .protocol = PROTO_UDP,
+                                     .queryTime = query_time,
+                                     .delayMs = elapsedTimeInMs(statp->udpsocks_ts[slot.actualNs]),
+                                     .latencyUs = slot.latencyUs,
+                                     .wireRttUs = slot.wireRttUs,
+                                     .rcode = slot.rcode,
+                                     .terrno = slot.terrno,
+                             },
+                             attempt == 0);
+                if (slot.truncated) {
+                    slot.done = true;
+                } else if (slot.resplen > 0) {
+                    slot.done = true;
+                    BatchQuery& query = *slot.query;
+                    LOG(DEBUG) << __func__ << ": got answer:";
+                    res_pquery(query.ans.first(slot.resplen));
+                    if (slot.cacheStatus == RESOLV_CACHE_NOTFOUND) {
+                        resolv_cache_add(statp->netid, query.msg, query.ans.first(slot.resplen));
+                    }
+                    query.rcode = slot.rcode;
+                    query.result = slot.resplen;
+                }
+            }
+        }
+    }
+    // The sockets which have no query outstanding can be reused.
+    for (size_t ns = 0; ns < statp->nsaddrs.size(); ++ns) {
+        if (unanswered[ns] == 0) releaseUdpSocket(statp, ns);
+    }
+    statp->closeSockets();
+
+    for (BatchSlot& slot : slots) {
+        BatchQuery& query = *slot.query;
+        if (slot.truncated) {
+            // Rare enough that res_nsend() can take it over, at the cost of asking again over UDP
+            // before it switches to TCP.
+            query.result = res_nsend_uncached(statp, query.msg, query.ans, &query.rcode, 0,
+                                              slot.cacheStatus, 0ms);
+            continue;
+        }
+        if (slot.done) continue;
+
+        const int terrno = fatal ? slot.terrno : gotsomewhere ? ETIMEDOUT : ECONNREFUSED;
+        _resolv_cache_query_failed(statp->netid, query.msg, 0);
+        query.rcode = slot.rcode;
+        if (int stalelen = res_serve_stale(statp, query.msg, query.ans, &query.rcode, 0);
+            stalelen > 0) {
+            query.result = stalelen;
+        } else {
+            query.result = -terrno;
+        }
+    }
+    return true;
 }
 
 // return length - when receiving valid packets.
 // return 0      - when mdns packets transfer error.
+// |answeredLocally| is set if the answer was made from the records cached by the mDNS engine.
 static int send_mdns(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int* terrno,
-                     int* rcode) {
+                     int* rcode, bool* answeredLocally) {
+    if (Experiments::getInstance()->getFlag("mdns_engine", 0)) {
+        return send_mdns_engine(statp, msg, ans, terrno, rcode, answeredLocally);
+    }
     const sockaddr_storage ss = (getQueryType(msg) == NS_T_AAAA) ? mdns_addrs[0] : mdns_addrs[1];
     const sockaddr* mdnsap = reinterpret_cast<const sockaddr*>(&ss);
     unique_fd fd;
@@ -1260,6 +2188,52 @@ static int send_mdns(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans
     return resplen;
 }
 
+// send_mdns() with the mDNS engine: the query is answered from the records which the engine has
+// cached for the network if it can be, or else sent on a socket which the engine keeps open.
+static int send_mdns_engine(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans,
+                            int* terrno, int* rcode, bool* answeredLocally) {
+    MdnsEngine& engine = MdnsEngine::getInstance();
+    auto answer = engine.answer(statp->netid, msg);
+    *answeredLocally = answer.has_value();
+    if (!answer.has_value()) {
+        const IPSockAddr& group = (getQueryType(msg) == NS_T_AAAA) ? mdns_addrs[0] : mdns_addrs[1];
+        const MdnsEngine::Key key = {
+                .netid = statp->netid,
+                .mark = statp->mark,
+                .uid = statp->enforce_dns_uid ? AID_DNS : statp->uid,
+                .server = group,
+        };
+        // RFC 6762: Typically, the timeout would also be shortened to two or three seconds.
+        const auto deadline = MdnsEngine::Clock::now() + std::chrono::milliseconds(2002);
+        auto result = engine.query(key, msg, deadline, [&]() -> Result<unique_fd> {
+            const sockaddr_storage ss = group;
+            unique_fd fd;
+            int err = 0;
+            if (setupUdpSocket(statp, reinterpret_cast<const sockaddr*>(&ss), &fd, &err) <= 0) {
+                return Error(err) << "Failed to set up the mDNS socket";
+            }
+            return fd;
+        });
+        if (!result.ok()) {
+            *terrno = result.error().code();
+            if (*terrno == ETIMEDOUT) *rcode = RCODE_TIMEOUT;
+            LOG(ERROR) << __func__ << ": " << result.error().message();
+            return 0;
+        }
+        answer = std::move(*result);
+    }
+
+    if (answer->size() > ans.size()) {
+        LOG(DEBUG) << __func__ << ": answer too large: " << answer->size();
+        *terrno = E2BIG;
+        return 0;
+    }
+    std::copy(answer->begin(), answer->end(), ans.begin());
+    *rcode = reinterpret_cast<const HEADER*>(answer->data())->rcode;
+    *terrno = 0;
+    return answer->size();
+}
+
 static void dump_error(const char* str, const struct sockaddr* address) {
     char hbuf[NI_MAXHOST];
     char sbuf[NI_MAXSERV];
@@ -1456,13 +2430,13 @@ int res_tls_send(const std::list<DnsTlsServer>& tlsServers, ResState* statp, con
 }
 
 int resolv_res_nsend(const android_net_context* netContext, span<const uint8_t> msg,
-                     span<uint8_t> ans, int* rcode, uint32_t flags,
-                     NetworkDnsEventReported* event) {
+                     span<uint8_t> ans, int* rcode, uint32_t flags, NetworkDnsEventReported* event,
+                     ResolvCacheAnswer* shared) {
     assert(event != nullptr);
     ResState res(netContext, event);
     resolv_populate_res_for_net(&res);
     *rcode = NOERROR;
-    return res_nsend(&res, msg, ans, rcode, flags);
+    return res_nsend_shared(&res, msg, ans, rcode, flags, {}, shared);
 }
 
 // Returns the elapsed time in milliseconds since the given time `from`.
@@ -19,9 +19,13 @@
 #include <span>
 
 #include "netd_resolv/resolv.h"  // struct android_net_context
+#include "resolv_cache.h"
 #include "stats.pb.h"
 
-// Query dns with raw msg
+// Query dns with raw msg. If |shared| isn't null, an answer from the cache may be handed out in
+// |*shared| rather than copied to |ans|, and its DNS ID is the one of the query which was cached.
+// The length of the answer is returned either way.
 int resolv_res_nsend(const android_net_context* netContext, std::span<const uint8_t> msg,
                      std::span<uint8_t> ans, int* rcode, uint32_t flags,
-                     android::net::NetworkDnsEventReported* event);
+                     android::net::NetworkDnsEventReported* event,
+                     ResolvCacheAnswer* shared = nullptr);
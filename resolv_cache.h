@@ -28,18 +28,24 @@
 
 #pragma once
 
+#include <chrono>
+#include <memory>
+#include <optional>
 #include <span>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
 #include <aidl/android/net/IDnsResolver.h>
 #include <aidl/android/net/ResolverOptionsParcel.h>
+#include <aidl/android/net/resolv/aidl/CacheStatsParcel.h>
 
 #include <netdutils/DumpWriter.h>
 #include <netdutils/InternetAddresses.h>
 #include <stats.pb.h>
 
 #include "ResolverStats.h"
+#include "ServerCapabilities.h"
 #include "params.h"
 #include "stats.h"
 
@@ -62,17 +68,54 @@ typedef enum {
     RESOLV_CACHE_SKIP         /* Don't do anything on cache */
 } ResolvCacheStatus;
 
+// Look up the answer to |query| in the cache. On RESOLV_CACHE_FOUND, |*prefetch| is set to true
+// if the caller should refresh the entry ahead of its expiry with resolv_cache_refresh().
 ResolvCacheStatus resolv_cache_lookup(unsigned netid, std::span<const uint8_t> query,
-                                      std::span<uint8_t> answer, int* answerlen, uint32_t flags);
+                                      std::span<uint8_t> answer, int* answerlen, uint32_t flags,
+                                      bool* prefetch = nullptr);
+
+// An immutable answer shared between the cache and the callers of resolv_cache_lookup_shared().
+using ResolvCacheAnswer = std::shared_ptr<const std::vector<uint8_t>>;
+
+// Like resolv_cache_lookup(), but hand out a reference to the cached answer instead of copying
+// it, so that concurrent hits on the same entry share one buffer. The DNS ID of |*answer| is the
+// one of the query which was answered: callers must patch it in their own copy of the header.
+//
+// With serve-stale, |*stale| is set to true on RESOLV_CACHE_NOTFOUND if the entry has a stale
+// answer which the caller is to refresh, as it would answer a miss. It may then start the query
+// in the background, and get its answer, or the stale one, from resolv_cache_wait_refresh().
+ResolvCacheStatus resolv_cache_lookup_shared(unsigned netid, std::span<const uint8_t> query,
+                                             ResolvCacheAnswer* answer, uint32_t flags,
+                                             bool* prefetch = nullptr, bool* stale = nullptr);
+
+// Wait up to the stale answer timeout for the refresh of the stale entry of |query|, and copy its
+// answer to |answer|. If the refresh is still running by then, or failed, the stale answer is
+// copied instead, as described in RFC 8767.
+ResolvCacheStatus resolv_cache_wait_refresh(unsigned netid, std::span<const uint8_t> query,
+                                            std::span<uint8_t> answer, int* answerlen);
 
 // add a (query,answer) to the cache. If the pair has been in the cache, no new entry will be added
 // in the cache.
 int resolv_cache_add(unsigned netid, std::span<const uint8_t> query,
                      std::span<const uint8_t> answer);
 
+// Add a (query,answer) to the cache, replacing the entry of the query if there is one.
+int resolv_cache_refresh(unsigned netid, std::span<const uint8_t> query,
+                         std::span<const uint8_t> answer);
+
 /* Notify the cache a request failed */
 void _resolv_cache_query_failed(unsigned netid, std::span<const uint8_t> query, uint32_t flags);
 
+// Notify the cache that the prefetch of the entry of |query|, which resolv_cache_lookup() asked
+// for, failed or wasn't started, so that a later hit may prefetch it again.
+void resolv_cache_prefetch_failed(unsigned netid, std::span<const uint8_t> query);
+
+// Look up a stale answer to serve after the upstream servers failed to answer |query|, as
+// described in RFC 8767. Return RESOLV_CACHE_FOUND if such an answer was copied to |answer|.
+ResolvCacheStatus resolv_cache_lookup_stale(unsigned netid, std::span<const uint8_t> query,
+                                            std::span<uint8_t> answer, int* answerlen,
+                                            uint32_t flags);
+
 // Get a customized table for a given network.
 std::vector<std::string> getCustomizedTableByName(const size_t netid, const char* hostname);
 
@@ -94,6 +137,18 @@ void resolv_delete_cache_for_net(unsigned netid);
 // Flushes the cache associated with the given network.
 int resolv_flush_cache_for_net(unsigned netid);
 
+// Saves the cache of every configured network to a snapshot which the first
+// resolv_set_nameservers() of the same netId loads back when the cache_snapshot_interval_sec
+// experiment flag is set, if the configuration and the interfaces are the same. The snapshots are
+// saved every cache_snapshot_interval_sec, as the resolver has no shutdown path to save them
+// from. Returns 0 on success, or the negative errno of the last failure.
+int resolv_cache_save_snapshots();
+
+// Get the telemetry of the cache of a given network. Return 0 on success, or -ENONET if there is
+// no cache for |netid|.
+int resolv_cache_get_stats(unsigned netid,
+                           aidl::android::net::resolv::aidl::CacheStatsParcel* stats);
+
 // Get transport types to a given network.
 android::net::NetworkType resolv_get_network_types_for_net(unsigned netid);
 
@@ -111,6 +166,10 @@ bool has_named_cache(unsigned netid);
 // returned if the expiration time can't be acquired.
 int resolv_cache_get_expiration(unsigned netid, std::span<const uint8_t> query, time_t* expiration);
 
+// For test only.
+// Set the directory of the cache snapshots. An empty |dir| restores the default one.
+void resolv_cache_set_snapshot_dir(const std::string& dir);
+
 // Set addresses to DnsStats for a given network.
 int resolv_stats_set_addrs(unsigned netid, android::net::Protocol proto,
                            const std::vector<std::string>& addrs, int port);
@@ -119,6 +178,39 @@ int resolv_stats_set_addrs(unsigned netid, android::net::Protocol proto,
 bool resolv_stats_add(unsigned netid, const android::netdutils::IPSockAddr& server,
                       const android::net::DnsQueryEvent* record);
 
+// Return the retransmission timeout of |server| in |netid|, estimated from the latencies of its
+// recent UDP answers, or nullopt if it answered none.
+std::optional<std::chrono::microseconds> resolv_stats_get_udp_timeout(
+        unsigned netid, const android::netdutils::IPSockAddr& server);
+
+// What was learned of the EDNS0 and TCP support of the nameservers of a network, see
+// ServerCapabilities. It is only kept with the server_capability_ttl_sec flag, for that many
+// seconds; without it, nothing is recorded and nothing is returned.
+std::optional<android::net::ServerCapabilities::Record> resolv_get_server_capabilities(
+        unsigned netid, const android::netdutils::IPSockAddr& server);
+void resolv_record_edns_rejected(unsigned netid, const android::netdutils::IPSockAddr& server);
+void resolv_record_udp_answer(unsigned netid, const android::netdutils::IPSockAddr& server,
+                              std::span<const uint8_t> answer);
+void resolv_record_tcp_connect(unsigned netid, const android::netdutils::IPSockAddr& server,
+                               bool connected);
+
+// Hedged UDP queries, see send_dg() in res_send.cpp.
+// Return how long to wait for |server| before hedging a query of |netid|: the |percentile|th
+// percentile of its recent UDP latencies, or nullopt if it answered too few queries to tell. Each
+// call also adds |budgetPct|% of a hedge to the hedge budget of the network.
+std::optional<std::chrono::microseconds> resolv_hedge_delay(
+        unsigned netid, const android::netdutils::IPSockAddr& server, int percentile,
+        int budgetPct);
+
+// Take one hedge out of the budget of |netid|. Return false if the budget is exhausted.
+bool resolv_hedge_spend(unsigned netid);
+
+// Give back the hedge which resolv_hedge_spend() took, when it couldn't be sent.
+void resolv_hedge_refund(unsigned netid);
+
+// Record that a hedge of |netid| was answered before the server it hedged.
+void resolv_hedge_won(unsigned netid);
+
 /* Retrieve a local copy of the stats for the given netid. The buffer must have space for
  * MAXNS __resolver_stats. Returns the revision id of the resolvers used.
  */
@@ -54,6 +54,7 @@
 
 #include <net/if.h>
 #include <time.h>
+#include <chrono>
 #include <span>
 #include <string>
 #include <vector>
@@ -138,6 +139,8 @@ struct ResState {
     std::vector<android::netdutils::IPSockAddr> nsaddrs;
     std::array<timespec, MAXNS> udpsocks_ts;    // The creation time of the UDP sockets
     android::base::unique_fd udpsocks[MAXNS];   // UDP sockets to nameservers
+    std::array<std::chrono::steady_clock::time_point, MAXNS> udpsocks_expiry;  // See UdpSocketPool
+    std::array<timespec, MAXNS> udpsocks_sent_ts{};  // When the UDP sockets last sent a query
     unsigned ndots : 4 = 1;                     // threshold for initial abs. query
     unsigned mark;                              // Socket mark to be used by all DNS query sockets
     android::base::unique_fd tcp_nssock;        // TCP socket (but why not one per nameserver?)
@@ -178,6 +181,23 @@ int res_nmkquery(int op, const char* qname, int cl, int type, std::span<const ui
                  std::span<uint8_t> msg, int netcontext_flags);
 int res_nsend(ResState* statp, std::span<const uint8_t> msg, std::span<uint8_t> ans, int* rcode,
               uint32_t flags, std::chrono::milliseconds sleepTimeMs = {});
+
+// A query sent by res_nsend_batch().
+struct BatchQuery {
+    std::span<const uint8_t> msg;
+    std::span<uint8_t> ans;
+    int rcode = 0;
+    // What res_nsend() would have returned for the query.
+    int result = 0;
+};
+
+// Send |queries|, such as the A and AAAA queries of a name, like res_nsend() does, except that they
+// are sent together: each attempt sends all the queries still unanswered to the server with one
+// sendmmsg() on one UDP socket, and reads their answers with recvmmsg(). Returns false without
+// sending anything if the queries can't be sent that way, such as with private DNS, in which case
+// they ought to be sent with res_nsend().
+bool res_nsend_batch(ResState* statp, std::span<BatchQuery> queries);
+
 int res_nopt(ResState*, int, std::span<uint8_t>, int);
 
 int getaddrinfo_numeric(const char* hostname, const char* servname, addrinfo hints,
@@ -53,6 +53,7 @@ using aidl::android::net::ResolverHostsParcel;
 using aidl::android::net::ResolverOptionsParcel;
 using aidl::android::net::ResolverParamsParcel;
 using aidl::android::net::metrics::INetdEventListener;
+using aidl::android::net::resolv::aidl::CacheStatsParcel;
 using aidl::android::net::resolv::aidl::DohParamsParcel;
 using android::base::ReadFdToString;
 using android::base::StringReplace;
@@ -623,6 +624,20 @@ TEST_F(DnsResolverBinderTest, SetResolverOptions) {
                                 "setResolverOptions.*-1.*64"});
 }
 
+TEST_F(DnsResolverBinderTest, GetCacheStats) {
+    SKIP_IF_REMOTE_VERSION_LESS_THAN(mDnsResolver.get(), 16);
+    // The cache has been created in the DnsResolverBinderTest constructor.
+    CacheStatsParcel stats;
+    EXPECT_TRUE(mDnsResolver->getCacheStats(TEST_NETID, &stats).isOk());
+    EXPECT_GE(stats.lookups, stats.hits + stats.misses);
+    EXPECT_EQ(16U, stats.lookupLatencyHistogram.size());
+    EXPECT_EQ(ENONET, mDnsResolver->getCacheStats(-1, &stats).getServiceSpecificError());
+    mExpectedLogData.push_back(
+            {"getCacheStats(-1) -> ServiceSpecificException(64, \"Machine is not on the "
+             "network\")",
+             "getCacheStats.*-1.*64"});
+}
+
 static std::string getNetworkInterfaceNames(int netId, const std::vector<std::string>& lines) {
     bool foundNetId = false;
     for (const auto& line : lines) {
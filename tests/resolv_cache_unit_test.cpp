@@ -16,13 +16,16 @@
 
 #include <netdb.h>
 
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <chrono>
 #include <ctime>
+#include <numeric>
 #include <span>
 #include <thread>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android/multinetwork.h>
 #include <arpa/inet.h>
@@ -30,6 +33,7 @@
 #include <gmock/gmock-matchers.h>
 #include <gtest/gtest.h>
 #include <netdutils/NetNativeTestBase.h>
+#include <sys/stat.h>
 
 #include "Experiments.h"
 #include "resolv_cache.h"
@@ -40,11 +44,27 @@
 
 using namespace std::chrono_literals;
 
+using aidl::android::net::resolv::aidl::CacheStatsParcel;
 using android::netdutils::IPSockAddr;
 
 const std::string kMaxCacheEntriesFlag("persist.device_config.netd_native.max_cache_entries");
+const std::string kServeStaleWindowFlag(
+        "persist.device_config.netd_native.cache_serve_stale_window_sec");
+const std::string kStaleAnswerTimeoutFlag(
+        "persist.device_config.netd_native.cache_stale_answer_timeout_ms");
+const std::string kPrefetchThresholdFlag(
+        "persist.device_config.netd_native.cache_prefetch_threshold_pct");
+const std::string kMaxBytesFlag("persist.device_config.netd_native.cache_max_bytes");
+const std::string kMaxTotalBytesFlag("persist.device_config.netd_native.cache_max_total_bytes");
+const std::string kAdmissionFilterFlag("persist.device_config.netd_native.cache_admission_filter");
+const std::string kSnapshotIntervalFlag(
+        "persist.device_config.netd_native.cache_snapshot_interval_sec");
+const std::string kShareCacheFlag(
+        "persist.device_config.netd_native.cache_share_between_networks");
 
 constexpr int TEST_NETID_2 = 31;
+constexpr int TEST_NETID_3 = 32;
+constexpr int TEST_NETID_4 = 33;
 constexpr int DNS_PORT = 53;
 
 // Constant values sync'd from res_cache.cpp
@@ -154,6 +174,8 @@ class ResolvCacheTest : public NetNativeTestBase {
     ~ResolvCacheTest() {
         cacheDelete(TEST_NETID);
         cacheDelete(TEST_NETID_2);
+        cacheDelete(TEST_NETID_3);
+        cacheDelete(TEST_NETID_4);
 
         // Restore the log severity.
         android::base::SetMinimumLogSeverity(defaultLogSeverity);
@@ -398,6 +420,140 @@ TEST_F(ResolvCacheTest, CacheLookup_Types) {
     }
 }
 
+TEST_F(ResolvCacheTest, CacheLookup_CanonicalKey) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    const CacheEntry ce = makeCacheEntry(QUERY, "www.Example.com", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    // Names are compared case-insensitively, and the ID and the TC bit are ignored.
+    CacheEntry variant = ce;
+    variant.query = makeQuery(QUERY, "WWW.EXAMPLE.COM", ns_c_in, ns_t_a);
+    variant.query[0] ^= 0xff;
+    variant.query[2] |= 0x02;
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, variant));
+
+    // The RD bit, the type and the name are not.
+    variant.query = ce.query;
+    variant.query[2] ^= 0x01;
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, variant));
+    variant.query = makeQuery(QUERY, "www.example.com", ns_c_in, ns_t_aaaa);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, variant));
+    variant.query = makeQuery(QUERY, "www.example.co", ns_c_in, ns_t_a);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, variant));
+}
+
+// Measures the latency of cache hits on the names of a few popular sites, looked up in lower and
+// in mixed case, and records it as a test property.
+TEST_F(ResolvCacheTest, CacheLookup_MixedCaseLatency) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    constexpr const char* kTopSites[] = {
+            "facebook.com",   "www.amazon.com",  "www.bing.com",      "www.ebay.com",
+            "www.google.com", "www.netflix.com", "www.reddit.com",    "www.wikipedia.org",
+            "www.yahoo.com",  "www.youtube.com",
+    };
+
+    std::vector<std::vector<uint8_t>> queries;
+    for (const char* name : kTopSites) {
+        std::string mixedCase = name;
+        for (size_t i = 0; i < mixedCase.size(); i += 2) mixedCase[i] = toupper(mixedCase[i]);
+        for (int type : {ns_t_a, ns_t_aaaa}) {
+            const CacheEntry ce = makeCacheEntry(QUERY, name, ns_c_in, type,
+                                                 type == ns_t_a ? "1.2.3.4" : "2001:db8::1");
+            EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+            queries.push_back(ce.query);
+            queries.push_back(makeQuery(QUERY, mixedCase.c_str(), ns_c_in, type));
+        }
+    }
+
+    constexpr int kLookups = 100000;
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+    int found = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kLookups; i++) {
+        if (resolv_cache_lookup(TEST_NETID, queries[i % queries.size()], answer, &anslen, 0) ==
+            RESOLV_CACHE_FOUND) {
+            found++;
+        }
+    }
+    const std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(kLookups, found);
+    RecordProperty("ns_per_lookup", elapsed.count() / kLookups);
+}
+
+TEST_F(ResolvCacheTest, CacheLookup_Shared) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    const CacheEntry ce = makeCacheEntry(QUERY, "shared.in.cache", ns_c_in, ns_t_a, "1.2.3.4");
+
+    ResolvCacheAnswer first;
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, resolv_cache_lookup_shared(TEST_NETID, ce.query, &first, 0));
+    EXPECT_EQ(nullptr, first);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    CacheStatsParcel stats;
+    EXPECT_EQ(0, resolv_cache_get_stats(TEST_NETID, &stats));
+    const int64_t unsharedBytes = stats.bytes;
+
+    // All the hits share the same buffer, which is charged to the cache once.
+    EXPECT_EQ(RESOLV_CACHE_FOUND, resolv_cache_lookup_shared(TEST_NETID, ce.query, &first, 0));
+    ASSERT_NE(nullptr, first);
+    EXPECT_EQ(ce.answer, *first);
+    ResolvCacheAnswer second;
+    EXPECT_EQ(RESOLV_CACHE_FOUND, resolv_cache_lookup_shared(TEST_NETID, ce.query, &second, 0));
+    EXPECT_EQ(first, second);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    EXPECT_EQ(0, resolv_cache_get_stats(TEST_NETID, &stats));
+    EXPECT_EQ(unsharedBytes + static_cast<int64_t>(ce.answer.size()), stats.bytes);
+
+    // The answer outlives its entry.
+    EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+    EXPECT_EQ(ce.answer, *first);
+
+    // The flushed cache takes entries again.
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+}
+
+// Measures the latency of looking up a hot name from several threads, with the answer copied and
+// with it shared, and records it as test properties.
+TEST_F(ResolvCacheTest, CacheLookup_SharedHotNameLatency) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    const CacheEntry ce = makeCacheEntry(QUERY, "www.google.com", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    constexpr int kThreads = 8;
+    constexpr int kLookups = 20000;
+    auto run = [&](const char* name, auto lookup) {
+        std::atomic_int found = 0;
+        std::vector<std::thread> threads(kThreads);
+        const auto start = std::chrono::steady_clock::now();
+        for (std::thread& thread : threads) {
+            thread = std::thread([&]() {
+                for (int i = 0; i < kLookups; i++) {
+                    if (lookup() == RESOLV_CACHE_FOUND) found++;
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        const std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+        EXPECT_EQ(kThreads * kLookups, found);
+        RecordProperty(std::string(name) + "_ns_per_lookup",
+                       elapsed.count() / (kThreads * kLookups));
+    };
+
+    run("copying", [&]() {
+        thread_local std::vector<uint8_t> answer(MAXPACKET);
+        int anslen = 0;
+        return resolv_cache_lookup(TEST_NETID, ce.query, answer, &anslen, 0);
+    });
+    run("shared", [&]() {
+        ResolvCacheAnswer answer;
+        return resolv_cache_lookup_shared(TEST_NETID, ce.query, &answer, 0);
+    });
+}
+
 TEST_F(ResolvCacheTest, CacheLookup_InvalidArgs) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
 
@@ -425,6 +581,39 @@ TEST_F(ResolvCacheTest, CacheLookup_InvalidArgs) {
     EXPECT_TRUE(cacheLookup(RESOLV_CACHE_UNSUPPORTED, TEST_NETID_2, ce));
 }
 
+TEST_F(ResolvCacheTest, CacheStats) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    CacheStatsParcel stats;
+    EXPECT_EQ(-ENONET, resolv_cache_get_stats(TEST_NETID_2, &stats));
+
+    const CacheEntry ce = makeCacheEntry(QUERY, "stats.in.cache", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+
+    // The queries which bypass the cache aren't counted.
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce, ANDROID_RESOLV_NO_CACHE_LOOKUP));
+
+    EXPECT_EQ(0, resolv_cache_get_stats(TEST_NETID, &stats));
+    EXPECT_EQ(3, stats.lookups);
+    EXPECT_EQ(2, stats.hits);
+    EXPECT_EQ(1, stats.misses);
+    EXPECT_EQ(1, stats.entries);
+    EXPECT_GT(stats.bytes, 0);
+    EXPECT_EQ(0, stats.evictedFlushed);
+    EXPECT_EQ(3, std::accumulate(stats.lookupLatencyHistogram.begin(),
+                                 stats.lookupLatencyHistogram.end(), int64_t{0}));
+
+    // The counters survive a flush, which is counted as well.
+    EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    EXPECT_EQ(0, resolv_cache_get_stats(TEST_NETID, &stats));
+    EXPECT_EQ(3, stats.lookups);
+    EXPECT_EQ(1, stats.evictedFlushed);
+    EXPECT_EQ(0, stats.entries);
+    EXPECT_EQ(0, stats.bytes);
+}
+
 TEST_F(ResolvCacheTest, CacheLookup_Expired) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
 
@@ -448,6 +637,289 @@ TEST_F(ResolvCacheTest, CacheLookup_Expired) {
     EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
 }
 
+TEST_F(ResolvCacheTest, CacheLookup_ServeStale) {
+    ScopedSystemProperties sp1(kServeStaleWindowFlag, "60");
+    ScopedSystemProperties sp2(kStaleAnswerTimeoutFlag, "200");
+    android::net::Experiments::getInstance()->update();
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    const auto getAnswerTtl = [](std::span<const uint8_t> answer) -> int {
+        ns_msg handle;
+        ns_rr rr;
+        if (ns_initparse(answer.data(), answer.size(), &handle) < 0) return -1;
+        if (ns_parserr(&handle, ns_s_an, 0, &rr) < 0) return -1;
+        return ns_rr_ttl(rr);
+    };
+    const auto lookupStale = [&](ResolvCacheStatus expected, auto lookupFn) {
+        std::vector<uint8_t> answer(MAXPACKET);
+        int anslen = 0;
+        EXPECT_EQ(expected, lookupFn(answer, &anslen));
+        if (expected == RESOLV_CACHE_FOUND) {
+            EXPECT_EQ(30, getAnswerTtl(std::span(answer.data(), anslen)));
+        }
+    };
+
+    CacheEntry ce = makeCacheEntry(QUERY, "stale.in.1s", ns_c_in, ns_t_a, "1.2.3.4", 1s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    std::this_thread::sleep_for(1500ms);
+
+    // The first lookup of the stale entry refreshes it.
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+
+    // Other lookups get the stale answer once the stale answer timeout elapses.
+    const auto start = std::chrono::steady_clock::now();
+    lookupStale(RESOLV_CACHE_FOUND, [&](std::span<uint8_t> answer, int* anslen) {
+        return resolv_cache_lookup(TEST_NETID, ce.query, answer, anslen, 0);
+    });
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 200ms);
+
+    // The refresh fails, so the stale answer is served, and the following lookups get it right
+    // away without trying the upstream servers again.
+    cacheQueryFailed(TEST_NETID, ce, 0);
+    lookupStale(RESOLV_CACHE_FOUND, [&](std::span<uint8_t> answer, int* anslen) {
+        return resolv_cache_lookup_stale(TEST_NETID, ce.query, answer, anslen, 0);
+    });
+    lookupStale(RESOLV_CACHE_FOUND, [&](std::span<uint8_t> answer, int* anslen) {
+        return resolv_cache_lookup(TEST_NETID, ce.query, answer, anslen, 0);
+    });
+    lookupStale(RESOLV_CACHE_SKIP, [&](std::span<uint8_t> answer, int* anslen) {
+        return resolv_cache_lookup_stale(TEST_NETID, ce.query, answer, anslen,
+                                         ANDROID_RESOLV_NO_CACHE_LOOKUP);
+    });
+
+    // A fresh answer replaces the stale entry.
+    ce = makeCacheEntry(QUERY, "stale.in.1s", ns_c_in, ns_t_a, "1.2.3.4", 10s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    lookupStale(RESOLV_CACHE_NOTFOUND, [&](std::span<uint8_t> answer, int* anslen) {
+        return resolv_cache_lookup_stale(TEST_NETID, ce.query, answer, anslen, 0);
+    });
+}
+
+TEST_F(ResolvCacheTest, CacheLookup_ServeStaleWhileRefreshing) {
+    ScopedSystemProperties sp1(kServeStaleWindowFlag, "60");
+    ScopedSystemProperties sp2(kStaleAnswerTimeoutFlag, "200");
+    android::net::Experiments::getInstance()->update();
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    const CacheEntry slow = makeCacheEntry(QUERY, "slow.in.1s", ns_c_in, ns_t_a, "1.2.3.4", 1s);
+    const CacheEntry fast = makeCacheEntry(QUERY, "fast.in.1s", ns_c_in, ns_t_a, "1.2.3.4", 1s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, slow));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, fast));
+    std::this_thread::sleep_for(1500ms);
+
+    const auto lookupLeader = [](const CacheEntry& ce) {
+        ResolvCacheAnswer shared;
+        bool stale = false;
+        EXPECT_EQ(RESOLV_CACHE_NOTFOUND,
+                  resolv_cache_lookup_shared(TEST_NETID, ce.query, &shared, 0, nullptr, &stale));
+        EXPECT_TRUE(stale);
+    };
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+
+    // The lookup which refreshes a stale entry gets the stale answer once the stale answer
+    // timeout elapses, and the lookups which come while the refresh goes on get it right away.
+    lookupLeader(slow);
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(RESOLV_CACHE_FOUND, resolv_cache_wait_refresh(TEST_NETID, slow.query, answer,
+                                                            &anslen));
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 200ms);
+    EXPECT_NE(std::vector(answer.begin(), answer.begin() + anslen), slow.answer);
+    start = std::chrono::steady_clock::now();
+    EXPECT_EQ(RESOLV_CACHE_FOUND,
+              resolv_cache_lookup(TEST_NETID, slow.query, answer, &anslen, 0));
+    EXPECT_LT(std::chrono::steady_clock::now() - start, 200ms);
+
+    // The refresh still replaces the entry once it completes.
+    const CacheEntry slowRefreshed =
+            makeCacheEntry(QUERY, "slow.in.1s", ns_c_in, ns_t_a, "1.2.3.4", 10s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, slowRefreshed));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, slowRefreshed));
+
+    // A refresh which completes within the timeout gives its answer.
+    lookupLeader(fast);
+    const CacheEntry fastRefreshed =
+            makeCacheEntry(QUERY, "fast.in.1s", ns_c_in, ns_t_a, "1.2.3.4", 10s);
+    std::thread refresh([&] {
+        std::this_thread::sleep_for(50ms);
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, fastRefreshed));
+    });
+    EXPECT_EQ(RESOLV_CACHE_FOUND, resolv_cache_wait_refresh(TEST_NETID, fast.query, answer,
+                                                            &anslen));
+    EXPECT_EQ(std::vector(answer.begin(), answer.begin() + anslen), fastRefreshed.answer);
+    refresh.join();
+}
+
+TEST_F(ResolvCacheTest, CacheLookup_Prefetch) {
+    ScopedSystemProperties sp(kPrefetchThresholdFlag, "50");
+    android::net::Experiments::getInstance()->update();
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+    const auto lookup = [&](const CacheEntry& ce) {
+        bool prefetch = false;
+        EXPECT_EQ(RESOLV_CACHE_FOUND,
+                  resolv_cache_lookup(TEST_NETID, ce.query, answer, &anslen, 0, &prefetch));
+        return prefetch;
+    };
+
+    // Hits in the first half of the TTL don't trigger a prefetch, but they earn prefetch budget.
+    CacheEntry ce = makeCacheEntry(QUERY, "prefetch.in.4s", ns_c_in, ns_t_a, "1.2.3.4", 4s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    for (int i = 0; i < 20; i++) {
+        EXPECT_FALSE(lookup(ce));
+    }
+
+    // The first hit in the second half of the TTL triggers a prefetch, only once.
+    std::this_thread::sleep_for(2100ms);
+    EXPECT_TRUE(lookup(ce));
+    EXPECT_FALSE(lookup(ce));
+
+    // Unless that prefetch fails.
+    resolv_cache_prefetch_failed(TEST_NETID, ce.query);
+    EXPECT_TRUE(lookup(ce));
+    EXPECT_FALSE(lookup(ce));
+
+    // The prefetched answer replaces the entry.
+    time_t expiration1;
+    EXPECT_EQ(0, cacheGetExpiration(TEST_NETID, ce.query, &expiration1));
+    CacheEntry prefetched = makeCacheEntry(QUERY, "prefetch.in.4s", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(-EEXIST, cacheAdd(TEST_NETID, prefetched));
+    EXPECT_EQ(0, resolv_cache_refresh(TEST_NETID, prefetched.query, prefetched.answer));
+    time_t expiration2;
+    EXPECT_EQ(0, cacheGetExpiration(TEST_NETID, ce.query, &expiration2));
+    EXPECT_GT(expiration2, expiration1);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, prefetched));
+}
+
+TEST_F(ResolvCacheTest, CacheSnapshot) {
+    ScopedSystemProperties sp(kSnapshotIntervalFlag, "3600");
+    android::net::Experiments::getInstance()->update();
+    TemporaryDir dir;
+    resolv_cache_set_snapshot_dir(dir.path);
+    const std::string path = fmt::format("{}/cache_{}.snap", dir.path, TEST_NETID);
+    const SetupParams setup = {
+            .servers = {"127.0.0.1", "::127.0.0.2"},
+            .domains = {"domain1.com"},
+            .params = kParams,
+    };
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+
+    const CacheEntry ce1 = makeCacheEntry(QUERY, "snapshot.in.10s", ns_c_in, ns_t_a, "1.2.3.4");
+    const CacheEntry ce2 = makeCacheEntry(QUERY, "snapshot.in.1s", ns_c_in, ns_t_a, "1.2.3.4", 1s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce1));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce2));
+    time_t expiration1;
+    EXPECT_EQ(0, cacheGetExpiration(TEST_NETID, ce1.query, &expiration1));
+    EXPECT_EQ(0, resolv_cache_save_snapshots());
+    struct stat st;
+    ASSERT_EQ(0, stat(path.c_str(), &st));
+    EXPECT_EQ(0600U, st.st_mode & 0777);
+
+    // Deleting the network removes its snapshot, so keep a copy to simulate a restart.
+    std::string snapshot;
+    ASSERT_TRUE(android::base::ReadFileToString(path, &snapshot));
+    cacheDelete(TEST_NETID);
+    EXPECT_NE(0, access(path.c_str(), F_OK));
+    ASSERT_TRUE(android::base::WriteStringToFile(snapshot, path));
+
+    // The entries which are still valid are loaded once the network is configured as it was,
+    // and expire when they would have.
+    std::this_thread::sleep_for(1500ms);
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce1));
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+    EXPECT_EQ(RESOLV_CACHE_FOUND, resolv_cache_lookup(TEST_NETID, ce1.query, answer, &anslen, 0));
+    time_t expiration2;
+    EXPECT_EQ(0, cacheGetExpiration(TEST_NETID, ce1.query, &expiration2));
+    EXPECT_EQ(expiration1, expiration2);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce2));
+
+    // A network which reuses the netId with other servers doesn't get the entries, and the
+    // snapshot is discarded.
+    cacheDelete(TEST_NETID);
+    ASSERT_TRUE(android::base::WriteStringToFile(snapshot, path));
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    SetupParams otherSetup = setup;
+    otherSetup.servers = {"127.0.0.3"};
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, otherSetup));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce1));
+    EXPECT_NE(0, access(path.c_str(), F_OK));
+
+    resolv_cache_set_snapshot_dir("");
+}
+
+TEST_F(ResolvCacheTest, CacheSharing) {
+    ScopedSystemProperties sp(kShareCacheFlag, "1");
+    android::net::Experiments::getInstance()->update();
+    const SetupParams setup = {
+            .servers = {"192.0.2.1", "2001:db8::2"},
+            .domains = {"domain1.com", "domain2.com"},
+            .params = kParams,
+    };
+    SetupParams reordered = setup;
+    std::reverse(reordered.servers.begin(), reordered.servers.end());
+    SetupParams other = setup;
+    other.servers = {"192.0.2.3"};
+    for (const int netId : {TEST_NETID, TEST_NETID_2, TEST_NETID_3}) {
+        EXPECT_EQ(0, cacheCreate(netId));
+    }
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID_2, reordered));
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID_3, other));
+
+    // Networks with the same servers share their answers, regardless of the order of the servers.
+    const CacheEntry ce = makeCacheEntry(QUERY, "shared.example", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID_2, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID_3, ce));
+    cacheQueryFailed(TEST_NETID_3, ce, 0);
+
+    // A network whose configuration diverges leaves the others' entries alone.
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID_2, other));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID_2, ce));
+    cacheQueryFailed(TEST_NETID_2, ce, 0);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+
+    // Deleting a network keeps the cache for the remaining networks.
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID_2, setup));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID_2, ce));
+    cacheDelete(TEST_NETID);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID_2, ce));
+
+    // Flushing a shared cache flushes it for all its networks, and is counted for each of them.
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    EXPECT_EQ(0, cacheFlush(TEST_NETID_2));
+    for (const int netId : {TEST_NETID, TEST_NETID_2}) {
+        CacheStatsParcel stats;
+        EXPECT_EQ(0, resolv_cache_get_stats(netId, &stats));
+        EXPECT_EQ(1, stats.evictedFlushed);
+    }
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+    cacheQueryFailed(TEST_NETID, ce, 0);
+
+    // The same private or link-local address may be a different server on each network.
+    for (const auto& server : {"192.168.1.1", "10.0.0.1", "100.64.0.1", "fe80::1", "fd00::1"}) {
+        SCOPED_TRACE(server);
+        SetupParams local = setup;
+        local.servers = {"192.0.2.1", server};
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, local));
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID_2, local));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID_2, ce));
+        cacheQueryFailed(TEST_NETID_2, ce, 0);
+        EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    }
+}
+
 TEST_F(ResolvCacheTest, PendingRequest_QueryDeferred) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
     EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
@@ -524,6 +996,41 @@ TEST_F(ResolvCacheTest, PendingRequest_QueryFailed) {
     }
 }
 
+TEST_F(ResolvCacheTest, PendingRequest_UncacheableAnswer) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    // An answer with zero ttl isn't cached, but it is still handed over to the waiting threads.
+    CacheEntry ce = makeCacheEntry(QUERY, "query.uncacheable", ns_c_in, ns_t_a, "1.2.3.4", 0s);
+    std::atomic_bool done(false);
+
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+
+    std::vector<std::thread> threads(5);
+    for (std::thread& thread : threads) {
+        thread = std::thread([&]() {
+            EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+
+            // Ensure this thread gets stuck in lookups before we wake it.
+            EXPECT_TRUE(done);
+        });
+    }
+
+    // Wait for a while for the threads performing lookups.
+    std::this_thread::sleep_for(100ms);
+
+    // Wake up the threads
+    done = true;
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    // The next lookup becomes the leader of a new query.
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+    cacheQueryFailed(TEST_NETID, ce, 0);
+}
+
 TEST_F(ResolvCacheTest, PendingRequest_CacheDestroyed) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
     EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
@@ -625,6 +1132,265 @@ TEST_F(ResolvCacheTest, CacheFull) {
     EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce1));
 }
 
+TEST_F(ResolvCacheTest, CacheFull_SecondChance) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    // Fill the cache without looking anything up, so that no entry is marked as referenced.
+    std::vector<CacheEntry> ces;
+    const int max_cache_entries = resolv_get_max_cache_entries(TEST_NETID);
+    for (int i = 0; i < max_cache_entries; i++) {
+        std::string qname = fmt::format("cache.{:06d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        ces.emplace_back(ce);
+    }
+
+    // A hit on the oldest entry gives it a second chance, so the next oldest one is evicted.
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ces[0]));
+    CacheEntry ce = makeCacheEntry(QUERY, "cache.overfilled", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ces[0]));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ces[1]));
+}
+
+TEST_F(ResolvCacheTest, CacheFull_ByteBudget) {
+    {
+        ScopedSystemProperties sp(kMaxBytesFlag, "4096");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    // The byte budget is reached long before the entry limit, so the oldest entries are evicted.
+    std::vector<CacheEntry> ces;
+    for (int i = 0; i < 100; i++) {
+        std::string qname = fmt::format("cache.{:06d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+        ces.emplace_back(ce);
+    }
+    std::vector<bool> found;
+    for (const auto& ce : ces) {
+        std::vector<uint8_t> answer(MAXPACKET);
+        int anslen = 0;
+        found.push_back(resolv_cache_lookup(TEST_NETID, ce.query, answer, &anslen, 0) ==
+                        RESOLV_CACHE_FOUND);
+    }
+    EXPECT_FALSE(found.front());
+    EXPECT_TRUE(found.back());
+    EXPECT_LT(std::count(found.begin(), found.end(), true), 100);
+
+    // An answer larger than the whole budget is not cached, and doesn't evict anything.
+    CacheEntry large = makeCacheEntry(QUERY, "cache.large", ns_c_in, ns_t_a, "1.2.3.4");
+    large.answer.resize(4096);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, large));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, large));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ces.back()));
+}
+
+TEST_F(ResolvCacheTest, CacheFull_TotalByteBudget) {
+    {
+        ScopedSystemProperties sp(kMaxTotalBytesFlag, "4096");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    // The second network holds one small entry, and the first one takes the rest of the budget.
+    const CacheEntry small = makeCacheEntry(QUERY, "small", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID_2, small));
+    for (int i = 0; i < 100; i++) {
+        const std::string qname = fmt::format("cache.{:06d}", i);
+        EXPECT_EQ(0, cacheAdd(TEST_NETID,
+                              makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4")));
+    }
+
+    // An entry which wouldn't fit even once the second network's cache is empty isn't cached, and
+    // doesn't evict anything.
+    const std::string label(63, 'a');
+    const std::string qname = fmt::format("{0}.{0}.{0}.large", label);
+    const CacheEntry large = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID_2, large));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID_2, large));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID_2, small));
+}
+
+TEST_F(ResolvCacheTest, CacheFull_AdmissionFilter) {
+    {
+        ScopedSystemProperties sp1(kMaxCacheEntriesFlag, "100");
+        ScopedSystemProperties sp2(kAdmissionFilterFlag, "1");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    const auto lookupAndAdd = [this](const std::string& qname) {
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        if (cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce)) {
+            EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        }
+        return ce;
+    };
+
+    // Popular entries, looked up a few times each.
+    std::vector<CacheEntry> popular;
+    for (int i = 0; i < 50; i++) {
+        popular.emplace_back(lookupAndAdd(fmt::format("popular.{:06d}", i)));
+        for (int j = 0; j < 4; j++) {
+            EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, popular.back()));
+        }
+    }
+
+    // A scan of one-time queries only churns the admission window and the other one-time
+    // entries, instead of evicting the popular entries as plain CLOCK would.
+    for (int i = 0; i < 1000; i++) {
+        lookupAndAdd(fmt::format("scan.{:06d}", i));
+    }
+    for (const auto& ce : popular) {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    }
+}
+
+// Measures the latency of adding entries to a full cache, when the entries to make room for come
+// from expired entries and when they come from evictions. The latencies are recorded as test
+// properties.
+TEST_F(ResolvCacheTest, CacheAdd_FullCacheLatency) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    const int max_cache_entries = resolv_get_max_cache_entries(TEST_NETID);
+
+    // Half of the entries expire in 1s, the others are still valid when the measurement starts.
+    for (int i = 0; i < max_cache_entries; i++) {
+        std::string qname = fmt::format("cache.{:06d}", i);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4",
+                                       i % 2 ? 1s : 300s);
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    }
+    std::this_thread::sleep_for(1500ms);
+
+    std::vector<std::chrono::nanoseconds> latencies;
+    for (int i = 0; i < max_cache_entries; i++) {
+        std::string qname = fmt::format("cache.overfilled.{:06d}", i);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4", 300s);
+        const auto start = std::chrono::steady_clock::now();
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        latencies.push_back(std::chrono::steady_clock::now() - start);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    RecordProperty("adds", latencies.size());
+    RecordProperty("add_median_ns", latencies[latencies.size() / 2].count());
+    RecordProperty("add_p99_ns", latencies[latencies.size() * 99 / 100].count());
+    RecordProperty("add_max_ns", latencies.back().count());
+}
+
+// Measures cache hit throughput with threads spread over several networks. Each network has its
+// own lock, so the throughput is expected to grow with the number of threads instead of being
+// capped by a single lock. The throughputs are recorded as test properties.
+TEST_F(ResolvCacheTest, ConcurrentLookupsAcrossNetworks) {
+    constexpr int kEntriesPerNetwork = 100;
+    constexpr int kLookupsPerThread = 20000;
+    const std::vector<unsigned> netIds = {TEST_NETID, TEST_NETID_2, TEST_NETID_3, TEST_NETID_4};
+
+    std::vector<std::vector<CacheEntry>> entries(netIds.size());
+    for (size_t n = 0; n < netIds.size(); n++) {
+        EXPECT_EQ(0, cacheCreate(netIds[n]));
+        for (int i = 0; i < kEntriesPerNetwork; i++) {
+            std::string qname = fmt::format("cache.{:06d}.net{}", i, netIds[n]);
+            CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4", 300s);
+            EXPECT_EQ(0, cacheAdd(netIds[n], ce));
+            entries[n].push_back(std::move(ce));
+        }
+    }
+
+    for (const int numThreads : {1, 2, 4, 8}) {
+        std::atomic_int misses = 0;
+        std::vector<std::thread> threads(numThreads);
+        const auto start = std::chrono::steady_clock::now();
+        for (int t = 0; t < numThreads; t++) {
+            threads[t] = std::thread([&, t]() {
+                const size_t n = t % netIds.size();
+                std::vector<uint8_t> answer(MAXPACKET);
+                int anslen = 0;
+                for (int i = 0; i < kLookupsPerThread; i++) {
+                    const CacheEntry& ce = entries[n][i % kEntriesPerNetwork];
+                    if (resolv_cache_lookup(netIds[n], ce.query, answer, &anslen, 0) !=
+                        RESOLV_CACHE_FOUND) {
+                        misses++;
+                    }
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        EXPECT_EQ(0, misses);
+        RecordProperty(fmt::format("lookups_per_sec_{}_threads", numThreads),
+                       static_cast<int>(numThreads * kLookupsPerThread / elapsed.count()));
+    }
+}
+
+// Measures how long flushing a large cache holds its lock, which is the longest that a lookup on
+// that network waits, and the lookup latency on another network meanwhile. The entries are freed
+// in the background, so the flush shouldn't grow with the number of entries. The latencies are
+// recorded as test properties.
+TEST_F(ResolvCacheTest, CacheFlush_LookupLatency) {
+    constexpr int kEntries = 50000;
+    constexpr int kFlushes = 5;
+    {
+        ScopedSystemProperties sp(kMaxCacheEntriesFlag, std::to_string(kEntries));
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    const CacheEntry hot = makeCacheEntry(QUERY, "hot.example", ns_c_in, ns_t_a, "1.2.3.4", 300s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, hot));
+
+    std::atomic_bool done = false;
+    std::vector<std::chrono::nanoseconds> latencies;
+    std::thread lookups([&]() {
+        std::vector<uint8_t> answer(MAXPACKET);
+        int anslen = 0;
+        while (!done) {
+            const auto start = std::chrono::steady_clock::now();
+            EXPECT_EQ(RESOLV_CACHE_FOUND,
+                      resolv_cache_lookup(TEST_NETID, hot.query, answer, &anslen, 0));
+            latencies.push_back(std::chrono::steady_clock::now() - start);
+        }
+    });
+
+    std::vector<std::chrono::nanoseconds> flushes;
+    for (int n = 0; n < kFlushes; n++) {
+        for (int i = 0; i < kEntries; i++) {
+            std::string qname = fmt::format("flush.{:06d}", i);
+            CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4", 300s);
+            EXPECT_EQ(0, cacheAdd(TEST_NETID_2, ce));
+        }
+        const auto start = std::chrono::steady_clock::now();
+        EXPECT_EQ(0, cacheFlush(TEST_NETID_2));
+        flushes.push_back(std::chrono::steady_clock::now() - start);
+    }
+    done = true;
+    lookups.join();
+
+    std::sort(flushes.begin(), flushes.end());
+    std::sort(latencies.begin(), latencies.end());
+    RecordProperty("flush_median_us", flushes[flushes.size() / 2].count() / 1000);
+    RecordProperty("flush_max_us", flushes.back().count() / 1000);
+    RecordProperty("lookups", latencies.size());
+    RecordProperty("lookup_median_ns", latencies[latencies.size() / 2].count());
+    RecordProperty("lookup_p99_ns", latencies[latencies.size() * 99 / 100].count());
+    RecordProperty("lookup_max_ns", latencies.back().count());
+}
+
 class ResolvCacheParameterizedTest : public ResolvCacheTest,
                                      public testing::WithParamInterface<int> {};
 
@@ -870,6 +1636,73 @@ TEST_F(ResolvCacheTest, GetHostByAddrFromCache) {
     EXPECT_STREQ(answer, domain_name);
 }
 
+TEST_F(ResolvCacheTest, GetHostByAddrFromCache_EntryRemoved) {
+    char domain_name[NS_MAXDNAME] = {};
+    const char query_v4[] = "1.2.3.5";
+    const char answer[] = "existent.in.cache";
+
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    CacheEntry ce = makeCacheEntry(QUERY, answer, ns_c_in, ns_t_a, query_v4);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                AF_INET));
+    EXPECT_STREQ(answer, domain_name);
+
+    // Evict the entry by filling up the cache.
+    const int max_cache_entries = resolv_get_max_cache_entries(TEST_NETID);
+    for (int i = 0; i < max_cache_entries; i++) {
+        std::string qname = fmt::format("cache.{:06d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    }
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+    memset(domain_name, 0, NS_MAXDNAME);
+    EXPECT_FALSE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                 AF_INET));
+    EXPECT_STREQ("", domain_name);
+
+    // Flushing the cache drops the remaining addresses.
+    EXPECT_TRUE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, "1.2.3.4",
+                                                AF_INET));
+    EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    memset(domain_name, 0, NS_MAXDNAME);
+    EXPECT_FALSE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, "1.2.3.4",
+                                                 AF_INET));
+}
+
+// Measures reverse lookups against a full cache, where every entry has a distinct address, and
+// records their rate as test properties.
+TEST_F(ResolvCacheTest, GetHostByAddrFromCache_FullCache) {
+    constexpr int kLookups = 20000;
+    char domain_name[NS_MAXDNAME] = {};
+
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    const int max_cache_entries = resolv_get_max_cache_entries(TEST_NETID);
+    std::vector<std::string> addrs;
+    for (int i = 0; i < max_cache_entries; i++) {
+        std::string qname = fmt::format("cache.{:06d}", i);
+        addrs.push_back(fmt::format("10.0.{}.{}", i / 256, i % 256));
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, addrs.back().data());
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    }
+
+    for (const bool hit : {true, false}) {
+        int found = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kLookups; i++) {
+            const char* addr = hit ? addrs[i % max_cache_entries].data() : "192.0.2.1";
+            found += resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, addr,
+                                                     AF_INET);
+        }
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        EXPECT_EQ(hit ? kLookups : 0, found);
+        RecordProperty(hit ? "hits_per_sec" : "misses_per_sec",
+                       static_cast<int>(kLookups / elapsed.count()));
+    }
+}
+
 TEST_F(ResolvCacheTest, GetResolverStats) {
     const res_sample sample1 = {.at = time(nullptr), .rtt = 100, .rcode = ns_r_noerror};
     const res_sample sample2 = {.at = time(nullptr), .rtt = 200, .rcode = ns_r_noerror};
@@ -929,6 +1762,28 @@ TEST_F(ResolvCacheTest, GetResolverStats) {
     }
 }
 
+TEST_F(ResolvCacheTest, HedgeBudget) {
+    const IPSockAddr server = IPSockAddr::toIPSockAddr("127.0.0.1", DNS_PORT);
+    EXPECT_FALSE(resolv_hedge_spend(TEST_NETID));
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, {.servers = {"127.0.0.1"}, .params = kParams}));
+
+    // Without stats, there is nothing to derive the hedge delay from.
+    EXPECT_EQ(resolv_hedge_delay(TEST_NETID, server, 90, 50), std::nullopt);
+    EXPECT_FALSE(resolv_hedge_spend(TEST_NETID));
+
+    // Two queries at 50% each earn one hedge.
+    EXPECT_EQ(resolv_hedge_delay(TEST_NETID, server, 90, 50), std::nullopt);
+    EXPECT_TRUE(resolv_hedge_spend(TEST_NETID));
+    EXPECT_FALSE(resolv_hedge_spend(TEST_NETID));
+
+    // The budget saved up is capped.
+    for (int i = 0; i < 100; i++) resolv_hedge_delay(TEST_NETID, server, 90, 100);
+    int spent = 0;
+    while (resolv_hedge_spend(TEST_NETID)) spent++;
+    EXPECT_EQ(10, spent);
+}
+
 TEST_F(ResolvCacheTest, IsEnforceDnsUidEnabled) {
     const SetupParams unenforcedDnsUidCfg = {
             .servers = {"127.0.0.1", "::127.0.0.2", "fe80::3"},
@@ -27,6 +27,15 @@
 #include <netdutils/NetNativeTestBase.h>
 #include <resolv_stats_test_utils.h>
 
+#include <chrono>
+#include <ctime>
+#include <thread>
+
+#include "Experiments.h"
+#include "LookupExecutor.h"
+#include "MdnsEngine.h"
+#include "TcpConnectionPool.h"
+#include "UdpSocketPool.h"
 #include "dns_responder.h"
 #include "getaddrinfo.h"
 #include "gethnamaddr.h"
@@ -1052,6 +1061,48 @@ TEST_F(ResolvGetAddrInfoTest, MdnsResponderTimeout) {
     }
 }
 
+// With the mDNS engine, a .local name which was just resolved is answered from the records which
+// the engine cached, without another query.
+TEST_F(ResolvGetAddrInfoTest, MdnsEngine_AnswersRepeatedLookupsLocally) {
+    constexpr char v4addr[] = "127.0.0.3";
+    constexpr char host_name[] = "hello.local.";
+    test::DNSResponder mdnsv4("127.0.0.3", test::kDefaultMdnsListenService);
+    mdnsv4.addMapping(host_name, ns_type::ns_t_a, v4addr);
+    mdnsv4.setTtl(120);
+    ASSERT_TRUE(mdnsv4.startServer());
+    ASSERT_EQ(0, SetResolvers());
+    {
+        ScopedSystemProperties sp("persist.device_config.netd_native.mdns_engine", "1");
+        Experiments::getInstance()->update();
+        MdnsEngine::getInstance().clear(TEST_NETID);
+
+        for (const auto& [cacheHit, latencyBoundMs] :
+             {std::pair{CS_NOTFOUND, 2000}, {CS_FOUND, 5}}) {
+            SCOPED_TRACE(fmt::format("cache_hit: {}", static_cast<int>(cacheHit)));
+            addrinfo* result = nullptr;
+            const addrinfo hints = {.ai_family = AF_INET};
+            NetworkDnsEventReported event;
+            EXPECT_EQ(0, resolv_getaddrinfo("hello.local", nullptr, &hints, &mNetcontext, &result,
+                                            &event));
+            ScopedAddrinfo result_cleanup(result);
+            EXPECT_EQ(ToString(result), v4addr);
+            EXPECT_EQ(1U, GetNumQueries(mdnsv4, host_name));
+            ASSERT_EQ(1, event.dns_query_events().dns_query_event_size());
+            const auto& queryEvent = event.dns_query_events().dns_query_event(0);
+            EXPECT_EQ(cacheHit, queryEvent.cache_hit());
+            EXPECT_EQ(android::net::PROTO_MDNS, queryEvent.protocol());
+            EXPECT_LT(queryEvent.latency_micros(), latencyBoundMs * 1000);
+        }
+
+        const auto stats = MdnsEngine::getInstance().getStats(TEST_NETID);
+        EXPECT_EQ(1U, stats.queriesSent);
+        EXPECT_EQ(1U, stats.localAnswers);
+
+        MdnsEngine::getInstance().clear(TEST_NETID);
+    }
+    Experiments::getInstance()->update();
+}
+
 TEST_F(ResolvGetAddrInfoTest, CnamesNoIpAddress) {
     constexpr char ACNAME[] = "acname";  // expect a cname in answer
     constexpr char CNAMES[] = "cnames";  // expect cname chain in answer
@@ -1372,6 +1423,466 @@ TEST_F(ResolvGetAddrInfoTest, OverlengthResp) {
     EXPECT_EQ(GetNumQueriesForProtocol(dns, IPPROTO_TCP, kHelloExampleCom), 2U);
 }
 
+// DNSResponder closes each TCP connection once it answered a query. The pooled connection which
+// the second query reuses is found closed, and the query is retried on a new connection.
+TEST_F(ResolvGetAddrInfoTest, TcpConnectionPool_ClosedByServer) {
+    test::DNSResponder dns;
+    // A CNAME chain long enough for the UDP answers to be truncated.
+    dns.addMapping(kHelloExampleCom, ns_type::ns_t_cname, kCnameA);
+    dns.addMapping(kCnameA, ns_type::ns_t_cname, kCnameB);
+    dns.addMapping(kCnameB, ns_type::ns_t_cname, kCnameC);
+    dns.addMapping(kCnameC, ns_type::ns_t_cname, kCnameD);
+    dns.addMapping(kCnameD, ns_type::ns_t_a, kHelloExampleComAddrV4);
+    dns.addMapping(kCnameD, ns_type::ns_t_aaaa, kHelloExampleComAddrV6);
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_EQ(0, SetResolvers());
+    {
+        ScopedSystemProperties sp("persist.device_config.netd_native.tcp_connection_pool", "1");
+        Experiments::getInstance()->update();
+        TcpConnectionPool::getInstance().clear(TEST_NETID);
+
+        static const struct TestConfig {
+            int ai_family;
+            const std::string expected_addr;
+        } testConfigs[]{
+                {AF_INET, kHelloExampleComAddrV4},
+                {AF_INET6, kHelloExampleComAddrV6},
+        };
+        for (const auto& config : testConfigs) {
+            SCOPED_TRACE(fmt::format("family: {}", config.ai_family));
+            dns.clearQueries();
+            addrinfo* result = nullptr;
+            const addrinfo hints = {.ai_family = config.ai_family};
+            NetworkDnsEventReported event;
+            EXPECT_EQ(0, resolv_getaddrinfo("hello", nullptr, &hints, &mNetcontext, &result,
+                                            &event));
+            ScopedAddrinfo result_cleanup(result);
+            EXPECT_EQ(ToString(result), config.expected_addr);
+            EXPECT_EQ(GetNumQueriesForProtocol(dns, IPPROTO_TCP, kHelloExampleCom), 1U);
+        }
+        const auto stats = TcpConnectionPool::getInstance().getStats(TEST_NETID);
+        EXPECT_EQ(2U, stats.handshakes);
+        EXPECT_EQ(1U, stats.reuses);
+
+        TcpConnectionPool::getInstance().clear(TEST_NETID);
+    }
+    Experiments::getInstance()->update();
+}
+
+// Resolves names which all miss the cache, with and without the UDP socket pool, and counts the
+// sockets which are set up. Setting up a socket costs socket(), fchown(), bind() and connect(), and
+// a call to netd to tag it, on top of the send(), poll() and recvfrom() of the query itself. The
+// counts and the query rate are recorded as test properties.
+TEST_F(ResolvGetAddrInfoTest, UdpSocketPool_CacheMisses) {
+    constexpr int kQueries = 500;
+    // The syscalls made by setupUdpSocket() and connect(), without the tagging call.
+    constexpr int kSetupSyscalls = 4;
+    test::DNSResponder dns;
+    for (int i = 0; i < kQueries; i++) {
+        dns.addMapping(fmt::format("host{}.example.com.", i), ns_type::ns_t_a, "1.2.3.4");
+    }
+    ASSERT_TRUE(dns.startServer());
+
+    for (const bool pooled : {false, true}) {
+        ScopedSystemProperties sp("persist.device_config.netd_native.udp_socket_pool",
+                                  pooled ? "1" : "0");
+        Experiments::getInstance()->update();
+        // Start with a cold cache, and with no idle sockets.
+        resolv_delete_cache_for_net(TEST_NETID);
+        resolv_create_cache_for_net(TEST_NETID);
+        UdpSocketPool::getInstance().clear(TEST_NETID);
+        ASSERT_EQ(0, SetResolvers());
+
+        const auto before = UdpSocketPool::getInstance().getStats();
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kQueries; i++) {
+            addrinfo* result = nullptr;
+            const addrinfo hints = {.ai_family = AF_INET};
+            NetworkDnsEventReported event;
+            const std::string name = fmt::format("host{}", i);
+            EXPECT_EQ(0, resolv_getaddrinfo(name.c_str(), nullptr, &hints, &mNetcontext, &result,
+                                            &event));
+            ScopedAddrinfo result_cleanup(result);
+        }
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        const auto after = UdpSocketPool::getInstance().getStats();
+
+        const uint64_t reused = after.hits - before.hits;
+        const uint64_t opened = kQueries - reused;
+        if (pooled) {
+            // Only the first query opens a socket.
+            EXPECT_EQ(1U, opened);
+        } else {
+            EXPECT_EQ(0U, reused);
+        }
+        const std::string mode = pooled ? "pooled" : "unpooled";
+        RecordProperty(mode + "_sockets_opened", opened);
+        RecordProperty(mode + "_setup_syscalls", opened * kSetupSyscalls);
+        RecordProperty(mode + "_queries_per_sec", static_cast<int>(kQueries / elapsed.count()));
+    }
+    Experiments::getInstance()->update();
+    UdpSocketPool::getInstance().clear(TEST_NETID);
+}
+
+// Once the first server answers slower than it usually does, the query is hedged to the second
+// server, and answered well before the timeout of the first one.
+TEST_F(ResolvGetAddrInfoTest, HedgedQuery) {
+    constexpr char kSecondListenAddr[] = "127.0.0.4";
+    constexpr int kWarmupQueries = 10;
+    test::DNSResponder dns1;
+    test::DNSResponder dns2(kSecondListenAddr);
+    for (test::DNSResponder* dns : {&dns1, &dns2}) {
+        dns->addMapping(kHelloExampleCom, ns_type::ns_t_a, kHelloExampleComAddrV4);
+        for (int i = 0; i < kWarmupQueries; i++) {
+            dns->addMapping(fmt::format("host{}.example.com.", i), ns_type::ns_t_a, "1.2.3.4");
+        }
+        ASSERT_TRUE(dns->startServer());
+    }
+    {
+        ScopedSystemProperties sp1("persist.device_config.netd_native.udp_hedge_latency_percentile",
+                                   "90");
+        ScopedSystemProperties sp2("persist.device_config.netd_native.udp_hedge_budget_pct", "100");
+        Experiments::getInstance()->update();
+        ASSERT_EQ(0, SetResolvers({test::kDefaultListenAddr, kSecondListenAddr}));
+
+        // Give the first server a latency record. It answers quickly, so nothing is hedged.
+        for (int i = 0; i < kWarmupQueries; i++) {
+            addrinfo* result = nullptr;
+            const addrinfo hints = {.ai_family = AF_INET};
+            NetworkDnsEventReported event;
+            const std::string name = fmt::format("host{}", i);
+            EXPECT_EQ(0, resolv_getaddrinfo(name.c_str(), nullptr, &hints, &mNetcontext, &result,
+                                            &event));
+            ScopedAddrinfo result_cleanup(result);
+        }
+        EXPECT_TRUE(dns2.queries().empty());
+
+        constexpr int kSlowResponseMs = 800;
+        dns1.setResponseDelayMs(kSlowResponseMs);
+        addrinfo* result = nullptr;
+        const addrinfo hints = {.ai_family = AF_INET};
+        NetworkDnsEventReported event;
+        const auto start = std::chrono::steady_clock::now();
+        EXPECT_EQ(0, resolv_getaddrinfo("hello", nullptr, &hints, &mNetcontext, &result, &event));
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        ScopedAddrinfo result_cleanup(result);
+        EXPECT_EQ(ToString(result), kHelloExampleComAddrV4);
+        EXPECT_LT(elapsed, std::chrono::milliseconds(kSlowResponseMs));
+        EXPECT_EQ(1U, GetNumQueries(dns1, kHelloExampleCom));
+        EXPECT_EQ(1U, GetNumQueries(dns2, kHelloExampleCom));
+    }
+    Experiments::getInstance()->update();
+}
+
+// When a server which usually answers quickly drops a query, the adaptive timeout gives up on it
+// after about 100ms rather than the configured 1s, so the second server answers much sooner. The
+// answer times are recorded as test properties.
+TEST_F(ResolvGetAddrInfoTest, AdaptiveUdpTimeout) {
+    constexpr char kSecondListenAddr[] = "127.0.0.4";
+    constexpr int kWarmupQueries = 10;
+    // Longer than the configured timeout, so the first server never answers in time.
+    constexpr int kSlowResponseMs = 1500;
+    test::DNSResponder dns1;
+    test::DNSResponder dns2(kSecondListenAddr);
+    for (test::DNSResponder* dns : {&dns1, &dns2}) {
+        for (int i = 0; i < kWarmupQueries; i++) {
+            dns->addMapping(fmt::format("host{}.example.com.", i), ns_type::ns_t_a, "1.2.3.4");
+        }
+        for (const char* name : {"adaptive.example.com.", "legacy.example.com."}) {
+            dns->addMapping(name, ns_type::ns_t_a, kHelloExampleComAddrV4);
+        }
+        ASSERT_TRUE(dns->startServer());
+    }
+    ASSERT_EQ(0, SetResolvers({test::kDefaultListenAddr, kSecondListenAddr}));
+
+    // Give the first server a latency record.
+    for (int i = 0; i < kWarmupQueries; i++) {
+        addrinfo* result = nullptr;
+        const addrinfo hints = {.ai_family = AF_INET};
+        NetworkDnsEventReported event;
+        const std::string name = fmt::format("host{}", i);
+        EXPECT_EQ(0, resolv_getaddrinfo(name.c_str(), nullptr, &hints, &mNetcontext, &result,
+                                        &event));
+        ScopedAddrinfo result_cleanup(result);
+    }
+    EXPECT_TRUE(dns2.queries().empty());
+
+    dns1.setResponseDelayMs(kSlowResponseMs);
+    for (const bool adaptive : {true, false}) {
+        const std::string name = adaptive ? "adaptive" : "legacy";
+        SCOPED_TRACE(name);
+        ScopedSystemProperties sp("persist.device_config.netd_native.udp_adaptive_timeout",
+                                  adaptive ? "1" : "0");
+        Experiments::getInstance()->update();
+
+        addrinfo* result = nullptr;
+        const addrinfo hints = {.ai_family = AF_INET};
+        NetworkDnsEventReported event;
+        const auto start = std::chrono::steady_clock::now();
+        EXPECT_EQ(0, resolv_getaddrinfo(name.c_str(), nullptr, &hints, &mNetcontext, &result,
+                                        &event));
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start);
+        ScopedAddrinfo result_cleanup(result);
+        EXPECT_EQ(ToString(result), kHelloExampleComAddrV4);
+        EXPECT_EQ(1U, GetNumQueries(dns2, (name + ".example.com.").c_str()));
+        if (adaptive) {
+            EXPECT_LT(elapsed, std::chrono::milliseconds(500));
+        } else {
+            EXPECT_GE(elapsed, std::chrono::milliseconds(params.base_timeout_msec));
+        }
+        RecordProperty(name + "_answer_ms", elapsed.count());
+    }
+
+    Experiments::getInstance()->update();
+}
+
+// With kernel timestamps, the answer of a server which came in while the next server was queried
+// gets its own RTT, rather than an unknown latency.
+TEST_F(ResolvGetAddrInfoTest, KernelTimestampedRtt) {
+    constexpr char kSecondListenAddr[] = "127.0.0.4";
+    // Past the timeout of the first server, and before the answer of the second one.
+    constexpr int kFirstDelayMs = 1500;
+    constexpr int kSecondDelayMs = 900;
+    test::DNSResponder dns1;
+    test::DNSResponder dns2(kSecondListenAddr);
+    for (test::DNSResponder* dns : {&dns1, &dns2}) {
+        dns->addMapping(kHelloExampleCom, ns_type::ns_t_a, kHelloExampleComAddrV4);
+        ASSERT_TRUE(dns->startServer());
+    }
+    dns1.setResponseDelayMs(kFirstDelayMs);
+    dns2.setResponseDelayMs(kSecondDelayMs);
+    {
+        ScopedSystemProperties sp1("persist.device_config.netd_native.keep_listening_udp", "1");
+        ScopedSystemProperties sp2("persist.device_config.netd_native.udp_kernel_timestamps", "1");
+        Experiments::getInstance()->update();
+        ASSERT_EQ(0, SetResolvers({test::kDefaultListenAddr, kSecondListenAddr}));
+
+        addrinfo* result = nullptr;
+        const addrinfo hints = {.ai_family = AF_INET};
+        NetworkDnsEventReported event;
+        EXPECT_EQ(0, resolv_getaddrinfo("hello", nullptr, &hints, &mNetcontext, &result, &event));
+        ScopedAddrinfo result_cleanup(result);
+        EXPECT_EQ(ToString(result), kHelloExampleComAddrV4);
+
+        ASSERT_EQ(2, event.dns_query_events().dns_query_event_size());
+        const auto& queryEvent = event.dns_query_events().dns_query_event(1);
+        EXPECT_EQ(0, queryEvent.dns_server_index());
+        EXPECT_EQ(android::net::NS_R_NO_ERROR, queryEvent.rcode());
+        EXPECT_GE(queryEvent.latency_micros(), kFirstDelayMs * 1000);
+        EXPECT_LT(queryEvent.latency_micros(), (kFirstDelayMs + 200) * 1000);
+    }
+    Experiments::getInstance()->update();
+}
+
+// Once a server has answered FORMERR to a query with EDNS0, the next queries are sent to it
+// without EDNS0 right away, instead of each being retried without it.
+TEST_F(ResolvGetAddrInfoTest, ServerCapabilities_EdnsRejected) {
+    test::DNSResponder dns;
+    for (const char* name : {"first.example.com.", "second.example.com."}) {
+        dns.addMapping(name, ns_type::ns_t_a, kHelloExampleComAddrV4);
+    }
+    dns.setEdns(test::DNSResponder::Edns::FORMERR_ON_EDNS);
+    ASSERT_TRUE(dns.startServer());
+    {
+        ScopedSystemProperties sp("persist.device_config.netd_native.server_capability_ttl_sec",
+                                  "60");
+        Experiments::getInstance()->update();
+        ASSERT_EQ(0, SetResolvers());
+
+        android_net_context netcontext = mNetcontext;
+        netcontext.flags |= NET_CONTEXT_FLAG_USE_EDNS;
+        for (const auto& [name, expectedQueries] : {std::pair{"first", 2U}, {"second", 1U}}) {
+            SCOPED_TRACE(name);
+            addrinfo* result = nullptr;
+            const addrinfo hints = {.ai_family = AF_INET};
+            NetworkDnsEventReported event;
+            EXPECT_EQ(0, resolv_getaddrinfo(name, nullptr, &hints, &netcontext, &result, &event));
+            ScopedAddrinfo result_cleanup(result);
+            EXPECT_EQ(ToString(result), kHelloExampleComAddrV4);
+            const std::string fqdn = fmt::format("{}.example.com.", name);
+            EXPECT_EQ(expectedQueries, GetNumQueries(dns, fqdn.c_str()));
+        }
+
+        const auto caps = resolv_get_server_capabilities(
+                TEST_NETID, netdutils::IPSockAddr::toIPSockAddr(test::kDefaultListenAddr, 53));
+        ASSERT_TRUE(caps.has_value());
+        EXPECT_TRUE(caps->ednsRejected);
+    }
+    Experiments::getInstance()->update();
+}
+
+// The A and AAAA queries of an AF_UNSPEC lookup are sent together on one socket, and both
+// answered.
+TEST_F(ResolvGetAddrInfoTest, BatchedParallelLookup) {
+    test::DNSResponder dns;
+    dns.addMapping(kHelloExampleCom, ns_type::ns_t_a, kHelloExampleComAddrV4);
+    dns.addMapping(kHelloExampleCom, ns_type::ns_t_aaaa, kHelloExampleComAddrV6);
+    ASSERT_TRUE(dns.startServer());
+    {
+        ScopedSystemProperties sp1("persist.device_config.netd_native.batched_parallel_lookup",
+                                   "1");
+        ScopedSystemProperties sp2("persist.device_config.netd_native.udp_socket_pool", "1");
+        Experiments::getInstance()->update();
+        UdpSocketPool::getInstance().clear(TEST_NETID);
+        ASSERT_EQ(0, SetResolvers());
+
+        const auto before = UdpSocketPool::getInstance().getStats();
+        addrinfo* result = nullptr;
+        const addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+        NetworkDnsEventReported event;
+        EXPECT_EQ(0, resolv_getaddrinfo("hello", nullptr, &hints, &mNetcontext, &result, &event));
+        ScopedAddrinfo result_cleanup(result);
+        EXPECT_THAT(ToStrings(result), testing::UnorderedElementsAreArray(
+                                               {kHelloExampleComAddrV4, kHelloExampleComAddrV6}));
+        EXPECT_EQ(2U, GetNumQueries(dns, kHelloExampleCom));
+        ASSERT_EQ(2, event.dns_query_events().dns_query_event_size());
+        for (const auto& queryEvent : event.dns_query_events().dns_query_event()) {
+            EXPECT_EQ(android::net::PROTO_UDP, queryEvent.protocol());
+            EXPECT_EQ(android::net::NS_R_NO_ERROR, queryEvent.rcode());
+        }
+
+        // One socket carried both queries, and went back to the pool.
+        const auto after = UdpSocketPool::getInstance().getStats();
+        EXPECT_EQ(1U, (after.hits - before.hits) + (after.misses - before.misses));
+        EXPECT_EQ(1U, after.idle);
+
+        // Both answers were cached.
+        EXPECT_EQ(0, resolv_getaddrinfo("hello", nullptr, &hints, &mNetcontext, &result, &event));
+        ScopedAddrinfo result_cleanup2(result);
+        EXPECT_EQ(2U, GetNumQueries(dns, kHelloExampleCom));
+        UdpSocketPool::getInstance().clear(TEST_NETID);
+    }
+    Experiments::getInstance()->update();
+}
+
+// A batch isn't sent to a server known to reject EDNS0: the lookups take the parallel path, where
+// res_nsend() sends the queries without EDNS0 right away.
+TEST_F(ResolvGetAddrInfoTest, BatchedParallelLookup_EdnsRejected) {
+    test::DNSResponder dns;
+    for (const char* name : {"first.example.com.", "second.example.com."}) {
+        dns.addMapping(name, ns_type::ns_t_a, kHelloExampleComAddrV4);
+        dns.addMapping(name, ns_type::ns_t_aaaa, kHelloExampleComAddrV6);
+    }
+    dns.setEdns(test::DNSResponder::Edns::FORMERR_ON_EDNS);
+    ASSERT_TRUE(dns.startServer());
+    {
+        ScopedSystemProperties sp1("persist.device_config.netd_native.batched_parallel_lookup",
+                                   "1");
+        ScopedSystemProperties sp2("persist.device_config.netd_native.server_capability_ttl_sec",
+                                   "60");
+        Experiments::getInstance()->update();
+        ASSERT_EQ(0, SetResolvers());
+
+        android_net_context netcontext = mNetcontext;
+        netcontext.flags |= NET_CONTEXT_FLAG_USE_EDNS;
+        for (const auto& [name, family, expectedQueries] :
+             {std::tuple{"first", AF_INET, 2U}, {"second", AF_UNSPEC, 2U}}) {
+            SCOPED_TRACE(name);
+            addrinfo* result = nullptr;
+            const addrinfo hints = {.ai_family = family, .ai_socktype = SOCK_STREAM};
+            NetworkDnsEventReported event;
+            EXPECT_EQ(0, resolv_getaddrinfo(name, nullptr, &hints, &netcontext, &result, &event));
+            ScopedAddrinfo result_cleanup(result);
+            EXPECT_FALSE(ToStrings(result).empty());
+            const std::string fqdn = fmt::format("{}.example.com.", name);
+            EXPECT_EQ(expectedQueries, GetNumQueries(dns, fqdn.c_str()));
+        }
+    }
+    Experiments::getInstance()->update();
+}
+
+// Resolves names which all miss the cache with AF_UNSPEC, with the A and AAAA queries sent from
+// two threads, and batched on the calling thread. Records the latency and the CPU time per lookup
+// as test properties. The CPU time is that of the whole process, so it includes the DNS responder.
+TEST_F(ResolvGetAddrInfoTest, BatchedParallelLookup_Benchmark) {
+    constexpr int kQueries = 200;
+    test::DNSResponder dns;
+    for (int i = 0; i < kQueries; i++) {
+        const std::string name = fmt::format("host{}.example.com.", i);
+        dns.addMapping(name, ns_type::ns_t_a, "1.2.3.4");
+        dns.addMapping(name, ns_type::ns_t_aaaa, "::1.2.3.4");
+    }
+    ASSERT_TRUE(dns.startServer());
+
+    for (const bool batched : {false, true}) {
+        ScopedSystemProperties sp("persist.device_config.netd_native.batched_parallel_lookup",
+                                  batched ? "1" : "0");
+        Experiments::getInstance()->update();
+        resolv_delete_cache_for_net(TEST_NETID);
+        resolv_create_cache_for_net(TEST_NETID);
+        ASSERT_EQ(0, SetResolvers());
+
+        const std::clock_t cpuStart = std::clock();
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kQueries; i++) {
+            addrinfo* result = nullptr;
+            const addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+            NetworkDnsEventReported event;
+            const std::string name = fmt::format("host{}", i);
+            EXPECT_EQ(0, resolv_getaddrinfo(name.c_str(), nullptr, &hints, &mNetcontext, &result,
+                                            &event));
+            ScopedAddrinfo result_cleanup(result);
+            EXPECT_EQ(2U, ToStrings(result).size());
+        }
+        const std::chrono::duration<double, std::micro> elapsed =
+                std::chrono::steady_clock::now() - start;
+        const double cpuUs = 1e6 * (std::clock() - cpuStart) / CLOCKS_PER_SEC;
+        const std::string mode = batched ? "batched" : "threaded";
+        RecordProperty(mode + "_us_per_lookup", static_cast<int>(elapsed.count() / kQueries));
+        RecordProperty(mode + "_cpu_us_per_lookup", static_cast<int>(cpuUs / kQueries));
+    }
+    Experiments::getInstance()->update();
+}
+
+// Runs concurrent AF_UNSPEC lookups which miss the cache with the lookup executor, and counts the
+// threads started for them: at most the executor's workers, instead of one per query.
+TEST_F(ResolvGetAddrInfoTest, LookupExecutor_Stress) {
+    constexpr int kCallers = 16;
+    constexpr int kLookupsPerCaller = 25;
+    test::DNSResponder dns;
+    for (int i = 0; i < kCallers * kLookupsPerCaller; i++) {
+        const std::string name = fmt::format("host{}.example.com.", i);
+        dns.addMapping(name, ns_type::ns_t_a, "1.2.3.4");
+        dns.addMapping(name, ns_type::ns_t_aaaa, "::1.2.3.4");
+    }
+    ASSERT_TRUE(dns.startServer());
+    {
+        ScopedSystemProperties sp("persist.device_config.netd_native.lookup_executor", "1");
+        Experiments::getInstance()->update();
+        ASSERT_EQ(0, SetResolvers());
+
+        const auto before = LookupExecutor::getInstance().getStats();
+        std::vector<std::thread> callers;
+        for (int i = 0; i < kCallers; i++) {
+            callers.emplace_back([&, i] {
+                for (int j = 0; j < kLookupsPerCaller; j++) {
+                    addrinfo* result = nullptr;
+                    const addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+                    NetworkDnsEventReported event;
+                    const std::string name = fmt::format("host{}", i * kLookupsPerCaller + j);
+                    EXPECT_EQ(0, resolv_getaddrinfo(name.c_str(), nullptr, &hints, &mNetcontext,
+                                                    &result, &event));
+                    ScopedAddrinfo result_cleanup(result);
+                    EXPECT_EQ(2U, ToStrings(result).size());
+                }
+            });
+        }
+        for (auto& caller : callers) caller.join();
+        const auto after = LookupExecutor::getInstance().getStats();
+
+        const uint64_t threadsStarted = after.threadsStarted - before.threadsStarted;
+        const uint64_t byCaller = after.tasksRunByCaller - before.tasksRunByCaller;
+        const uint64_t byWorkers = after.tasksRunByWorkers - before.tasksRunByWorkers;
+        EXPECT_LE(after.threadsStarted, LookupExecutor::kMaxThreads);
+        EXPECT_EQ(static_cast<uint64_t>(kCallers * kLookupsPerCaller * 2), byCaller + byWorkers);
+        RecordProperty("threads_started", static_cast<int>(threadsStarted));
+        RecordProperty("queries_run_by_caller", static_cast<int>(byCaller));
+        RecordProperty("queries_run_by_workers", static_cast<int>(byWorkers));
+    }
+    Experiments::getInstance()->update();
+}
+
 TEST_F(GetHostByNameForNetContextTest, AlphabeticalHostname) {
     constexpr char host_name[] = "jiababuei.example.com.";
     constexpr char v4addr[] = "1.2.3.4";